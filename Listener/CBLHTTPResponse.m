@@ -22,6 +22,13 @@
 #define LogVerbose MYLogVerbose
 
 
+// Max amount of unsent data to buffer before pausing a streamed router response:
+#define kMaxBufferedLength (256*1024)
+
+// Sent data is discarded from the front of the buffer once this much has accumulated:
+#define kMinTrimLength (64*1024)
+
+
 // Declared here just so we can name them with @selector() without a compiler warning:
 @interface CBL_Router (SomeActions)
 - (CBLStatus) do_POST_all_docs: (CBLDatabase*)db;
@@ -43,6 +50,7 @@
     BOOL _dataMutable;          // Is _data an NSMutableData?
     UInt64 _dataOffset;         // Offset in response of 1st byte of _data
     UInt64 _offset;             // Offset in response for next readData
+    BOOL _outputPaused;         // Has the router paused its output waiting for me?
 }
 
 
@@ -62,6 +70,13 @@
         router.onFinished = ^{
             [self onFinished];
         };
+        router.onAborted = ^{
+            [self onAborted];
+        };
+        router.streamQueryRows = YES;
+        router.shouldPauseOutput = ^BOOL{
+            return [self shouldPauseOutput];
+        };
 
         if (connection.listener.readOnly) {
             NSString* method = router.request.HTTPMethod;
@@ -186,6 +201,18 @@
 }
 
 
+// Called by the router between chunks of a streamed response.
+- (BOOL) shouldPauseOutput {
+    @synchronized(self) {
+        if (_connection && _dataOffset + _data.length - _offset > kMaxBufferedLength) {
+            LogVerbose(Listener, @"%@ pausing router output", self);
+            _outputPaused = YES;
+        }
+        return _outputPaused;
+    }
+}
+
+
 /**
  * The HTTP server supports range requests in order to allow things like
  * file download resumption and optimized streaming on mobile devices.
@@ -227,6 +254,27 @@
         _offset += range.length;
         LogVerbose(Listener, @"%@ sending %lu bytes (of %ld requested)",
               self, (unsigned long)result.length, (unsigned long)length);
+
+        if (_chunked) {
+            // A chunked response is never re-read, so discard what's been sent to bound memory:
+            NSUInteger sent = (NSUInteger)(_offset - _dataOffset);
+            if (sent >= kMinTrimLength) {
+                if (_dataMutable) {
+                    [(NSMutableData*)_data replaceBytesInRange: NSMakeRange(0, sent)
+                                                     withBytes: NULL length: 0];
+                } else {
+                    _data = [[_data subdataWithRange: NSMakeRange(sent, _data.length - sent)]
+                                                                                mutableCopy];
+                    _dataMutable = YES;
+                }
+                _dataOffset = _offset;
+            }
+            if (_outputPaused && _dataOffset + _data.length - _offset <= kMaxBufferedLength/2) {
+                LogVerbose(Listener, @"%@ resuming router output", self);
+                _outputPaused = NO;
+                [_router resumeOutput];
+            }
+        }
         return result;
     }
 }
@@ -247,6 +295,8 @@
     _router.onResponseReady = nil;
     _router.onDataAvailable = nil;
     _router.onFinished = nil;
+    _router.onAborted = nil;
+    _router.shouldPauseOutput = nil;
     if (!_finished) {
         _finished = true;
     }
@@ -272,7 +322,8 @@
 #endif
             if (pretty) {
                 NSString* contentType = (_response.headers)[@"Content-Type"];
-                if ([contentType hasPrefix: @"application/json"] && _data.length < 100000) {
+                if ([contentType hasPrefix: @"application/json"] && _data.length < 100000
+                        && _response.body) {
                     LogVerbose(Listener, @"%@ prettifying response body", self);
                     _data = [_response.body.asPrettyJSON mutableCopy];
                 }
@@ -283,6 +334,19 @@
 }
 
 
+// Called by the router if a streamed response fails after its headers have gone out. Closing the
+// connection without the final chunk lets the client know the body is incomplete.
+- (void) onAborted {
+    @synchronized(self) {
+        if (_finished)
+            return;
+        [self cleanUp];
+        LogTo(Listener, @"%@ aborted", self);
+        [_connection responseDidAbort: self];
+    }
+}
+
+
 /**
  * This method is called from the HTTPConnection class when the connection is closed,
  * or when the connection is finished with the response.
@@ -293,6 +357,8 @@
     @synchronized(self) {
         _connection = nil;
         _data = nil;
+        if (!_finished)
+            [_router stop];     // e.g. a streamed response that's waiting for the socket to drain
         [self cleanUp];
     }
 }
@@ -58,7 +58,10 @@ NS_ASSUME_NONNULL_BEGIN
     property or the `openContentStream` method instead.
     The file must be treated as read-only! DO NOT MODIFY OR DELETE IT.
     If the database is encrypted, attachment files are also encrypted and not directly readable,
-    so this property will return nil. */
+    so this property will return nil. It's also nil for small attachments stored in pack files
+    (see CBLDatabaseOptions.packSmallAttachments), for large ones stored in chunks
+    (see CBLDatabaseOptions.chunkLargeAttachments), and for ones stored gzip-compressed
+    (see CBLDatabaseOptions.compressAttachments.) */
 @property (readonly, nullable) NSURL* contentURL;
 
 /** Deletes the attachment's contents from local storage. If the attachment is still available on
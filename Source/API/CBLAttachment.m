@@ -21,6 +21,7 @@
 #import "CBL_BlobStoreWriter.h"
 #import "CBLInternal.h"
 #import "CBLStatus.h"
+#import "CBLGZip.h"
 
 
 @implementation CBLAttachment
@@ -29,6 +30,7 @@
     NSString* _name;
     NSDictionary* _metadata;
     id _body;   // Either NSData, NSURL (file URL), or nil
+    NSData* _gzippedBody;   // Compressed _body, if it's to be stored that way
 }
 
 
@@ -186,6 +188,21 @@
 }
 
 
+// Only store an attachment compressed if that saves at least this fraction of its size
+#define kMaxCompressedRatio 0.9
+
+- (void) compressWithPolicy: (CBLAttachmentCompressionPolicy)policy {
+    if (!_body || _metadata[@"digest"] || _metadata[@"encoding"])
+        return;     // not new, or already saved (maybe compressed), or explicitly encoded
+    NSData* body = [self getContent: NULL];
+    if (!body || !policy(_name, self.contentType, body.length))
+        return;
+    NSData* gzipped = [CBLGZip dataByCompressingData: body];
+    if (gzipped.length > 0 && gzipped.length <= body.length * kMaxCompressedRatio)
+        _gzippedBody = gzipped;
+}
+
+
 - (BOOL) saveToDatabase: (CBLDatabase*)database error: (NSError**)outError {
     if (!_body)
         return YES;
@@ -208,13 +225,17 @@
     // Copy attachment body into the database's blob store:
     // OPT: If _body is an NSURL, could just copy the file without reading into RAM
     CBL_BlobStoreWriter* writer = [database attachmentWriter];
-    [writer appendData: body];
+    [writer appendData: _gzippedBody ?: body];
     [writer finish];
     [database rememberAttachmentWriter: writer];
 
     // Update metadata with digest and 'follows':
     NSMutableDictionary* metadata = [self.metadata mutableCopy];
     metadata[@"length"] = @(body.length);
+    if (_gzippedBody) {
+        metadata[@"encoding"] = @"gzip";
+        metadata[@"encoded_length"] = @(_gzippedBody.length);
+    }
     metadata[@"digest"] = writer.MD5DigestString;
     metadata[@"follows"] = $true;
     LogTo(Database, @"%@: Stored new CBLAttachment '%@' %@",
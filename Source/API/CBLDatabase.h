@@ -114,6 +114,17 @@ typedef BOOL (^CBLFilterBlock) (CBLSavedRevision* revision, NSDictionary* __null
     at a time with the same documentID. */
 - (nullable CBLDocument*) existingDocumentWithID: (NSString*)docID;
 
+/** Instantiates CBLDocument objects for many document IDs at once, loading the current
+    revisions of all the ones not already in memory in a single pass through the database. This
+    is much faster than calling -existingDocumentWithID: on each one.
+    As with -documentWithID:, a CBLDocument is returned even if no such document exists; its
+    currentRevision will be nil.
+    @param docIDs  The document IDs.
+    @param outError  On failure, the error that occurred.
+    @return  The documents, in the same order as the IDs, or nil on failure. */
+- (nullable CBLArrayOf(CBLDocument*)*) documentsWithIDs: (CBLArrayOf(NSString*)*)docIDs
+                                                  error: (NSError**)outError;
+
 /** Same as -documentWithID:. Enables "[]" access in Xcode 4.4+ */
 - (nullable CBLDocument*)objectForKeyedSubscript: (NSString*)key;
 
@@ -121,6 +132,20 @@ typedef BOOL (^CBLFilterBlock) (CBLSavedRevision* revision, NSDictionary* __null
     The document will be saved to the database when you call -putProperties: on it. */
 - (CBLDocument*) createDocument;
 
+/** Saves new revisions of many documents at once, in a single transaction. This is much faster
+    than calling -[CBLDocument putProperties:] on each one, for instance when importing data.
+    Each dictionary's "_id" property is the document ID (a new UUID is assigned if it's missing),
+    its "_rev" property is the ID of the revision being replaced (omit it for a new document), and
+    a "_deleted" property of true deletes the document. Attachments must be given as JSON
+    metadata with inline "data", not as CBLAttachment objects.
+    This is all-or-nothing: if any document can't be saved (because of a conflict, a validation
+    failure, etc.) none of them are.
+    @param documents  The new revisions' properties.
+    @param outError  On failure, the error that prevented a document from being saved.
+    @return  The new revisions, in the same order as the documents, or nil on failure. */
+- (nullable CBLArrayOf(CBLSavedRevision*)*) putDocuments: (CBLArrayOf(CBLJSONDict*)*)documents
+                                                   error: (NSError**)outError;
+
 
 #pragma mark - LOCAL DOCUMENTS:
 
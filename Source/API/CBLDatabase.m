@@ -262,6 +262,14 @@ static void catchInBlock(void (^block)()) {
 
 
 - (BOOL) changeEncryptionKey: (id)newKeyOrPassword error: (NSError**)outError {
+    return [self changeEncryptionKey: newKeyOrPassword progress: nil error: outError];
+}
+
+
+- (BOOL) changeEncryptionKey: (id)newKeyOrPassword
+                    progress: (CBLProgressGroup*)progress
+                       error: (NSError**)outError
+{
     if (_readOnly)
         return CBLStatusToOutNSError(kCBLStatusForbidden, outError);
     if (![_storage respondsToSelector: @selector(actionToChangeEncryptionKey:)])
@@ -300,10 +308,14 @@ static void catchInBlock(void (^block)()) {
         return NO;
     }
 
-    MYAction* action = [_storage actionToChangeEncryptionKey: newKey];
-    if (!action)
+    MYAction* storageAction = [_storage actionToChangeEncryptionKey: newKey];
+    if (!storageAction)
         return CBLStatusToOutNSError(kCBLStatusNotImplemented, outError);
-    [action addAction: [_attachments actionToChangeEncryptionKey: newKey]];
+    // Re-encrypt the attachments first: it's the slow part, and if it's interrupted nothing has
+    // been changed yet, and a retry will resume it.
+    MYAction* action = [MYAction new];
+    [action addAction: [_attachments actionToChangeEncryptionKey: newKey progress: progress]];
+    [action addAction: storageAction];
     [action addPerform:^BOOL(NSError** error) {
         [_manager registerEncryptionKey: newKeyOrPassword forDatabaseNamed: _name];
         return YES;
@@ -346,6 +358,41 @@ static void catchInBlock(void (^block)()) {
     return [self documentWithID: docID mustExist: YES isNew: NO];
 }
 
+- (NSArray*) documentsWithIDs: (NSArray*)docIDs error: (NSError**)outError {
+    NSMutableArray* docs = [NSMutableArray arrayWithCapacity: docIDs.count];
+    NSMutableArray* docsToLoad = [NSMutableArray array];
+    NSMutableArray* docIDsToLoad = [NSMutableArray array];
+    for (NSString* docID in docIDs) {
+        CBLDocument* doc = (CBLDocument*) [_docCache resourceWithCacheKey: docID];
+        if (!doc) {
+            if (docID.length == 0) {
+                CBLStatusToOutNSError(kCBLStatusBadID, outError);
+                return nil;
+            }
+            doc = [[CBLDocument alloc] initWithDatabase: self documentID: docID exists: YES];
+            if (!_docCache)
+                _docCache = [[CBLCache alloc] initWithRetainLimit: kDocRetainLimit];
+            [_docCache addResource: doc];
+            [docsToLoad addObject: doc];
+            [docIDsToLoad addObject: docID];
+        }
+        [docs addObject: doc];
+    }
+
+    if (docsToLoad.count > 0) {
+        CBLStatus status;
+        NSArray* revs = [_storage getDocumentsWithIDs: docIDsToLoad withBody: YES status: &status];
+        if (!revs) {
+            CBLStatusToOutNSError(status, outError);
+            return nil;
+        }
+        [docsToLoad enumerateObjectsUsingBlock: ^(CBLDocument* doc, NSUInteger i, BOOL *stop) {
+            [doc loadCurrentRevision: $castIf(CBL_Revision, revs[i])];
+        }];
+    }
+    return docs;
+}
+
 - (CBLDocument*) objectForKeyedSubscript: (NSString*)key {
     return [self documentWithID: key mustExist: NO isNew: NO];
 }
@@ -355,6 +402,42 @@ static void catchInBlock(void (^block)()) {
 }
 
 
+- (NSArray*) putDocuments: (NSArray*)documents error: (NSError**)outError {
+    __block NSArray* results = nil;
+    __block NSError* error = nil;
+    CBLStatus status = [_storage inTransaction: ^CBLStatus {
+        // Saving updates the copies' _id and _rev, so a retried transaction needs fresh ones:
+        NSMutableArray* docs = [NSMutableArray arrayWithCapacity: documents.count];
+        for (NSDictionary* properties in documents)
+            [docs addObject: [properties mutableCopy]];
+        results = [self putDocuments: docs allowConflict: NO source: nil error: &error];
+        if (!results)
+            return CBLStatusFromNSError(error, kCBLStatusDBError);
+        // All or nothing: if any doc failed, back out the transaction:
+        for (id result in results) {
+            if ([result isKindOfClass: [NSError class]]) {
+                error = result;
+                return CBLStatusFromNSError(error, kCBLStatusBadRequest);
+            }
+        }
+        return kCBLStatusOK;
+    }];
+    if (CBLStatusIsError(status)) {
+        if (outError)
+            *outError = error ?: CBLStatusToNSError(status);
+        return nil;
+    }
+
+    NSMutableArray* savedRevs = [NSMutableArray arrayWithCapacity: results.count];
+    for (CBL_Revision* rev in results) {
+        CBLDocument* doc = [self _cachedDocumentWithID: rev.docID];
+        [savedRevs addObject: (doc ? [doc revisionFromRev: rev]
+                                   : [[CBLSavedRevision alloc] initWithDatabase: self revision: rev])];
+    }
+    return savedRevs;
+}
+
+
 - (CBLDocument*) _cachedDocumentWithID: (NSString*)docID {
     return (CBLDocument*) [_docCache resourceWithCacheKeyDontRecache: docID];
 }
@@ -91,6 +91,7 @@ NSString* const kCBLDocumentChangeNotification = @"CBLDocumentChange";
         return NO;
     }
     [_database removeDocumentFromCache: self];
+    [_database garbageCollectAttachmentsInBackground];
     return YES;
 }
 
@@ -228,6 +229,13 @@ NSString* const kCBLDocumentChangeNotification = @"CBLDocumentChange";
 }
 
 
+// Sets the current revision to one that was already loaded (or nil if there's none.)
+- (void) loadCurrentRevision: (CBL_Revision*)rev {
+    _currentRevision = [self revisionFromRev: rev];
+    _currentRevisionKnown = YES;
+}
+
+
 - (NSArray*) getRevisionHistory: (NSError**)outError {
     return [self.currentRevision getRevisionHistory: outError];
 }
@@ -289,6 +297,18 @@ NSString* const kCBLDocumentChangeNotification = @"CBLDocumentChange";
     // Process _attachments dict, converting CBLAttachments to dicts:
     NSDictionary* attachments = properties.cbl_attachments;
     if (attachments.count) {
+        // First compress the new bodies the database's policy selects, all at once:
+        CBLAttachmentCompressionPolicy policy = _database.attachmentCompressionPolicy;
+        if (policy) {
+            NSArray* values = attachments.allValues;
+            dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+            dispatch_apply(values.count, queue, ^(size_t i) {
+                @autoreleasepool {
+                    [$castIf(CBLAttachment, values[i]) compressWithPolicy: policy];
+                }
+            });
+        }
+
         __block BOOL ok = YES;
         __block NSError* error;
         NSDictionary* expanded = [attachments my_dictionaryByUpdatingValues: ^id(NSString* name,
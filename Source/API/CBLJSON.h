@@ -88,6 +88,21 @@ typedef NSUInteger CBLJSONWritingOptions;
 @end
 
 
+/** Immutable dictionary backed by the data of a JSON object, which avoids parsing values that
+    aren't used. The object's top-level keys are located, and all of it is checked for
+    well-formedness, when it's created; but each value is only parsed the first time it's accessed. */
+@interface CBLLazyDictionaryOfJSON : NSDictionary
+
+/** Initializes a lazy dictionary, or returns nil if the data isn't a well-formed JSON object
+    (or is nested too deeply to check; the caller can then parse it eagerly.)
+    @param json  The JSON data of an object. It must not be mutated afterwards.
+    @param extraProperties  Optional properties to add; they override any with the same keys in
+                            the JSON. */
+- (nullable instancetype) initWithJSON: (NSData*)json
+                       extraProperties: (nullable NSDictionary*)extraProperties;
+@end
+
+
 typedef void (^CBLOnMutateBlock)();
 
 /** Protocol for classes whose instances can encode themselves as JSON.
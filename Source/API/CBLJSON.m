@@ -17,6 +17,8 @@
 #import "CBLParseDate.h"
 #import "CBLBase64.h"
 #import "CBLMisc.h"
+#import "CBLJSONReader.h"
+#import <libkern/OSAtomic.h>
 
 
 @implementation CBLJSON
@@ -52,6 +54,22 @@ static NSTimeInterval k1970ToReferenceDate;
 }
 
 
++ (id) JSONObjectWithData: (NSData*)data
+                  options: (NSJSONReadingOptions)options
+                    error: (NSError**)error
+{
+    if (!(options & NSJSONReadingMutableLeaves)) {
+        id result = [CBLJSONReader objectWithBytes: data.bytes length: data.length
+                                           options: options];
+        if (result)
+            return result;
+    }
+    // Let NSJSONSerialization handle the option CBLJSONReader doesn't, and report errors (or
+    // accept the other encodings it supports):
+    return [super JSONObjectWithData: data options: options error: error];
+}
+
+
 + (NSString*) stringWithJSONObject:(id)obj
                            options:(CBLJSONWritingOptions)opt
                              error:(NSError **)error
@@ -260,6 +278,403 @@ static NSDateFormatter* getISO8601Formatter() {
 
 
 
+#pragma mark - LAZY DICTIONARY:
+
+
+static inline const char* skipWhitespace(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\n' || *p == '\r' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+#define kMaxLazyJSONDepth 512    // Deeper values are rejected, so the caller parses eagerly
+
+static inline BOOL isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Reads the four hex digits of a \u escape. Returns NO if they aren't all there.
+static BOOL readHex4(const char* p, const char* end, unsigned* outValue) {
+    if (end - p < 4)
+        return NO;
+    unsigned value = 0;
+    for (int i = 0; i < 4; ++i) {
+        char c = p[i];
+        unsigned digit;
+        if (isDigit(c))
+            digit = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return NO;
+        value = (value << 4) | digit;
+    }
+    *outValue = value;
+    return YES;
+}
+
+// Skips a multi-byte UTF-8 character. Returns a pointer just past it, or NULL if it's invalid
+// (truncated, overlong, a surrogate, or out of range.)
+static const char* skipUTF8Char(const char* p, const char* end) {
+    static const uint32_t kMinCodePoint[4] = {0, 0x80, 0x800, 0x10000};
+    uint8_t c = (uint8_t)*p;
+    int n;
+    if (c >= 0xC2 && c <= 0xDF)
+        n = 1;
+    else if (c >= 0xE0 && c <= 0xEF)
+        n = 2;
+    else if (c >= 0xF0 && c <= 0xF4)
+        n = 3;
+    else
+        return NULL;
+    if (end - p < n + 1)
+        return NULL;
+    uint32_t codePoint = c & (0x7F >> (n + 1));
+    for (int i = 1; i <= n; ++i) {
+        uint8_t cont = (uint8_t)p[i];
+        if ((cont & 0xC0) != 0x80)
+            return NULL;
+        codePoint = (codePoint << 6) | (cont & 0x3F);
+    }
+    if (codePoint < kMinCodePoint[n] || codePoint > 0x10FFFF
+            || (codePoint >= 0xD800 && codePoint <= 0xDFFF))
+        return NULL;
+    return p + n + 1;
+}
+
+// Skips a JSON string, starting at its opening quote. Returns a pointer just past the closing
+// quote, or NULL if the string is malformed. Sets *outEscaped if it contains escapes.
+static const char* skipString(const char* p, const char* end, BOOL* outEscaped) {
+    for (++p; p < end; ) {
+        uint8_t c = (uint8_t)*p;
+        if (c == '"') {
+            return p + 1;
+        } else if (c == '\\') {
+            *outEscaped = YES;
+            if (++p >= end)
+                return NULL;
+            if (*p == 'u') {
+                unsigned ch;
+                if (!readHex4(p + 1, end, &ch))
+                    return NULL;
+                p += 5;
+                if (ch >= 0xD800 && ch <= 0xDBFF) {
+                    // A high surrogate has to be followed by an escaped low surrogate:
+                    unsigned low;
+                    if (end - p < 2 || p[0] != '\\' || p[1] != 'u' || !readHex4(p + 2, end, &low)
+                            || low < 0xDC00 || low > 0xDFFF)
+                        return NULL;
+                    p += 6;
+                } else if (ch >= 0xDC00 && ch <= 0xDFFF) {
+                    return NULL;
+                }
+            } else if (*p != '\0' && strchr("\"\\/bfnrt", *p)) {
+                ++p;
+            } else {
+                return NULL;
+            }
+        } else if (c < 0x20) {
+            return NULL;
+        } else if (c < 0x80) {
+            ++p;
+        } else {
+            p = skipUTF8Char(p, end);
+            if (!p)
+                return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Skips a JSON number. Returns a pointer just past it, or NULL if it's malformed.
+static const char* skipNumber(const char* p, const char* end) {
+    if (p < end && *p == '-')
+        ++p;
+    if (p >= end || !isDigit(*p))
+        return NULL;
+    if (*p == '0') {
+        ++p;
+    } else {
+        while (p < end && isDigit(*p))
+            ++p;
+    }
+    if (p < end && *p == '.') {
+        if (++p >= end || !isDigit(*p))
+            return NULL;
+        while (p < end && isDigit(*p))
+            ++p;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if (p < end && (*p == '+' || *p == '-'))
+            ++p;
+        if (p >= end || !isDigit(*p))
+            return NULL;
+        while (p < end && isDigit(*p))
+            ++p;
+    }
+    return p;
+}
+
+static const char* skipLiteral(const char* p, const char* end, const char* literal) {
+    size_t length = strlen(literal);
+    if ((size_t)(end - p) < length || memcmp(p, literal, length) != 0)
+        return NULL;
+    return p + length;
+}
+
+// Skips a JSON value of any type, checking its syntax along the way (without building any
+// objects), so that a value that's been skipped is known to parse later. Returns a pointer just
+// past it, or NULL if it's malformed or nested more than kMaxLazyJSONDepth deep.
+static const char* skipValue(const char* p, const char* end, unsigned depth) {
+    BOOL escaped;
+    if (p >= end)
+        return NULL;
+    switch (*p) {
+        case '"':
+            return skipString(p, end, &escaped);
+        case '[':
+            if (depth >= kMaxLazyJSONDepth)
+                return NULL;
+            p = skipWhitespace(p + 1, end);
+            if (p < end && *p == ']')
+                return p + 1;
+            for (;;) {
+                p = skipValue(p, end, depth + 1);
+                if (!p)
+                    return NULL;
+                p = skipWhitespace(p, end);
+                if (p >= end)
+                    return NULL;
+                else if (*p == ']')
+                    return p + 1;
+                else if (*p != ',')
+                    return NULL;
+                p = skipWhitespace(p + 1, end);
+            }
+        case '{':
+            if (depth >= kMaxLazyJSONDepth)
+                return NULL;
+            p = skipWhitespace(p + 1, end);
+            if (p < end && *p == '}')
+                return p + 1;
+            for (;;) {
+                if (p >= end || *p != '"')
+                    return NULL;
+                p = skipString(p, end, &escaped);
+                if (!p)
+                    return NULL;
+                p = skipWhitespace(p, end);
+                if (p >= end || *p != ':')
+                    return NULL;
+                p = skipValue(skipWhitespace(p + 1, end), end, depth + 1);
+                if (!p)
+                    return NULL;
+                p = skipWhitespace(p, end);
+                if (p >= end)
+                    return NULL;
+                else if (*p == '}')
+                    return p + 1;
+                else if (*p != ',')
+                    return NULL;
+                p = skipWhitespace(p + 1, end);
+            }
+        case 't':
+            return skipLiteral(p, end, "true");
+        case 'f':
+            return skipLiteral(p, end, "false");
+        case 'n':
+            return skipLiteral(p, end, "null");
+        default:
+            return skipNumber(p, end);
+    }
+}
+
+
+@implementation CBLLazyDictionaryOfJSON
+{
+    NSData* _json;
+    NSDictionary* _extra;
+    NSMutableArray* _keys;          // all keys: those in the JSON, then the extra ones
+    NSDictionary* _keyIndex;        // maps JSON keys to their indexes in _keys
+    NSRange* _ranges;               // byte range in _json of the value of each JSON key
+    NSMutableArray* _values;        // parsed value of each JSON key, or sUnparsed
+    int32_t _unparsedCount;         // number of sUnparsed items left in _values
+}
+
+static id sUnparsed;    // placeholder in _values
+
++ (void) initialize {
+    if (self == [CBLLazyDictionaryOfJSON class]) {
+        sUnparsed = [[NSObject alloc] init];
+    }
+}
+
+- (instancetype) initWithJSON: (NSData*)json extraProperties: (NSDictionary*)extraProperties {
+    self = [super init];
+    if (self) {
+        _json = json;
+        _extra = extraProperties;
+        if (![self indexKeys])
+            return nil;
+        if (_extra)
+            [_keys addObjectsFromArray: _extra.allKeys];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    free(_ranges);
+}
+
+// Finds the keys of the top-level object and the ranges of their values, checking that all of it
+// is well-formed, so that every key found will have a value.
+- (BOOL) indexKeys {
+    const char* start = _json.bytes;
+    const char* end = start + _json.length;
+    const char* p = skipWhitespace(start, end);
+    if (p >= end || *p != '{')
+        return NO;
+    p = skipWhitespace(p + 1, end);
+
+    _keys = [[NSMutableArray alloc] init];
+    NSMutableDictionary* keyIndex = [[NSMutableDictionary alloc] init];
+    NSUInteger capacity = 0;
+    if (p < end && *p == '}') {
+        ++p;
+    } else {
+        for (;;) {
+            // Key:
+            if (p >= end || *p != '"')
+                return NO;
+            const char* keyStart = p;
+            BOOL escaped = NO;
+            p = skipString(p, end, &escaped);
+            if (!p)
+                return NO;
+            NSString* key;
+            if (escaped) {
+                NSData* keyJSON = [[NSData alloc] initWithBytesNoCopy: (void*)keyStart
+                                                               length: p - keyStart
+                                                         freeWhenDone: NO];
+                key = $castIf(NSString, [CBLJSON JSONObjectWithData: keyJSON
+                                                            options: CBLJSONReadingAllowFragments
+                                                              error: NULL]);
+            } else {
+                key = [[NSString alloc] initWithBytes: keyStart + 1
+                                               length: p - keyStart - 2
+                                             encoding: NSUTF8StringEncoding];
+            }
+            if (!key)
+                return NO;
+            p = skipWhitespace(p, end);
+            if (p >= end || *p != ':')
+                return NO;
+
+            // Value:
+            p = skipWhitespace(p + 1, end);
+            const char* valueStart = p;
+            p = skipValue(p, end, 1);
+            if (!p)
+                return NO;
+            if (!_extra[key]) {
+                NSUInteger index;
+                NSNumber* existing = keyIndex[key];
+                if (existing) {
+                    index = existing.unsignedIntegerValue;  // duplicate key; last one wins
+                } else {
+                    index = _keys.count;
+                    if (index >= capacity) {
+                        capacity = MAX(2 * capacity, 16u);
+                        _ranges = reallocf(_ranges, capacity * sizeof(NSRange));
+                        if (!_ranges)
+                            return NO;
+                    }
+                    [_keys addObject: key];
+                    keyIndex[key] = @(index);
+                }
+                _ranges[index] = NSMakeRange(valueStart - start, p - valueStart);
+            }
+
+            // Comma or end:
+            p = skipWhitespace(p, end);
+            if (p < end && *p == ',') {
+                p = skipWhitespace(p + 1, end);
+            } else if (p < end && *p == '}') {
+                ++p;
+                break;
+            } else {
+                return NO;
+            }
+        }
+    }
+    if (skipWhitespace(p, end) != end)
+        return NO;
+
+    _keyIndex = keyIndex;
+    NSUInteger count = _keys.count;
+    _values = [[NSMutableArray alloc] initWithCapacity: count];
+    for (NSUInteger i = 0; i < count; ++i)
+        [_values addObject: sUnparsed];
+    _unparsedCount = (int32_t)count;
+    return YES;
+}
+
+- (NSUInteger) count {
+    return _keys.count;
+}
+
+- (NSEnumerator*) keyEnumerator {
+    return _keys.objectEnumerator;
+}
+
+- (id) objectForKey: (id)key {
+    id value = _extra[key];
+    if (value)
+        return value;
+    NSNumber* indexObj = _keyIndex[key];
+    if (!indexObj)
+        return nil;
+    NSUInteger index = indexObj.unsignedIntegerValue;
+    if (OSAtomicAdd32Barrier(0, &_unparsedCount) == 0)
+        return _values[index];      // all parsed, so _values won't change again
+    // (An immutable dictionary may be read on several threads at once, so this locks until every
+    // value has been parsed.)
+    @synchronized(self) {
+        value = _values[index];
+        if (value == sUnparsed) {
+            NSRange range = _ranges[index];
+            NSData* valueJSON = [[NSData alloc] initWithBytesNoCopy: (void*)((const char*)_json.bytes
+                                                                             + range.location)
+                                                             length: range.length
+                                                       freeWhenDone: NO];
+            value = [CBLJSON JSONObjectWithData: valueJSON
+                                        options: CBLJSONReadingAllowFragments
+                                          error: NULL];
+            if (!value) {
+                // -indexKeys checked its syntax, so this shouldn't happen; but the key is listed
+                // by -keyEnumerator and -count, so it has to have some value:
+                Warn(@"CBLLazyDictionaryOfJSON: Unparseable value for key \"%@\": %@",
+                     key, [valueJSON my_UTF8ToString]);
+                value = [NSNull null];
+            }
+            _values[index] = value;
+            OSAtomicDecrement32Barrier(&_unparsedCount);
+        }
+    }
+    return value;
+}
+
+- (id) copyWithZone: (NSZone*)zone {
+    return self;    // immutable
+}
+
+@end
+
+
+
 #if DEBUG
 
 
@@ -44,6 +44,57 @@ typedef struct CBLManagerOptions {
       the user's Keychain, or generate one there if it doesn't exist yet.
     * A default nil value, of course, means the database is unencrypted. */
 @property (nonatomic, strong, nullable) id encryptionKey;
+
+/** If YES, attachment files are spread across two levels of subdirectories instead of being
+    stored in a single directory, which keeps file lookups fast when there are very many
+    attachments. An existing database's attachments are moved over in the background.
+    Once a database has been sharded it stays that way, even if later opened without this flag. */
+@property (nonatomic) BOOL shardAttachments;
+
+/** If YES, new attachments smaller than 4KB are appended to shared pack files instead of each
+    getting a file of its own, which saves a lot of file-system overhead when there are many small
+    attachments like thumbnails. (Such attachments have no contentURL.) */
+@property (nonatomic) BOOL packSmallAttachments;
+
+/** If YES, new attachments of 1MB or more are split into chunks at boundaries determined by their
+    contents, and each distinct chunk is stored only once. Successive versions of a large file that
+    differ only in places then share most of their storage. (Such attachments have no
+    contentURL.) */
+@property (nonatomic) BOOL chunkLargeAttachments;
+
+/** If YES, new attachments of 1KB or more whose names or content types indicate text (including
+    JSON, XML, HTML, CSV...) are gzip-compressed when saved, if that makes them significantly
+    smaller. They're stored and replicated compressed, and decompressed when read, so this is
+    transparent except that such attachments have no contentURL. */
+@property (nonatomic) BOOL compressAttachments;
+
+/** If YES, document bodies of 128 bytes or more are stored compressed (SQLite storage only),
+    using a dictionary trained from a sample of the database's documents once there are enough of
+    them. Compacting the database compresses existing bodies too. This is transparent to
+    everything but the file size; but versions of Couchbase Lite without this feature can't read
+    a database that has compressed bodies. */
+@property (nonatomic) BOOL compressDocuments;
+
+/** If YES, the database's document IDs are loaded into memory when it opens (SQLite storage only,
+    and up to documentIDCacheSize, newest documents first.) This speeds up bulk operations on
+    existing documents, like pulling updates or indexing views, at the cost of a slower open. */
+@property (nonatomic) BOOL preloadDocumentIDs;
+
+/** The approximate maximum number of bytes of memory used to cache the database's document IDs
+    (SQLite storage only.) Zero means the default, 4MB. The cache is shared by every CBLDatabase
+    instance on the same file, so the most recently opened one's setting applies. */
+@property (nonatomic) size_t documentIDCacheSize;
+
+/** Tunes SQLite storage's memory use and durability for a kind of device or workload. Legal
+    values are kCBLSQLiteProfileDefault, kCBLSQLiteProfileServer, kCBLSQLiteProfileLowMemory,
+    or nil to use the CBLManager's sqliteProfile. Ignored by ForestDB storage. */
+@property (nonatomic, copy, nullable) NSString* sqliteProfile;
+
+/** Overrides individual settings of the sqliteProfile. Keys are the SQLite pragmas "cache_size",
+    "mmap_size", "temp_store", "synchronous" and "wal_autocheckpoint"; values are numbers, or
+    for "temp_store" and "synchronous" also the pragma's keyword (like @"NORMAL".) See the
+    SQLite documentation for their meanings. */
+@property (nonatomic, copy, nullable) NSDictionary<NSString*, id>* sqliteSettings;
 @end
 
 
@@ -86,6 +137,10 @@ typedef struct CBLManagerOptions {
     There are two options, "SQLite" (the default) or "ForestDB". */
 @property (copy, nonatomic) NSString* storageType;
 
+/** Default SQLite tuning profile for databases opened without one in their CBLDatabaseOptions.
+    Defaults to kCBLSQLiteProfileDefault. */
+@property (copy, nonatomic) NSString* sqliteProfile;
+
 /** The root directory of this manager (as specified at initialization time.) */
 @property (readonly) NSString* directory;
 
@@ -227,4 +282,17 @@ extern NSString* const kCBLSQLiteStorage;
 /** ForestDB storage type used for setting CBLDatabaseOptions.storageType. */
 extern NSString* const kCBLForestDBStorage;
 
+/** SQLite profile for setting CBLDatabaseOptions.sqliteProfile: SQLite's own defaults. */
+extern NSString* const kCBLSQLiteProfileDefault;
+
+/** SQLite profile for a machine with plenty of RAM serving many clients, like a listener: a big
+    page cache, memory-mapped I/O, in-memory temp tables, less frequent WAL checkpoints, and
+    synchronous=NORMAL (a power loss may roll back the latest transactions, but can't corrupt
+    the database.) */
+extern NSString* const kCBLSQLiteProfileServer;
+
+/** SQLite profile for a device short of memory: a small page cache, temp tables on disk, and
+    frequent WAL checkpoints to keep the WAL file small. */
+extern NSString* const kCBLSQLiteProfileLowMemory;
+
 NS_ASSUME_NONNULL_END
@@ -43,6 +43,9 @@
 
 NSString* const kCBLSQLiteStorage = @"SQLite";
 NSString* const kCBLForestDBStorage = @"ForestDB";
+NSString* const kCBLSQLiteProfileDefault = @"default";
+NSString* const kCBLSQLiteProfileServer = @"server";
+NSString* const kCBLSQLiteProfileLowMemory = @"low-memory";
 
 static const CBLManagerOptions kCBLManagerDefaultOptions;
 
@@ -70,7 +73,10 @@ static NSString* CBLFullVersionInfo( void ) {
 
 
 @implementation CBLDatabaseOptions
-@synthesize create, readOnly, storageType, encryptionKey;
+@synthesize create, readOnly, storageType, encryptionKey, shardAttachments,
+            packSmallAttachments, chunkLargeAttachments,
+            compressAttachments, compressDocuments, preloadDocumentIDs, documentIDCacheSize,
+            sqliteProfile, sqliteSettings;
 @end
 
 
@@ -97,7 +103,8 @@ static NSString* CBLFullVersionInfo( void ) {
 
 @synthesize dispatchQueue=_dispatchQueue, directory = _dir;
 @synthesize customHTTPHeaders = _customHTTPHeaders;
-@synthesize storageType=_storageType, replicatorClassName=_replicatorClassName;
+@synthesize storageType=_storageType, replicatorClassName=_replicatorClassName,
+            sqliteProfile=_sqliteProfile;
 @synthesize defaultMaxRevTreeDepth=_defaultMaxRevTreeDepth;
 
 
@@ -276,6 +283,9 @@ static CBLManager* sInstance;
         _defaultMaxRevTreeDepth = kDefaultMaxRevs;
         if (!_storageType)
             _storageType = kCBLSQLiteStorage;
+        _sqliteProfile = [[NSUserDefaults standardUserDefaults] stringForKey: @"CBLSQLiteProfile"];
+        if (!_sqliteProfile)
+            _sqliteProfile = kCBLSQLiteProfileDefault;
         _replicatorClassName = [[NSUserDefaults standardUserDefaults]
                                                             stringForKey: @"CBLReplicatorClass"];
         if (!_replicatorClassName)
@@ -318,6 +328,7 @@ static CBLManager* sInstance;
     if (managerCopy) {
         managerCopy.customHTTPHeaders = [self.customHTTPHeaders copy];
         managerCopy.storageType = _storageType;
+        managerCopy.sqliteProfile = _sqliteProfile;
         managerCopy.replicatorClassName = _replicatorClassName;
         managerCopy.defaultMaxRevTreeDepth = _defaultMaxRevTreeDepth;
     }
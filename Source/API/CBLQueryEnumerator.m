@@ -27,6 +27,8 @@
     CBLDatabase* _database;
     CBLView* _view; // nil if this is an all-docs query
     NSArray* _rows;
+    CBLQueryRowGenerator _rowGenerator;
+    BOOL _rowGeneratorFinished;
     NSUInteger _nextRowIndex;
     UInt64 _sequenceNumber;
     BOOL _generating;
@@ -49,6 +51,17 @@
 }
 
 
+- (instancetype) initWithSequenceNumber: (SequenceNumber)sequenceNumber
+                           rowGenerator: (CBLQueryRowGenerator)generator
+{
+    self = [self initWithSequenceNumber: sequenceNumber rows: nil];
+    if (self) {
+        _rowGenerator = [generator copy];
+    }
+    return self;
+}
+
+
 - (instancetype) initWithDatabase: (CBLDatabase*)database
                              view: (CBLView*)view
                    sequenceNumber: (SequenceNumber)sequenceNumber
@@ -171,7 +184,17 @@
 
 
 - (CBLQueryRow*) generateNextRow {
-    AssertAbstractMethod();
+    if (!_rowGenerator) {
+        if (!_rowGeneratorFinished)
+            AssertAbstractMethod();
+        return nil;
+    }
+    CBLQueryRow* row = _rowGenerator();
+    if (!row) {
+        _rowGenerator = nil;     // Frees whatever it was reading from
+        _rowGeneratorFinished = YES;
+    }
+    return row;
 }
 
 
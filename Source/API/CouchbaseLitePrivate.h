@@ -100,6 +100,9 @@
 
 
 @interface CBLAttachment ()
+/** If the policy selects the new body, gzips it to be stored compressed by the next save.
+    Thread-safe, so a revision's attachments can be compressed concurrently. */
+- (void) compressWithPolicy: (BOOL(^)(NSString* name, NSString* contentType, UInt64 length))policy;
 - (BOOL) saveToDatabase: (CBLDatabase*)database error: (NSError**)outError;
 @property (readwrite, copy) NSString* name;
 @property (readwrite, retain) CBLRevision* revision;
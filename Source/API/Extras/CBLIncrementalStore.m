@@ -1616,13 +1616,11 @@ static CBLManager* sCBLManager;
                         // many-to-many
                         value = [properties objectForKey: srcKeyPath];
                         NSMutableArray* values = [NSMutableArray array];
-                        for (NSString* childDocId in value) {
-                            CBLDocument* document = [self.database existingDocumentWithID: childDocId];
-                            if (document) {
-                                id propValue = [document.properties objectForKey: destKeyPath];
-                                if (propValue)
-                                    [values addObject: propValue];
-                            }
+                        NSArray* documents = [self.database documentsWithIDs: value error: nil];
+                        for (CBLDocument* document in documents) {
+                            id propValue = [document.properties objectForKey: destKeyPath];
+                            if (propValue)
+                                [values addObject: propValue];
                         }
                         value = values;
                     } else {
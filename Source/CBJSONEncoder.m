@@ -15,28 +15,370 @@
 
 #import "CBJSONEncoder.h"
 #import "CBLMisc.h"
-#include "yajl/yajl_gen.h"
+#include "yajl/yajl_gen.h"      // for yajl_gen_status, which is still used as the error code
 
 
 NSString* const CBJSONEncoderErrorDomain = @"CBJSONEncoder";
 
 
+// Same nesting limit that yajl_gen enforced (YAJL_MAX_DEPTH).
+#define kMaxDepth 128
+
+// Number of slots in the sorted-key cache. Must be a power of 2.
+#define kKeyOrderCacheSize 64
+
+
 @interface CBJSONEncoder ()
 @property (readwrite, nonatomic) NSError* error;
 @end
 
 
-@interface NSObject (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen canonical: (BOOL)canonical;
-@end
+// The output buffer, plus the state of the encoder as it walks the object tree.
+typedef struct {
+    uint8_t* buf;
+    size_t length, capacity;
+    bool canonical;
+    unsigned depth;
+} CBJSONWriter;
 
-@interface NSDictionary (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen
-                          canonical: (BOOL)canonical
-                          keyFilter: (CBJSONEncoderKeyFilter)keyFilter
-                              error: (NSError**)outError;
-@end
 
+// For each byte, the character that follows a backslash when escaping it; 'u' means it's
+// written as "\u00XX", and 0 means it doesn't need escaping. Matches yajl_string_encode.
+static uint8_t kEscape[256];
+
+// The canonical key orders of recently-encoded dictionaries, indexed by a hash of the key set.
+// Documents in a database tend to share a handful of schemas, so this usually saves sorting.
+static NSArray* sKeyOrderCache[kKeyOrderCacheSize];
+static NSLock* sKeyOrderCacheLock;
+
+
+static void initializeEscapes(void) {
+    for (int c = 0; c < 0x20; c++)
+        kEscape[c] = 'u';
+    kEscape['\r'] = 'r';
+    kEscape['\n'] = 'n';
+    kEscape['\f'] = 'f';
+    kEscape['\b'] = 'b';
+    kEscape['\t'] = 't';
+    kEscape['\\'] = '\\';
+    kEscape['"'] = '"';
+}
+
+
+#pragma mark - OUTPUT BUFFER:
+
+
+static void growBuffer(CBJSONWriter* w, size_t minCapacity) {
+    size_t capacity = MAX(MAX(w->capacity * 2, minCapacity), 256u);
+    uint8_t* buf = realloc(w->buf, capacity);
+    if (!buf)
+        [NSException raise: NSMallocException format: @"CBJSONEncoder: out of memory"];
+    w->buf = buf;
+    w->capacity = capacity;
+}
+
+static inline uint8_t* reserve(CBJSONWriter* w, size_t n) {
+    if (w->length + n > w->capacity)
+        growBuffer(w, w->length + n);
+    return w->buf + w->length;
+}
+
+static inline void writeBytes(CBJSONWriter* w, const void* bytes, size_t n) {
+    memcpy(reserve(w, n), bytes, n);
+    w->length += n;
+}
+
+static inline void writeByte(CBJSONWriter* w, uint8_t c) {
+    *reserve(w, 1) = c;
+    w->length++;
+}
+
+
+#pragma mark - SCALARS:
+
+
+static const char kDigitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Equivalent to printf("%llu"), but several times faster.
+static void writeUnsigned(CBJSONWriter* w, uint64_t n) {
+    char digits[20];
+    char* end = digits + sizeof(digits), *p = end;
+    while (n >= 100) {
+        p -= 2;
+        memcpy(p, &kDigitPairs[2 * (n % 100)], 2);
+        n /= 100;
+    }
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, &kDigitPairs[2 * n], 2);
+    } else {
+        *--p = (char)('0' + n);
+    }
+    writeBytes(w, p, end - p);
+}
+
+static void writeInteger(CBJSONWriter* w, int64_t n) {
+    if (n < 0) {
+        writeByte(w, '-');
+        writeUnsigned(w, -(uint64_t)n);
+    } else {
+        writeUnsigned(w, n);
+    }
+}
+
+static yajl_gen_status writeNumber(CBJSONWriter* w, NSNumber* number) {
+    char ctype = number.objCType[0];
+    switch (ctype) {
+        case 'c':
+            // Booleans have already been handled by the caller, as CFBooleans.
+            writeInteger(w, number.longLongValue);
+            return yajl_gen_status_ok;
+        case 'f':
+        case 'd': {
+            // yajl_gen_double uses too many significant figures (20 not 16)
+            // which causes some numbers to round badly (e.g "8.9900000000000002" for "8.99")
+            double n = number.doubleValue;
+            char str[32];
+            if (isnan(n) || isinf(n))  {
+                return yajl_gen_invalid_number;
+            }
+            unsigned len = sprintf(str, (ctype=='f' ? "%.6g" : "%.16g"), n);
+            if (strspn(str, "0123456789-") == len) {
+                strcpy(str + len, ".0");
+                len += 2;
+            }
+            writeBytes(w, str, len);
+            return yajl_gen_status_ok;
+        }
+        case 'Q':
+            writeUnsigned(w, number.unsignedLongLongValue);
+            return yajl_gen_status_ok;
+        default:
+            writeInteger(w, number.longLongValue);
+            return yajl_gen_status_ok;
+    }
+}
+
+
+// Writes UTF-8 as a quoted JSON string, escaping the same characters as yajl_string_encode.
+static void writeEscapedString(CBJSONWriter* w, const uint8_t* chars, size_t len) {
+    reserve(w, len + 2);
+    w->buf[w->length++] = '"';
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t esc = kEscape[chars[i]];
+        if (!esc)
+            continue;
+        writeBytes(w, chars + start, i - start);
+        if (esc == 'u') {
+            static const char kHex[] = "0123456789ABCDEF";
+            char hex[6] = {'\\', 'u', '0', '0', kHex[chars[i] >> 4], kHex[chars[i] & 0x0F]};
+            writeBytes(w, hex, sizeof(hex));
+        } else {
+            char pair[2] = {'\\', (char)esc};
+            writeBytes(w, pair, 2);
+        }
+        start = i + 1;
+    }
+    writeBytes(w, chars + start, len - start);
+    writeByte(w, '"');
+}
+
+static yajl_gen_status writeString(CBJSONWriter* w, CFStringRef str) {
+    // Fastest case: the string has an internal UTF-8 C string we can use directly:
+    const char* cstr = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+    if (cstr) {
+        writeEscapedString(w, (const uint8_t*)cstr, strlen(cstr));
+        return yajl_gen_status_ok;
+    }
+
+    // Next try converting it as ASCII straight into the output buffer. This succeeds for
+    // most keys and short values (which are often tagged pointers with no C string.)
+    CFIndex length = CFStringGetLength(str);
+    uint8_t* dst = reserve(w, length + 2);
+    CFIndex used;
+    if (CFStringGetBytes(str, CFRangeMake(0, length), kCFStringEncodingASCII, 0, false,
+                         dst + 1, length, &used) == length) {
+        bool needsEscape = false;
+        for (CFIndex i = 1; i <= length; i++) {
+            if (kEscape[dst[i]]) {
+                needsEscape = true;
+                break;
+            }
+        }
+        if (!needsEscape) {
+            dst[0] = dst[length + 1] = '"';
+            w->length += length + 2;
+            return yajl_gen_status_ok;
+        }
+    }
+
+    // General case: convert to UTF-8 in a temporary buffer:
+    BOOL ok = CBLWithStringBytes((__bridge NSString*)str, ^(const char *chars, size_t len) {
+        writeEscapedString(w, (const uint8_t*)chars, len);
+    });
+    return ok ? yajl_gen_status_ok : yajl_gen_invalid_string;
+}
+
+
+#pragma mark - COLLECTIONS:
+
+
+static yajl_gen_status writeObject(CBJSONWriter* w, id object);
+
+
+// Returns the dictionary's keys in canonical order, or nil if any key isn't a string.
+static NSArray* canonicalKeyOrder(NSDictionary* dict, NSUInteger count) {
+    NSUInteger hash = count;
+    for (NSString* key in dict) {
+        if (CFGetTypeID((__bridge CFTypeRef)key) != CFStringGetTypeID()
+                && ![key isKindOfClass: [NSString class]])
+            return nil;
+        hash += key.hash;
+    }
+    hash ^= hash >> 16;
+    NSUInteger slot = (hash ^ (hash >> 8)) & (kKeyOrderCacheSize - 1);
+
+    [sKeyOrderCacheLock lock];
+    NSArray* keys = sKeyOrderCache[slot];
+    [sKeyOrderCacheLock unlock];
+
+    // A cached order is only usable if it has exactly the same keys. Since dictionary keys are
+    // unique, it's enough to check that the counts match and every cached key is present.
+    if (keys.count == count) {
+        CFDictionaryRef cfDict = (__bridge CFDictionaryRef)dict;
+        for (NSString* key in keys) {
+            if (!CFDictionaryContainsKey(cfDict, (__bridge CFStringRef)key)) {
+                keys = nil;
+                break;
+            }
+        }
+        if (keys)
+            return keys;
+    }
+
+    keys = [dict.allKeys sortedArrayUsingComparator: ^NSComparisonResult(UU id s1, UU id s2) {
+        return [s1 compare: s2 options: NSLiteralSearch];
+    }];
+    [sKeyOrderCacheLock lock];
+    sKeyOrderCache[slot] = keys;
+    [sKeyOrderCacheLock unlock];
+    return keys;
+}
+
+
+static yajl_gen_status writeDictionary(CBJSONWriter* w, NSDictionary* dict,
+                                       CBJSONEncoderKeyFilter keyFilter, NSError** outError)
+{
+    if (++w->depth >= kMaxDepth)
+        return yajl_max_depth_exceeded;
+    writeByte(w, '{');
+
+    id keys = dict;
+    NSUInteger count = dict.count;
+    if (w->canonical && count > 1) {
+        keys = canonicalKeyOrder(dict, count);
+        if (!keys)
+            return yajl_gen_keys_must_be_strings;
+    }
+
+    bool first = true;
+    for (NSString* key in keys) {
+        if (keyFilter) {
+            NSError* error = nil;
+            if (!keyFilter(key, &error)) {
+                if (error) {
+                    if (outError)
+                        *outError = error;
+                    return -1;
+                } else {
+                    continue;
+                }
+            }
+        }
+        if (!first)
+            writeByte(w, ',');
+        first = false;
+
+        if (CFGetTypeID((__bridge CFTypeRef)key) != CFStringGetTypeID()
+                && ![key isKindOfClass: [NSString class]])
+            return yajl_gen_keys_must_be_strings;
+        yajl_gen_status status = writeString(w, (__bridge CFStringRef)key);
+        if (status)
+            return status;
+        writeByte(w, ':');
+        status = writeObject(w, dict[key]);
+        if (status)
+            return status;
+    }
+
+    writeByte(w, '}');
+    --w->depth;
+    return yajl_gen_status_ok;
+}
+
+
+static yajl_gen_status writeArray(CBJSONWriter* w, NSArray* array) {
+    if (++w->depth >= kMaxDepth)
+        return yajl_max_depth_exceeded;
+    writeByte(w, '[');
+    bool first = true;
+    for (id item in array) {
+        if (!first)
+            writeByte(w, ',');
+        first = false;
+        yajl_gen_status status = writeObject(w, item);
+        if (status)
+            return status;
+    }
+    writeByte(w, ']');
+    --w->depth;
+    return yajl_gen_status_ok;
+}
+
+
+static yajl_gen_status writeObject(CBJSONWriter* w, id object) {
+    // Dispatch on the CF type first; it's much cheaper than a series of -isKindOfClass: calls,
+    // and covers all the objects created by the JSON parsers.
+    CFTypeRef cf = (__bridge CFTypeRef)object;
+    CFTypeID type = CFGetTypeID(cf);
+    if (type == CFStringGetTypeID()) {
+        return writeString(w, (CFStringRef)cf);
+    } else if (type == CFDictionaryGetTypeID()) {
+        return writeDictionary(w, object, nil, NULL);
+    } else if (type == CFArrayGetTypeID()) {
+        return writeArray(w, object);
+    } else if (type == CFBooleanGetTypeID()) {
+        if (cf == kCFBooleanTrue)
+            writeBytes(w, "true", 4);
+        else
+            writeBytes(w, "false", 5);
+        return yajl_gen_status_ok;
+    } else if (type == CFNumberGetTypeID()) {
+        return writeNumber(w, object);
+    } else if (type == CFNullGetTypeID()) {
+        writeBytes(w, "null", 4);
+        return yajl_gen_status_ok;
+    } else if ([object isKindOfClass: [NSString class]]) {
+        return writeString(w, (CFStringRef)cf);
+    } else if ([object isKindOfClass: [NSDictionary class]]) {
+        return writeDictionary(w, object, nil, NULL);
+    } else if ([object isKindOfClass: [NSArray class]]) {
+        return writeArray(w, object);
+    } else if ([object isKindOfClass: [NSNumber class]]) {
+        return writeNumber(w, object);
+    } else if ([object isKindOfClass: [NSNull class]]) {
+        writeBytes(w, "null", 4);
+        return yajl_gen_status_ok;
+    } else {
+        [NSException raise: NSInvalidArgumentException
+                    format: @"CBJSONEncoder can't encode instances of %@", [object class]];
+        return yajl_gen_in_error_state;
+    }
+}
 
 
 
@@ -44,7 +386,7 @@ NSString* const CBJSONEncoderErrorDomain = @"CBJSONEncoder";
 @implementation CBJSONEncoder
 {
     NSMutableData* _encoded;
-    yajl_gen _gen;
+    CBJSONWriter _writer;
     yajl_gen_status _status;
     NSError* _error;
 }
@@ -52,6 +394,14 @@ NSString* const CBJSONEncoderErrorDomain = @"CBJSONEncoder";
 @synthesize canonical=_canonical, keyFilter=_keyFilter;
 
 
++ (void) initialize {
+    if (self == [CBJSONEncoder class]) {
+        initializeEscapes();
+        sKeyOrderCacheLock = [[NSLock alloc] init];
+    }
+}
+
+
 + (NSData*) encode: (UU id)object error: (NSError**)outError {
     CBJSONEncoder* encoder = [[self alloc] init];
     if ([encoder encode: object])
@@ -72,45 +422,39 @@ NSString* const CBJSONEncoderErrorDomain = @"CBJSONEncoder";
 }
 
 
-- (instancetype) init {
-    self = [super init];
-    if (self) {
-        _encoded = [[NSMutableData alloc] initWithCapacity: 1024];
-        _gen = yajl_gen_alloc(NULL);
-        if (!_gen)
-            return nil;
-    }
-    return self;
-}
-
-
 - (void) dealloc {
-    if (_gen)
-        yajl_gen_free(_gen);
+    free(_writer.buf);
 }
 
 
 - (BOOL) encode: (UU id)object {
+    _writer.canonical = _canonical;
+    _writer.depth = 0;
     if (_keyFilter && [object isKindOfClass: [NSDictionary class]]) {
         NSError* error = nil;
-        _status = [(NSDictionary*)object cbjson_encodeTo: _gen
-                                               canonical: _canonical
-                                               keyFilter: _keyFilter
-                                                   error: &error];
+        _status = writeDictionary(&_writer, object, _keyFilter, &error);
         _error = error;
     } else {
-        _status = [object cbjson_encodeTo: _gen canonical: _canonical];
+        _status = writeObject(&_writer, object);
     }
     return _status == yajl_gen_status_ok;
 }
 
 
 - (NSData*) encodedData {
-    const uint8_t* buf;
-    size_t len;
-    yajl_gen_get_buf(_gen, &buf, &len);
-    [_encoded appendBytes: buf length: len];
-    yajl_gen_clear(_gen);
+    if (!_encoded && _writer.buf) {
+        // Hand the buffer over to the NSData instead of copying it:
+        uint8_t* buf = realloc(_writer.buf, MAX(_writer.length, 1u)) ?: _writer.buf;
+        _encoded = [[NSMutableData alloc] initWithBytesNoCopy: buf length: _writer.length
+                                                 freeWhenDone: YES];
+        _writer.buf = NULL;
+        _writer.capacity = 0;
+    } else {
+        if (!_encoded)
+            _encoded = [[NSMutableData alloc] init];
+        [_encoded appendBytes: _writer.buf length: _writer.length];
+    }
+    _writer.length = 0;
     return _encoded;
 }
 
@@ -156,138 +500,3 @@ NSString* const CBJSONEncoderErrorDomain = @"CBJSONEncoder";
 
 
 @end
-
-
-
-
-@implementation NSString (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen canonical: (BOOL)canonical {
-    __block yajl_gen_status status = yajl_gen_invalid_string;
-    CBLWithStringBytes(self, ^(const char *chars, size_t len) {
-        status = yajl_gen_string(gen, (const unsigned char*)chars, len);
-    });
-    return status;
-}
-@end
-
-@implementation NSNumber (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen canonical: (BOOL)canonical {
-    char ctype = self.objCType[0];
-    switch (ctype) {
-        case 'c': {
-            // The only way to tell whether an NSNumber with 'char' type is a boolean is to
-            // compare it against the singleton kCFBoolean objects:
-            if (self == (id)kCFBooleanTrue)
-                return yajl_gen_bool(gen, true);
-            else if (self == (id)kCFBooleanFalse)
-                return yajl_gen_bool(gen, false);
-            else
-                return yajl_gen_integer(gen, self.longLongValue);
-        }
-        case 'f':
-        case 'd': {
-            // Based on yajl_gen_double, except yajl uses too many significant figures (20 not 16)
-            // which causes some numbers to round badly (e.g "8.9900000000000002" for "8.99")
-            double n = self.doubleValue;
-            char str[32];
-            if (isnan(n) || isinf(n))  {
-                return yajl_gen_invalid_number;
-            }
-            unsigned len = sprintf(str, (ctype=='f' ? "%.6g" : "%.16g"), n);
-            if (strspn(str, "0123456789-") == strlen(str)) {
-                strcat(str, ".0");
-                len += 2;
-            }
-            return yajl_gen_number(gen, str, len);
-        }
-        case 'Q': {
-            char str[32];
-            unsigned len = sprintf(str, "%llu", self.unsignedLongLongValue);
-            return yajl_gen_number(gen, str, len);
-        }
-        default:
-            return yajl_gen_integer(gen, self.longLongValue);
-    }
-}
-@end
-
-@implementation NSNull (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen canonical: (BOOL)canonical {
-    return yajl_gen_null(gen);
-}
-@end
-
-@implementation NSArray (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen canonical: (BOOL)canonical {
-    yajl_gen_array_open(gen);
-    for (id item in self) {
-        yajl_gen_status status = [item cbjson_encodeTo: gen canonical: canonical];
-        if (status)
-            return status;
-    }
-    return yajl_gen_array_close(gen);
-}
-@end
-
-@implementation NSDictionary (CBJSONEncoder)
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen canonical: (BOOL)canonical {
-    yajl_gen_map_open(gen);
-    id keys;
-    if (canonical && self.count > 1) {
-        // inlining +orderedKeys: for performance
-        keys = [self.allKeys sortedArrayUsingComparator: ^NSComparisonResult(UU id s1, UU id s2) {
-            return [s1 compare: s2 options: NSLiteralSearch];
-        }];
-    } else {
-        keys = self;
-    }
-
-    for (NSString* key in keys) {
-        yajl_gen_status status = [key cbjson_encodeTo: gen canonical: canonical];
-        if (status)
-            return status;
-        status = [self[key] cbjson_encodeTo: gen canonical: canonical];
-        if (status)
-            return status;
-    }
-    return yajl_gen_map_close(gen);
-}
-
-- (yajl_gen_status) cbjson_encodeTo: (yajl_gen)gen
-                          canonical: (BOOL)canonical
-                          keyFilter: (CBJSONEncoderKeyFilter)keyFilter
-                              error: (NSError**)outError
-{
-    NSError* error = nil;
-
-    yajl_gen_map_open(gen);
-    id keys;
-    if (canonical && self.count > 1) {
-        // inlining +orderedKeys: for performance
-        keys = [self.allKeys sortedArrayUsingComparator: ^NSComparisonResult(id s1, id s2) {
-            return [s1 compare: s2 options: NSLiteralSearch];
-        }];
-    } else {
-        keys = self;
-    }
-
-    for (NSString* key in keys) {
-        if (!keyFilter(key, &error)) {
-            if (error) {
-                if (outError)
-                    *outError = error;
-                return -1;
-            } else {
-                continue;
-            }
-        }
-        yajl_gen_status status = [key cbjson_encodeTo: gen canonical: canonical];
-        if (status)
-            return status;
-        status = [self[key] cbjson_encodeTo: gen canonical: canonical];
-        if (status)
-            return status;
-    }
-    return yajl_gen_map_close(gen);
-}
-@end
@@ -61,8 +61,12 @@ BOOL CBLAttachmentDownloaderFakeTransientFailures;
         }
 
         _writer = task.writer;
-        if (!_writer)
+        if (!_writer) {
             _writer = task.writer = [database attachmentWriter];
+            // Only -verifyDigest: looks at the digest, so skip MD5 unless that's what it needs:
+            NSString* digest = task.ID.metadata[@"digest"];
+            _writer.computesMD5 = !digest || [digest hasPrefix: @"md5-"];
+        }
 
         _database = database;
         _url = url;
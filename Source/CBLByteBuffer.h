@@ -7,8 +7,12 @@
 //
 
 #import <Foundation/Foundation.h>
+#include <sys/uio.h>
 
-/** A queue of bytes that's written to at the end and read from the beginning.  */
+/** A queue of bytes that's written to at the end and read from the beginning.
+    It's stored as a chain of segments, each of which is (part of) an NSData, so consumed bytes are
+    released a segment at a time instead of being slid down, data whose bytes won't change can be
+    appended without copying it, and slices can share storage with the buffer. */
 @interface CBLByteBuffer : NSObject
 
 /** Removes/consumes bytes from the start of the buffer. */
@@ -20,19 +24,33 @@
 /** The number of bytes the buffer has available */
 @property (readonly) NSUInteger bytesAvailable;
 
-/** Appends more data to the buffer */
+/** Appends more data to the buffer, copying its bytes. */
 - (void)appendData:(NSData *)data;
 
+/** Appends more data to the buffer, retaining it instead of copying its bytes if it's large.
+    The caller guarantees the bytes stay valid and unchanged until they've been consumed; so don't
+    pass mutable data that will be changed, or data made with a NoCopy initializer over a buffer
+    that will be reused or freed. */
+- (void)appendDataNoCopy:(NSData *)data;
+
 /** Appends raw bytes to the buffer */
 - (void)appendBytes:(const void *)bytes length:(NSUInteger)length;
 
+/** Returns a pointer to `length` contiguous writable bytes at the end of the buffer. Write into
+    them, then call -commitBytes: with the number actually written, before any other call. */
+- (void *)reserveBytes:(NSUInteger)length;
+
+/** Adds `length` bytes written into the space returned by -reserveBytes: to the buffer. */
+- (void)commitBytes:(NSUInteger)length;
+
 /** Resets the buffer to zero bytes, zero offset */
 - (void)reset;
 
-/** An unmutable reference to the buffer's bytes */
+/** An unmutable reference to the buffer's bytes.
+    If the bytes span more than one segment, this first copies them into one. */
 @property (readonly) const void* bytes;
 
-/** A mutable reference to the buffer's bytes */
+/** A mutable reference to the buffer's bytes. (Like .bytes, this may coalesce segments.) */
 @property (readonly) void* mutableBytes;
 
 /** A copy of the available bytes in the buffer, or nil if there are no available bytes */
@@ -42,6 +60,15 @@
     The result becomes invalid as soon as any more data is written to the buffer. */
 - (NSData *)subdataWithRangeNoCopy:(NSRange)range;
 
+/** An NSData containing the available bytes with the given range, which stays valid after the
+    buffer changes. It shares storage with the buffer if the range lies within one segment. */
+- (NSData *)subdataWithRange:(NSRange)range;
+
+/** Fills in up to `maxCount` iovecs with the locations of the available bytes, in order, for
+    use with writev() and the like. Returns the number filled in. They're valid until the buffer
+    is next changed. */
+- (NSUInteger)getRegions:(struct iovec *)regions maxCount:(NSUInteger)maxCount;
+
 /** Searches for the first occurrence of a specific byte string in the buffer. */
 - (NSRange) searchFor: (NSData*)pattern from: (NSUInteger)start;
 
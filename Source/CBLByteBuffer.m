@@ -9,26 +9,56 @@
 #import "CBLByteBuffer.h"
 
 
-// Initial capacity of the buffer
-#define kInitialCapacity 32768
+// Size of the segments that appended bytes are copied into
+#define kSegmentSize 32768
+
+// Data at least this long is retained by -appendDataNoCopy: instead of being copied
+#define kMinRetainedDataLength 4096
+
+// If no more than this many bytes are available when appended bytes don't fit in the last segment,
+// they're carried over into the new segment, so that a small remainder (like a partial header)
+// stays contiguous with what follows it.
+#define kMaxCarriedLength 4096
+
+
+/** A run of bytes in an NSData. Segments the buffer allocated itself are writable past `end`;
+    their data never changes length, so pointers into it stay valid. */
+@interface CBLByteBufferSegment : NSObject
+{
+    @public
+    NSData* data;
+    uint8_t* bytes;         // == data.bytes
+    NSUInteger start, end;  // range of available bytes
+    BOOL writable;          // can bytes be added past `end`?
+    BOOL shared;            // has -subdataWithRange: handed out some of its bytes?
+}
+@end
+
+@implementation CBLByteBufferSegment
+@end
+
+
+static CBLByteBufferSegment* newSegment(NSUInteger capacity) {
+    CBLByteBufferSegment* seg = [CBLByteBufferSegment new];
+    NSMutableData* data = [NSMutableData dataWithLength: capacity];
+    seg->data = data;
+    seg->bytes = data.mutableBytes;
+    seg->writable = YES;
+    return seg;
+}
 
-// How much free space there has to be at the start of _data before we'll slide it down or realloc
-#define kCompactionLength 4096
 
 @implementation CBLByteBuffer
 {
-    NSMutableData *_data;
-    NSUInteger _offset;
-    NSUInteger _capacity;
+    NSMutableArray* _segments;      // CBLByteBufferSegments, oldest first
+    NSUInteger _length;             // total bytes available in the segments
 }
 
 #pragma mark - Initialization
 
 - (instancetype)init {
     if((self = [super init])) {
-        _capacity = kInitialCapacity;
-        _data = [NSMutableData dataWithCapacity:_capacity];
-        _offset = 0;
+        _segments = [[NSMutableArray alloc] init];
     }
     return self;
 }
@@ -36,87 +66,227 @@
 #pragma mark - Actions
 
 - (void)advance:(NSUInteger)amount {
-    Assert(_offset + amount <= _data.length);
-    _offset += amount;
+    Assert(amount <= _length);
+    if (amount == _length) {
+        [self reset];
+        return;
+    }
+    _length -= amount;
+    while (amount > 0) {
+        CBLByteBufferSegment* seg = _segments[0];
+        NSUInteger n = MIN(amount, seg->end - seg->start);
+        seg->start += n;
+        amount -= n;
+        if (seg->start == seg->end)
+            [_segments removeObjectAtIndex: 0];
+    }
 }
 
 - (BOOL)hasBytesAvailable {
-    return _data.length > _offset;
+    return _length > 0;
 }
 
 - (NSUInteger)bytesAvailable {
-    return _data.length - _offset;
+    return _length;
 }
 
 - (void)appendData:(NSData *)data {
     [self appendBytes: data.bytes length: data.length];
 }
 
+- (void)appendDataNoCopy:(NSData *)data {
+    NSUInteger length = data.length;
+    if (length < kMinRetainedDataLength) {
+        [self appendBytes: data.bytes length: length];
+        return;
+    }
+    // Even an immutable NSData may point to someone else's buffer (it may have been created with
+    // -initWithBytesNoCopy:...), so -copy wouldn't be a safe copy; the caller vouches for it.
+    CBLByteBufferSegment* seg = [CBLByteBufferSegment new];
+    seg->data = data;
+    seg->bytes = (uint8_t*)seg->data.bytes;
+    seg->end = length;
+    [_segments addObject: seg];
+    _length += length;
+}
+
 - (void)appendBytes:(const void *)bytes length:(NSUInteger)length {
-    [self makeRoom: length];
-    [_data appendBytes:bytes length:length];
-    _capacity = MAX(_capacity, _data.length);
-}
-
-- (void)compact {
-    [self makeRoom: 0];
-}
-
-- (void)makeRoom: (NSUInteger)amount {
-    if(_offset > kCompactionLength && _offset > (_data.length >> 1)) {
-        void* dst = _data.mutableBytes, *src = dst + _offset;
-        NSUInteger curLength = self.bytesAvailable;
-        NSUInteger newLength = curLength + amount;
-        if (newLength <= _capacity) {
-            // There's enough room if we slide everything down:
-            memcpy(dst, src, curLength);
-            _data.length = curLength;
-        } else {
-            // No room, allocate a new buffer:
-            _capacity = newLength + 1024;
-            NSMutableData* newData = [NSMutableData dataWithCapacity: _capacity];
-            [newData appendBytes: src length: curLength];
-            _data = newData;
-        }
-        _offset = 0;
+    if (length == 0)
+        return;
+    memcpy([self reserveBytes: length], bytes, length);
+    [self commitBytes: length];
+}
+
+- (void *)reserveBytes:(NSUInteger)length {
+    CBLByteBufferSegment* tail = _segments.lastObject;
+    if (tail && tail->writable && tail->data.length - tail->end >= length)
+        return tail->bytes + tail->end;
+    CBLByteBufferSegment* seg;
+    if (_length <= kMaxCarriedLength) {
+        seg = newSegment(MAX(kSegmentSize, _length + length));
+        [self copyRange: NSMakeRange(0, _length) to: seg->bytes];
+        seg->end = _length;
+        [_segments removeAllObjects];
+    } else {
+        seg = newSegment(MAX(kSegmentSize, length));
     }
+    [_segments addObject: seg];
+    return seg->bytes + seg->end;
+}
+
+- (void)commitBytes:(NSUInteger)length {
+    CBLByteBufferSegment* tail = _segments.lastObject;
+    Assert(tail && tail->writable && tail->end + length <= tail->data.length);
+    tail->end += length;
+    _length += length;
 }
 
 - (void)reset {
-    _offset = 0;
-    _data.length = 0;
+    // Keep the last segment to write into again, unless it's read-only or has been sliced:
+    CBLByteBufferSegment* tail = _segments.lastObject;
+    [_segments removeAllObjects];
+    _length = 0;
+    if (tail && tail->writable && !tail->shared) {
+        tail->start = tail->end = 0;
+        [_segments addObject: tail];
+    }
+}
+
+#pragma mark - Accessors
+
+// Copies bytes in the given range of the available bytes to `dst`, gathering them from segments.
+- (void) copyRange: (NSRange)range to: (uint8_t*)dst {
+    NSUInteger pos = range.location, remaining = range.length;
+    for (CBLByteBufferSegment* seg in _segments) {
+        if (remaining == 0)
+            break;
+        NSUInteger segLen = seg->end - seg->start;
+        if (pos >= segLen) {
+            pos -= segLen;
+            continue;
+        }
+        NSUInteger n = MIN(remaining, segLen - pos);
+        memcpy(dst, seg->bytes + seg->start + pos, n);
+        dst += n;
+        remaining -= n;
+        pos = 0;
+    }
+}
+
+// Returns the segment holding all of `range`, changing `range` to be relative to its bytes;
+// or nil if the range spans segments.
+- (CBLByteBufferSegment*) segmentForRange: (NSRange*)range {
+    NSUInteger pos = range->location;
+    for (CBLByteBufferSegment* seg in _segments) {
+        NSUInteger segLen = seg->end - seg->start;
+        if (pos < segLen) {
+            if (pos + range->length > segLen)
+                return nil;
+            range->location = seg->start + pos;
+            return seg;
+        }
+        pos -= segLen;
+    }
+    return nil;
+}
+
+// Makes the available bytes contiguous, copying them into one new segment if they're in several
+// (or if `mutable` is set and they're in read-only or shared storage.) Returns the segment.
+- (CBLByteBufferSegment*) contiguousSegment: (BOOL)mutable {
+    if (_length == 0)
+        return nil;
+    if (_segments.count > 1) {
+        NSIndexSet* empty = [_segments indexesOfObjectsPassingTest:
+                             ^BOOL(CBLByteBufferSegment* seg, NSUInteger i, BOOL *stop) {
+            return seg->start == seg->end;
+        }];
+        [_segments removeObjectsAtIndexes: empty];
+    }
+    CBLByteBufferSegment* seg = _segments[0];
+    if (_segments.count > 1 || (mutable && (!seg->writable || seg->shared))) {
+        seg = newSegment(MAX(kSegmentSize, _length));
+        [self copyRange: NSMakeRange(0, _length) to: seg->bytes];
+        seg->end = _length;
+        [_segments removeAllObjects];
+        [_segments addObject: seg];
+    }
+    return seg;
 }
 
 - (const void *)bytes {
-    return _data.bytes + _offset;
+    CBLByteBufferSegment* seg = [self contiguousSegment: NO];
+    return seg ? seg->bytes + seg->start : NULL;
 }
 
 - (void *)mutableBytes {
-    return _data.mutableBytes + _offset;
+    CBLByteBufferSegment* seg = [self contiguousSegment: YES];
+    return seg ? seg->bytes + seg->start : NULL;
 }
 
 - (NSData *)data {
     if (!self.hasBytesAvailable) {
         return nil;
     }
-    return [NSData dataWithBytes:self.bytes length:self.bytesAvailable];
+    NSMutableData* data = [NSMutableData dataWithLength: _length];
+    [self copyRange: NSMakeRange(0, _length) to: data.mutableBytes];
+    return data;
 }
 
 - (NSData *)subdataWithRangeNoCopy:(NSRange)range {
     Assert(NSMaxRange(range) <= self.bytesAvailable);
-    return [[NSData alloc] initWithBytesNoCopy: _data.mutableBytes + _offset + range.location
+    if (range.length == 0)
+        return [NSData data];
+    CBLByteBufferSegment* seg = [self segmentForRange: &range];
+    if (!seg) {
+        seg = [self contiguousSegment: NO];
+        range.location += seg->start;
+    }
+    return [[NSData alloc] initWithBytesNoCopy: seg->bytes + range.location
                                         length: range.length
                                   freeWhenDone: NO];
 }
 
+- (NSData *)subdataWithRange:(NSRange)range {
+    Assert(NSMaxRange(range) <= self.bytesAvailable);
+    if (range.length == 0)
+        return [NSData data];
+    NSRange segRange = range;
+    CBLByteBufferSegment* seg = [self segmentForRange: &segRange];
+    if (!seg) {
+        NSMutableData* data = [NSMutableData dataWithLength: range.length];
+        [self copyRange: range to: data.mutableBytes];
+        return data;
+    }
+    seg->shared = YES;
+    NSData* owner = seg->data;
+    return [[NSData alloc] initWithBytesNoCopy: seg->bytes + segRange.location
+                                        length: segRange.length
+                                   deallocator: ^(void *bytes, NSUInteger length) {
+                                       (void)owner;     // keeps the segment's data alive
+                                   }];
+}
+
+- (NSUInteger)getRegions:(struct iovec *)regions maxCount:(NSUInteger)maxCount {
+    NSUInteger n = 0;
+    for (CBLByteBufferSegment* seg in _segments) {
+        if (n >= maxCount)
+            break;
+        if (seg->end > seg->start) {
+            regions[n].iov_base = seg->bytes + seg->start;
+            regions[n].iov_len = seg->end - seg->start;
+            ++n;
+        }
+    }
+    return n;
+}
+
 - (NSRange) searchFor: (NSData*)pattern from: (NSUInteger)start {
-    start += _offset;
-    NSRange r = [_data rangeOfData: pattern
-                           options: 0
-                             range: NSMakeRange(start, _data.length-start)];
-    if (r.length > 0)
-        r.location -= _offset;
-    return r;
+    if (start >= _length)
+        return NSMakeRange(NSNotFound, 0);
+    NSData* available = [[NSData alloc] initWithBytesNoCopy: (void*)self.bytes
+                                                     length: _length
+                                               freeWhenDone: NO];
+    return [available rangeOfData: pattern options: 0 range: NSMakeRange(start, _length - start)];
 }
 
 @end
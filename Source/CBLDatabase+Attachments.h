@@ -18,12 +18,27 @@ typedef enum {
 } CBLAttachmentEncoding;
 
 
+/** Decides whether a new attachment should be stored gzip-compressed. */
+typedef BOOL (^CBLAttachmentCompressionPolicy)(NSString* name, NSString* contentType,
+                                               UInt64 length);
+
+
 @interface CBLDatabase (Attachments)
 
 @property (readonly) NSString* attachmentStorePath;
 
 + (NSString*) blobKeyToDigest: (CBLBlobKey)key;
 
+/** If set, new attachment bodies saved through the API are gzipped when this returns YES for them,
+    as long as that makes them significantly smaller; they're then stored and replicated with
+    "encoding":"gzip". Attachments that already have an encoding or digest are left alone.
+    Defaults to nil (never compress.) */
+@property (copy) CBLAttachmentCompressionPolicy attachmentCompressionPolicy;
+
+/** Compresses attachments of at least 1KB whose names or content types indicate text, JSON, XML
+    and the like. Set by CBLDatabaseOptions.compressAttachments. */
++ (CBLAttachmentCompressionPolicy) defaultAttachmentCompressionPolicy;
+
 /** Register attachment bodies in `attachments` (NSData or file NSURLs) corresponding to the
     attachments in `rev`. The _attachments dict will be mutated if necessary to add "digest"
     and "follows" properties. */
@@ -67,6 +82,10 @@ typedef enum {
 /** Deletes obsolete attachments from the database and blob store. */
 - (BOOL) garbageCollectAttachments: (NSError**)outError;
 
+/** Does the same as -garbageCollectAttachments:, but incrementally, in short time slices on the
+    database's thread/queue so other work can interleave. Does nothing if already running. */
+- (void) garbageCollectAttachmentsInBackground;
+
 - (void) rememberAttachmentWriter: (CBL_BlobStoreWriter*)writer;
 - (void) rememberAttachmentWriter: (CBL_BlobStoreWriter*)writer forDigest:(NSString*)digest;
 - (void) rememberAttachmentWritersForDigests: (NSDictionary*)writersByDigests;
@@ -42,6 +42,9 @@
 // Length that constitutes a 'big' attachment
 #define kBigAttachmentLength (2*1024)
 
+// Minimum length of attachment the default compression policy compresses
+#define kMinAttachmentLengthToCompress 1024
+
 
 @implementation CBLDatabase (Attachments)
 
@@ -55,6 +58,23 @@
 }
 
 
+- (CBLAttachmentCompressionPolicy) attachmentCompressionPolicy {
+    return _attachmentCompressionPolicy;
+}
+
+- (void) setAttachmentCompressionPolicy: (CBLAttachmentCompressionPolicy)policy {
+    _attachmentCompressionPolicy = [policy copy];
+}
+
+
++ (CBLAttachmentCompressionPolicy) defaultAttachmentCompressionPolicy {
+    return ^BOOL(NSString* name, NSString* contentType, UInt64 length) {
+        return length >= kMinAttachmentLengthToCompress
+            && [CBL_Attachment isCompressibleName: name contentType: contentType];
+    };
+}
+
+
 #pragma mark - ATTACHMENT WRITERS:
 
 
@@ -468,18 +488,90 @@ static UInt64 smallestLength(NSDictionary* attachment) {
 #pragma mark - MISC.:
 
 
+#define kGCBatchSize 100            // Number of blobs looked up in the storage at once
+#define kGCSliceDuration 0.05       // Max time a background GC slice runs for
+#define kGCSliceInterval 0.25       // Delay between background GC slices
+
+
 - (BOOL) garbageCollectAttachments: (NSError**)outError {
-    LogTo(Database, @"Scanning database revisions for attachments...");
-    NSSet* keys = [_storage findAllAttachmentKeys: outError];
-    if (!keys)
-        return NO;
-    LogTo(Database, @"    ...found %lu attachments", (unsigned long)keys.count);
-    NSInteger deleted = [_attachments deleteBlobsExceptMatching: ^BOOL(CBLBlobKey blobKey) {
-        NSData* keyData = [[NSData alloc] initWithBytes: &blobKey length: sizeof(blobKey)];
-        return [keys containsObject: keyData];
-    } error: outError];
-    LogTo(Database, @"    ... deleted %ld obsolete attachment files.", (long)deleted);
-    return deleted >= 0;
+    _gcKeys = nil;      // start over, in case a background GC is partway through
+    BOOL finished;
+    return [self garbageCollectAttachmentsFor: 0 finished: &finished error: outError];
+}
+
+
+// Deletes blobs that no revision refers to, working through a snapshot of the blob store's keys
+// in batches until it's done or `duration` seconds (if nonzero) have passed. A later call picks
+// up where it left off. Blobs added after the snapshot was taken aren't examined. Each batch's
+// references are looked up just before it's swept, so revisions saved between slices protect their
+// attachments; but a blob that's in the snapshot and whose revision hasn't been saved yet when its
+// batch is swept (e.g. a new attachment identical to an orphaned one) can still be deleted.
+// If the storage has no reference index, finding the referenced keys takes a scan of every
+// revision, and that result would be stale by the next slice; so the whole GC runs in one pass.
+- (BOOL) garbageCollectAttachmentsFor: (NSTimeInterval)duration
+                             finished: (BOOL*)outFinished
+                                error: (NSError**)outError
+{
+    *outFinished = NO;
+    NSSet* allLiveKeys = nil;
+    if (![_storage respondsToSelector: @selector(referencedAttachmentKeys:error:)]) {
+        _gcKeys = nil;
+        duration = 0;
+        LogTo(Database, @"Scanning database revisions for attachments...");
+        allLiveKeys = [_storage findAllAttachmentKeys: outError];
+        if (!allLiveKeys)
+            return NO;
+    }
+    if (!_gcKeys) {
+        _gcKeys = [_attachments.allKeys mutableCopy] ?: [NSMutableArray array];
+        _gcDeleted = 0;
+        LogTo(Database, @"Garbage-collecting %lu attachments...", (unsigned long)_gcKeys.count);
+    }
+
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + duration;
+    while (_gcKeys.count > 0) {
+        NSRange range = NSMakeRange(0, MIN(_gcKeys.count, (NSUInteger)kGCBatchSize));
+        NSArray* batch = [_gcKeys subarrayWithRange: range];
+        NSSet* liveKeys = allLiveKeys ?: [_storage referencedAttachmentKeys: batch error: outError];
+        if (!liveKeys) {
+            _gcKeys = nil;
+            return NO;
+        }
+        for (NSData* keyData in batch) {
+            if (![liveKeys containsObject: keyData]) {
+                CBLBlobKey key;
+                [keyData getBytes: &key length: sizeof(key)];
+                if ([_attachments deleteBlobForKey: key])
+                    ++_gcDeleted;
+            }
+        }
+        [_gcKeys removeObjectsInRange: range];
+        if (duration > 0 && _gcKeys.count > 0 && CFAbsoluteTimeGetCurrent() >= deadline)
+            return YES;
+    }
+
+    LogTo(Database, @"    ... deleted %lu obsolete attachments.", (unsigned long)_gcDeleted);
+    _gcKeys = nil;
+    *outFinished = YES;
+    return [_attachments compactStorage: outError];
+}
+
+
+- (void) garbageCollectAttachmentsInBackground {
+    if (_gcScheduled)
+        return;
+    _gcScheduled = YES;
+    [self doAsyncAfterDelay: kGCSliceInterval block: ^{
+        _gcScheduled = NO;
+        BOOL finished;
+        NSError* error;
+        if (![self garbageCollectAttachmentsFor: kGCSliceDuration finished: &finished
+                                          error: &error])
+            Warn(@"%@: Attachment garbage collection failed: %@",
+                 self, error.my_compactDescription);
+        else if (!finished)
+            [self garbageCollectAttachmentsInBackground];
+    }];
 }
 
 
@@ -32,6 +32,17 @@
                     status: (CBLStatus*)outStatus
                      error: (NSError**)outError;
 
+/** Stores new revisions of many documents, in a single transaction. Each is handled as by -putDocID:..., but if the storage supports it the lookups and inserts are done in bulk; either way, all the changes are posted in a single notification.
+    @param docs  The new revisions' properties. Each one's "_id" is the document ID (if missing, a new UUID is assigned), "_rev" the ID of the revision to replace (missing for a new document), and "_deleted" makes it a deletion. The dictionaries may be modified.
+    @param allowConflict  As for -putDocID:...
+    @param source  The URL of the client that sent the documents, if any; passed to validation functions.
+    @param outError  On return, the error that made the whole operation fail.
+    @return  An array with one item for each document, in order: the new CBL_Revision, or an NSError if that document couldn't be saved. Returns nil if the operation as a whole failed. */
+- (NSArray*) putDocuments: (NSArray<NSMutableDictionary*>*)docs
+            allowConflict: (BOOL)allowConflict
+                   source: (NSURL*)source
+                    error: (NSError**)outError;
+
 /** Inserts an already-existing revision replicated from a remote database. It must already have a revision ID. This may create a conflict! The revision's history must be given; ancestor revision IDs that don't already exist locally will create phantom revisions with no content. */
 - (CBLStatus) forceInsert: (CBL_Revision*)rev
           revisionHistory: (NSArray<CBL_RevID*>*)history
@@ -112,31 +112,15 @@ DefineLogDomain(Validation);
     }
 
     if (properties.cbl_attachments) {
-        // Add any new attachment data to the blob-store, and turn all of them into stubs:
-        //FIX: Optimize this to avoid creating a revision object
-        CBL_RevID* tmpRevID = $sprintf(@"%d-00", prevRevID.generation + 1).cbl_asRevID;
-        CBL_MutableRevision* tmpRev = [[CBL_MutableRevision alloc] initWithDocID: (docID ?: @"x")
-                                                                           revID: tmpRevID
-                                                                         deleted: deleting];
-        tmpRev.properties = properties;
-        if (![self processAttachmentsForRevision: tmpRev
-                                        ancestry: (prevRevID ? @[prevRevID] : nil)
-                                          status: outStatus]) {
+        properties = [self processAttachmentsInProperties: properties
+                                                    docID: docID
+                                                prevRevID: prevRevID
+                                                 deleting: deleting
+                                                   status: outStatus];
+        if (!properties) {
             CBLStatusToOutNSError(*outStatus, outError);
             return nil;
         }
-        properties = [tmpRev.properties mutableCopy];
-    }
-
-    CBL_StorageValidationBlock validationBlock = nil;
-    if ([self.shared hasValuesOfType: @"validation" inDatabaseNamed: _name]) {
-        validationBlock = ^(CBL_Revision* rev, CBL_Revision* prev, CBL_RevID* parentRevID, NSError** outError) {
-            return [self validateRevision: rev
-                         previousRevision: prev
-                              parentRevID: parentRevID
-                                   source: nil
-                                    error: outError];
-        };
     }
 
     return [_storage addDocID: inDocID
@@ -144,12 +128,131 @@ DefineLogDomain(Validation);
                    properties: properties
                      deleting: deleting
                 allowConflict: allowConflict
-              validationBlock: validationBlock
+              validationBlock: [self validationBlockWithSource: source]
                        status: outStatus
                         error: outError];
 }
 
 
+- (NSArray*) putDocuments: (NSArray<NSMutableDictionary*>*)docs
+            allowConflict: (BOOL)allowConflict
+                   source: (NSURL*)source
+                    error: (NSError**)outError
+{
+    LogTo(Database, @"PUT %lu docs (allowConflict=%d)", (unsigned long)docs.count, allowConflict);
+    // Check the docs, and process their attachments, before handing them to the storage:
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity: docs.count];
+    NSMutableArray* toAdd = [NSMutableArray arrayWithCapacity: docs.count];
+    for (NSMutableDictionary* docProperties in docs) {
+        NSMutableDictionary* properties = docProperties;
+        NSString* docID = properties.cbl_id;
+        CBL_RevID* prevRevID = properties.cbl_rev;
+        BOOL deleting = properties.cbl_deleted;
+        CBLStatus status = kCBLStatusOK;
+        if ((prevRevID && !docID) || (deleting && !docID)
+                || (docID && ![CBLDatabase isValidDocumentID: docID])) {
+            status = kCBLStatusBadID;
+        } else {
+            if (!docID)
+                properties[@"_id"] = docID = [CBLDatabase generateDocumentID];
+            if (properties.cbl_attachments) {
+                properties = [self processAttachmentsInProperties: properties
+                                                            docID: docID
+                                                        prevRevID: prevRevID
+                                                         deleting: deleting
+                                                           status: &status];
+            }
+        }
+        if (CBLStatusIsError(status)) {
+            [results addObject: CBLStatusToNSError(status)];
+        } else {
+            [results addObject: [NSNull null]];     // placeholder for the new revision
+            [toAdd addObject: properties];
+        }
+    }
+
+    CBL_StorageValidationBlock validationBlock = [self validationBlockWithSource: source];
+    NSArray* added;
+    if ([_storage respondsToSelector: @selector(addDocuments:allowConflict:validationBlock:error:)]) {
+        added = [_storage addDocuments: toAdd
+                         allowConflict: allowConflict
+                       validationBlock: validationBlock
+                                 error: outError];
+    } else {
+        // The storage can't insert in bulk, so add the docs one at a time in a transaction:
+        NSMutableArray* revs = [NSMutableArray arrayWithCapacity: toAdd.count];
+        CBLStatus status = [_storage inTransaction: ^CBLStatus {
+            [revs removeAllObjects];
+            for (NSMutableDictionary* properties in toAdd) {
+                CBLStatus status;
+                NSError* error = nil;
+                CBL_Revision* rev = [_storage addDocID: properties.cbl_id
+                                             prevRevID: properties.cbl_rev
+                                            properties: properties
+                                              deleting: properties.cbl_deleted
+                                         allowConflict: allowConflict
+                                       validationBlock: validationBlock
+                                                status: &status
+                                                 error: &error];
+                if (!rev && status >= 500)
+                    return status;
+                [revs addObject: rev ?: (error ?: CBLStatusToNSError(status))];
+            }
+            return kCBLStatusOK;
+        }];
+        added = CBLStatusIsError(status) ? nil : revs;
+        if (!added)
+            CBLStatusToOutNSError(status, outError);
+    }
+    if (!added)
+        return nil;
+
+    NSUInteger next = 0;
+    for (NSUInteger i = 0; i < results.count; i++) {
+        if (results[i] == [NSNull null])
+            results[i] = added[next++];
+    }
+    return results;
+}
+
+
+/** Adds any new attachment data in the properties to the blob-store, and turns all of the
+    attachments into stubs. Returns the updated properties, or nil on error. */
+- (NSMutableDictionary*) processAttachmentsInProperties: (NSMutableDictionary*)properties
+                                                  docID: (NSString*)docID
+                                              prevRevID: (CBL_RevID*)prevRevID
+                                               deleting: (BOOL)deleting
+                                                 status: (CBLStatus*)outStatus
+{
+    //FIX: Optimize this to avoid creating a revision object
+    CBL_RevID* tmpRevID = $sprintf(@"%d-00", prevRevID.generation + 1).cbl_asRevID;
+    CBL_MutableRevision* tmpRev = [[CBL_MutableRevision alloc] initWithDocID: (docID ?: @"x")
+                                                                       revID: tmpRevID
+                                                                     deleted: deleting];
+    tmpRev.properties = properties;
+    if (![self processAttachmentsForRevision: tmpRev
+                                    ancestry: (prevRevID ? @[prevRevID] : nil)
+                                      status: outStatus])
+        return nil;
+    return [tmpRev.properties mutableCopy];
+}
+
+
+/** Returns a block that runs the database's validation functions, or nil if it has none. */
+- (CBL_StorageValidationBlock) validationBlockWithSource: (NSURL*)source {
+    if (![self.shared hasValuesOfType: @"validation" inDatabaseNamed: _name])
+        return nil;
+    return ^(CBL_Revision* newRev, CBL_Revision* prev, CBL_RevID* parentRevID,
+             NSError** outError) {
+        return [self validateRevision: newRev
+                     previousRevision: prev
+                          parentRevID: parentRevID
+                               source: source
+                                error: outError];
+    };
+}
+
+
 /** Add an existing revision of a document (probably being pulled) plus its ancestors. */
 - (CBLStatus) forceInsert: (CBL_Revision*)inRev
           revisionHistory: (NSArray<CBL_RevID*>*)history  // in *reverse* order, starting with rev's revID
@@ -188,21 +291,9 @@ DefineLogDomain(Validation);
         inRev = updatedRev;
     }
 
-    CBL_StorageValidationBlock validationBlock = nil;
-    if ([self.shared hasValuesOfType: @"validation" inDatabaseNamed: _name]) {
-        validationBlock = ^(CBL_Revision* newRev, CBL_Revision* prev, CBL_RevID* parentRevID,
-                            NSError** outError) {
-            return [self validateRevision: newRev
-                         previousRevision: prev
-                              parentRevID: parentRevID
-                                   source: source
-                                    error: outError];
-        };
-    }
-
     return [_storage forceInsert: inRev
                  revisionHistory: history
-                 validationBlock: validationBlock
+                 validationBlock: [self validationBlockWithSource: source]
                           source: source
                            error: outError];
 }
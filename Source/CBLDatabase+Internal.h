@@ -9,7 +9,8 @@
 #import "CBL_Storage.h"
 #import "CBLDatabase.h"
 @class CBLQueryOptions, CBLView, CBLQueryRow, CBL_BlobStore, CBLDocument, CBLCache, CBLDatabase,
-       CBLDatabaseChange, CBL_Shared, CBLModelFactory, CBLDatabaseOptions, CBLCookieStorage;
+       CBLDatabaseChange, CBL_Shared, CBLModelFactory, CBLDatabaseOptions, CBLCookieStorage,
+       CBLProgressGroup;
 
 
 UsingLogDomain(Database);
@@ -50,6 +51,12 @@ extern NSArray* CBL_RunloopModes;
     NSMutableDictionary* _views;
     CBL_BlobStore* _attachments;
     NSMutableDictionary* _pendingAttachmentsByDigest;
+    BOOL (^_attachmentCompressionPolicy)(NSString*, NSString*, UInt64);
+    NSMutableArray* _gcKeys;            // Blob keys not yet examined by attachment GC
+    NSUInteger _gcDeleted;              // Number of blobs deleted so far by attachment GC
+    BOOL _gcScheduled;                  // Is a background GC slice scheduled?
+    BOOL _compactScheduled;             // Is a background compaction slice scheduled?
+    NSUInteger _revsSinceCompact;       // Revisions added since auto-compaction was scheduled
     NSMutableArray* _activeReplicators;
     NSMutableArray* _changesToNotify;
     bool _postingChangeNotifications;
@@ -88,8 +95,34 @@ extern NSArray* CBL_RunloopModes;
 - (BOOL) openWithOptions: (CBLDatabaseOptions*)options error: (NSError**)outError;
 - (void) _close; // closes without saving CBLModels.
 
+/** Same as -changeEncryptionKey:error:, but reports progress re-encrypting attachments. */
+- (BOOL) changeEncryptionKey: (id)newKeyOrPassword
+                    progress: (CBLProgressGroup*)progress
+                       error: (NSError**)outError;
+
 + (void) setAutoCompact: (BOOL)autoCompact;
 
+/** Does the same as -compact:, but in short time slices on the database's thread/queue so other
+    work can interleave, then garbage-collects attachments the same way. Does nothing if already
+    running. Used by POST /db/_compact, and (if auto-compaction is on) after every
+    kAutoCompactRevisionInterval new revisions. Returns NO if the database is read-only. */
+- (BOOL) compactInBackground;
+
+/** Is a background compaction scheduled or partway through? */
+@property (nonatomic, readonly) BOOL compactionScheduled;
+
+/** Statistics about the storage's file space and compaction progress, if it provides any. */
+@property (nonatomic, readonly) NSDictionary* compactionInfo;
+
+/** Statistics about the storage's document ID cache, if it has one. */
+@property (nonatomic, readonly) NSDictionary* docIDCacheInfo;
+
+/** Statistics about the storage's prepared SQL statements, if it has any. */
+@property (nonatomic, readonly) NSDictionary* statementStats;
+
+/** Turns collection of per-statement statistics on or off, if the storage supports it. */
+@property (nonatomic) BOOL collectsStatementStats;
+
 @property (nonatomic, readonly) id<CBL_Storage> storage;
 @property (nonatomic, readonly) CBL_BlobStore* attachmentStore;
 @property (nonatomic, readonly) CBL_Shared* shared;
@@ -23,7 +23,7 @@
 #import "CBLModel_Internal.h"
 #import "CBL_Revision.h"
 #import "CBLDatabaseChange.h"
-#import "CBL_BlobStore.h"
+#import "CBL_BlobStore+Internal.h"
 #import "CBL_Replicator.h"
 #import "CBL_Shared.h"
 #import "CBLMisc.h"
@@ -241,6 +241,10 @@ static BOOL sAutoCompact = YES;
             [_storage setEncryptionKey: encryptionKey];
     }
 
+    if ([_storage respondsToSelector: @selector(setSQLiteProfile:settings:)])
+        [_storage setSQLiteProfile: (options.sqliteProfile ?: _manager.sqliteProfile)
+                          settings: options.sqliteSettings];
+
     // Open the storage!
     if (![_storage openInDirectory: _dir
                           readOnly: _readOnly
@@ -259,10 +263,23 @@ static BOOL sAutoCompact = YES;
         maxRevs = (unsigned)_manager.defaultMaxRevTreeDepth;
     _storage.maxRevTreeDepth = maxRevs;
 
+    if (options.compressDocuments && [_storage respondsToSelector: @selector(setCompressesDocuments:)])
+        _storage.compressesDocuments = YES;
+
+    if (options.documentIDCacheSize > 0
+            && [_storage respondsToSelector: @selector(setDocIDCacheBudget:)])
+        _storage.docIDCacheBudget = options.documentIDCacheSize;
+    if (options.preloadDocumentIDs && [_storage respondsToSelector: @selector(preloadDocIDs)])
+        [_storage preloadDocIDs];
+
     // Open attachment store:
     NSString* attachmentsPath = self.attachmentStorePath;
+    CBLBlobStoreLayout layout = options.shardAttachments ? kCBLBlobStoreSharded
+                                                         : kCBLBlobStoreFlat;
     _attachments = [[CBL_BlobStore alloc] initWithPath: attachmentsPath
                                          encryptionKey: encryptionKey
+                                                layout: layout
+                                              readOnly: _readOnly
                                                  error: outError];
     if (!_attachments) {
         Warn(@"%@: Couldn't open attachment store at %@", self, attachmentsPath);
@@ -270,6 +287,12 @@ static BOOL sAutoCompact = YES;
         _storage = nil;
         return NO;
     }
+    if (options.packSmallAttachments)
+        _attachments.maxPackedBlobLength = kDefaultMaxPackedBlobLength;
+    if (options.chunkLargeAttachments)
+        _attachments.minChunkedBlobLength = kDefaultMinChunkedBlobLength;
+    if (options.compressAttachments)
+        _attachmentCompressionPolicy = [CBLDatabase defaultAttachmentCompressionPolicy];
 
     [self willChangeValueForKey: @"isOpen"];
     _isOpen = YES;
@@ -377,6 +400,7 @@ static BOOL sAutoCompact = YES;
 
         [_storage close];
         _storage = nil;
+        [_attachments close];
         _attachments = nil;
 
         [self willChangeValueForKey: @"isOpen"];
@@ -409,6 +433,93 @@ static BOOL sAutoCompact = YES;
 }
 
 
+#pragma mark - COMPACTION:
+
+
+#define kCompactSliceDuration 0.05  // Max time a background compaction slice runs for
+#define kCompactSliceInterval 0.25  // Delay between background compaction slices
+#define kAutoCompactRevisionInterval 1000 // Auto-compact after this many new revisions
+
+
+- (BOOL) compactInBackground {
+    if (_readOnly)
+        return NO;
+    if (_compactScheduled)
+        return YES;
+    _compactScheduled = YES;
+    [self doAsyncAfterDelay: kCompactSliceInterval block: ^{
+        _compactScheduled = NO;
+        NSError* error;
+        if (![_storage respondsToSelector: @selector(compactFor:finished:error:)]) {
+            if ([self compact: &error])
+                return;
+        } else {
+            BOOL finished;
+            if ([_storage compactFor: kCompactSliceDuration finished: &finished error: &error]) {
+                if (finished)
+                    [self garbageCollectAttachmentsInBackground];
+                else
+                    [self compactInBackground];
+                return;
+            }
+        }
+        Warn(@"%@: Background compaction failed: %@", self, error.my_compactDescription);
+    }];
+    return YES;
+}
+
+
+- (BOOL) compactionScheduled {
+    return _compactScheduled;
+}
+
+
+// Storage that compacts in time slices doesn't compact itself, so schedule that every so often.
+// (Storage that can't, like ForestDB, compacts itself if its autoCompact property is set.)
+- (void) noteRevisionAddedForAutoCompact {
+    if (++_revsSinceCompact < kAutoCompactRevisionInterval || !_storage.autoCompact
+            || ![_storage respondsToSelector: @selector(compactFor:finished:error:)])
+        return;
+    _revsSinceCompact = 0;
+    LogTo(Database, @"%@: Auto-compacting in the background", self);
+    [self compactInBackground];
+}
+
+
+- (NSDictionary*) compactionInfo {
+    if (![_storage respondsToSelector: @selector(compactionInfo)])
+        return nil;
+    return _storage.compactionInfo;
+}
+
+
+- (NSDictionary*) docIDCacheInfo {
+    if (![_storage respondsToSelector: @selector(docIDCacheInfo)])
+        return nil;
+    return _storage.docIDCacheInfo;
+}
+
+
+- (NSDictionary*) statementStats {
+    if (![_storage respondsToSelector: @selector(statementStats)])
+        return nil;
+    return _storage.statementStats;
+}
+
+
+- (BOOL) collectsStatementStats {
+    if (![_storage respondsToSelector: @selector(collectsStatementStats)])
+        return NO;
+    return _storage.collectsStatementStats;
+}
+
+
+- (void) setCollectsStatementStats: (BOOL)collect {
+    if ([_storage respondsToSelector: @selector(setCollectsStatementStats:)])
+        _storage.collectsStatementStats = collect;
+}
+
+
 #pragma mark - EXPIRATION:
 
 
@@ -457,6 +568,8 @@ static BOOL sAutoCompact = YES;
 - (void) databaseStorageChanged:(CBLDatabaseChange *)change {
     LogTo(Database, @"---> Added: %@ as seq %lld",
           change.addedRevision, change.addedRevision.sequence);
+    if (change.addedRevision)
+        [self noteRevisionAddedForAutoCompact];
     if (!_changesToNotify)
         _changesToNotify = [[NSMutableArray alloc] init];
     [_changesToNotify addObject: change];
@@ -576,6 +689,7 @@ static BOOL sAutoCompact = YES;
         [self _pruneDocumentCache];
         if ([_storage respondsToSelector:@selector(lowMemoryWarning)])
             [_storage lowMemoryWarning];
+        [_attachments lowMemoryWarning];
     }];
 }
 #endif
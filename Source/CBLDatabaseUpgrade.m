@@ -17,8 +17,10 @@
 #import "CouchbaseLitePrivate.h"
 #import "CBLDatabase+Attachments.h"
 #import "CBLDatabase+Insertion.h"
+#import "CBL_BlobStore+Internal.h"
 #import "CBL_Revision.h"
 #import "CBLMisc.h"
+#import "CBL_SQLiteStorage.h"
 #import <sqlite3.h>
 
 
@@ -33,6 +35,7 @@ DefineLogDomain(Upgrade);
     sqlite3_stmt* _docQuery;
     sqlite3_stmt* _revQuery;
     sqlite3_stmt* _attQuery;
+    NSMutableDictionary* _bodyDictionaries;
 }
 
 
@@ -152,8 +155,11 @@ static int collateRevIDs(void *context,
     if ([fmgr isReadableFileAtPath: newAttachmentsPath]) {
         NSString* oldAttachmentsPath = [[_path stringByDeletingPathExtension]
                                                 stringByAppendingString: @" attachments"];
-        if (_canRemoveOldAttachmentsDir)
+        if (_canRemoveOldAttachmentsDir) {
+            // The old version only understands the flat layout:
+            [_db.attachmentStore changeLayout: kCBLBlobStoreFlat error: NULL];
             [fmgr moveItemAtPath: newAttachmentsPath toPath: oldAttachmentsPath error: NULL];
+        }
     }
 
     [_db deleteDatabase: NULL];
@@ -195,7 +201,14 @@ static int collateRevIDs(void *context,
         }
     }
 
-    return [self renameAttachmentFileNamesInDir: newAttachmentsPath];
+    CBLStatus status = [self renameAttachmentFileNamesInDir: newAttachmentsPath];
+    if (CBLStatusIsError(status))
+        return status;
+
+    // The db's blob store is already open, so let it know its directory has been swapped out:
+    if (![_db.attachmentStore directoryReplaced: &error])
+        return CBLStatusFromNSError(error, kCBLStatusAttachmentError);
+    return kCBLStatusOK;
 }
 
 
@@ -294,6 +307,11 @@ static int collateRevIDs(void *context,
                 // Add a leaf revision:
                 BOOL deleted = (BOOL)sqlite3_column_int(_revQuery, 4);
                 NSData* json = columnData(_revQuery, 5);
+                if (json)
+                    json = [CBL_SQLiteStorage JSONFromStoredBody: json
+                                                    dictionaries: ^NSData*(unsigned number) {
+                        return [self bodyDictionaryNumbered: number];
+                    }];
                 if (!json)
                     json = [NSData dataWithBytes: "{}" length: 2];
 
@@ -479,13 +497,39 @@ static int collateRevIDs(void *context,
         return status;
     int err;
     while (SQLITE_ROW == (err = sqlite3_step(infoQuery))) {
-        [_db.storage setInfo: columnString(infoQuery, 1) forKey: columnString(infoQuery, 0)];
+        NSString* key = columnString(infoQuery, 0);
+        if ([key hasPrefix: @"body_dict"])
+            continue;   // compression dictionaries only apply to the SQLite revs table
+        [_db.storage setInfo: columnString(infoQuery, 1) forKey: key];
     }
     sqlite3_finalize(infoQuery);
     return sqliteErrToStatus(err);
 }
 
 
+// A dictionary that compressed revision bodies refer to (see CBL_SQLiteStorage.compressesDocuments)
+- (NSData*) bodyDictionaryNumbered: (unsigned)number {
+    NSData* dictionary = _bodyDictionaries[@(number)];
+    if (!dictionary) {
+        sqlite3_stmt* infoQuery = NULL;
+        if (CBLStatusIsError([self prepare: &infoQuery
+                                   fromSQL: "SELECT value FROM info WHERE key=?"]))
+            return nil;
+        NSString* key = $sprintf(@"body_dict_%u", number);
+        sqlite3_bind_text(infoQuery, 1, key.UTF8String, -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(infoQuery) == SQLITE_ROW)
+            dictionary = columnData(infoQuery, 0);
+        sqlite3_finalize(infoQuery);
+        if (!dictionary)
+            return nil;
+        if (!_bodyDictionaries)
+            _bodyDictionaries = [[NSMutableDictionary alloc] init];
+        _bodyDictionaries[@(number)] = dictionary;
+    }
+    return dictionary;
+}
+
+
 - (CBLStatus) prepare: (sqlite3_stmt**)pStmt fromSQL: (const char*)sql {
     int err;
     if (*pStmt)
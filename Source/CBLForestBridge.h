@@ -86,6 +86,11 @@ using namespace CBL;
 
 + (NSMutableDictionary*) bodyOfSelectedRevision: (C4Document*)doc;
 
+/** Returns the body of the selected revision as an immutable dictionary whose values are only
+    parsed when they're accessed, plus the given extra properties. Used for map functions. */
++ (NSDictionary*) lazyBodyOfSelectedRevision: (C4Document*)doc
+                             extraProperties: (NSDictionary*)extraProperties;
+
 /** Stores the body of a revision (including metadata) into a CBL_MutableRevision. */
 + (CBLStatus) loadBodyOfRevisionObject: (CBL_MutableRevision*)rev
                   fromSelectedRevision: (C4Document*)doc;
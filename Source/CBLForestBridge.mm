@@ -301,5 +301,25 @@ C4EncryptionKey symmetricKey2Forest(CBLSymmetricKey* key) {
     return properties;
 }
 
++ (NSDictionary*) lazyBodyOfSelectedRevision: (C4Document*)doc
+                             extraProperties: (NSDictionary*)extraProperties
+{
+    if (!c4doc_loadRevisionBody(doc, NULL))
+        return nil;
+    C4Slice body = doc->selectedRev.body;
+    NSDictionary* properties = [[CBLLazyDictionaryOfJSON alloc] initWithJSON: slice2data(body)
+                                                             extraProperties: extraProperties];
+    if (!properties) {
+        // The lazy dictionary rejects some JSON the full parser accepts (such as very deep
+        // nesting), so fall back to parsing all of it now:
+        NSMutableDictionary* parsed = slice2mutableDict(body);
+        Assert(parsed, @"Unable to parse doc from db: %.*s", body.size, body.buf);
+        if (extraProperties)
+            [parsed addEntriesFromDictionary: extraProperties];
+        properties = parsed;
+    }
+    return properties;
+}
+
 
 @end
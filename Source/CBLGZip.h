@@ -54,10 +54,76 @@ typedef enum : int {
     @return  The initialized instance. */
 - (instancetype)initForCompressing: (BOOL)compressing;
 
+/** Initializes a compressor with a zlib compression level: 1 (fastest) to 9 (smallest),
+    or -1 for zlib's default (6). */
+- (instancetype)initForCompressingWithLevel: (int)level;
+
 /** One-shot compression of NSData. */
 + (NSData*) dataByCompressingData: (NSData*)src;
 
-/** One-shot decompression of NSData. */
+/** One-shot compression of NSData at a zlib compression level (see above.) The output is
+    allocated at its maximum size and compressed in a single pass. */
++ (NSData*) dataByCompressingData: (NSData*)src level: (int)level;
+
+/** One-shot decompression of NSData. The output is allocated up front, sized from the
+    uncompressed length in the gzip trailer (up to a limit), and grown if that's too small.
+    Concatenated gzip members are all decompressed; trailing data that isn't a member is an error. */
 + (NSData*) dataByDecompressingData: (NSData*)src;
 
+/** One-shot compression to a raw deflate stream, with no gzip header or trailer, for callers that
+    store the length and format themselves. If `dictionary` is given, the compressor is primed
+    with it (a zlib "preset dictionary"), so strings that occur in it compress well even in short
+    inputs; only its last 32KB count. */
++ (NSData*) dataByDeflatingData: (NSData*)src
+                     dictionary: (NSData*)dictionary
+                          level: (int)level;
+
+/** Decompresses a raw deflate stream made by the above, given the same dictionary and the exact
+    uncompressed length. Returns nil if the data is corrupt or doesn't have that length. */
++ (NSData*) dataByInflatingBytes: (const void*)bytes
+                          length: (size_t)length
+                      dictionary: (NSData*)dictionary
+                  inflatedLength: (size_t)inflatedLength;
+
+@end
+
+
+
+/** A compression format that can be used as an HTTP content-coding (Content-Encoding.)
+    "gzip" is built in. Others, like zstd, can be plugged in by subclassing and registering an
+    instance; registered codings are preferred over earlier ones during negotiation. */
+@interface CBLContentCoding : NSObject
+
+/** Makes a coding available for negotiation. Replaces any existing one with the same name. */
++ (void) registerCoding: (CBLContentCoding*)coding;
+
+/** The registered coding with the given name (case-insensitive), or nil. */
++ (instancetype) codingNamed: (NSString*)name;
+
+/** The names of all registered codings, most preferred first, as an Accept-Encoding value. */
++ (NSString*) acceptEncoding;
+
+/** The most preferred registered coding allowed by an Accept-Encoding header value (honoring
+    "q" weights), or nil if there's none. */
++ (instancetype) codingForAcceptEncoding: (NSString*)acceptEncoding;
+
+/** The content-coding name, in lowercase, e.g. "gzip". */
+@property (readonly) NSString* name;
+
+/** Compression level passed to the underlying compressor; its meaning depends on the format.
+    Defaults to -1, meaning the format's default. */
+@property int compressionLevel;
+
+/** One-shot compression; subclasses must override. */
+- (NSData*) compressData: (NSData*)data;
+
+/** One-shot decompression; subclasses must override. */
+- (NSData*) decompressData: (NSData*)data;
+
+/** Returns a new incremental codec; subclasses must override. */
+- (id<CBLCodec>) codecForCompressing: (BOOL)compressing;
+
+// protected:
+- (instancetype) initWithName: (NSString*)name;
+
 @end
@@ -9,7 +9,18 @@
 #import "CBLGZip.h"
 #import <zlib.h>
 
-#define kBufferSize (8*1024)
+#define kBufferSize (32*1024)
+
+// Deflate can't expand data by more than this factor, so a gzip trailer claiming more is bogus
+#define kMaxInflateRatio 1032
+
+// Most output one-shot decompression allocates up front, whatever the gzip trailer claims
+#define kMaxInitialInflateLength (16*1024*1024)
+
+
+@interface CBLGZip ()
+- (instancetype) initForCompressing: (BOOL)compressing level: (int)level;
+@end
 
 
 @implementation CBLGZip
@@ -24,6 +35,14 @@
 
 
 - (instancetype) initForCompressing: (BOOL)compressing {
+    return [self initForCompressing: compressing level: Z_DEFAULT_COMPRESSION];
+}
+
+- (instancetype)initForCompressingWithLevel: (int)level {
+    return [self initForCompressing: YES level: level];
+}
+
+- (instancetype) initForCompressing: (BOOL)compressing level: (int)level {
     self = [super init];
     if (self) {
         _strm.next_out  = _buffer;
@@ -33,7 +52,7 @@
         int rval;
         if (compressing)
             rval = deflateInit2(&_strm,
-                                Z_DEFAULT_COMPRESSION,
+                                level,
                                 Z_DEFLATED, // Only legal value
                                 15 + 16,    // Default window size, plus write gzip header
                                 8,          // Default mem level
@@ -128,12 +147,282 @@
 }
 
 + (NSData*) dataByCompressingData: (NSData*)src {
-    return [self processData: src compress: YES];
+    return [self dataByCompressingData: src level: Z_DEFAULT_COMPRESSION];
+}
+
++ (NSData*) dataByCompressingData: (NSData*)src level: (int)level {
+    NSUInteger srcLength = src.length;
+    if (srcLength > UINT32_MAX / 2)
+        return [self processData: src compress: YES];       // too big for one z_stream call
+    z_stream strm = {};
+    if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nil;
+    uLong bound = deflateBound(&strm, srcLength);
+    NSMutableData* output = [NSMutableData dataWithLength: bound];
+    strm.next_in   = (Bytef*)src.bytes;
+    strm.avail_in  = (uInt)srcLength;
+    strm.next_out  = output.mutableBytes;
+    strm.avail_out = (uInt)bound;
+    int rval = deflate(&strm, Z_FINISH);
+    output.length = strm.total_out;
+    deflateEnd(&strm);
+    if (rval != Z_STREAM_END) {
+        Warn(@"GZip error %d compressing data", rval);
+        return nil;
+    }
+    return output;
 }
 
 + (NSData*) dataByDecompressingData: (NSData*)src {
-    return [self processData: src compress: NO];
+    NSUInteger srcLength = src.length;
+    if (srcLength == 0)
+        return [NSData data];
+    if (srcLength > UINT32_MAX)
+        return [self processData: src compress: NO];       // too big for one z_stream call
+
+    // The last 4 bytes of a gzip stream are the uncompressed length, mod 2^32 (little-endian).
+    // That's only a hint: it's untrusted, and it's just the last member's length if several gzip
+    // members are concatenated. So the initial allocation is capped, and grows if it's too small.
+    NSUInteger capacity = 2 * srcLength;
+    if (srcLength >= 18) {
+        const uint8_t* trailer = (const uint8_t*)src.bytes + srcLength - 4;
+        uint32_t hint = trailer[0] | (trailer[1] << 8) | (trailer[2] << 16)
+                                   | ((uint32_t)trailer[3] << 24);
+        if (hint <= srcLength * kMaxInflateRatio)
+            capacity = MAX(capacity, hint);
+    }
+    capacity = MIN(capacity, kMaxInitialInflateLength);
+
+    z_stream strm = {};
+    if (inflateInit2(&strm, 15 + 32) != Z_OK)
+        return nil;
+    NSMutableData* output = [NSMutableData dataWithLength: capacity];
+    NSUInteger outLength = 0;
+    strm.next_in  = (Bytef*)src.bytes;
+    strm.avail_in = (uInt)srcLength;
+    int rval;
+    for (;;) {
+        if (outLength == output.length)
+            output.length = 2 * output.length;
+        strm.next_out  = (Bytef*)output.mutableBytes + outLength;
+        strm.avail_out = (uInt)MIN(output.length - outLength, UINT32_MAX);
+        uInt availOut = strm.avail_out;
+        rval = inflate(&strm, Z_NO_FLUSH);
+        outLength += availOut - strm.avail_out;
+        if (rval == Z_STREAM_END) {
+            if (strm.avail_in == 0)
+                break;
+            // Another gzip member follows (RFC 1952 sec. 2.2); its output is appended:
+            rval = inflateReset(&strm);
+        } else if (rval == Z_BUF_ERROR && strm.avail_out == 0) {
+            rval = Z_OK;        // output buffer is full; grow it and go on
+        }
+        if (rval != Z_OK)
+            break;
+    }
+    inflateEnd(&strm);
+    if (rval != Z_STREAM_END) {
+        Warn(@"GZip error %d decompressing data", rval);
+        return nil;
+    }
+    output.length = outLength;
+    return output;
 }
 
++ (NSData*) dataByDeflatingData: (NSData*)src
+                     dictionary: (NSData*)dictionary
+                          level: (int)level
+{
+    NSUInteger srcLength = src.length;
+    if (srcLength > UINT32_MAX / 2)
+        return nil;
+    z_stream strm = {};
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nil;
+    if (dictionary && deflateSetDictionary(&strm, dictionary.bytes,
+                                           (uInt)dictionary.length) != Z_OK) {
+        deflateEnd(&strm);
+        return nil;
+    }
+    uLong bound = deflateBound(&strm, srcLength);
+    NSMutableData* output = [NSMutableData dataWithLength: bound];
+    strm.next_in   = (Bytef*)src.bytes;
+    strm.avail_in  = (uInt)srcLength;
+    strm.next_out  = output.mutableBytes;
+    strm.avail_out = (uInt)bound;
+    int rval = deflate(&strm, Z_FINISH);
+    output.length = strm.total_out;
+    deflateEnd(&strm);
+    if (rval != Z_STREAM_END) {
+        Warn(@"Deflate error %d compressing data", rval);
+        return nil;
+    }
+    return output;
+}
+
++ (NSData*) dataByInflatingBytes: (const void*)bytes
+                          length: (size_t)length
+                      dictionary: (NSData*)dictionary
+                  inflatedLength: (size_t)inflatedLength
+{
+    if (length > UINT32_MAX || inflatedLength > UINT32_MAX
+                            || inflatedLength > MAX(length, 1u) * kMaxInflateRatio)
+        return nil;
+    z_stream strm = {};
+    if (inflateInit2(&strm, -15) != Z_OK)
+        return nil;
+    // (A raw stream doesn't ask for its dictionary, so it has to be set up front.)
+    if (dictionary && inflateSetDictionary(&strm, dictionary.bytes,
+                                           (uInt)dictionary.length) != Z_OK) {
+        inflateEnd(&strm);
+        return nil;
+    }
+    // Allocate one extra byte, so that excess output is detected instead of silently truncated:
+    uint8_t* output = malloc(inflatedLength + 1);
+    if (!output) {
+        inflateEnd(&strm);
+        return nil;
+    }
+    strm.next_in   = (Bytef*)bytes;
+    strm.avail_in  = (uInt)length;
+    strm.next_out  = output;
+    strm.avail_out = (uInt)inflatedLength + 1;
+    int rval = inflate(&strm, Z_FINISH);
+    inflateEnd(&strm);
+    if (rval != Z_STREAM_END || strm.total_out != inflatedLength) {
+        Warn(@"Inflate error %d decompressing data", rval);
+        free(output);
+        return nil;
+    }
+    // (Immutable, so that callers that copy it, like -[CBL_Revision setAsJSON:], don't have to)
+    return [NSData dataWithBytesNoCopy: output length: inflatedLength freeWhenDone: YES];
+}
+
+
+@end
+
+
+
+@interface CBLGZipCoding : CBLContentCoding
+@end
+
+
+@implementation CBLContentCoding
+
+@synthesize name=_name, compressionLevel=_compressionLevel;
+
+
+static NSMutableArray* sCodings;     // registered codings, most preferred first
+
++ (NSMutableArray*) registeredCodings {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sCodings = [NSMutableArray arrayWithObject: [[CBLGZipCoding alloc] initWithName: @"gzip"]];
+    });
+    return sCodings;
+}
+
++ (void) registerCoding: (CBLContentCoding*)coding {
+    NSMutableArray* codings = [self registeredCodings];
+    @synchronized(codings) {
+        CBLContentCoding* existing = [self codingNamed: coding.name];
+        if (existing)
+            [codings removeObject: existing];
+        [codings insertObject: coding atIndex: 0];
+    }
+}
+
++ (NSArray*) codings {
+    NSMutableArray* codings = [self registeredCodings];
+    @synchronized(codings) {
+        return [codings copy];
+    }
+}
+
++ (instancetype) codingNamed: (NSString*)name {
+    name = name.lowercaseString;
+    for (CBLContentCoding* coding in [self codings])
+        if ($equal(coding.name, name))
+            return coding;
+    return nil;
+}
+
++ (NSString*) acceptEncoding {
+    return [[[self codings] valueForKey: @"name"] componentsJoinedByString: @", "];
+}
+
++ (instancetype) codingForAcceptEncoding: (NSString*)acceptEncoding {
+    if (acceptEncoding.length == 0)
+        return nil;
+    // Parse the header into a map from coding name to q-value:
+    NSCharacterSet* whitespace = [NSCharacterSet whitespaceCharacterSet];
+    NSMutableDictionary* qualities = [NSMutableDictionary dictionary];
+    for (NSString* item in [acceptEncoding componentsSeparatedByString: @","]) {
+        NSArray* params = [item componentsSeparatedByString: @";"];
+        NSString* name = [params[0] stringByTrimmingCharactersInSet: whitespace].lowercaseString;
+        double q = 1.0;
+        for (NSUInteger i = 1; i < params.count; ++i) {
+            NSString* param = [params[i] stringByTrimmingCharactersInSet: whitespace];
+            if ([param hasPrefix: @"q="])
+                q = [param substringFromIndex: 2].doubleValue;
+        }
+        if (name.length > 0)
+            qualities[name] = @(q);
+    }
+    // Pick the coding with the highest q-value, breaking ties by my preference:
+    CBLContentCoding* best = nil;
+    double bestQ = 0.0;
+    for (CBLContentCoding* coding in [self codings]) {
+        double q = [(qualities[coding.name] ?: qualities[@"*"]) doubleValue];
+        if (q > bestQ) {
+            best = coding;
+            bestQ = q;
+        }
+    }
+    return best;
+}
+
+- (instancetype) initWithName: (NSString*)name {
+    self = [super init];
+    if (self) {
+        _name = name.lowercaseString;
+        _compressionLevel = -1;
+    }
+    return self;
+}
+
+- (NSData*) compressData: (NSData*)data {
+    AssertAbstractMethod();
+}
+
+- (NSData*) decompressData: (NSData*)data {
+    AssertAbstractMethod();
+}
+
+- (id<CBLCodec>) codecForCompressing: (BOOL)compressing {
+    AssertAbstractMethod();
+}
+
+- (NSString*) description {
+    return $sprintf(@"%@[%@]", [self class], _name);
+}
+
+@end
+
+
+
+@implementation CBLGZipCoding
+
+- (NSData*) compressData: (NSData*)data {
+    return [CBLGZip dataByCompressingData: data level: self.compressionLevel];
+}
+
+- (NSData*) decompressData: (NSData*)data {
+    return [CBLGZip dataByDecompressingData: data];
+}
+
+- (id<CBLCodec>) codecForCompressing: (BOOL)compressing {
+    return [[CBLGZip alloc] initForCompressing: compressing level: self.compressionLevel];
+}
 
 @end
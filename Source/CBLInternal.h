@@ -54,6 +54,7 @@
                 notify: (BOOL)notify                                __attribute__((nonnull));
 - (void) forgetCurrentRevision;
 - (void) loadCurrentRevisionFrom: (CBLQueryRow*)row                 __attribute__((nonnull));
+- (void) loadCurrentRevision: (CBL_Revision*)rev;
 @end
 
 
@@ -10,9 +10,16 @@
 @class CBLJSONMatcher, CBLJSONArrayMatcher, CBLJSONDictMatcher;
 
 
-/** A streaming JSON parser that feeds the output through a hierarchy of matchers. */
+/** A streaming JSON parser that feeds the output through a hierarchy of matchers.
+    It first indexes the structural characters of the input a 64-byte block at a time, then
+    reads the tokens from that index, so it doesn't have to look at every byte of a string. */
 @interface CBLJSONReader : NSObject
 
+/** Parses a complete JSON document into Foundation objects, like NSJSONSerialization but
+    faster. Supports the MutableContainers and AllowFragments reading options.
+    Returns nil if the JSON is invalid. */
++ (id) objectWithBytes: (const void*)bytes length: (size_t)length options: (NSUInteger)options;
+
 - (instancetype) initWithMatcher: (CBLJSONMatcher*)rootMatcher;
 
 - (BOOL) parseBytes: (const void*)bytes length: (size_t)length;
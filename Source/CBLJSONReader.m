@@ -14,7 +14,8 @@
 //  and limitations under the License.
 
 #import "CBLJSONReader.h"
-#import <yajl/yajl_parse.h>
+#import <libkern/OSByteOrder.h>
+#import <xlocale.h>
 
 
 DefineLogDomain(JSONReader);
@@ -155,20 +156,696 @@ DefineLogDomain(JSONReader);
 
 
 
+#pragma mark - STRUCTURAL INDEX:
+
+
+// Parsing happens in two stages, as in simdjson. Stage 1 scans the input 64 bytes at a time,
+// using bitwise arithmetic on whole words instead of examining each byte, and records the
+// offsets of all structural characters: the brackets, colons and commas outside strings, and the
+// quotes around strings. Stage 2 walks that index, so it can jump over whole strings and find
+// each number or literal between two structural characters.
+
+
+#define kBlockSize 64
+#define kEvenBits  0x5555555555555555ULL
+#define kOnes      0x0101010101010101ULL
+#define kHighBits  0x8080808080808080ULL
+
+
+typedef enum {
+    kExpectValue,               // at start, or after ':' or an array's ','
+    kExpectValueOrEnd,          // after '['
+    kExpectKeyOrEnd,            // after '{'
+    kExpectKey,                 // after an object's ','
+    kExpectColon,               // after a key
+    kExpectCommaOrEnd,          // after a value in a container
+    kExpectNothing,             // after the top-level value
+} CBLJSONExpect;
+
+typedef enum {
+    kTokenError,
+    kTokenNeedMore,             // the rest of the input isn't available yet
+    kTokenEOF,
+    kTokenStartObject,
+    kTokenEndObject,
+    kTokenStartArray,
+    kTokenEndArray,
+    kTokenKey,
+    kTokenString,
+    kTokenScalar,               // number, true, false or null
+} CBLJSONToken;
+
+typedef struct {
+    const uint8_t* buf;         // the input
+    size_t length;              // length of the input available so far
+    size_t indexedLength;       // length of the input that's been through stage 1
+    bool final;                 // true if no more input will be added
+
+    uint64_t prevOddBackslash;  // 1 if the last block ended in an odd number of backslashes
+    uint64_t prevInString;      // all 1s if the last block ended inside a string
+
+    uint32_t* indexes;          // offsets of structural characters, in increasing order
+    size_t count, capacity;
+    size_t next;                // index of the next structural character to be read
+
+    size_t cursor;              // offset just past the last token read
+    CBLJSONExpect expect;
+    uint8_t* stack;             // '{' or '[' for each open container
+    size_t depth, stackCapacity;
+
+    const uint8_t* tokenStart;  // the last token's bytes (string contents, or scalar)
+    size_t tokenLength;
+    bool tokenEscaped;          // true if the last string token contains escapes
+
+    const char* error;          // description of the syntax error, if any
+    size_t errorPos;
+} CBLJSONScanner;
+
+
+static void scannerInit(CBLJSONScanner* s) {
+    memset(s, 0, sizeof(*s));
+    s->expect = kExpectValue;
+}
+
+static void scannerFree(CBLJSONScanner* s) {
+    free(s->indexes);
+    free(s->stack);
+}
+
+static bool scannerFail(CBLJSONScanner* s, const char* error, size_t pos) {
+    if (!s->error) {
+        s->error = error;
+        s->errorPos = pos;
+    }
+    return false;
+}
+
+
+// Sets the high bit of each byte of `word` that equals `c`.
+static inline uint64_t bytesEqual(uint64_t word, uint8_t c) {
+    uint64_t t = word ^ (kOnes * c);
+    return ~(((t & ~kHighBits) + ~kHighBits) | t) & kHighBits;
+}
+
+// Sets the high bit of each byte of `word` that's a control character.
+static inline uint64_t bytesControl(uint64_t word) {
+    uint64_t t = word & (kOnes * 0xE0);
+    return ~(((t & ~kHighBits) + ~kHighBits) | t) & kHighBits;
+}
+
+// Gathers the high bits of the 8 bytes of `m` into the low 8 bits.
+static inline uint64_t packHighBits(uint64_t m) {
+    return ((m >> 7) * 0x0102040810204080ULL) >> 56;
+}
+
+// Each bit of the result is the XOR of that bit and all lower bits of `x`.
+static inline uint64_t prefixXor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+// Returns the bits of the characters that are escaped by a preceding odd-length run of
+// backslashes, given the bits of the backslashes.
+static inline uint64_t findEscaped(uint64_t backslash, uint64_t* prevOddBackslash) {
+    uint64_t starts = backslash & ~(backslash << 1);
+    uint64_t evenStartMask = kEvenBits ^ *prevOddBackslash;
+    uint64_t evenStarts = starts & evenStartMask;
+    uint64_t oddStarts = starts & ~evenStartMask;
+    uint64_t evenCarries = backslash + evenStarts;
+    uint64_t oddCarries;
+    bool endsOdd = __builtin_add_overflow(backslash, oddStarts, &oddCarries);
+    oddCarries |= *prevOddBackslash;
+    *prevOddBackslash = endsOdd;
+    uint64_t evenCarryEnds = evenCarries & ~backslash;
+    uint64_t oddCarryEnds = oddCarries & ~backslash;
+    return (evenCarryEnds & ~kEvenBits) | (oddCarryEnds & kEvenBits);
+}
+
+// Stage 1: Adds the structural characters of one 64-byte block to the index, skipping any
+// before offset `minPos` (which have already been read.)
+static bool indexBlock(CBLJSONScanner* s, const uint8_t* block, size_t blockPos, size_t minPos) {
+    uint64_t quote = 0, backslash = 0, op = 0, control = 0;
+    for (int i = 0; i < kBlockSize / 8; i++) {
+        uint64_t word = OSReadLittleInt64(block, 8 * i);
+        int shift = 8 * i;
+        quote     |= packHighBits(bytesEqual(word, '"')) << shift;
+        backslash |= packHighBits(bytesEqual(word, '\\')) << shift;
+        op        |= packHighBits(bytesEqual(word, '{') | bytesEqual(word, '}')
+                                | bytesEqual(word, '[') | bytesEqual(word, ']')
+                                | bytesEqual(word, ':') | bytesEqual(word, ',')) << shift;
+        control   |= packHighBits(bytesControl(word)) << shift;
+    }
+
+    quote &= ~findEscaped(backslash, &s->prevOddBackslash);
+    uint64_t inString = prefixXor(quote) ^ s->prevInString;
+    s->prevInString = (uint64_t)((int64_t)inString >> 63);
+    if (control & inString)
+        return scannerFail(s, "control character in string",
+                           blockPos + __builtin_ctzll(control & inString));
+
+    uint64_t structurals = (op & ~inString) | quote;
+    if (minPos > blockPos)
+        structurals &= (minPos - blockPos >= kBlockSize) ? 0 : ~0ULL << (minPos - blockPos);
+
+    if (s->count + kBlockSize > s->capacity) {
+        s->capacity = MAX(2 * s->capacity, 1024u);
+        s->indexes = reallocf(s->indexes, s->capacity * sizeof(uint32_t));
+        if (!s->indexes)
+            return scannerFail(s, "out of memory", blockPos);
+    }
+    uint32_t* out = &s->indexes[s->count];
+    while (structurals) {
+        *out++ = (uint32_t)(blockPos + __builtin_ctzll(structurals));
+        structurals &= structurals - 1;
+    }
+    s->count = out - s->indexes;
+    return true;
+}
+
+// Runs stage 1 over the whole blocks of input that haven't been indexed yet. If `final` is set,
+// the last partial block is indexed too, padded with spaces.
+static bool indexInput(CBLJSONScanner* s, bool final) {
+    size_t pos = s->indexedLength;
+    for (; pos + kBlockSize <= s->length; pos += kBlockSize) {
+        if (!indexBlock(s, s->buf + pos, pos, s->cursor))
+            return false;
+    }
+    if (final && pos < s->length) {
+        uint8_t block[kBlockSize];
+        memset(block, ' ', kBlockSize);
+        memcpy(block, s->buf + pos, s->length - pos);
+        if (!indexBlock(s, block, pos, s->cursor))
+            return false;
+        pos = s->length;
+    }
+    s->indexedLength = pos;
+    return true;
+}
+
+
+#pragma mark - TOKENIZER:
+
+
+static inline bool isJSONSpace(uint8_t c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline bool isDelimiter(uint8_t c) {
+    return isJSONSpace(c) || c == ',' || c == ']' || c == '}' || c == ':'
+                          || c == '[' || c == '{' || c == '"';
+}
+
+static bool pushContainer(CBLJSONScanner* s, uint8_t type) {
+    if (s->depth >= s->stackCapacity) {
+        s->stackCapacity = MAX(2 * s->stackCapacity, 32u);
+        s->stack = reallocf(s->stack, s->stackCapacity);
+        if (!s->stack)
+            return scannerFail(s, "out of memory", s->cursor);
+    }
+    s->stack[s->depth++] = type;
+    return true;
+}
+
+static inline CBLJSONExpect afterValue(CBLJSONScanner* s) {
+    return s->depth > 0 ? kExpectCommaOrEnd : kExpectNothing;
+}
+
+// Stage 2: Returns the next token, and checks that it's valid at this point. Tokens are
+// consumed atomically; if one isn't complete yet, kTokenNeedMore is returned and the scanner
+// is left unchanged, so the call can be repeated after more input has been indexed.
+static CBLJSONToken nextToken(CBLJSONScanner* s) {
+    const uint8_t* buf = s->buf;
+    for (;;) {
+        size_t pos = s->cursor;
+        while (pos < s->length && isJSONSpace(buf[pos]))
+            ++pos;
+        if (pos >= s->length) {
+            if (!s->final)
+                return kTokenNeedMore;
+            s->cursor = pos;
+            if (s->expect != kExpectNothing)
+                return scannerFail(s, "unexpected end of JSON", pos), kTokenError;
+            return kTokenEOF;
+        }
+        if (s->expect == kExpectNothing)
+            return scannerFail(s, "unexpected data after JSON value", pos), kTokenError;
+
+        uint8_t c = buf[pos];
+        if (s->next < s->count && s->indexes[s->next] == pos) {
+            // Structural character:
+            switch (c) {
+                case '{':
+                case '[':
+                    if (s->expect != kExpectValue && s->expect != kExpectValueOrEnd)
+                        break;
+                    if (!pushContainer(s, c))
+                        return kTokenError;
+                    s->expect = (c == '{') ? kExpectKeyOrEnd : kExpectValueOrEnd;
+                    s->next++;
+                    s->cursor = pos + 1;
+                    return (c == '{') ? kTokenStartObject : kTokenStartArray;
+                case '}':
+                case ']': {
+                    uint8_t open = (c == '}') ? '{' : '[';
+                    if (s->depth == 0 || s->stack[s->depth - 1] != open)
+                        break;
+                    if (s->expect != kExpectCommaOrEnd
+                            && s->expect != (c == '}' ? kExpectKeyOrEnd : kExpectValueOrEnd))
+                        break;
+                    s->depth--;
+                    s->expect = afterValue(s);
+                    s->next++;
+                    s->cursor = pos + 1;
+                    return (c == '}') ? kTokenEndObject : kTokenEndArray;
+                }
+                case ':':
+                    if (s->expect != kExpectColon)
+                        break;
+                    s->expect = kExpectValue;
+                    s->next++;
+                    s->cursor = pos + 1;
+                    continue;
+                case ',':
+                    if (s->expect != kExpectCommaOrEnd)
+                        break;
+                    s->expect = (s->stack[s->depth - 1] == '{') ? kExpectKey : kExpectValue;
+                    s->next++;
+                    s->cursor = pos + 1;
+                    continue;
+                case '"': {
+                    // The closing quote is the next structural character:
+                    if (s->next + 1 >= s->count) {
+                        if (!s->final)
+                            return kTokenNeedMore;
+                        return scannerFail(s, "unterminated string", pos), kTokenError;
+                    }
+                    size_t end = s->indexes[s->next + 1];
+                    CBLJSONToken token;
+                    if (s->expect == kExpectKey || s->expect == kExpectKeyOrEnd) {
+                        token = kTokenKey;
+                        s->expect = kExpectColon;
+                    } else if (s->expect == kExpectValue || s->expect == kExpectValueOrEnd) {
+                        token = kTokenString;
+                        s->expect = afterValue(s);
+                    } else {
+                        break;
+                    }
+                    s->tokenStart = buf + pos + 1;
+                    s->tokenLength = end - pos - 1;
+                    s->tokenEscaped = memchr(s->tokenStart, '\\', s->tokenLength) != NULL;
+                    s->next += 2;
+                    s->cursor = end + 1;
+                    return token;
+                }
+            }
+            return scannerFail(s, "unexpected character", pos), kTokenError;
+        } else {
+            // Anything between structural characters must be a number or literal:
+            if (s->expect != kExpectValue && s->expect != kExpectValueOrEnd)
+                return scannerFail(s, "unexpected character", pos), kTokenError;
+            size_t end = pos;
+            while (end < s->length && !isDelimiter(buf[end]))
+                ++end;
+            if (end == s->length && !s->final)
+                return kTokenNeedMore;
+            if (end == pos)
+                return scannerFail(s, "unexpected character", pos), kTokenError;
+            s->tokenStart = buf + pos;
+            s->tokenLength = end - pos;
+            s->expect = afterValue(s);
+            s->cursor = end;
+            return kTokenScalar;
+        }
+    }
+}
+
+
+#pragma mark - VALUES:
+
+
+// Converts a number or literal token to an object, or returns NULL if it's invalid.
+static CFTypeRef createScalar(const uint8_t* p, size_t length) {
+    switch (p[0]) {
+        case 't':
+            return (length == 4 && memcmp(p, "true", 4) == 0) ? CFRetain(kCFBooleanTrue) : NULL;
+        case 'f':
+            return (length == 5 && memcmp(p, "false", 5) == 0) ? CFRetain(kCFBooleanFalse) : NULL;
+        case 'n':
+            return (length == 4 && memcmp(p, "null", 4) == 0) ? CFRetain(kCFNull) : NULL;
+    }
+
+    // Check the number's syntax, and accumulate it if it's an integer:
+    const uint8_t* s = p, *end = p + length;
+    bool negative = (*s == '-');
+    if (negative)
+        ++s;
+    if (s == end || !isdigit(*s) || (*s == '0' && s + 1 < end && isdigit(s[1])))
+        return NULL;
+    uint64_t n = 0;
+    bool overflow = false;
+    for (; s < end && isdigit(*s); ++s) {
+        overflow = overflow || __builtin_mul_overflow(n, 10, &n)
+                            || __builtin_add_overflow(n, *s - '0', &n);
+    }
+    bool integer = (s == end);
+    if (s < end && *s == '.') {
+        ++s;
+        if (s == end || !isdigit(*s))
+            return NULL;
+        while (s < end && isdigit(*s))
+            ++s;
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        ++s;
+        if (s < end && (*s == '+' || *s == '-'))
+            ++s;
+        if (s == end || !isdigit(*s))
+            return NULL;
+        while (s < end && isdigit(*s))
+            ++s;
+    }
+    if (s != end)
+        return NULL;
+
+    if (integer && !overflow) {
+        if (!negative && n > INT64_MAX)
+            return CFBridgingRetain(@(n));
+        if (n <= INT64_MAX || (negative && n == (uint64_t)INT64_MAX + 1))
+            return CFBridgingRetain(@(negative ? (int64_t)(0 - n) : (int64_t)n));
+    }
+    char buffer[64];
+    char* str = (length < sizeof(buffer)) ? buffer : malloc(length + 1);
+    if (!str)
+        return NULL;
+    memcpy(str, p, length);
+    str[length] = '\0';
+    double d = strtod_l(str, NULL, LC_C_LOCALE);
+    if (str != buffer)
+        free(str);
+    if (!isfinite(d))
+        return NULL;
+    return CFBridgingRetain(@(d));
+}
+
+static inline int hexDigit(uint8_t c) {
+    if (isdigit(c))
+        return c - '0';
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+static bool readHex4(const uint8_t* p, const uint8_t* end, unsigned* outValue) {
+    if (end - p < 4)
+        return false;
+    unsigned value = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = hexDigit(p[i]);
+        if (d < 0)
+            return false;
+        value = (value << 4) | d;
+    }
+    *outValue = value;
+    return true;
+}
+
+// Converts a string token to an NSString, or returns NULL if it's invalid.
+static CFStringRef createString(const uint8_t* p, size_t length, bool escaped) {
+    if (!escaped)
+        return CFStringCreateWithBytes(NULL, p, length, kCFStringEncodingUTF8, false);
+
+    // Unescaping never makes the string longer:
+    uint8_t buffer[256];
+    uint8_t* out = (length <= sizeof(buffer)) ? buffer : malloc(length);
+    if (!out)
+        return NULL;
+    uint8_t* dst = out;
+    const uint8_t* end = p + length;
+    bool ok = true;
+    while (p < end && ok) {
+        const uint8_t* backslash = memchr(p, '\\', end - p);
+        size_t run = (backslash ? backslash : end) - p;
+        memcpy(dst, p, run);
+        dst += run;
+        p += run;
+        if (!backslash)
+            break;
+        if (++p >= end) {
+            ok = false;
+            break;
+        }
+        switch (*p++) {
+            case '"':   *dst++ = '"'; break;
+            case '\\':  *dst++ = '\\'; break;
+            case '/':   *dst++ = '/'; break;
+            case 'b':   *dst++ = '\b'; break;
+            case 'f':   *dst++ = '\f'; break;
+            case 'n':   *dst++ = '\n'; break;
+            case 'r':   *dst++ = '\r'; break;
+            case 't':   *dst++ = '\t'; break;
+            case 'u': {
+                unsigned ch, low;
+                if (!readHex4(p, end, &ch)) {
+                    ok = false;
+                    break;
+                }
+                p += 4;
+                if (ch >= 0xD800 && ch <= 0xDBFF) {
+                    // Surrogate pair:
+                    if (end - p < 6 || p[0] != '\\' || p[1] != 'u' || !readHex4(p + 2, end, &low)
+                            || low < 0xDC00 || low > 0xDFFF) {
+                        ok = false;
+                        break;
+                    }
+                    p += 6;
+                    ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+                } else if (ch >= 0xDC00 && ch <= 0xDFFF) {
+                    ok = false;
+                    break;
+                }
+                // Encode as UTF-8 (which is no longer than the escape sequence):
+                if (ch < 0x80) {
+                    *dst++ = (uint8_t)ch;
+                } else if (ch < 0x800) {
+                    *dst++ = (uint8_t)(0xC0 | (ch >> 6));
+                    *dst++ = (uint8_t)(0x80 | (ch & 0x3F));
+                } else if (ch < 0x10000) {
+                    *dst++ = (uint8_t)(0xE0 | (ch >> 12));
+                    *dst++ = (uint8_t)(0x80 | ((ch >> 6) & 0x3F));
+                    *dst++ = (uint8_t)(0x80 | (ch & 0x3F));
+                } else {
+                    *dst++ = (uint8_t)(0xF0 | (ch >> 18));
+                    *dst++ = (uint8_t)(0x80 | ((ch >> 12) & 0x3F));
+                    *dst++ = (uint8_t)(0x80 | ((ch >> 6) & 0x3F));
+                    *dst++ = (uint8_t)(0x80 | (ch & 0x3F));
+                }
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+    }
+    CFStringRef result = NULL;
+    if (ok)
+        result = CFStringCreateWithBytes(NULL, out, dst - out, kCFStringEncodingUTF8, false);
+    if (out != buffer)
+        free(out);
+    return result;
+}
+
+
+// Builds Foundation objects from the tokens of a complete JSON document.
+static CFTypeRef createObject(CBLJSONScanner* s, bool mutableContainers) {
+    // Values (and keys) of the open containers are pushed on these stacks, then popped off all
+    // at once when the container ends. `starts` remembers where each container's items begin.
+    CFTypeRef* values = NULL, *keys = NULL;
+    size_t nValues = 0, nKeys = 0, valuesCapacity = 0, keysCapacity = 0;
+    size_t* starts = NULL;
+    size_t startsCapacity = 0;
+    CFTypeRef result = NULL;
+
+    for (;;) {
+        CFTypeRef value = NULL;
+        CBLJSONToken token = nextToken(s);
+        switch (token) {
+            case kTokenStartObject:
+            case kTokenStartArray:
+                if (s->depth > startsCapacity) {
+                    startsCapacity = MAX(2 * startsCapacity, 32u);
+                    starts = reallocf(starts, 2 * startsCapacity * sizeof(size_t));
+                    if (!starts)
+                        goto fail;
+                }
+                starts[2 * (s->depth - 1)] = nValues;
+                starts[2 * (s->depth - 1) + 1] = nKeys;
+                continue;
+            case kTokenEndObject: {
+                size_t vStart = starts[2 * s->depth], kStart = starts[2 * s->depth + 1];
+                CFIndex n = nValues - vStart;
+                CAssert(n == (CFIndex)(nKeys - kStart));
+                if (mutableContainers) {
+                    CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, n,
+                                                            &kCFTypeDictionaryKeyCallBacks,
+                                                            &kCFTypeDictionaryValueCallBacks);
+                    for (CFIndex i = 0; i < n; i++)
+                        CFDictionarySetValue(dict, keys[kStart + i], values[vStart + i]);
+                    value = dict;
+                } else {
+                    value = CFDictionaryCreate(NULL, &keys[kStart], &values[vStart], n,
+                                               &kCFTypeDictionaryKeyCallBacks,
+                                               &kCFTypeDictionaryValueCallBacks);
+                    if (CFDictionaryGetCount(value) < n) {
+                        // Duplicate keys; make sure the last value of each wins:
+                        CFMutableDictionaryRef dict = CFDictionaryCreateMutable(NULL, n,
+                                                            &kCFTypeDictionaryKeyCallBacks,
+                                                            &kCFTypeDictionaryValueCallBacks);
+                        for (CFIndex i = 0; i < n; i++)
+                            CFDictionarySetValue(dict, keys[kStart + i], values[vStart + i]);
+                        CFRelease(value);
+                        value = CFDictionaryCreateCopy(NULL, dict);
+                        CFRelease(dict);
+                    }
+                }
+                for (CFIndex i = 0; i < n; i++) {
+                    CFRelease(keys[kStart + i]);
+                    CFRelease(values[vStart + i]);
+                }
+                nKeys = kStart;
+                nValues = vStart;
+                break;
+            }
+            case kTokenEndArray: {
+                size_t vStart = starts[2 * s->depth];
+                CFIndex n = nValues - vStart;
+                if (mutableContainers) {
+                    CFMutableArrayRef array = CFArrayCreateMutable(NULL, n, &kCFTypeArrayCallBacks);
+                    for (CFIndex i = 0; i < n; i++)
+                        CFArrayAppendValue(array, values[vStart + i]);
+                    value = array;
+                } else {
+                    value = CFArrayCreate(NULL, &values[vStart], n, &kCFTypeArrayCallBacks);
+                }
+                for (CFIndex i = 0; i < n; i++)
+                    CFRelease(values[vStart + i]);
+                nValues = vStart;
+                break;
+            }
+            case kTokenKey: {
+                CFStringRef key = createString(s->tokenStart, s->tokenLength, s->tokenEscaped);
+                if (!key) {
+                    scannerFail(s, "invalid string", s->tokenStart - s->buf);
+                    goto fail;
+                }
+                if (nKeys >= keysCapacity) {
+                    keysCapacity = MAX(2 * keysCapacity, 64u);
+                    keys = reallocf(keys, keysCapacity * sizeof(CFTypeRef));
+                    if (!keys) {
+                        CFRelease(key);
+                        goto fail;
+                    }
+                }
+                keys[nKeys++] = key;
+                continue;
+            }
+            case kTokenString:
+                value = createString(s->tokenStart, s->tokenLength, s->tokenEscaped);
+                if (!value) {
+                    scannerFail(s, "invalid string", s->tokenStart - s->buf);
+                    goto fail;
+                }
+                break;
+            case kTokenScalar:
+                value = createScalar(s->tokenStart, s->tokenLength);
+                if (!value) {
+                    scannerFail(s, "invalid number or literal", s->tokenStart - s->buf);
+                    goto fail;
+                }
+                break;
+            case kTokenEOF:
+                CAssert(nValues == 1);
+                result = values[0];
+                nValues = 0;
+                goto done;
+            case kTokenNeedMore:
+            case kTokenError:
+                goto fail;
+        }
+
+        // Push the value:
+        if (nValues >= valuesCapacity) {
+            valuesCapacity = MAX(2 * valuesCapacity, 64u);
+            values = reallocf(values, valuesCapacity * sizeof(CFTypeRef));
+            if (!values) {
+                CFRelease(value);
+                goto fail;
+            }
+        }
+        values[nValues++] = value;
+    }
+
+fail:
+    for (size_t i = 0; i < nValues; i++)
+        CFRelease(values[i]);
+    for (size_t i = 0; i < nKeys; i++)
+        CFRelease(keys[i]);
+done:
+    free(values);
+    free(keys);
+    free(starts);
+    return result;
+}
+
+
+
+
 @implementation CBLJSONReader
 {
-    yajl_handle _yajl;
+    CBLJSONScanner _scanner;
+    NSMutableData* _buffer;
+    size_t _discarded;              // number of bytes already dropped from the front of _buffer
     NSMutableArray* _stack;
     CBLJSONMatcher* _matcher;
 }
 
 
++ (id) objectWithBytes: (const void*)bytes length: (size_t)length options: (NSUInteger)options {
+    if (length >= UINT32_MAX)
+        return nil;
+    CBLJSONScanner s;
+    scannerInit(&s);
+    s.buf = bytes;
+    s.length = length;
+    s.final = true;
+    CFTypeRef result = NULL;
+    if (indexInput(&s, true)) {
+        if (s.prevInString)
+            scannerFail(&s, "unterminated string", length);
+        else
+            result = createObject(&s, (options & NSJSONReadingMutableContainers) != 0);
+    }
+    if (!result)
+        LogTo(JSONReader, @"Parse error: %s at offset %zu", s.error, s.errorPos);
+    scannerFree(&s);
+    if (result && !(options & NSJSONReadingAllowFragments)
+               && CFGetTypeID(result) != CFDictionaryGetTypeID()
+               && CFGetTypeID(result) != CFArrayGetTypeID()) {
+        CFRelease(result);
+        return nil;
+    }
+    return CFBridgingRelease(result);
+}
+
+
 - (instancetype) initWithMatcher: (CBLJSONMatcher*)rootMatcher {
     self = [super init];
     if (self) {
-        _yajl = yajl_alloc(&kCallbacks, NULL, (__bridge void*)self);
-        if (!_yajl)
-            return nil;
+        scannerInit(&_scanner);
+        _buffer = [[NSMutableData alloc] init];
         _stack = $marray();
         _matcher = rootMatcher;
         LogTo(JSONReader, @"Start with %@", _matcher);
@@ -178,18 +855,15 @@ DefineLogDomain(JSONReader);
 
 
 - (void) dealloc {
-    if (_yajl)
-        yajl_free(_yajl);
+    scannerFree(&_scanner);
 }
 
 
 - (NSString*) errorString {
-    unsigned char* cstr = yajl_get_error(_yajl, false, NULL, 0);
-    if (!cstr)
+    if (!_scanner.error)
         return nil;
-    NSString* error = [NSString stringWithUTF8String: (const char*)cstr];
-    yajl_free_error(_yajl, cstr);
-    return error;
+    return $sprintf(@"parse error: %s at offset %zu",
+                    _scanner.error, _discarded + _scanner.errorPos);
 }
 
 
@@ -197,28 +871,144 @@ DefineLogDomain(JSONReader);
 
 
 - (BOOL) parseBytes: (const void*)bytes length: (size_t)length {
+    if (_scanner.error)
+        return NO;
     CFRetain((__bridge CFTypeRef)self); // keep self from being released during this call
-    BOOL ok = yajl_parse(_yajl, bytes, length) == yajl_status_ok;
+    [_buffer appendBytes: bytes length: length];
+    BOOL ok = [self scan];
     CFRelease((__bridge CFTypeRef)self);
     return ok;
 }
 
 - (BOOL) parseData:(NSData *)data {
-    CFRetain((__bridge CFTypeRef)self); // keep self from being released during this call
-    BOOL ok = yajl_parse(_yajl, data.bytes, data.length) == yajl_status_ok;
-    CFRelease((__bridge CFTypeRef)self);
-    return ok;
+    return [self parseBytes: data.bytes length: data.length];
 }
 
 
 - (BOOL) finish {
+    if (_scanner.error)
+        return NO;
     CFRetain((__bridge CFTypeRef)self); // keep self from being released during this call
-    BOOL ok = yajl_complete_parse(_yajl) == yajl_status_ok;
+    _scanner.final = true;
+    BOOL ok = [self scan];
     CFRelease((__bridge CFTypeRef)self);
     return ok;
 }
 
 
+// Indexes the new input, and feeds all the complete tokens in it to the matchers.
+- (BOOL) scan {
+    CBLJSONScanner* s = &_scanner;
+    s->buf = _buffer.bytes;
+    s->length = _buffer.length;
+    if (s->length >= UINT32_MAX)
+        return scannerFail(s, "input too large", s->length);
+    if (!indexInput(s, s->final))
+        return NO;
+
+    // Tokens in the last, partial block have to be read too, or a change at the end of the
+    // input would be held back until more arrives. So index that block provisionally, and
+    // afterwards forget its unread structural characters and index it again next time.
+    uint64_t savedOddBackslash = s->prevOddBackslash, savedInString = s->prevInString;
+    size_t savedCount = s->count, savedIndexedLength = s->indexedLength;
+    bool provisional = (s->indexedLength < s->length);
+    if (provisional && !indexInput(s, true))
+        return NO;
+
+    BOOL ok = [self readTokens];
+
+    if (provisional) {
+        s->count = MAX(s->next, savedCount);
+        s->indexedLength = savedIndexedLength;
+        s->prevOddBackslash = savedOddBackslash;
+        s->prevInString = savedInString;
+    } else if (ok && s->final && s->prevInString) {
+        ok = scannerFail(s, "unterminated string", s->length);
+    }
+    if (ok)
+        [self discardConsumedInput];
+    return ok;
+}
+
+- (BOOL) readTokens {
+    CBLJSONScanner* s = &_scanner;
+    for (;;) {
+        CBLJSONToken token = nextToken(s);
+        bool ok;
+        switch (token) {
+            case kTokenNeedMore:
+            case kTokenEOF:
+                return YES;
+            case kTokenError:
+                return NO;
+            case kTokenStartObject:
+                LogTo(JSONReader, @"Start object");
+                ok = [self startMap];
+                break;
+            case kTokenStartArray:
+                LogTo(JSONReader, @"Start array");
+                ok = [self startArray];
+                break;
+            case kTokenEndObject:
+            case kTokenEndArray:
+                LogTo(JSONReader, @"End %s", (token == kTokenEndObject ? "object" : "array"));
+                ok = [self endArrayOrMap: (token == kTokenEndObject)];
+                break;
+            case kTokenKey: {
+                CFStringRef key = createString(s->tokenStart, s->tokenLength, s->tokenEscaped);
+                if (!key)
+                    return scannerFail(s, "invalid string", s->tokenStart - s->buf);
+                LogTo(JSONReader, @"Object key: \"%@\"", key);
+                ((CBLJSONDictMatcher*)_matcher).key = CFBridgingRelease(key);
+                ok = true;
+                break;
+            }
+            case kTokenString:
+            case kTokenScalar: {
+                CFTypeRef value;
+                if (token == kTokenString)
+                    value = createString(s->tokenStart, s->tokenLength, s->tokenEscaped);
+                else
+                    value = createScalar(s->tokenStart, s->tokenLength);
+                if (!value)
+                    return scannerFail(s, (token == kTokenString ? "invalid string"
+                                                                 : "invalid number or literal"),
+                                       s->tokenStart - s->buf);
+                LogTo(JSONReader, @"Match %@", value);
+                ok = [_matcher matchValue: CFBridgingRelease(value)];
+                break;
+            }
+        }
+        if (!ok) {
+#if DEBUG
+            Warn(@"CBLJSONMatcher returned an error");
+#endif
+            return scannerFail(s, "rejected by matcher", s->cursor);
+        }
+    }
+}
+
+// Drops the whole blocks of input that have been read, so the buffer doesn't keep growing
+// while reading a long feed.
+- (void) discardConsumedInput {
+    CBLJSONScanner* s = &_scanner;
+    size_t drop = MIN(s->cursor, s->indexedLength) / kBlockSize * kBlockSize;
+    if (drop == 0)
+        return;
+    [_buffer replaceBytesInRange: NSMakeRange(0, drop) withBytes: NULL length: 0];
+    size_t remaining = s->count - s->next;
+    for (size_t i = 0; i < remaining; i++)
+        s->indexes[i] = s->indexes[s->next + i] - (uint32_t)drop;
+    s->count = remaining;
+    s->next = 0;
+    s->cursor -= drop;
+    s->indexedLength -= drop;
+    _discarded += drop;
+    s->buf = _buffer.bytes;
+    s->length = _buffer.length;
+}
+
+
 - (void) push: (CBLJSONMatcher*)matcher {
     if (_matcher)
         [_stack addObject: _matcher];
@@ -238,10 +1028,6 @@ DefineLogDomain(JSONReader);
     LogTo(JSONReader, @"Popped: now %@", _matcher);
 }
 
-- (CBLJSONMatcher*) matcher {
-    return _matcher;
-}
-
 - (bool) startArray {
     CBLJSONMatcher* matcher = [_matcher startArray];
     if (!matcher)
@@ -258,13 +1044,6 @@ DefineLogDomain(JSONReader);
     return true;
 }
 
-
-- (bool) matchMapKey: (const unsigned char*)key length: (size_t)length {
-    ((CBLJSONDictMatcher*)_matcher).key = [[NSString alloc] initWithBytes: key length: length
-                                                                 encoding: NSUTF8StringEncoding];
-    return true;
-}
-
 - (bool) endArrayOrMap: (BOOL)isMap {
     id result = [_matcher end];
     if (!result)
@@ -273,92 +1052,4 @@ DefineLogDomain(JSONReader);
     return [_matcher matchValue: result];
 }
 
-
-#pragma mark - CALLBACKS:
-
-
-static inline CBLJSONReader* parserForCtx(void *ctx) {
-    return (__bridge CBLJSONReader*)ctx;
-}
-
-static inline int checkErr(bool result) {
-#if DEBUG
-    if (!result)
-        Warn(@"CBLJSONMatcher returned an error");
-#endif
-    return result;
-}
-
-
-static int parsed_null(void * ctx) {
-    LogTo(JSONReader, @"Match null");
-    CBLJSONReader* self = parserForCtx(ctx);
-    return checkErr([self.matcher matchValue: [NSNull null]]);
-}
-
-static int parsed_boolean(void * ctx, int boolVal) {
-    LogTo(JSONReader, @"Match %s", (boolVal ?"true" :"false"));
-    CBLJSONReader* self = parserForCtx(ctx);
-    return checkErr([self.matcher matchValue: [NSNumber numberWithBool: (BOOL)boolVal]]);
-}
-
-static int parsed_integer(void * ctx, long long integerVal) {
-    LogTo(JSONReader, @"Match %lld", integerVal);
-    CBLJSONReader* self = parserForCtx(ctx);
-    return checkErr([self.matcher matchValue: [NSNumber numberWithLongLong: integerVal]]);
-}
-
-static int parsed_double(void * ctx, double doubleVal) {
-    LogTo(JSONReader, @"Match %g", doubleVal);
-    CBLJSONReader* self = parserForCtx(ctx);
-    return checkErr([self.matcher matchValue: [NSNumber numberWithDouble: doubleVal]]);
-}
-
-static int parsed_string(void * ctx, const unsigned char * stringVal, size_t stringLen) {
-    LogTo(JSONReader, @"Match \"%.*s\"", (int)stringLen, stringVal);
-    CBLJSONReader* self = parserForCtx(ctx);
-    NSString* string = [[NSString alloc] initWithBytes: stringVal length: stringLen encoding: NSUTF8StringEncoding];
-    return checkErr([self.matcher matchValue: string]);
-}
-
-static int parsed_start_array(void * ctx) {
-    LogTo(JSONReader, @"Start array");
-    CBLJSONReader* self = parserForCtx(ctx);
-    return checkErr([self startArray]);
-}
-
-static int parsed_end_array(void * ctx) {
-    LogTo(JSONReader, @"End array");
-    return checkErr([parserForCtx(ctx) endArrayOrMap: false]);
-}
-
-static int parsed_start_map(void * ctx) {
-    LogTo(JSONReader, @"Start object");
-    CBLJSONReader* self = parserForCtx(ctx);
-    return checkErr([self startMap]);
-}
-
-static int parsed_map_key(void * ctx, const unsigned char * key, size_t stringLen) {
-    LogTo(JSONReader, @"Object key: \"%.*s\"", (int)stringLen, key);
-    return checkErr([parserForCtx(ctx) matchMapKey: key length: stringLen]);
-}
-
-static int parsed_end_map(void * ctx) {
-    LogTo(JSONReader, @"End object");
-    return checkErr([parserForCtx(ctx) endArrayOrMap: true]);
-}
-
-static const yajl_callbacks kCallbacks = {
-    .yajl_null        = &parsed_null,
-    .yajl_boolean     = &parsed_boolean,
-    .yajl_integer     = &parsed_integer,
-    .yajl_double      = &parsed_double,
-    .yajl_string      = &parsed_string,
-    .yajl_start_array = &parsed_start_array,
-    .yajl_end_array   = &parsed_end_array,
-    .yajl_start_map   = &parsed_start_map,
-    .yajl_map_key     = &parsed_map_key,
-    .yajl_end_map     = &parsed_end_map
-};
-
 @end
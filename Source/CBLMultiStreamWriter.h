@@ -7,6 +7,7 @@
 //
 
 #import <Foundation/Foundation.h>
+@class CBLByteBuffer;
 
 /** A stream aggregator that reads from a concatenated sequence of other inputs.
     Use this to combine multiple input streams (and data blobs) together into one.
@@ -17,8 +18,10 @@
     NSMutableArray* _inputs;
     NSUInteger _nextInputIndex;
     NSInputStream* _currentInput;
-    uint8_t* _buffer;
-    NSUInteger _bufferSize, _bufferLength;
+    NSData* _currentData;
+    CBLByteBuffer* _buffer;
+    NSUInteger _bufferSize, _fillSize;
+    BOOL _writesDataDirectly;
     NSOutputStream* _output;
     NSInputStream* _input;
     NSError* _error;
@@ -49,6 +52,12 @@
 
 - (void) close;
 
+/** If YES (the default), NSData and file inputs aren't copied through the buffer: they're written
+    to the output straight from their own storage, with files memory-mapped. Stream inputs are read
+    in chunks that grow (up to 256KB) as long as the output keeps up. If NO, everything is copied
+    through a fixed-size buffer. Must be set before opening. */
+@property BOOL writesDataDirectly;
+
 @property (readonly) BOOL isOpen;
 
 @property (readonly, strong) NSError* error;
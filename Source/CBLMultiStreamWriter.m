@@ -14,6 +14,7 @@
 //  and limitations under the License.
 
 #import "CBLMultiStreamWriter.h"
+#import "CBLByteBuffer.h"
 
 
 DefineLogDomain(MultiStreamWriter);
@@ -21,6 +22,9 @@ DefineLogDomain(MultiStreamWriter);
 
 #define kDefaultBufferSize 32768
 
+// Stream inputs are read in chunks that can grow up to this size, in writesDataDirectly mode
+#define kMaxFillSize (256*1024)
+
 
 @interface CBLMultiStreamWriter () <NSStreamDelegate>
 @property (readwrite, strong) NSError* error;
@@ -30,19 +34,16 @@ DefineLogDomain(MultiStreamWriter);
 @implementation CBLMultiStreamWriter
 
 
-@synthesize error=_error, length=_length;
+@synthesize error=_error, length=_length, writesDataDirectly=_writesDataDirectly;
 
 
 - (instancetype) initWithBufferSize: (NSUInteger)bufferSize {
     self = [super init];
     if (self) {
         _inputs = [[NSMutableArray alloc] init];
-        _bufferLength = 0;
-        _bufferSize = bufferSize;
-        _buffer = malloc(_bufferSize);
-        if (!_buffer) {
-            return nil;
-        }
+        _bufferSize = _fillSize = bufferSize;
+        _buffer = [[CBLByteBuffer alloc] init];
+        _writesDataDirectly = YES;
     }
     return self;
 }
@@ -54,7 +55,6 @@ DefineLogDomain(MultiStreamWriter);
 
 - (void) dealloc {
     [self close];
-    free(_buffer);
 }
 
 
@@ -103,6 +103,7 @@ DefineLogDomain(MultiStreamWriter);
 - (void) opened {
     _error = nil;
     _totalBytesWritten = 0;
+    _fillSize = _bufferSize;
     
     _output.delegate = self;
     [_output scheduleInRunLoop: [NSRunLoop currentRunLoop] forMode: NSDefaultRunLoopMode];
@@ -159,10 +160,11 @@ DefineLogDomain(MultiStreamWriter);
     _output = nil;
     _input = nil;
     
-    _bufferLength = 0;
+    [_buffer reset];
     
     [_currentInput close];
     _currentInput = nil;
+    _currentData = nil;
     _nextInputIndex = 0;
 }
 
@@ -184,16 +186,33 @@ DefineLogDomain(MultiStreamWriter);
 }
 
 
+// In writesDataDirectly mode, returns the contents of an NSData or file input (mapped, not read),
+// or nil if the input has to be read as a stream.
+- (NSData*) dataForInput: (id)input {
+    if ([input isKindOfClass: [NSData class]])
+        return input;
+    else if ([input isKindOfClass: [NSURL class]] && [input isFileURL])
+        return [NSData dataWithContentsOfURL: input options: NSDataReadingMappedAlways error: NULL];
+    else
+        return nil;
+}
+
+
 // Close the current input stream and open the next one, assigning it to _currentInput.
+// (Or, if the next input can be written directly, assign its contents to _currentData.)
 - (BOOL) openNextInput {
     if (_currentInput) {
         [_currentInput close];
         _currentInput = nil;
     }
     if (_nextInputIndex < _inputs.count) {
-        _currentInput = [self streamForInput: _inputs[_nextInputIndex]];
+        id input = _inputs[_nextInputIndex];
         ++_nextInputIndex;
-        [_currentInput open];
+        _currentData = _writesDataDirectly ? [self dataForInput: input] : nil;
+        if (!_currentData) {
+            _currentInput = [self streamForInput: input];
+            [_currentInput open];
+        }
         return YES;
     }
     return NO;
@@ -236,36 +255,58 @@ DefineLogDomain(MultiStreamWriter);
 // Read enough bytes from the aggregated input to refill my _buffer. Returns success/failure.
 - (BOOL) refillBuffer {
     LogTo(MultiStreamWriter, @"%@:   Refilling buffer", self);
-    NSInteger bytesRead = [self read: _buffer+_bufferLength maxLength: _bufferSize-_bufferLength];
-    if (bytesRead <= 0) {
+    NSUInteger oldLength = _buffer.bytesAvailable;
+    while (_buffer.bytesAvailable < _fillSize) {
+        if (_currentData) {
+            // Add it to the buffer as-is, so it'll be written to the output straight from its own
+            // storage. (Data added to a writer must already stay unchanged until it's written.)
+            [_buffer appendDataNoCopy: _currentData];
+            _currentData = nil;
+            [self openNextInput];
+        } else if (_currentInput) {
+            NSUInteger space = _fillSize - _buffer.bytesAvailable;
+            NSInteger bytesRead = [self read: [_buffer reserveBytes: space] maxLength: space];
+            [_buffer commitBytes: MAX(bytesRead, 0)];
+            if (bytesRead <= 0 && !_currentData)
+                break;
+        } else {
+            break;
+        }
+    }
+    if (_buffer.bytesAvailable == oldLength) {
         LogTo(MultiStreamWriter, @"%@:     at end of input, can't refill", self);
         return NO;
     }
-    _bufferLength += bytesRead;
-    LogTo(MultiStreamWriter, @"%@:   refilled buffer to %u bytes", self, (unsigned)_bufferLength);
-    //LogTo(MultiStreamWriter, @"%@:   buffer is now \"%.*s\"", self, _bufferLength, _buffer);
+    LogTo(MultiStreamWriter, @"%@:   refilled buffer to %u bytes",
+          self, (unsigned)_buffer.bytesAvailable);
     return YES;
 }
 
 
 // Write from my _buffer to _output, then refill _buffer if it's not halfway full.
 - (BOOL) writeToOutput {
-    Assert(_bufferLength > 0);
-    NSInteger bytesWritten = [_output write: _buffer maxLength: _bufferLength];
+    Assert(_buffer.hasBytesAvailable);
+    struct iovec region;
+    [_buffer getRegions: &region maxCount: 1];
+    NSInteger bytesWritten = [_output write: region.iov_base maxLength: region.iov_len];
     LogTo(MultiStreamWriter, @"%@:   Wrote %d (of %u) bytes to _output (total %lld of %lld)",
-          self, (int)bytesWritten, (unsigned)_bufferLength, _totalBytesWritten+bytesWritten, _length);
+          self, (int)bytesWritten, (unsigned)_buffer.bytesAvailable,
+          _totalBytesWritten+bytesWritten, _length);
     if (bytesWritten <= 0) {
         [self setErrorFrom: _output];
         return NO;
     }
     _totalBytesWritten += bytesWritten;
-    Assert(bytesWritten <= (NSInteger)_bufferLength);
-    _bufferLength -= bytesWritten;
-    memmove(_buffer, _buffer+bytesWritten, _bufferLength);
-    //LogTo(MultiStreamWriter, @"%@:     buffer is now \"%.*s\"", self, _bufferLength, _buffer);
-    if (_bufferLength <= _bufferSize/2)
+    Assert(bytesWritten <= (NSInteger)region.iov_len);
+    if (_writesDataDirectly && (NSUInteger)bytesWritten >= _fillSize && _fillSize < kMaxFillSize) {
+        // The output took a whole buffer-full at once, so read bigger chunks from now on:
+        _fillSize = MIN(2*_fillSize, (NSUInteger)kMaxFillSize);
+        LogTo(MultiStreamWriter, @"%@:   increased fill size to %u", self, (unsigned)_fillSize);
+    }
+    [_buffer advance: bytesWritten];     // frees segments as they're consumed; nothing is moved
+    if (_buffer.bytesAvailable <= _fillSize/2)
         [self refillBuffer];
-    return _bufferLength > 0;
+    return _buffer.hasBytesAvailable;
 }
 
 
@@ -17,6 +17,7 @@
     @private
     __weak id<CBLMultipartReaderDelegate> _delegate;
     NSData* _boundary;
+    size_t _boundarySkip[256];      // Boyer-Moore-Horspool shift table for _boundary
     CBLByteBuffer* _buffer;
     NSMutableDictionary* _headers;
     int _state;
@@ -54,7 +55,9 @@
 /** This method is called when a part's headers have been parsed, before its data is parsed. */
 - (BOOL) startedPart: (NSDictionary*)headers;
 
-/** This method is called to append data to a part's body. */
+/** This method is called to append data to a part's body.
+    The data may point into a buffer that's reused, or into the NSData given to the reader, so it's
+    only valid during the call; copy it if you need to keep it. */
 - (BOOL) appendToPart: (NSData*)data;
 
 /** This method is called when a part is complete. */
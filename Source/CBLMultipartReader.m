@@ -43,6 +43,46 @@ static NSString* trim( NSString* str ) {
 }
 
 
+// Finds the first occurrence of the boundary in a byte range, using the Boyer-Moore-Horspool
+// algorithm. `skip` is the boundary's shift table. Returns a zero-length range if not found.
+static NSRange findBoundary(const uint8_t* bytes, size_t length,
+                            const uint8_t* boundary, size_t boundaryLen, const size_t skip[256])
+{
+    if (length >= boundaryLen) {
+        const uint8_t last = boundary[boundaryLen - 1];
+        size_t pos = 0;
+        while (pos <= length - boundaryLen) {
+            uint8_t c = bytes[pos + boundaryLen - 1];
+            if (c == last && memcmp(bytes + pos, boundary, boundaryLen - 1) == 0)
+                return NSMakeRange(pos, boundaryLen);
+            pos += skip[c];
+        }
+    }
+    return NSMakeRange(NSNotFound, 0);
+}
+
+
+// Does a boundary start within the `tailLen` bytes at `tail` (fewer than the boundary's length)
+// and continue into `bytes`, which must have at least `boundaryLen - 1` bytes?
+static BOOL boundaryStraddles(const uint8_t* tail, size_t tailLen, const uint8_t* bytes,
+                              const uint8_t* boundary, size_t boundaryLen)
+{
+    for (size_t i = 0; i < tailLen; i++) {
+        size_t n = tailLen - i;     // number of boundary bytes that would be in the tail
+        if (memcmp(tail + i, boundary, n) == 0
+                && memcmp(bytes, boundary + n, boundaryLen - n) == 0)
+            return YES;
+    }
+    return NO;
+}
+
+
+// Wraps bytes in an NSData without copying them; it's only valid as long as the bytes are.
+static NSData* noCopyData(const void* bytes, NSUInteger length) {
+    return [[NSData alloc] initWithBytesNoCopy: (void*)bytes length: length freeWhenDone: NO];
+}
+
+
 @implementation CBLMultipartReader
 
 
@@ -101,6 +141,12 @@ static NSData* kCRLFCRLF;
                     return NO;
                 boundary = [@"\r\n--" stringByAppendingString: boundary];
                 _boundary = [boundary dataUsingEncoding: NSUTF8StringEncoding];
+                size_t boundaryLen = _boundary.length;
+                const uint8_t* boundaryBytes = _boundary.bytes;
+                for (int c = 0; c < 256; c++)
+                    _boundarySkip[c] = boundaryLen;
+                for (size_t i = 0; i < boundaryLen - 1; i++)
+                    _boundarySkip[boundaryBytes[i]] = boundaryLen - 1 - i;
                 break;
             }
         }
@@ -171,14 +217,94 @@ static NSData* kCRLFCRLF;
 }
          
 
+- (NSRange) searchBufferForBoundaryFrom: (NSUInteger)start {
+    NSRange r = findBoundary((const uint8_t*)_buffer.bytes + start, _buffer.bytesAvailable - start,
+                             _boundary.bytes, _boundary.length, _boundarySkip);
+    if (r.length > 0)
+        r.location += start;
+    return r;
+}
+
+
 - (void) appendData: (NSData*)data {
-    if (!_buffer)
-        return;
-    NSUInteger newDataLen = data.length;
-    if (newDataLen == 0)
-        return;
-    [_buffer appendData: data];
-    
+    NSUInteger length = data.length, pos = 0;
+    while (pos < length && _buffer) {
+        if (_state == kInBody && _buffer.bytesAvailable < _boundary.length
+                              && length - pos >= _boundary.length) {
+            NSUInteger n = [self readBodyFromData: data at: pos];
+            if (n > 0) {
+                pos += n;
+                continue;
+            }
+        }
+
+        // Copy the rest of the data into the buffer and parse it from there:
+        NSUInteger appended = length - pos;
+        [_buffer appendBytes: (const uint8_t*)data.bytes + pos length: appended];
+        pos = length;
+        if ([self parseBuffer: appended stopAtBody: YES]) {
+            // It got as far as a part's body. If the unparsed bytes all came from `data`, go back
+            // to reading them from there instead of the buffer:
+            NSUInteger unparsed = _buffer.bytesAvailable;
+            if (unparsed <= appended) {
+                pos = length - unparsed;
+                [_buffer reset];
+            } else {
+                [self parseBuffer: unparsed stopAtBody: NO];
+            }
+        }
+    }
+}
+
+
+// Reads part-body bytes directly out of `data` starting at `pos`, handing the delegate slices of
+// it instead of copying it into _buffer. On entry _buffer must hold fewer bytes than the boundary,
+// and `data` at least as many. Returns the number of bytes consumed, or 0 if a boundary starts in
+// the buffered bytes, in which case the caller has to parse from the buffer.
+- (NSUInteger) readBodyFromData: (NSData*)data at: (NSUInteger)pos {
+    const uint8_t* bytes = (const uint8_t*)data.bytes + pos;
+    NSUInteger length = data.length - pos;
+    const uint8_t* boundary = _boundary.bytes;
+    NSUInteger boundaryLen = _boundary.length;
+    id<CBLMultipartReaderDelegate> delegate = _delegate;
+    __unused id retainSelf = self;
+
+    // The bytes left in the buffer are body data unless they begin a boundary:
+    NSUInteger tailLen = _buffer.bytesAvailable;
+    if (tailLen > 0) {
+        if (boundaryStraddles(_buffer.bytes, tailLen, bytes, boundary, boundaryLen))
+            return 0;
+        if (![delegate appendToPart: [_buffer subdataWithRangeNoCopy: NSMakeRange(0, tailLen)]]) {
+            [self stop];
+            return length;
+        }
+        [_buffer reset];
+    }
+
+    NSRange r = findBoundary(bytes, length, boundary, boundaryLen, _boundarySkip);
+    if (r.length > 0) {
+        if (![delegate appendToPart: noCopyData(bytes, r.location)] || ![delegate finishedPart]) {
+            [self stop];
+            return length;
+        }
+        _state = kInHeaders;
+        return NSMaxRange(r);
+    } else {
+        // Keep back enough bytes to recognize a boundary that continues in the next data:
+        NSUInteger bodyLen = length - (boundaryLen - 1);
+        if (![delegate appendToPart: noCopyData(bytes, bodyLen)]) {
+            [self stop];
+            return length;
+        }
+        [_buffer appendBytes: bytes + bodyLen length: boundaryLen - 1];
+        return length;
+    }
+}
+
+
+// Parses the data in _buffer, of which the last `newDataLen` bytes are new. If `stopAtBody` is
+// set, returns YES upon reaching the start of a part's body, leaving the rest in the buffer.
+- (BOOL) parseBuffer: (NSUInteger)newDataLen stopAtBody: (BOOL)stopAtBody {
     int nextState;
     do {
         nextState = -1;
@@ -205,7 +331,7 @@ static NSData* kCRLFCRLF;
                 if (bufLen < _boundary.length)
                     break;
                 NSInteger start = MAX(0, (NSInteger)(bufLen - newDataLen - _boundary.length));
-                NSRange r = [_buffer searchFor: _boundary from: start];
+                NSRange r = [self searchBufferForBoundaryFrom: start];
                 if (r.length > 0) {
                     if (_state == kInBody) {
                         __unused id retainSelf = self;
@@ -231,7 +357,7 @@ static NSData* kCRLFCRLF;
                 if (bufLen >= 2 && memcmp(_buffer.bytes, "--", 2) == 0) {
                     _state = kAtEnd;
                     [self close];
-                    return;
+                    return NO;
                 }
                 // Otherwise look for two CRLFs that delimit the end of the headers:
                 NSRange r = [_buffer searchFor: kCRLFCRLF from: 0];
@@ -242,7 +368,7 @@ static NSData* kCRLFCRLF;
                                                                  freeWhenDone: NO];
                     BOOL ok = [self parseHeaders: headers];
                     if (!ok)
-                        return;  // parseHeaders already set .error
+                        return NO;  // parseHeaders already set .error
                     [self deleteUpThrough: r];
                     if (![delegate startedPart: _headers]) {
                         [self stop];
@@ -255,11 +381,15 @@ static NSData* kCRLFCRLF;
                 
             default:
                 self.error = @"Unexpected data after end of MIME body";
-                return;
+                return NO;
         }
-        if (nextState > 0)
+        if (nextState > 0) {
             _state = nextState;
+            if (stopAtBody && nextState == kInBody)
+                return YES;
+        }
     } while (nextState >= 0 && _buffer.hasBytesAvailable);
+    return NO;
 }
 
 
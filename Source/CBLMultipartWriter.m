@@ -104,6 +104,12 @@
     [self setNextPartsHeaders: $dict({@"Content-Disposition", disposition},
                                      {@"Content-Type", attachment.contentType},
                                      {@"Content-Encoding", attachment.encodingName})];
+    if (self.writesDataDirectly) {
+        // If the blob's in a plain file, it can be mapped and written without copying:
+        NSURL* fileURL = attachment.encodedContentURL;
+        if (fileURL && [self addFileURL: fileURL])
+            return kCBLStatusOK;
+    }
     uint64_t contentLength;
     NSInputStream *contentStream = [attachment getContentStreamDecoded: NO
                                                              andLength: &contentLength];
@@ -8,7 +8,7 @@
 
 #import <Foundation/Foundation.h>
 @protocol CBLAuthorizer, CBLRemoteRequestDelegate;
-@class CBLCookieStorage, CBLRemoteSession;
+@class CBLCookieStorage, CBLRemoteSession, CBLContentCoding;
 
 
 UsingLogDomain(RemoteRequest);
@@ -57,6 +57,9 @@ void CBLWarnUntrustedCert(NSString* host, SecTrustRef trust);
 /** Applies GZip compression to the request body if appropriate. */
 - (BOOL) compressBody;
 
+/** Compresses the request body with the given content-coding, if appropriate. */
+- (BOOL) compressBodyWithCoding: (CBLContentCoding*)coding;
+
 /** In some cases a kCBLStatusNotFound Not Found is an expected condition and shouldn't be logged; call this to suppress that log message. */
 - (void) dontLog404;
 
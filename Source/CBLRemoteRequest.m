@@ -123,14 +123,20 @@ typedef enum {
 
 
 - (BOOL) compressBody {
+    return [self compressBodyWithCoding: [CBLContentCoding codingNamed: @"gzip"]];
+}
+
+
+- (BOOL) compressBodyWithCoding: (CBLContentCoding*)coding {
     NSData* body = _request.HTTPBody;
-    if (body.length < 100 || [_request valueForHTTPHeaderField: @"Content-Encoding"] != nil)
+    if (!coding || body.length < 100
+                || [_request valueForHTTPHeaderField: @"Content-Encoding"] != nil)
         return NO;
-    NSData* encoded = [CBLGZip dataByCompressingData: body];
-    if (encoded.length >= body.length)
+    NSData* encoded = [coding compressData: body];
+    if (!encoded || encoded.length >= body.length)
         return NO;
     _request.HTTPBody = encoded;
-    [_request setValue: @"gzip" forHTTPHeaderField: @"Content-Encoding"];
+    [_request setValue: coding.name forHTTPHeaderField: @"Content-Encoding"];
     return YES;
 }
 
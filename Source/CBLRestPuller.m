@@ -567,8 +567,7 @@
           }
      ];
 
-    if (self.canSendCompressedRequests)
-        [dl compressBody];
+    [dl compressBodyWithCoding: self.requestCoding];
 
     [_remoteSession startRequest: dl];
 }
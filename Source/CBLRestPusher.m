@@ -385,10 +385,11 @@
     LogVerbose(Sync, @"%@: Sending %@", self, changes.allRevisions);
     self.changesTotal += numDocsToSend;
     [self asyncTaskStarted];
-    [_remoteSession startRequest: @"POST"
-                      path: @"_bulk_docs"
-                      body: $dict({@"docs", docsToSend},
-                                  {@"new_edits", $false})
+    CBLRemoteJSONRequest* req = [[CBLRemoteJSONRequest alloc]
+                                    initWithMethod: @"POST"
+                                               URL: CBLAppendToURL(_settings.remote, @"_bulk_docs")
+                                              body: $dict({@"docs", docsToSend},
+                                                          {@"new_edits", $false})
               onCompletion: ^(NSDictionary* response, NSError *error) {
                   if (error) {
                       self.error = error;
@@ -418,6 +419,10 @@
                   [self asyncTasksFinished: 1];
               }
      ];
+    // Only compress if the server has said it accepts it: unlike _bulk_get, _bulk_docs has never
+    // been sent compressed, so a server version that decodes one needn't decode the other.
+    [req compressBodyWithCoding: self.peerRequestCoding];
+    [_remoteSession startRequest: req];
 }
 
 
@@ -8,7 +8,7 @@
 
 #import "CBLRestReplicator.h"
 #import "CBLRemoteRequest.h"
-@class CBL_RevisionList, CBLReachability;
+@class CBL_RevisionList, CBLReachability, CBLContentCoding;
 @protocol CBLAuthorizer;
 
 
@@ -38,6 +38,8 @@
 - (void) receivedResponseHeaders: (NSDictionary*)responseHeaders;
 - (BOOL) serverIsSyncGatewayVersion: (NSString*)minVersion;
 @property (readonly) BOOL canSendCompressedRequests;
+@property (readonly) CBLContentCoding* requestCoding;   // coding to compress request bodies with
+@property (readonly) CBLContentCoding* peerRequestCoding; // coding the peer said it accepts, if any
 - (void) stopRemoteRequests;
 - (void) asyncTaskStarted;
 - (void) asyncTasksFinished: (NSUInteger)numTasks;
@@ -25,6 +25,7 @@
 #import "CBLReachability.h"
 #import "CBL_URLProtocol.h"
 #import "CBLInternal.h"
+#import "CBLGZip.h"
 #import "CouchbaseLitePrivate.h"
 #import "CBLMisc.h"
 #import "CBLBase64.h"
@@ -82,6 +83,7 @@ static NSString* const kSyncGatewayServerHeaderPrefix = @"Couchbase Sync Gateway
     SecCertificateRef _serverCert;
     NSData* _pinnedCertData;
     NSString* _serverType;
+    CBLContentCoding* _peerRequestCoding;
 }
 
 @synthesize db=_db, settings=_settings, serverCert=_serverCert;
@@ -159,6 +161,7 @@ static NSString* const kSyncGatewayServerHeaderPrefix = @"Couchbase Sync Gateway
 @synthesize status=_status, error=_error, sessionID=_sessionID;
 @synthesize changesProcessed=_changesProcessed, changesTotal=_changesTotal;
 @synthesize remoteCheckpoint=_remoteCheckpoint;
+@synthesize peerRequestCoding=_peerRequestCoding;
 
 
 - (bool) hasSameSettingsAs: (CBLRestReplicator*)other {
@@ -631,6 +634,15 @@ static NSString* const kSyncGatewayServerHeaderPrefix = @"Couchbase Sync Gateway
             LogTo(Sync, @"%@: Server is %@", self, _serverType);
         }
     }
+    // A server may list the content-codings it accepts in request bodies (RFC 7694):
+    NSString* acceptEncoding = responseHeaders[@"Accept-Encoding"];
+    if (acceptEncoding) {
+        CBLContentCoding* coding = [CBLContentCoding codingForAcceptEncoding: acceptEncoding];
+        if (coding != _peerRequestCoding) {
+            _peerRequestCoding = coding;
+            LogTo(Sync, @"%@: Server accepts requests with Content-Encoding %@", self, coding.name);
+        }
+    }
 }
 
 
@@ -640,8 +652,18 @@ static NSString* const kSyncGatewayServerHeaderPrefix = @"Couchbase Sync Gateway
 }
 
 
+- (CBLContentCoding*) requestCoding {
+    if (_peerRequestCoding)
+        return _peerRequestCoding;
+    else if ([self serverIsSyncGatewayVersion: @"0.92"])
+        return [CBLContentCoding codingNamed: @"gzip"];
+    else
+        return nil;
+}
+
+
 - (BOOL) canSendCompressedRequests {
-    return [self serverIsSyncGatewayVersion: @"0.92"];
+    return self.requestCoding != nil;
 }
 
 
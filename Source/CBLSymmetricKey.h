@@ -22,6 +22,18 @@
 typedef NSMutableData* (^CBLCryptorBlock)(NSData* input);
 
 
+/** Implemented by the data returned from -[CBLSymmetricKey decryptedContentsOfFile:]. The plain
+    NSData accessors have no way to report an error, so if a chunk can't be read or fails
+    authentication they raise an NSFileHandleOperationException rather than return bad bytes. */
+@protocol CBLDecryptedData <NSObject>
+
+/** Decrypts a range of the data, returning nil (and an NSFileReadCorruptFileError) if any chunk
+    overlapping it can't be read or fails authentication. */
+- (NSData*) decryptedDataInRange: (NSRange)range error: (NSError**)outError;
+
+@end
+
+
 /** Basic AES encryption. Uses a 256-bit (32-byte) key. */
 @interface CBLSymmetricKey : NSObject
 
@@ -79,4 +91,26 @@ typedef NSMutableData* (^CBLCryptorBlock)(NSData* input);
     it will return the remaining encrypted data from its buffer. */
 - (CBLCryptorBlock) createEncryptor;
 
+/** Encrypts data in the chunked format, which splits it into 64KB chunks that are each encrypted
+    (AES-256-CTR) and authenticated (HMAC-SHA256) independently. Unlike the regular format, this
+    can be decrypted a range at a time. -decryptData: and -decryptStream: accept either format. */
+- (NSData*) encryptDataInChunks: (NSData*)data;
+
+/** Incremental encryption in the chunked format; works like -createEncryptor. Memory use is
+    bounded by the chunk size, regardless of the total length. */
+- (CBLCryptorBlock) createChunkedEncryptor;
+
+/** Returns YES if the data (or at least its first 8 bytes) is in the chunked format. */
++ (BOOL) isChunkedFormat: (NSData*)encryptedData;
+
+/** Decrypts data in the chunked format, verifying every chunk. */
+- (NSData*) decryptChunkedData: (NSData*)encryptedData;
+
+/** Returns an NSData representing the decrypted contents of a file in the chunked format, without
+    reading it: the chunks are only read and decrypted when a range of the data is accessed.
+    (Accessing -bytes decrypts the whole file.) The object conforms to CBLDecryptedData, which
+    should be used to read it wherever a corrupt chunk needs to be detected.
+    Returns nil if the file is missing or isn't in the chunked format. */
+- (NSData<CBLDecryptedData>*) decryptedContentsOfFile: (NSString*)path;
+
 @end
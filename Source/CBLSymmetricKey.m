@@ -16,6 +16,9 @@
 #import "CBLSymmetricKey.h"
 #import "CBLMisc.h"
 #import <CommonCrypto/CommonCrypto.h>
+#import <fcntl.h>
+#import <sys/stat.h>
+#import <unistd.h>
 
 
 /* Encrypted message format:
@@ -24,6 +27,21 @@
     Adler32 checksum of original data (4 bytes)
  */
 
+/* Chunked encrypted format:
+    Header (32 bytes):
+        magic "CBLAESC\2" (8 bytes)
+        nonce (8 random bytes)
+        chunk size (4 bytes, big-endian)
+        reserved (12 bytes, zero)
+    Chunks, each consisting of:
+        AES-256-CTR ciphertext (chunk size, except the last chunk which is shorter, maybe empty)
+        HMAC-SHA256 tag (truncated to 16 bytes) of the header, chunk index, last-chunk flag and
+            ciphertext
+    The CTR counter of the block at plaintext offset N is nonce || (N / 16), so every chunk can be
+    decrypted independently. The last chunk is always present & flagged, so truncation is detected.
+    The cipher and MAC keys are derived from the key data with HMAC-SHA256.
+ */
+
 
 #define kAlgorithm      kCCAlgorithmAES
 #define kKeySize        kCCKeySizeAES256
@@ -31,10 +49,20 @@
 #define kIVSize         kBlockSize
 #define kChecksumSize   sizeof(uint32_t)
 
+#define kChunkedMagic        "CBLAESC\2"
+#define kChunkedMagicSize    8
+#define kDefaultChunkSize    (64*1024)
+#define kChunkTagSize        16
+
 #define kDefaultSalt @"Salty McNaCl"
 #define kDefaultPBKDFRounds 64000       // Same as what SQLCipher uses
 
 
+@interface CBLChunkedFileData : NSData <CBLDecryptedData>
+- (instancetype) initWithPath: (NSString*)path keys: (const struct ChunkKeys*)keys;
+@end
+
+
 @implementation CBLSymmetricKey
 
 
@@ -215,6 +243,10 @@ typedef struct {
 
 
 - (NSData*) decryptData: (NSData*)encryptedData {
+    if ([[self class] isChunkedFormat: encryptedData])
+        return [self decryptChunkedData: encryptedData];
+    if (encryptedData.length < sizeof(Header))
+        return nil;
     const Header *header = encryptedData.bytes;
     size_t encodedLength = encryptedData.length - sizeof(Header);
     size_t lengthWritten;
@@ -261,12 +293,18 @@ static BOOL writeFully(NSOutputStream* out, const void* src, size_t len) {
 }
 
 
+static BOOL decryptChunkedStreamSync(NSInputStream* encryptedStream, NSOutputStream *writer,
+                                     const uint8_t* headerStart, NSData* keyData);
+
+
 static BOOL decryptStreamSync(NSInputStream* encryptedStream, NSOutputStream *writer,
                               NSData* keyData)
 {
     Header header;
     if (!readFully(encryptedStream, &header.iv, sizeof(header.iv)))
         return NO;
+    if (memcmp(header.iv, kChunkedMagic, kChunkedMagicSize) == 0)
+        return decryptChunkedStreamSync(encryptedStream, writer, header.iv, keyData);
     CCCryptorRef cryptor;
     CCCryptorStatus status = CCCryptorCreate(kCCDecrypt, kAlgorithm,
                                              kCCOptionPKCS7Padding,
@@ -321,4 +359,424 @@ static BOOL decryptStreamSync(NSInputStream* encryptedStream, NSOutputStream *wr
 }
 
 
+
+#pragma mark - CHUNKED FORMAT:
+
+
+typedef struct {
+    char magic[kChunkedMagicSize];
+    uint8_t nonce[8];
+    uint32_t chunkSize;         // big-endian
+    uint8_t reserved[12];
+} ChunkedHeader;
+
+typedef struct ChunkKeys {
+    uint8_t cipherKey[kKeySize];
+    uint8_t macKey[CC_SHA256_DIGEST_LENGTH];
+} ChunkKeys;
+
+
+static void deriveChunkKeys(NSData* keyData, ChunkKeys* keys) {
+    static const char kCipherLabel[] = "CBL chunk cipher", kMACLabel[] = "CBL chunk MAC";
+    uint8_t digest[CC_SHA256_DIGEST_LENGTH];
+    CCHmac(kCCHmacAlgSHA256, keyData.bytes, keyData.length,
+           kCipherLabel, strlen(kCipherLabel), digest);
+    memcpy(keys->cipherKey, digest, kKeySize);
+    CCHmac(kCCHmacAlgSHA256, keyData.bytes, keyData.length,
+           kMACLabel, strlen(kMACLabel), keys->macKey);
+}
+
+
+// Reads & validates a chunked-format header. Returns the chunk size, or 0 if invalid.
+static uint32_t readChunkedHeader(const void* bytes, size_t length, ChunkedHeader* header) {
+    if (length < sizeof(ChunkedHeader) || memcmp(bytes, kChunkedMagic, kChunkedMagicSize) != 0)
+        return 0;
+    memcpy(header, bytes, sizeof(ChunkedHeader));
+    uint32_t chunkSize = NSSwapBigIntToHost(header->chunkSize);
+    if (chunkSize == 0 || chunkSize % kBlockSize != 0)
+        return 0;
+    return chunkSize;
+}
+
+
+// Computes the decrypted length and number of chunks, given the encrypted length.
+static BOOL getChunkedLayout(uint64_t encryptedLength, uint32_t chunkSize,
+                             uint64_t* outLength, uint64_t* outChunkCount)
+{
+    if (encryptedLength < sizeof(ChunkedHeader) + kChunkTagSize)
+        return NO;
+    uint64_t payload = encryptedLength - sizeof(ChunkedHeader);
+    uint64_t recordSize = chunkSize + kChunkTagSize;
+    uint64_t fullChunks = payload / recordSize, rest = payload % recordSize;
+    if (rest < kChunkTagSize)
+        return NO;      // last chunk is missing or truncated
+    *outLength = fullChunks * chunkSize + (rest - kChunkTagSize);
+    *outChunkCount = fullChunks + 1;
+    return YES;
+}
+
+
+// AES-CTR encryption and decryption are the same operation.
+static BOOL cryptChunk(const ChunkKeys* keys, const ChunkedHeader* header,
+                       uint64_t chunkIndex, uint32_t chunkSize,
+                       const void* src, size_t length, void* dst)
+{
+    uint8_t counter[kBlockSize];
+    memcpy(counter, header->nonce, sizeof(header->nonce));
+    uint64_t block = NSSwapHostLongLongToBig(chunkIndex * (chunkSize / kBlockSize));
+    memcpy(counter + sizeof(header->nonce), &block, sizeof(block));
+    CCCryptorRef cryptor;
+    if (CCCryptorCreateWithMode(kCCEncrypt, kCCModeCTR, kAlgorithm, ccNoPadding,
+                                counter, keys->cipherKey, kKeySize, NULL, 0, 0,
+                                kCCModeOptionCTR_BE, &cryptor) != kCCSuccess)
+        return NO;
+    size_t bytesWritten;
+    BOOL ok = CCCryptorUpdate(cryptor, src, length, dst, length, &bytesWritten) == kCCSuccess
+           && bytesWritten == length;
+    CCCryptorRelease(cryptor);
+    return ok;
+}
+
+
+static void computeChunkTag(const ChunkKeys* keys, const ChunkedHeader* header,
+                            uint64_t chunkIndex, BOOL isLast,
+                            const void* ciphertext, size_t length, uint8_t tag[kChunkTagSize])
+{
+    CCHmacContext ctx;
+    CCHmacInit(&ctx, kCCHmacAlgSHA256, keys->macKey, sizeof(keys->macKey));
+    CCHmacUpdate(&ctx, header, sizeof(ChunkedHeader));
+    uint64_t index = NSSwapHostLongLongToBig(chunkIndex);
+    CCHmacUpdate(&ctx, &index, sizeof(index));
+    uint8_t last = isLast;
+    CCHmacUpdate(&ctx, &last, sizeof(last));
+    CCHmacUpdate(&ctx, ciphertext, length);
+    uint8_t digest[CC_SHA256_DIGEST_LENGTH];
+    CCHmacFinal(&ctx, digest);
+    memcpy(tag, digest, kChunkTagSize);
+}
+
+
+// Encrypts a chunk and appends it (and its tag) to `output`.
+static BOOL appendEncryptedChunk(NSMutableData* output, const ChunkKeys* keys,
+                                 const ChunkedHeader* header, uint32_t chunkSize,
+                                 uint64_t chunkIndex, BOOL isLast,
+                                 const void* plaintext, size_t length)
+{
+    size_t start = output.length;
+    [output increaseLengthBy: length + kChunkTagSize];
+    uint8_t* dst = (uint8_t*)output.mutableBytes + start;
+    if (!cryptChunk(keys, header, chunkIndex, chunkSize, plaintext, length, dst))
+        return NO;
+    computeChunkTag(keys, header, chunkIndex, isLast, dst, length, dst + length);
+    return YES;
+}
+
+
+// Authenticates and decrypts one chunk. `record` is the ciphertext followed by the tag.
+static BOOL decryptChunk(const ChunkKeys* keys, const ChunkedHeader* header, uint32_t chunkSize,
+                         uint64_t chunkIndex, BOOL isLast,
+                         const uint8_t* record, size_t recordLength, void* dst)
+{
+    if (recordLength < kChunkTagSize)
+        return NO;
+    size_t length = recordLength - kChunkTagSize;
+    uint8_t tag[kChunkTagSize];
+    computeChunkTag(keys, header, chunkIndex, isLast, record, length, tag);
+    uint8_t diff = 0;   // constant-time comparison
+    for (size_t i = 0; i < kChunkTagSize; ++i)
+        diff |= tag[i] ^ record[length + i];
+    if (diff != 0)
+        return NO;
+    return cryptChunk(keys, header, chunkIndex, chunkSize, record, length, dst);
+}
+
+
++ (BOOL) isChunkedFormat: (NSData*)encryptedData {
+    return encryptedData.length >= kChunkedMagicSize
+        && memcmp(encryptedData.bytes, kChunkedMagic, kChunkedMagicSize) == 0;
+}
+
+
+- (CBLCryptorBlock) createChunkedEncryptor {
+    ChunkedHeader header = {};
+    memcpy(header.magic, kChunkedMagic, kChunkedMagicSize);
+    if (SecRandomCopyBytes(kSecRandomDefault, sizeof(header.nonce), header.nonce) != 0)
+        return nil;
+    header.chunkSize = NSSwapHostIntToBig(kDefaultChunkSize);
+    ChunkKeys keys;
+    deriveChunkKeys(_keyData, &keys);
+
+    // Only the final chunk, written at EOF, can be partial; so at most one chunk is buffered.
+    NSMutableData* pending = [NSMutableData dataWithCapacity: kDefaultChunkSize];
+    __block uint64_t chunkIndex = 0;
+    __block BOOL wroteHeader = NO;
+
+    return ^NSMutableData*(NSData* input) {
+        NSMutableData* output = [NSMutableData dataWithCapacity: input.length + kDefaultChunkSize];
+        if (!wroteHeader) {
+            [output appendBytes: &header length: sizeof(header)];
+            wroteHeader = YES;
+        }
+        const uint8_t* src = input.bytes;
+        size_t srcLength = input.length;
+        while (srcLength > 0) {
+            size_t n = MIN(srcLength, kDefaultChunkSize - pending.length);
+            if (n == kDefaultChunkSize) {
+                // Encrypt a whole chunk directly from the input:
+                if (!appendEncryptedChunk(output, &keys, &header, kDefaultChunkSize,
+                                          chunkIndex++, NO, src, n))
+                    return nil;
+            } else {
+                [pending appendBytes: src length: n];
+                if (pending.length == kDefaultChunkSize) {
+                    if (!appendEncryptedChunk(output, &keys, &header, kDefaultChunkSize,
+                                              chunkIndex++, NO, pending.bytes, pending.length))
+                        return nil;
+                    pending.length = 0;
+                }
+            }
+            src += n;
+            srcLength -= n;
+        }
+        if (!input) {
+            if (!appendEncryptedChunk(output, &keys, &header, kDefaultChunkSize,
+                                      chunkIndex++, YES, pending.bytes, pending.length))
+                return nil;
+            pending.length = 0;
+        }
+        return output;
+    };
+}
+
+
+- (NSData*) encryptDataInChunks: (NSData*)data {
+    CBLCryptorBlock cryptor = [self createChunkedEncryptor];
+    if (!cryptor)
+        return nil;
+    NSMutableData* encrypted = cryptor(data);
+    NSMutableData* trailer = cryptor(nil);
+    if (!encrypted || !trailer)
+        return nil;
+    [encrypted appendData: trailer];
+    return encrypted;
+}
+
+
+- (NSData*) decryptChunkedData: (NSData*)encryptedData {
+    ChunkedHeader header;
+    uint32_t chunkSize = readChunkedHeader(encryptedData.bytes, encryptedData.length, &header);
+    uint64_t length, chunkCount;
+    if (!chunkSize || !getChunkedLayout(encryptedData.length, chunkSize, &length, &chunkCount))
+        return nil;
+    ChunkKeys keys;
+    deriveChunkKeys(_keyData, &keys);
+    NSMutableData* decrypted = [NSMutableData dataWithLength: (NSUInteger)length];
+    const uint8_t* src = (const uint8_t*)encryptedData.bytes + sizeof(ChunkedHeader);
+    uint8_t* dst = decrypted.mutableBytes;
+    for (uint64_t i = 0; i < chunkCount; ++i) {
+        BOOL isLast = (i == chunkCount - 1);
+        size_t n = isLast ? (size_t)(length - i * chunkSize) : chunkSize;
+        if (!decryptChunk(&keys, &header, chunkSize, i, isLast, src, n + kChunkTagSize, dst))
+            return nil;
+        src += n + kChunkTagSize;
+        dst += n;
+    }
+    return decrypted;
+}
+
+
+// Reads up to `len` bytes, stopping early only at EOF. Returns the number read, or -1 on error.
+static NSInteger readUpTo(NSInputStream* in, void* dst, size_t len) {
+    size_t bytesRead = 0;
+    while (bytesRead < len) {
+        NSInteger n = [in read: (uint8_t*)dst + bytesRead maxLength: (len - bytesRead)];
+        if (n < 0)
+            return -1;
+        else if (n == 0)
+            break;
+        bytesRead += n;
+    }
+    return bytesRead;
+}
+
+
+// Called by decryptStreamSync after it's read the first 16 bytes of the header.
+static BOOL decryptChunkedStreamSync(NSInputStream* encryptedStream, NSOutputStream *writer,
+                                     const uint8_t* headerStart, NSData* keyData)
+{
+    uint8_t headerBuf[sizeof(ChunkedHeader)];
+    memcpy(headerBuf, headerStart, kIVSize);
+    if (!readFully(encryptedStream, headerBuf + kIVSize, sizeof(headerBuf) - kIVSize))
+        return NO;
+    ChunkedHeader header;
+    uint32_t chunkSize = readChunkedHeader(headerBuf, sizeof(headerBuf), &header);
+    if (!chunkSize)
+        return NO;
+    ChunkKeys keys;
+    deriveChunkKeys(keyData, &keys);
+
+    // A full-size record can't be the last one, since the last chunk is always partial.
+    size_t recordSize = chunkSize + kChunkTagSize;
+    NSMutableData* record = [NSMutableData dataWithLength: recordSize];
+    NSMutableData* plaintext = [NSMutableData dataWithLength: chunkSize];
+    for (uint64_t i = 0; ; ++i) {
+        NSInteger n = readUpTo(encryptedStream, record.mutableBytes, recordSize);
+        if (n < kChunkTagSize)
+            return NO;
+        BOOL isLast = (n < (NSInteger)recordSize);
+        if (!decryptChunk(&keys, &header, chunkSize, i, isLast,
+                          record.bytes, n, plaintext.mutableBytes))
+            return NO;
+        if (!writeFully(writer, plaintext.bytes, n - kChunkTagSize))
+            return NO;
+        if (isLast)
+            return YES;
+    }
+}
+
+
+- (NSData<CBLDecryptedData>*) decryptedContentsOfFile: (NSString*)path {
+    ChunkKeys keys;
+    deriveChunkKeys(_keyData, &keys);
+    return [[CBLChunkedFileData alloc] initWithPath: path keys: &keys];
+}
+
+
+@end
+
+
+
+/** Read-only NSData whose contents are decrypted from a file in chunked format on demand, so
+    reading a range only decrypts the chunks that overlap it. */
+@implementation CBLChunkedFileData
+{
+    NSString* _path;
+    int _fd;
+    ChunkKeys _keys;
+    ChunkedHeader _header;
+    uint32_t _chunkSize;
+    uint64_t _length, _chunkCount;
+    NSData* _allBytes;
+}
+
+
+- (instancetype) initWithPath: (NSString*)path keys: (const ChunkKeys*)keys {
+    self = [super init];
+    if (self) {
+        _path = [path copy];
+        _keys = *keys;
+        _fd = open(path.fileSystemRepresentation, O_RDONLY);
+        if (_fd < 0)
+            return nil;
+        uint8_t headerBuf[sizeof(ChunkedHeader)];
+        struct stat st;
+        if (pread(_fd, headerBuf, sizeof(headerBuf), 0) != sizeof(headerBuf)
+                || fstat(_fd, &st) != 0)
+            return nil;
+        _chunkSize = readChunkedHeader(headerBuf, sizeof(headerBuf), &_header);
+        if (!_chunkSize || !getChunkedLayout(st.st_size, _chunkSize, &_length, &_chunkCount))
+            return nil;     // not in chunked format (or truncated)
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    if (_fd >= 0)
+        close(_fd);
+}
+
+
+- (id) copyWithZone: (NSZone*)zone {
+    return self;    // immutable
+}
+
+
+- (NSUInteger) length {
+    return (NSUInteger)_length;
+}
+
+
+- (const void*) bytes {
+    if (!_allBytes)
+        _allBytes = [self subdataWithRange: NSMakeRange(0, (NSUInteger)_length)];
+    return _allBytes.bytes;
+}
+
+
+- (void) getBytes: (void*)buffer length: (NSUInteger)length {
+    [self getBytes: buffer range: NSMakeRange(0, MIN(length, (NSUInteger)_length))];
+}
+
+
+- (void) getBytes: (void*)buffer range: (NSRange)range {
+    if (NSMaxRange(range) > _length)
+        [NSException raise: NSRangeException format: @"Range %@ exceeds length %llu",
+                                                     NSStringFromRange(range), _length];
+    if (![self getBytes: buffer range: range error: NULL])
+        [NSException raise: NSFileHandleOperationException
+                    format: @"CBLChunkedFileData: Encrypted file %@ is unreadable or corrupt",
+                            _path];
+}
+
+
+// Copies a range of the decrypted contents, decrypting only the chunks it overlaps.
+// Returns NO if a chunk can't be read or fails authentication.
+- (BOOL) getBytes: (void*)buffer range: (NSRange)range error: (NSError**)outError {
+    if (range.length == 0)
+        return YES;
+    if (_allBytes) {
+        [_allBytes getBytes: buffer range: range];
+        return YES;
+    }
+    uint8_t* dst = buffer;
+    NSMutableData* record = [NSMutableData dataWithLength: _chunkSize + kChunkTagSize];
+    NSMutableData* plaintext = [NSMutableData dataWithLength: _chunkSize];
+    uint64_t first = range.location / _chunkSize, last = (NSMaxRange(range) - 1) / _chunkSize;
+    for (uint64_t i = first; i <= last; ++i) {
+        BOOL isLast = (i == _chunkCount - 1);
+        size_t chunkLength = isLast ? (size_t)(_length - i * _chunkSize) : _chunkSize;
+        off_t offset = sizeof(ChunkedHeader) + i * (_chunkSize + kChunkTagSize);
+        size_t recordLength = chunkLength + kChunkTagSize;
+        if (pread(_fd, record.mutableBytes, recordLength, offset) != (ssize_t)recordLength
+                || !decryptChunk(&_keys, &_header, _chunkSize, i, isLast,
+                                 record.bytes, recordLength, plaintext.mutableBytes)) {
+            if (outError)
+                *outError = [NSError errorWithDomain: NSCocoaErrorDomain
+                                                code: NSFileReadCorruptFileError
+                                            userInfo: @{NSFilePathErrorKey: _path}];
+            return NO;
+        }
+        // Copy the part of the chunk that's within the range:
+        uint64_t chunkStart = i * _chunkSize;
+        uint64_t from = MAX(chunkStart, range.location);
+        uint64_t to = MIN(chunkStart + chunkLength, NSMaxRange(range));
+        memcpy(dst, (const uint8_t*)plaintext.bytes + (from - chunkStart), (size_t)(to - from));
+        dst += to - from;
+    }
+    return YES;
+}
+
+
+- (NSData*) decryptedDataInRange: (NSRange)range error: (NSError**)outError {
+    if (NSMaxRange(range) > _length) {
+        if (outError)
+            *outError = [NSError errorWithDomain: NSCocoaErrorDomain code: NSFileReadUnknownError
+                                        userInfo: @{NSFilePathErrorKey: _path}];
+        return nil;
+    }
+    NSMutableData* data = [NSMutableData dataWithLength: range.length];
+    if (![self getBytes: data.mutableBytes range: range error: outError])
+        return nil;
+    return data;
+}
+
+
+- (NSData*) subdataWithRange: (NSRange)range {
+    NSMutableData* data = [NSMutableData dataWithLength: range.length];
+    [self getBytes: data.mutableBytes range: range];
+    return data;
+}
+
+
 @end
@@ -7,6 +7,7 @@
 //
 
 #import "CBLSyncConnection_Internal.h"
+#import "CBL_Attachment.h"
 #import "CBL_BlobStoreWriter.h"
 #import "CBL_Body.h"
 #import "MYBuffer.h"
@@ -259,6 +260,7 @@ UsingLogDomain(Sync);
     //FIX: Calling CBL stuff on the wrong queue. But the BlobStoreWriter doesn't care what queue
     // it's called on as long as it's not re-entrant. (Except for -install, but we don't call that)
     CBL_BlobStoreWriter* writer = [_db attachmentWriter];
+    writer.computesMD5 = NO;    // the attachment is identified by its SHA-1 digest
 
     BLIPRequest* request = [_connection request];
     request.profile = @"getAttachment";
@@ -428,38 +430,14 @@ static BOOL ItsBeenAtLeast(NSTimeInterval minInterval, CFAbsoluteTime* time) {
 }
 
 
-//NOTE: This comes from CBL_Attachment.m in the feature/deltas branch.
 static BOOL ShouldCompressAttachment(NSString* name, NSDictionary* metadata) {
     if (metadata[@"encoding"] != nil)
         return NO;
     NSNumber* length = $castIf(NSNumber, metadata[@"length"]);
     if (length && length.unsignedLongLongValue < kMinLengthToCompress)
         return NO;
-
-    NSString* contentType = metadata[@"content_type"];
-
-    static NSSet* sCompressibleExtensions;
-    static NSArray* sCompressibleSubtypes;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        sCompressibleExtensions = [NSSet setWithObjects: @"txt", @"rtf", @"html", @"htm", @"xml",
-                                   @"json", @"yaml", @"yml", @"csv", @"tex", @"svg", @"plist", @"pdf", nil];
-        sCompressibleSubtypes = @[@"json", @"xml", @"html", @"yaml", @"pdf"];
-    });
-
-    // Filename extensions that indicate compressible data:
-    if ([sCompressibleExtensions containsObject: name.pathExtension.lowercaseString])
-        return YES;
-    // Any textual MIME type is compressible:
-    if ([contentType hasPrefix: @"text/"])
-        return YES;
-    // Look for types like "application/json" or "application/rss+xml":
-    if ([contentType hasPrefix: @"application/"])
-        for (NSString* subtype in sCompressibleSubtypes)
-            if ([contentType rangeOfString: subtype].length > 0)
-                return YES;
-
-    return NO; // Be conservative, default to storing as-is
+    return [CBL_Attachment isCompressibleName: name
+                                  contentType: $castIf(NSString, metadata[@"content_type"])];
 }
 
 
@@ -80,9 +80,15 @@ BOOL CBLQueryRowValueIsEntireDoc(id value);
 @end
 
 
+typedef CBLQueryRow* (^CBLQueryRowGenerator)(void);
+
 @interface CBLQueryEnumerator ()
 - (instancetype) initWithSequenceNumber: (SequenceNumber)sequenceNumber
                                    rows: (NSArray*)rows;
+/** Initializes an enumerator that produces its rows one at a time by calling the generator block,
+    which returns nil at the end, instead of from an array. */
+- (instancetype) initWithSequenceNumber: (SequenceNumber)sequenceNumber
+                           rowGenerator: (CBLQueryRowGenerator)generator;
 - (instancetype) initWithDatabase: (CBLDatabase*)database
                              view: (CBLView*)view
                    sequenceNumber: (SequenceNumber)sequenceNumber
@@ -24,6 +24,9 @@
 
 + (bool) digest: (NSString*)digest toBlobKey: (CBLBlobKey*)outKey;
 
+/** Guesses from an attachment's filename extension and MIME type whether gzip will shrink it. */
++ (BOOL) isCompressibleName: (NSString*)name contentType: (NSString*)contentType;
+
 - (instancetype) initWithName: (NSString*)name contentType: (NSString*)contentType;
 
 - (instancetype) initWithName: (NSString*)name
@@ -41,7 +44,9 @@
 @property (readonly, nonatomic) BOOL hasContent;
 @property (readonly, nonatomic) NSData* encodedContent;  // only if inline or stored in db blob-store
 @property (readonly, nonatomic) NSData* content;
-@property (readonly, nonatomic) NSURL* contentURL; // only if already stored in db blob-store
+@property (readonly, nonatomic) NSURL* contentURL; // only if stored unencoded in db blob-store
+@property (readonly, nonatomic) NSURL* encodedContentURL; // only if stored as a plain file
+@property (readonly, nonatomic) NSData* mappedEncodedContent; // only if in db blob-store
 
 @property (readonly) BOOL hasBlobKey;
 @property (readonly) BOOL isValid;
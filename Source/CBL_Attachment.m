@@ -47,6 +47,32 @@ static NSString* blobKeyToDigest(CBLBlobKey key) {
 }
 
 
++ (BOOL) isCompressibleName: (NSString*)name contentType: (NSString*)contentType {
+    static NSSet* sCompressibleExtensions;
+    static NSArray* sCompressibleSubtypes;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sCompressibleExtensions = [NSSet setWithObjects: @"txt", @"rtf", @"html", @"htm", @"xml",
+                                   @"json", @"yaml", @"yml", @"csv", @"tex", @"svg", @"plist", @"pdf", nil];
+        sCompressibleSubtypes = @[@"json", @"xml", @"html", @"yaml", @"pdf"];
+    });
+
+    // Filename extensions that indicate compressible data:
+    if ([sCompressibleExtensions containsObject: name.pathExtension.lowercaseString])
+        return YES;
+    // Any textual MIME type is compressible:
+    if ([contentType hasPrefix: @"text/"])
+        return YES;
+    // Look for types like "application/json" or "application/rss+xml":
+    if ([contentType hasPrefix: @"application/"])
+        for (NSString* subtype in sCompressibleSubtypes)
+            if ([contentType rangeOfString: subtype].length > 0)
+                return YES;
+
+    return NO; // Be conservative, default to storing as-is
+}
+
+
 - (instancetype) initWithName: (NSString*)name contentType: (NSString*)contentType {
     Assert(name);
     self = [super init];
@@ -222,6 +248,15 @@ static NSString* blobKeyToDigest(CBLBlobKey key) {
 }
 
 
+// Memory-mapped (or decrypted on demand), so serving it, or a byte range of it, doesn't read the
+// whole file into RAM.
+- (NSData*) mappedEncodedContent {
+    if (_data)
+        return nil;
+    return [_database.attachmentStore mappedBlobForKey: _blobKey];
+}
+
+
 - (NSData*) content {
     NSData* data = self.encodedContent;
     if (data) {
@@ -256,6 +291,16 @@ static NSString* blobKeyToDigest(CBLBlobKey key) {
 
 
 - (NSURL*) contentURL {
+    if (encoding != kCBLAttachmentEncodingNone)
+        return nil;     // the file holds the encoded data, which the caller doesn't expect
+    return self.encodedContentURL;
+}
+
+
+// The blob's file, if the blob store keeps it as-is (not packed, chunked or encrypted.)
+- (NSURL*) encodedContentURL {
+    if (_data)
+        return nil;
     NSString* path = [_database.attachmentStore blobPathForKey: _blobKey];
     if (!path || ![[NSFileManager defaultManager] fileExistsAtPath: path isDirectory: NULL])
         return nil;
@@ -9,13 +9,54 @@
 #import "CBL_BlobStore.h"
 
 
-// Name of file in blob-store dir that records encryption type used (currently "AES")
+// Name of file in blob-store dir that records encryption type used: "AES-chunked" once new blobs
+// are written in the chunked format, or "AES" if every blob is still in the original format
 #define kEncryptionMarkerFilename @"_encryption"
 
+// Name of file in blob-store dir that records a non-flat layout (currently "sharded")
+#define kLayoutMarkerFilename @"_layout"
+
+// Name of file in blob-store dir that caches the blob count & total size while it's closed
+#define kSummaryFilename @"_summary"
+
+// Name of subdirectory of blob-store dir that holds pack files of small blobs
+#define kPackDirName @"_packs"
+
+// Default value of maxPackedBlobLength when packing is enabled
+#define kDefaultMaxPackedBlobLength (4*1024)
+
+// Name of subdirectory of blob-store dir that holds the chunks (and manifests) of chunked blobs
+#define kChunkDirName @"_chunks"
+
+// Default value of minChunkedBlobLength when chunking is enabled
+#define kDefaultMinChunkedBlobLength (1024*1024)
+
+// Default values of maxCachedBlobLength and blobCacheCapacity
+#define kDefaultMaxCachedBlobLength (16*1024)
+#define kDefaultBlobCacheCapacity (1024*1024)
+
 
 @interface CBL_BlobStore ()
 
 - (NSString*) rawPathForKey: (CBLBlobKey)key;
+- (BOOL) installFileAtPath: (NSString*)tempPath forKey: (CBLBlobKey)key;
+- (BOOL) directoryReplaced: (NSError**)outError;   // call after moving a new dir into place
+@property (readonly) BOOL isMigrating;              // are files being moved to a new layout?
+
+/** Blobs up to this length are appended to shared pack files instead of being stored in files of
+    their own. Packed blobs are always readable; this only affects new blobs. Default is 0 (off). */
+@property UInt32 maxPackedBlobLength;
+
+/** Blobs at least this long are split into content-defined chunks, each stored only once, so
+    blobs with mostly the same contents share storage. Chunked blobs are always readable; this only
+    affects new blobs. Default is 0 (off). */
+@property UInt64 minChunkedBlobLength;
+
+/** Blobs up to this length are kept in an in-memory LRU cache after they're read, which holds up to
+    blobCacheCapacity bytes in all. The cache is shared by all instances on the same directory.
+    Setting either to 0 disables caching. */
+@property UInt32 maxCachedBlobLength;
+@property UInt64 blobCacheCapacity;
 @property (readonly, nonatomic) NSString* tempDir;
 @property (readonly) CBLSymmetricKey* encryptionKey;
 
@@ -23,3 +64,9 @@
 - (BOOL) markEncrypted: (BOOL)encrypted error: (NSError**)outError; // exposed for testing ONLY
 #endif
 @end
+
+
+#if DEBUG
+// For testing ONLY: if set, a rekey fails to copy any blob file for which this returns NO.
+extern BOOL (^CBLBlobStoreRekeyFileFilter)(NSString* path);
+#endif
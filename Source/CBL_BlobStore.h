@@ -15,7 +15,7 @@
 #import <CommonCrypto/CommonDigest.h>
 #endif
 
-@class CBLSymmetricKey, MYAction;
+@class CBLSymmetricKey, CBLProgressGroup, MYAction;
 
 
 /** Key identifying a data blob. This happens to be a SHA-1 digest. */
@@ -24,6 +24,13 @@ typedef struct CBLBlobKey {
 } CBLBlobKey;
 
 
+/** How blob files are arranged in the store's directory. */
+typedef enum {
+    kCBLBlobStoreFlat,      // All files in one directory ("ABCD...EF.blob")
+    kCBLBlobStoreSharded,   // Two levels of subdirectories ("AB/CD/ABCD...EF.blob")
+} CBLBlobStoreLayout;
+
+
 /** A persistent content-addressable store for arbitrary-size data blobs.
     Each blob is stored as a file named by its SHA-1 digest. */
 @interface CBL_BlobStore : NSObject
@@ -32,6 +39,33 @@ typedef struct CBLBlobKey {
                 encryptionKey: (CBLSymmetricKey*)encryptionKey
                         error: (NSError**)outError;
 
+/** Opens or creates a store. If `layout` is kCBLBlobStoreSharded and an existing store is flat,
+    its files are moved into shard directories in the background; they remain readable meanwhile.
+    (An existing sharded store is never implicitly flattened; use -changeLayout:error:.) */
+- (instancetype) initWithPath: (NSString*)dir
+                encryptionKey: (CBLSymmetricKey*)encryptionKey
+                       layout: (CBLBlobStoreLayout)layout
+                        error: (NSError**)outError;
+
+/** Opens or creates a store. If `readOnly` is YES, an existing store is left as it is on disk:
+    its encryption marker isn't upgraded, an unencrypted store isn't encrypted with the key, and
+    its layout isn't changed or migrated. */
+- (instancetype) initWithPath: (NSString*)dir
+                encryptionKey: (CBLSymmetricKey*)encryptionKey
+                       layout: (CBLBlobStoreLayout)layout
+                     readOnly: (BOOL)readOnly
+                        error: (NSError**)outError;
+
+/** Saves the blob count & size summary if this is the last open instance on the directory.
+    Called automatically on dealloc. */
+- (void) close;
+
+@property (readonly) CBLBlobStoreLayout layout;
+
+/** Synchronously moves all blob files into the given layout. */
+- (BOOL) changeLayout: (CBLBlobStoreLayout)layout
+                error: (NSError**)outError;
+
 /** Changes the encryption key. This will rewrite every blob to a new directory
     and then replace the current directory with it. */
 - (BOOL) changeEncryptionKey: (CBLSymmetricKey*)newKey
@@ -39,28 +73,76 @@ typedef struct CBLBlobKey {
 
 - (MYAction*) actionToChangeEncryptionKey: (CBLSymmetricKey*)newKey;
 
+/** Blobs are re-encrypted on several threads, and `progress` (if non-nil) is updated with the
+    number of bytes processed. If the action is interrupted, running it again with the same new
+    key resumes where it left off. */
+- (MYAction*) actionToChangeEncryptionKey: (CBLSymmetricKey*)newKey
+                                 progress: (CBLProgressGroup*)progress;
+
 - (BOOL) hasBlobForKey: (CBLBlobKey)key;
 - (NSData*) blobForKey: (CBLBlobKey)key;
 - (uint64_t) lengthOfBlobForKey: (CBLBlobKey)key;
 - (NSInputStream*) blobInputStreamForKey: (CBLBlobKey)key
                                   length: (UInt64*)outLength;
 
-/** Path to file storing the blob. Returns nil if the blob is encrypted. */
+/** Path to file storing the blob. Returns nil if the blob is encrypted, or is stored in a
+    pack file instead of a file of its own. */
 - (NSString*) blobPathForKey: (CBLBlobKey)key;
 
+/** The blob's contents memory-mapped from its file, so that only the pages actually read get
+    loaded into RAM. If the store is encrypted, the data is instead decrypted a chunk at a time as
+    it's accessed. Returns nil if the blob doesn't exist, is encrypted in the original
+    (non-chunked) format, or is split into content-defined chunks. */
+- (NSData*) mappedBlobForKey: (CBLBlobKey)key;
+
 - (BOOL) storeBlob: (NSData*)blob
        creatingKey: (CBLBlobKey*)outKey;
 
 - (BOOL) deleteBlobForKey: (CBLBlobKey)key;
 
 @property (readonly) NSString* path;
-@property (readonly) NSUInteger count;
+@property (readonly) NSUInteger count;           // cheap; doesn't scan the directory
 @property (readonly) NSArray* allKeys;
-@property (readonly) UInt64 totalDataSize;
+@property (readonly) UInt64 totalDataSize;       // cheap; doesn't scan the directory
 
+/** Small blobs are cached in memory after they're read. These count the reads that did and didn't
+    find the blob in the cache, since the directory was opened. Reads of blobs too big to cache,
+    or that don't exist, count as neither. */
+@property (readonly) UInt64 cacheHits, cacheMisses;
+
+/** Empties the in-memory cache of small blobs. */
+- (void) lowMemoryWarning;
+
+/** Deletes every blob the predicate returns NO for, then calls -compactStorage:. */
 - (NSInteger) deleteBlobsExceptMatching: (BOOL(^)(CBLBlobKey))predicate
                                   error: (NSError**)outError;
 
+/** Reclaims space left behind by deleted blobs: rewrites pack files that have dead records, and
+    deletes chunks that no longer belong to any chunked blob. */
+- (BOOL) compactStorage: (NSError**)outError;
+
+// Chunked blobs. These let a blob be transferred by sending only the chunks the recipient lacks:
+// the sender calls -chunkKeysForKey:, the recipient calls -missingChunkKeys: and stores the chunks
+// it gets with -storeChunk:creatingKey:, then assembles the blob with -storeBlobForKey:fromChunks:.
+// Chunks stored that way aren't deleted by -compactStorage: until they've been assembled (or the
+// store is closed.)
+
+/** If the blob is split into chunks, returns their keys (as NSData) in order; otherwise nil. */
+- (NSArray*) chunkKeysForKey: (CBLBlobKey)key;
+
+/** Returns those of the given chunk keys (NSData) whose chunks aren't in the store. */
+- (NSArray*) missingChunkKeys: (NSArray*)chunkKeys;
+
+- (NSData*) chunkForKey: (CBLBlobKey)key;
+- (BOOL) storeChunk: (NSData*)chunk
+        creatingKey: (CBLBlobKey*)outKey;
+
+/** Adds a blob consisting of the given chunks, which must already be in the store. Fails if any
+    are missing, or if their concatenation doesn't match `key`. */
+- (BOOL) storeBlobForKey: (CBLBlobKey)key
+              fromChunks: (NSArray*)chunkKeys
+                   error: (NSError**)outError;
+
 + (CBLBlobKey) keyForBlob: (NSData*)blob;
 + (NSData*) keyDataForBlob: (NSData*)blob;
 
@@ -16,12 +16,15 @@
 #import "CBL_BlobStore.h"
 #import "CBL_BlobStore+Internal.h"
 #import "CBL_BlobStoreWriter.h"
+#import "CBLProgressGroup.h"
 #import "CBLSymmetricKey.h"
 #import "CBLBase64.h"
 #import "CBLMisc.h"
 #import "CBLStatus.h"
+#import "CBLJSON.h"
 #import "MYAction.h"
 #import <ctype.h>
+#import <stdatomic.h>
 
 
 UsingLogDomain(Database);
@@ -34,16 +37,349 @@ UsingLogDomain(Database);
 
 #define kFileExtension "blob"
 
-#define kEncryptionAlgorithm @"AES"
+#define kEncryptionAlgorithm @"AES-chunked"     // new blobs are in the chunked format
+#define kLegacyEncryptionAlgorithm @"AES"       // all blobs were in the original format
+
+#define kShardedLayoutName @"sharded"
+
+#define kPackFileExtension @"pack"
+#define kMaxPackFileLength (4*1024*1024)    // Start a new pack file after this size
+#define kTombstoneLength UINT32_MAX         // Record length denoting a deleted blob
+
+#define kRekeyDirExtension @"rekey"
+#define kRekeyMarkerFilename @"_rekey"
+#define kMaxConcurrentRekeys 4              // Limits disk I/O more than CPU
+#define kRekeyProgressInterval 0.25
+
+
+#if DEBUG
+BOOL (^CBLBlobStoreRekeyFileFilter)(NSString* path);
+#endif
+
+
+// Header of a record in a pack file; followed by `length` bytes of blob data (encrypted if the
+// store is.) A pack file is nothing but a sequence of records, appended to as blobs are added.
+typedef struct {
+    CBLBlobKey key;
+    uint32_t length;        // big-endian
+} __attribute__((packed)) CBLPackRecordHeader;
+
+
+/** Location of a blob that's stored in a pack file. */
+@interface CBLPackedBlob : NSObject
+{
+    @public
+    unsigned pack;
+    UInt64 offset;
+    UInt32 length;
+}
+@end
+
+@implementation CBLPackedBlob
+@end
+
+
+/** An entry in the cache of recently read small blobs; also a node in its LRU list. */
+@interface CBLCachedBlob : NSObject
+{
+    @public
+    NSData* keyData;
+    NSData* data;
+    __unsafe_unretained CBLCachedBlob *prev, *next;   // (the cache dictionary retains entries)
+}
+@end
+
+@implementation CBLCachedBlob
+@end
+
+
+/** State shared by all CBL_BlobStore instances open on the same directory (there's one per
+    CBLDatabase instance, and a database may be open on several threads.) */
+@interface CBLBlobStoreState : NSObject
+{
+    @public
+    unsigned openCount;
+    BOOL summaryValid;          // Are blobCount and blobSize up to date?
+    NSUInteger blobCount;
+    UInt64 blobSize;
+    BOOL migrating;             // Are blob files being moved to a different layout?
+    NSMutableDictionary* packIndex; // Maps key (NSData) -> CBLPackedBlob; nil until loaded
+    unsigned lastPack;          // Number of the newest pack file
+    int packFD;                 // Descriptor for appending to pack `lastPack`, or -1
+    UInt64 packFileLength;      // Length of pack file `lastPack`
+    UInt64 livePackBytes, deadPackBytes;
+    NSMutableDictionary* cache; // Maps key (NSData) -> CBLCachedBlob
+    CBLCachedBlob *cacheNewest, *cacheOldest;   // Ends of the LRU list
+    UInt64 cacheBytes;          // Total length of the cached blobs
+    UInt64 cacheHits, cacheMisses;
+    NSCountedSet* pendingChunks; // Chunk keys (NSData) not to be compacted away; also a lock
+}
+@end
+
+@implementation CBLBlobStoreState
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        packFD = -1;
+        pendingChunks = [NSCountedSet new];
+    }
+    return self;
+}
+
+- (void) closePackFile {
+    if (packFD >= 0) {
+        close(packFD);
+        packFD = -1;
+    }
+}
+
+- (void) dealloc {
+    [self closePackFile];
+}
+
+// All the cache methods below must be called while synchronized on the receiver.
+
+- (void) unlinkCachedBlob: (CBLCachedBlob*)entry {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        cacheNewest = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        cacheOldest = entry->prev;
+    entry->prev = entry->next = nil;
+}
+
+- (void) linkCachedBlob: (CBLCachedBlob*)entry {
+    entry->next = cacheNewest;
+    if (cacheNewest)
+        cacheNewest->prev = entry;
+    else
+        cacheOldest = entry;
+    cacheNewest = entry;
+}
+
+// A miss isn't counted here but in -cacheBlob:..., since a blob that's too big to cache doesn't
+// count as a miss.
+- (NSData*) cachedBlobForKey: (NSData*)keyData {
+    CBLCachedBlob* entry = cache[keyData];
+    if (!entry)
+        return nil;
+    ++cacheHits;
+    if (entry != cacheNewest) {
+        [self unlinkCachedBlob: entry];
+        [self linkCachedBlob: entry];
+    }
+    return entry->data;
+}
+
+- (void) uncacheBlobForKey: (NSData*)keyData {
+    CBLCachedBlob* entry = cache[keyData];
+    if (entry) {
+        [self unlinkCachedBlob: entry];
+        cacheBytes -= entry->data.length;
+        [cache removeObjectForKey: keyData];
+    }
+}
+
+// Called after a lookup missed, with the blob that was read instead.
+- (void) cacheBlob: (NSData*)data forKey: (NSData*)keyData capacity: (UInt64)capacity {
+    [self uncacheBlobForKey: keyData];
+    if (data.length > capacity)
+        return;
+    ++cacheMisses;
+    while (cacheBytes + data.length > capacity)
+        [self uncacheBlobForKey: cacheOldest->keyData];
+    CBLCachedBlob* entry = [CBLCachedBlob new];
+    entry->keyData = keyData;
+    entry->data = [data copy];
+    if (!cache)
+        cache = [NSMutableDictionary new];
+    cache[keyData] = entry;
+    [self linkCachedBlob: entry];
+    cacheBytes += entry->data.length;
+}
+
+- (void) clearCache {
+    cache = nil;
+    cacheNewest = cacheOldest = nil;
+    cacheBytes = 0;
+}
+
+@end
+
+
+#ifndef GNUSTEP
+/** Reads a chunked blob, loading each chunk from the chunk store as the reader gets to it. Unlike
+    a bound stream pair fed from another thread, it can report a chunk that's unreadable or fails
+    to decrypt: -read:maxLength: returns -1 and the status becomes NSStreamStatusError. */
+@interface CBLChunkedBlobInputStream : NSInputStream
+- (instancetype) initWithChunkStore: (CBL_BlobStore*)chunkStore
+                          chunkKeys: (NSArray*)chunkKeys
+                            onClose: (void(^)(void))onClose;
+@end
+
+@implementation CBLChunkedBlobInputStream
+{
+    CBL_BlobStore* _chunkStore;
+    NSArray* _chunkKeys;            // keys (NSData) of the chunks, in order
+    NSUInteger _nextChunk;          // index in _chunkKeys of the next chunk to load
+    NSData* _chunk;                 // current chunk
+    NSUInteger _chunkPos;           // number of bytes of _chunk already read
+    void (^_onClose)(void);
+    NSStreamStatus _status;
+    NSError* _error;
+    __weak id<NSStreamDelegate> _delegate;
+    NSRunLoop* _runLoop;
+    NSString* _runLoopMode;
+}
+
+- (instancetype) initWithChunkStore: (CBL_BlobStore*)chunkStore
+                          chunkKeys: (NSArray*)chunkKeys
+                            onClose: (void(^)(void))onClose
+{
+    self = [super init];
+    if (self) {
+        _chunkStore = chunkStore;
+        _chunkKeys = [chunkKeys copy];
+        _onClose = [onClose copy];
+        _status = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    if (_onClose)
+        _onClose();
+}
+
+- (void) open {
+    if (_status != NSStreamStatusNotOpen)
+        return;
+    _status = NSStreamStatusOpen;
+    [self postEvent: NSStreamEventOpenCompleted];
+    [self postEvent: NSStreamEventHasBytesAvailable];
+}
+
+- (void) close {
+    _status = NSStreamStatusClosed;
+    _chunk = nil;
+    if (_onClose) {
+        _onClose();
+        _onClose = nil;
+    }
+}
+
+- (NSInteger) read: (uint8_t*)buffer maxLength: (NSUInteger)maxLength {
+    if (_status == NSStreamStatusError)
+        return -1;
+    if (_status != NSStreamStatusOpen)
+        return 0;
+    NSUInteger bytesRead = 0;
+    while (bytesRead < maxLength) {
+        if (_chunkPos >= _chunk.length) {
+            if (_nextChunk >= _chunkKeys.count) {
+                _status = NSStreamStatusAtEnd;
+                break;
+            }
+            CBLBlobKey key;
+            [_chunkKeys[_nextChunk] getBytes: &key length: sizeof(key)];
+            _chunk = [_chunkStore blobForKey: key];
+            _chunkPos = 0;
+            if (!_chunk) {
+                Warn(@"CBL_BlobStore: Chunk #%lu of a blob is unreadable",
+                     (unsigned long)_nextChunk);
+                _error = [NSError errorWithDomain: NSCocoaErrorDomain
+                                             code: NSFileReadCorruptFileError userInfo: nil];
+                if (bytesRead > 0)
+                    break;      // return what was read; the next call will fail
+                _status = NSStreamStatusError;
+                [self postEvent: NSStreamEventErrorOccurred];
+                return -1;
+            }
+            ++_nextChunk;
+        }
+        NSUInteger n = MIN(maxLength - bytesRead, _chunk.length - _chunkPos);
+        [_chunk getBytes: buffer + bytesRead range: NSMakeRange(_chunkPos, n)];
+        _chunkPos += n;
+        bytesRead += n;
+    }
+    [self postEvent: (_status == NSStreamStatusAtEnd ? NSStreamEventEndEncountered
+                                                     : NSStreamEventHasBytesAvailable)];
+    return bytesRead;
+}
+
+- (BOOL) getBuffer: (uint8_t**)buffer length: (NSUInteger*)length {
+    return NO;
+}
+
+- (BOOL) hasBytesAvailable {
+    return _status == NSStreamStatusOpen;    // a read never blocks
+}
+
+- (NSStreamStatus) streamStatus         {return _status;}
+- (NSError*) streamError                {return _status == NSStreamStatusError ? _error : nil;}
+- (id<NSStreamDelegate>) delegate       {return _delegate;}
+- (void) setDelegate: (id<NSStreamDelegate>)delegate {_delegate = delegate;}
+- (id) propertyForKey: (NSString*)key   {return nil;}
+- (BOOL) setProperty: (id)property forKey: (NSString*)key {return NO;}
+
+- (void) scheduleInRunLoop: (NSRunLoop*)runLoop forMode: (NSString*)mode {
+    _runLoop = runLoop;
+    _runLoopMode = mode;
+    if (_status == NSStreamStatusOpen)
+        [self postEvent: NSStreamEventHasBytesAvailable];
+}
+
+- (void) removeFromRunLoop: (NSRunLoop*)runLoop forMode: (NSString*)mode {
+    if (runLoop == _runLoop && $equal(mode, _runLoopMode))
+        _runLoop = nil;
+}
+
+// Tells the delegate about an event, on the run loop I'm scheduled on (if any).
+- (void) postEvent: (NSStreamEvent)event {
+    NSRunLoop* runLoop = _runLoop;
+    if (!runLoop || !_delegate)
+        return;
+    __weak CBLChunkedBlobInputStream* weakSelf = self;
+    CFRunLoopRef cfRunLoop = runLoop.getCFRunLoop;
+    CFRunLoopPerformBlock(cfRunLoop, (__bridge CFStringRef)_runLoopMode, ^{
+        CBLChunkedBlobInputStream* strongSelf = weakSelf;
+        if (strongSelf && strongSelf->_runLoop)
+            [strongSelf->_delegate stream: strongSelf handleEvent: event];
+    });
+    CFRunLoopWakeUp(cfRunLoop);
+}
+
+@end
+#endif // GNUSTEP
+
+
+static NSMutableDictionary* sStates;   // maps path -> CBLBlobStoreState
+
+
+// Is this the name of a shard subdirectory ("00" through "FF")?
+static BOOL isShardName(NSString* name) {
+    return name.length == 2 && isxdigit([name characterAtIndex: 0])
+                            && isxdigit([name characterAtIndex: 1]);
+}
 
 
 @implementation CBL_BlobStore
 {
     NSString* _tempDir;
+    CBLBlobStoreLayout _layout;
+    CBLBlobStoreState* _state;
+    CBL_BlobStore* _chunkStore;
+    BOOL _readOnly;
 }
 
 
-@synthesize path=_path, encryptionKey=_encryptionKey;
+@synthesize path=_path, encryptionKey=_encryptionKey, layout=_layout;
+@synthesize maxPackedBlobLength=_maxPackedBlobLength, minChunkedBlobLength=_minChunkedBlobLength;
+@synthesize maxCachedBlobLength=_maxCachedBlobLength, blobCacheCapacity=_blobCacheCapacity;
 
 
 // private
@@ -55,68 +391,1075 @@ UsingLogDomain(Database);
     if (self) {
         _path = [dir copy];
         _encryptionKey = encryptionKey;
+        _maxCachedBlobLength = kDefaultMaxCachedBlobLength;
+        _blobCacheCapacity = kDefaultBlobCacheCapacity;
     }
     return self;
 }
 
 
-- (instancetype) initWithPath: (NSString*)dir
-                encryptionKey: (CBLSymmetricKey*)encryptionKey
-                        error: (NSError**)outError
+- (instancetype) initWithPath: (NSString*)dir
+                encryptionKey: (CBLSymmetricKey*)encryptionKey
+                        error: (NSError**)outError
+{
+    return [self initWithPath: dir encryptionKey: encryptionKey
+                       layout: kCBLBlobStoreFlat error: outError];
+}
+
+
+- (instancetype) initWithPath: (NSString*)dir
+                encryptionKey: (CBLSymmetricKey*)encryptionKey
+                       layout: (CBLBlobStoreLayout)layout
+                        error: (NSError**)outError
+{
+    return [self initWithPath: dir encryptionKey: encryptionKey
+                       layout: layout readOnly: NO error: outError];
+}
+
+
+- (instancetype) initWithPath: (NSString*)dir
+                encryptionKey: (CBLSymmetricKey*)encryptionKey
+                       layout: (CBLBlobStoreLayout)layout
+                     readOnly: (BOOL)readOnly
+                        error: (NSError**)outError
+{
+    self = [self initInternalWithPath: dir encryptionKey: encryptionKey];
+    if (self) {
+        _readOnly = readOnly;
+        BOOL isDir;
+        if ([[NSFileManager defaultManager] fileExistsAtPath: dir isDirectory: &isDir] && isDir) {
+            // Existing blob-store.
+            [self openState];
+            if (![self readLayout: outError])
+                return nil;
+            if (![self verifyExistingStore: outError])
+                return nil;
+            if (!readOnly) {
+                if (layout == kCBLBlobStoreSharded && _layout == kCBLBlobStoreFlat) {
+                    if (![self writeLayout: kCBLBlobStoreSharded error: outError])
+                        return nil;
+                }
+                [self resumeMigration];
+            }
+        } else {
+            // New blob store; create directory:
+            if (![[NSFileManager defaultManager] createDirectoryAtPath: dir
+                                           withIntermediateDirectories: NO
+                                                            attributes: nil
+                                                                 error: outError]) {
+                return nil;
+            }
+            [self openState];
+            if (encryptionKey) {
+                if (![self markEncrypted: YES error: outError])  // note it's encrypted
+                    return nil;
+            }
+            if (layout != kCBLBlobStoreFlat) {
+                if (![self writeLayout: layout error: outError])
+                    return nil;
+            }
+            @synchronized(_state) {
+                _state->summaryValid = YES;  // new store is empty
+                _state->blobCount = 0;
+                _state->blobSize = 0;
+            }
+        }
+    }
+    return self;
+}
+
+
+- (BOOL) verifyExistingStore: (NSError**)outError {
+    NSString* markerPath = [_path stringByAppendingPathComponent: kEncryptionMarkerFilename];
+    NSError* error;
+    NSString* encryptionAlg = [NSString stringWithContentsOfFile: markerPath
+                                                 encoding: NSUTF8StringEncoding
+                                                    error: &error];
+    if (encryptionAlg) {
+        // "_encryption" file is present, so make sure we support its format & have a key:
+        if (!_encryptionKey) {
+            Warn(@"Opening encrypted blob-store without providing a key");
+            return CBLStatusToOutNSError(kCBLStatusUnauthorized, outError);
+        } else if ($equal(encryptionAlg, kLegacyEncryptionAlgorithm)) {
+            // Existing blobs are still readable, but new ones will be chunked; update the marker
+            // so older versions of CBL won't try to read them. (If I'm read-only there won't be
+            // any new ones.)
+            if (!_readOnly && ![self markEncrypted: YES error: outError])
+                return NO;
+        } else if (!$equal(encryptionAlg, kEncryptionAlgorithm)) {
+            Warn(@"Blob-store uses unrecognized encryption '%@'", encryptionAlg);
+            return CBLStatusToOutNSError(kCBLStatusUnauthorized, outError);
+        }
+    } else if (CBLIsFileNotFoundError(error)) {
+        // No "_encryption" file was found, so on-disk store isn't encrypted:
+        CBLSymmetricKey* encryptionKey = _encryptionKey;
+        if (encryptionKey && _readOnly) {
+            // Unencrypted store that I can't fix; just read its files as they are:
+            Warn(@"BlobStore should be encrypted, but is opened read-only");
+            _encryptionKey = nil;
+        } else if (encryptionKey) {
+            // This store was created before the db encryption fix, so its files are not
+            // encrypted, even though they should be. Remedy that:
+            NSLog(@"**** BlobStore should be encrypted; fixing it now...");
+            _encryptionKey = nil;
+            if (![self changeEncryptionKey: encryptionKey error: outError])
+                return NO;
+        }
+    } else {
+        // "_encryption" file was unreadable:
+        if (outError) *outError = error;
+        return NO;
+    }
+    return YES;
+}
+
+
+- (void) dealloc {
+    [self close];
+    if (_tempDir)
+        [[NSFileManager defaultManager] removeItemAtPath: _tempDir error: NULL];
+}
+
+
+#pragma mark - SHARED STATE & SUMMARY:
+
+
+// Registers this instance in sStates, and reads the persistent summary if it's the first.
+// The summary file is deleted while the store is open, so that if the process exits without
+// closing the store, the stale summary won't be trusted next time.
+- (void) openState {
+    NSString* key = _path.stringByStandardizingPath;
+    NSString* summaryPath = [_path stringByAppendingPathComponent: kSummaryFilename];
+    @synchronized([CBL_BlobStore class]) {
+        if (!sStates)
+            sStates = [NSMutableDictionary new];
+        _state = sStates[key];
+        if (!_state) {
+            _state = [CBLBlobStoreState new];
+            sStates[key] = _state;
+            NSData* json = [NSData dataWithContentsOfFile: summaryPath];
+            NSDictionary* summary = json ? $castIf(NSDictionary,
+                            [CBLJSON JSONObjectWithData: json options: 0 error: NULL]) : nil;
+            if (summary[@"count"] && summary[@"size"]) {
+                _state->summaryValid = YES;
+                _state->blobCount = [summary[@"count"] unsignedIntegerValue];
+                _state->blobSize = [summary[@"size"] unsignedLongLongValue];
+            }
+            if (json)
+                [[NSFileManager defaultManager] removeItemAtPath: summaryPath error: NULL];
+        }
+        ++_state->openCount;
+    }
+}
+
+
+- (void) close {
+    [_chunkStore close];
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    _state = nil;
+    @synchronized([CBL_BlobStore class]) {
+        if (--state->openCount > 0)
+            return;
+        [sStates removeObjectForKey: _path.stringByStandardizingPath];
+    }
+    @synchronized(state) {
+        if (state->summaryValid && !state->migrating
+                    && [[NSFileManager defaultManager] fileExistsAtPath: _path]) {
+            NSDictionary* summary = @{@"count": @(state->blobCount),
+                                      @"size": @(state->blobSize)};
+            NSData* json = [CBLJSON dataWithJSONObject: summary options: 0 error: NULL];
+            [json writeToFile: [_path stringByAppendingPathComponent: kSummaryFilename]
+                   atomically: YES];
+        }
+        [state closePackFile];
+    }
+}
+
+
+- (void) noteBlobAdded: (UInt64)size {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    @synchronized(state) {
+        ++state->blobCount;
+        state->blobSize += size;
+    }
+}
+
+
+- (void) noteBlobRemoved: (UInt64)size {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    @synchronized(state) {
+        if (state->blobCount > 0)
+            --state->blobCount;
+        state->blobSize -= MIN(size, state->blobSize);
+    }
+}
+
+
+// Forgets everything cached about the directory's contents; call after it's been replaced.
+- (void) resetState {
+    @synchronized(self) {
+        [_chunkStore resetState];   // so it won't save a stale summary into the new directory
+        [_chunkStore close];
+        _chunkStore = nil;          // will be reopened, with the current key, when needed
+    }
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    @synchronized(state) {
+        state->summaryValid = NO;
+        state->packIndex = nil;
+        [state closePackFile];
+        [state clearCache];
+    }
+}
+
+
+// Makes sure the count and size in _state are valid, scanning the files if necessary.
+- (CBLBlobStoreState*) validSummary {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return nil;
+    @synchronized(state) {
+        if (!state->summaryValid) {
+            LogTo(Database, @"CBL_BlobStore: Scanning %@ to count blobs", _path);
+            __block NSUInteger count = 0;
+            __block UInt64 size = 0;
+            NSFileManager* fmgr = [NSFileManager defaultManager];
+            [self forEachBlob: ^(CBLBlobKey key, NSString* path) {
+                NSDictionary* attrs = [fmgr attributesOfItemAtPath: path error: NULL];
+                if (attrs) {
+                    ++count;
+                    size += attrs.fileSize;
+                }
+            }];
+            NSDictionary* packIndex = [self packIndex: state];
+            count += packIndex.count;
+            count += self.chunkedKeys.count;
+            size += state->livePackBytes;
+            state->blobCount = count;
+            state->blobSize = size;
+            state->summaryValid = YES;
+        }
+    }
+    return state;
+}
+
+
+#pragma mark - BLOB CACHE:
+
+
+// Blobs no longer than maxCachedBlobLength are kept in memory (decrypted) after they're read, in
+// an LRU cache of up to blobCacheCapacity bytes. It's part of the shared state, so all instances
+// on the directory share it. It's only a cache of immutable data, so it's never written back.
+
+
+- (BOOL) cacheEnabled {
+    return _maxCachedBlobLength > 0 && _blobCacheCapacity > 0;
+}
+
+
+// Returns the cached contents of a blob, or nil; counts as a hit or a miss.
+- (NSData*) cachedBlobForKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!state || !self.cacheEnabled)
+        return nil;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    @synchronized(state) {
+        return [state cachedBlobForKey: keyData];
+    }
+}
+
+
+- (void) cacheBlob: (NSData*)blob forKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!blob || !state || !self.cacheEnabled || blob.length > _maxCachedBlobLength)
+        return;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    @synchronized(state) {
+        [state cacheBlob: blob forKey: keyData capacity: _blobCacheCapacity];
+    }
+}
+
+
+- (void) uncacheBlobForKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    @synchronized(state) {
+        [state uncacheBlobForKey: keyData];
+    }
+}
+
+
+- (void) lowMemoryWarning {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    @synchronized(state) {
+        [state clearCache];
+    }
+}
+
+
+- (UInt64) cacheHits {
+    CBLBlobStoreState* state = _state;
+    @synchronized(state) {
+        return state ? state->cacheHits : 0;
+    }
+}
+
+
+- (UInt64) cacheMisses {
+    CBLBlobStoreState* state = _state;
+    @synchronized(state) {
+        return state ? state->cacheMisses : 0;
+    }
+}
+
+
+#pragma mark - PACK FILES:
+
+
+// Blobs no longer than maxPackedBlobLength are appended to pack files in the "_packs"
+// subdirectory instead of getting files of their own, which saves a lot of file-system overhead
+// for small attachments. The index of packed blobs lives in memory, in the shared state, and is
+// rebuilt by scanning the packs the first time it's needed.
+
+
+- (NSString*) packDir {
+    return [_path stringByAppendingPathComponent: kPackDirName];
+}
+
+
+- (NSString*) pathOfPack: (unsigned)pack {
+    return [self.packDir stringByAppendingPathComponent:
+                                    $sprintf(@"%08u.%@", pack, kPackFileExtension)];
+}
+
+
+// Returns the index of packed blobs, loading it if necessary. Call while synchronized on state.
+- (NSMutableDictionary*) packIndex: (CBLBlobStoreState*)state {
+    if (!state->packIndex) {
+        state->packIndex = [NSMutableDictionary new];
+        state->lastPack = 0;
+        state->livePackBytes = state->deadPackBytes = 0;
+        NSArray* names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath: self.packDir
+                                                                             error: NULL];
+        names = [[names pathsMatchingExtensions: @[kPackFileExtension]]
+                                sortedArrayUsingSelector: @selector(compare:)];
+        for (NSString* name in names) {
+            unsigned pack = (unsigned)name.stringByDeletingPathExtension.intValue;
+            if (pack > 0) {
+                [self scanPack: pack into: state];
+                state->lastPack = MAX(state->lastPack, pack);
+            }
+        }
+    }
+    return state->packIndex;
+}
+
+
+// Adds the records of a pack file to the index. Later records supersede earlier ones.
+- (void) scanPack: (unsigned)pack into: (CBLBlobStoreState*)state {
+    NSString* path = [self pathOfPack: pack];
+    NSData* contents = [NSData dataWithContentsOfFile: path options: NSDataReadingMappedIfSafe
+                                                error: NULL];
+    const uint8_t* bytes = contents.bytes;
+    UInt64 pos = 0, length = contents.length;
+    while (pos + sizeof(CBLPackRecordHeader) <= length) {
+        CBLPackRecordHeader header;
+        memcpy(&header, bytes + pos, sizeof(header));
+        UInt32 dataLength = NSSwapBigIntToHost(header.length);
+        UInt64 end = pos + sizeof(header) + (dataLength == kTombstoneLength ? 0 : dataLength);
+        if (end > length)
+            break;
+        NSData* keyData = [NSData dataWithBytes: &header.key length: sizeof(header.key)];
+        CBLPackedBlob* old = state->packIndex[keyData];
+        if (old) {
+            state->livePackBytes -= old->length;
+            state->deadPackBytes += old->length;
+        }
+        if (dataLength == kTombstoneLength) {
+            [state->packIndex removeObjectForKey: keyData];
+        } else {
+            CBLPackedBlob* entry = [CBLPackedBlob new];
+            entry->pack = pack;
+            entry->offset = pos + sizeof(header);
+            entry->length = dataLength;
+            state->packIndex[keyData] = entry;
+            state->livePackBytes += dataLength;
+        }
+        pos = end;
+    }
+    if (pos < length) {
+        // A write was interrupted by a crash; chop off the partial record:
+        Warn(@"CBL_BlobStore: Truncating incomplete record at end of %@", path);
+        truncate(path.fileSystemRepresentation, (off_t)pos);
+    }
+}
+
+
+- (CBLPackedBlob*) packedBlobForKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return nil;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    @synchronized(state) {
+        return [self packIndex: state][keyData];
+    }
+}
+
+
+// Reads the raw (possibly encrypted) data of a packed blob, or returns nil if it isn't packed.
+// The lookup and the read happen under the state lock, so -compactPacks can't move the blob and
+// delete its pack file in between. (Packed blobs are small, so the lock isn't held for long.)
+- (NSData*) readPackedBlobForKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return nil;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    @synchronized(state) {
+        CBLPackedBlob* entry = [self packIndex: state][keyData];
+        if (!entry)
+            return nil;
+        NSString* path = [self pathOfPack: entry->pack];
+        int fd = open(path.fileSystemRepresentation, O_RDONLY);
+        if (fd < 0) {
+            Warn(@"CBL_BlobStore: Can't open %@ (errno %d)", path, errno);
+            return nil;
+        }
+        NSMutableData* data = [NSMutableData dataWithLength: entry->length];
+        ssize_t n = pread(fd, data.mutableBytes, entry->length, (off_t)entry->offset);
+        close(fd);
+        if (n != (ssize_t)entry->length) {
+            Warn(@"CBL_BlobStore: Couldn't read packed blob from %@ (errno %d)", path, errno);
+            return nil;
+        }
+        return data;
+    }
+}
+
+
+// Appends a record to the newest pack file, starting a new one if it's full.
+// Call while synchronized on state. On success returns the offset of the record's data.
+- (BOOL) appendRecord: (CBLBlobKey)key
+                 data: (NSData*)data
+                state: (CBLBlobStoreState*)state
+               offset: (UInt64*)outOffset
+{
+    if (state->packFD >= 0 && state->packFileLength >= kMaxPackFileLength)
+        [state closePackFile];
+    if (state->packFD < 0) {
+        unsigned pack = state->lastPack;
+        NSDictionary* attrs = nil;
+        if (pack > 0)
+            attrs = [[NSFileManager defaultManager] attributesOfItemAtPath: [self pathOfPack: pack]
+                                                                     error: NULL];
+        if (!attrs || attrs.fileSize >= kMaxPackFileLength) {
+            ++pack;
+            attrs = nil;
+            mkdir(self.packDir.fileSystemRepresentation, 0700);
+        }
+        NSString* path = [self pathOfPack: pack];
+        int fd = open(path.fileSystemRepresentation, O_CREAT | O_WRONLY | O_APPEND, 0600);
+        if (fd < 0) {
+            Warn(@"CBL_BlobStore: Can't open pack file %@ (errno %d)", path, errno);
+            return NO;
+        }
+        state->packFD = fd;
+        state->lastPack = pack;
+        state->packFileLength = attrs.fileSize;
+    }
+
+    CBLPackRecordHeader header;
+    header.key = key;
+    header.length = NSSwapHostIntToBig(data ? (uint32_t)data.length : kTombstoneLength);
+    NSMutableData* record = [NSMutableData dataWithBytes: &header length: sizeof(header)];
+    if (data)
+        [record appendData: data];
+    ssize_t written = write(state->packFD, record.bytes, record.length);
+    if (written != (ssize_t)record.length) {
+        Warn(@"CBL_BlobStore: Couldn't write to pack file (errno %d)", errno);
+        if (written > 0)
+            ftruncate(state->packFD, (off_t)state->packFileLength);
+        [state closePackFile];
+        return NO;
+    }
+    if (outOffset)
+        *outOffset = state->packFileLength + sizeof(header);
+    state->packFileLength += record.length;
+    return YES;
+}
+
+
+// Stores raw (already encrypted, if necessary) blob data in a pack file.
+// Returns NO if the blob is already packed, or on error.
+- (BOOL) packBlob: (NSData*)data forKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return NO;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    @synchronized(state) {
+        NSMutableDictionary* index = [self packIndex: state];
+        if (index[keyData])
+            return NO;
+        UInt64 offset;
+        if (![self appendRecord: key data: data state: state offset: &offset])
+            return NO;
+        CBLPackedBlob* entry = [CBLPackedBlob new];
+        entry->pack = state->lastPack;
+        entry->offset = offset;
+        entry->length = (UInt32)data.length;
+        index[keyData] = entry;
+        state->livePackBytes += data.length;
+    }
+    [self noteBlobAdded: data.length];
+    return YES;
+}
+
+
+// Removes a blob from the pack index, appending a tombstone so it stays deleted after reopening.
+- (BOOL) unpackBlobForKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return NO;
+    NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+    UInt32 length;
+    @synchronized(state) {
+        NSMutableDictionary* index = [self packIndex: state];
+        CBLPackedBlob* entry = index[keyData];
+        if (!entry)
+            return NO;
+        if (![self appendRecord: key data: nil state: state offset: NULL])
+            return NO;
+        [index removeObjectForKey: keyData];
+        length = entry->length;
+        state->livePackBytes -= length;
+        state->deadPackBytes += length;
+    }
+    [self noteBlobRemoved: length];
+    return YES;
+}
+
+
+- (NSArray*) packedKeys {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return @[];
+    @synchronized(state) {
+        return [self packIndex: state].allKeys;
+    }
+}
+
+
+// Copies the live blobs into a new pack file, then deletes the old packs, reclaiming the space
+// taken by deleted blobs. If this is interrupted, the old packs' records are superseded by the
+// new pack's when the index is next loaded, so nothing is lost.
+- (BOOL) compactPacks: (NSError**)outError {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return YES;
+    @synchronized(state) {
+        NSMutableDictionary* index = [self packIndex: state];
+        if (state->deadPackBytes == 0)
+            return YES;
+        LogTo(Database, @"CBL_BlobStore: Compacting packs in %@ (%llu live bytes, %llu dead)",
+              _path, state->livePackBytes, state->deadPackBytes);
+        unsigned firstOldPack = 1, lastOldPack = state->lastPack;
+        [state closePackFile];
+        state->lastPack = lastOldPack + 1;      // forces a new pack file
+        state->packFileLength = 0;
+        NSMutableDictionary* newIndex = [NSMutableDictionary dictionaryWithCapacity: index.count];
+        for (NSData* keyData in index) {
+            @autoreleasepool {
+                CBLBlobKey key;
+                [keyData getBytes: &key length: sizeof(key)];
+                NSData* data = [self readPackedBlobForKey: key];
+                UInt64 offset;
+                if (!data || ![self appendRecord: key data: data state: state offset: &offset]) {
+                    [state closePackFile];
+                    state->packIndex = nil;     // the index will be reloaded from the files
+                    return CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+                }
+                CBLPackedBlob* entry = [CBLPackedBlob new];
+                entry->pack = state->lastPack;
+                entry->offset = offset;
+                entry->length = (UInt32)data.length;
+                newIndex[keyData] = entry;
+            }
+        }
+        if (state->packFD >= 0)
+            fsync(state->packFD);   // make sure the new pack is durable before deleting old ones
+        for (unsigned pack = firstOldPack; pack <= lastOldPack; ++pack)
+            unlink([self pathOfPack: pack].fileSystemRepresentation);
+        state->packIndex = newIndex;
+        state->deadPackBytes = 0;
+    }
+    return YES;
+}
+
+
+#pragma mark - CHUNKED BLOBS:
+
+
+// Blobs at least minChunkedBlobLength long are split into chunks at content-defined boundaries,
+// and each chunk is stored as a blob of its own in a nested store in the "_chunks" subdirectory.
+// The blob itself is represented by a manifest (in the same subdirectory) listing its chunks.
+// Since a boundary depends only on the bytes just before it, editing part of a large blob changes
+// only the chunks around the edit, so different versions of a big file share most of their chunks.
+
+#define kManifestFileExtension @"manifest"
+#define kMinChunkLength (16*1024)
+#define kMaxChunkLength (256*1024)
+#define kChunkBoundaryMask 0xFFFF000000000000ull    // Avg chunk ~ kMinChunkLength + 64KB
+
+// Header of a manifest; followed by an array of CBLManifestEntry. (Encrypted if the store is.)
+typedef struct {
+    char magic[4];          // "CBLM"
+    uint32_t version;       // big-endian
+    uint64_t length;        // big-endian; total length of the blob
+} __attribute__((packed)) CBLManifestHeader;
+
+typedef struct {
+    CBLBlobKey key;         // key of the chunk in the chunk store
+    uint32_t length;        // big-endian
+} __attribute__((packed)) CBLManifestEntry;
+
+static const char kManifestMagic[4] = {'C', 'B', 'L', 'M'};
+#define kManifestVersion 1
+
+
+// Table of random values for the "gear" rolling hash. It's generated from a fixed seed, because
+// chunk boundaries have to come out the same everywhere for chunks to be shared.
+static const uint64_t* gearTable(void) {
+    static uint64_t sTable[256];
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        uint64_t x = 0x43424C4368756E6Bull;
+        for (int i = 0; i < 256; i++) {         // splitmix64
+            uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            sTable[i] = z ^ (z >> 31);
+        }
+    });
+    return sTable;
+}
+
+
+typedef struct {
+    uint64_t hash;
+    size_t length;          // Number of bytes in the current chunk so far
+} CBLChunker;
+
+// Scans bytes that follow the current chunk, and returns how many of them belong to it. Sets
+// *outComplete if they complete the chunk, in which case the chunker is reset for the next one.
+static size_t chunkerScan(CBLChunker* chunker, const uint8_t* bytes, size_t length,
+                          BOOL* outComplete)
+{
+    const uint64_t* gear = gearTable();
+    uint64_t hash = chunker->hash;
+    size_t limit = MIN(length, kMaxChunkLength - chunker->length);
+    size_t i = 0;
+    if (chunker->length < kMinChunkLength)
+        i = MIN(limit, kMinChunkLength - chunker->length);  // no cut possible yet; skip hashing
+    BOOL complete = NO;
+    while (i < limit) {
+        hash = (hash << 1) + gear[bytes[i++]];
+        if ((hash & kChunkBoundaryMask) == 0) {
+            complete = YES;
+            break;
+        }
+    }
+    chunker->length += i;
+    if (chunker->length >= kMaxChunkLength)
+        complete = YES;
+    if (complete) {
+        chunker->hash = 0;
+        chunker->length = 0;
+    } else {
+        chunker->hash = hash;
+    }
+    *outComplete = complete;
+    return i;
+}
+
+
+// Returns the number of entries in a manifest, or -1 if it's invalid.
+static NSInteger manifestEntryCount(NSData* manifest) {
+    const CBLManifestHeader* header = manifest.bytes;
+    if (manifest.length < sizeof(CBLManifestHeader)
+            || memcmp(header->magic, kManifestMagic, sizeof(kManifestMagic)) != 0
+            || CFSwapInt32BigToHost(header->version) != kManifestVersion
+            || (manifest.length - sizeof(CBLManifestHeader)) % sizeof(CBLManifestEntry) != 0)
+        return -1;
+    return (manifest.length - sizeof(CBLManifestHeader)) / sizeof(CBLManifestEntry);
+}
+
+static const CBLManifestEntry* manifestEntries(NSData* manifest) {
+    return (const CBLManifestEntry*)((const uint8_t*)manifest.bytes + sizeof(CBLManifestHeader));
+}
+
+static void setManifestHeader(NSMutableData* manifest, uint64_t blobLength) {
+    CBLManifestHeader* header = manifest.mutableBytes;
+    memcpy(header->magic, kManifestMagic, sizeof(kManifestMagic));
+    header->version = CFSwapInt32HostToBig(kManifestVersion);
+    header->length = CFSwapInt64HostToBig(blobLength);
+}
+
+static uint64_t manifestBlobLength(NSData* manifest) {
+    return CFSwapInt64BigToHost(((const CBLManifestHeader*)manifest.bytes)->length);
+}
+
+// Returns the keys (as NSData) of a manifest's chunks, in order.
+static NSArray* manifestChunkKeys(NSData* manifest) {
+    NSInteger count = manifestEntryCount(manifest);
+    const CBLManifestEntry* entries = manifestEntries(manifest);
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity: count];
+    for (NSInteger i = 0; i < count; ++i)
+        [keys addObject: [NSData dataWithBytes: &entries[i].key length: sizeof(CBLBlobKey)]];
+    return keys;
+}
+
+
+// Chunks that are stored but not yet listed in a manifest file, or that a stream is reading, are
+// "pending": -compactStorage: leaves them alone even though no manifest refers to them.
+- (void) addPendingChunks: (NSArray*)chunkKeys {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    NSCountedSet* pending = state->pendingChunks;
+    @synchronized(pending) {
+        for (NSData* keyData in chunkKeys)
+            [pending addObject: keyData];
+    }
+}
+
+- (void) removePendingChunks: (NSArray*)chunkKeys {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return;
+    NSCountedSet* pending = state->pendingChunks;
+    @synchronized(pending) {
+        for (NSData* keyData in chunkKeys)
+            [pending removeObject: keyData];
+    }
+}
+
+
+// The nested store holding chunks. Returns nil if there isn't one yet, unless `create` is YES.
+- (CBL_BlobStore*) chunkStoreCreating: (BOOL)create {
+    @synchronized(self) {
+        if (!_chunkStore) {
+            NSString* dir = [_path stringByAppendingPathComponent: kChunkDirName];
+            if (!create && ![[NSFileManager defaultManager] fileExistsAtPath: dir])
+                return nil;
+            NSError* error;
+            _chunkStore = [[CBL_BlobStore alloc] initWithPath: dir
+                                                encryptionKey: _encryptionKey
+                                                       layout: kCBLBlobStoreSharded
+                                                     readOnly: _readOnly
+                                                        error: &error];
+            if (!_chunkStore)
+                Warn(@"CBL_BlobStore: Couldn't open chunk store %@: %@",
+                     dir, error.my_compactDescription);
+        }
+        return _chunkStore;
+    }
+}
+
+
+- (NSString*) manifestPathForKey: (CBLBlobKey)key {
+    NSString* name = [CBLHexFromBytes(&key, sizeof(key)).uppercaseString
+                                stringByAppendingPathExtension: kManifestFileExtension];
+    return [[_path stringByAppendingPathComponent: kChunkDirName]
+                                stringByAppendingPathComponent: name];
+}
+
+
+// Returns the (decrypted) manifest of a chunked blob, or nil if the blob isn't chunked.
+- (NSData*) manifestForKey: (CBLBlobKey)key {
+    NSData* manifest = [NSData dataWithContentsOfFile: [self manifestPathForKey: key]];
+    if (!manifest)
+        return nil;
+    if (_encryptionKey)
+        manifest = [_encryptionKey decryptData: manifest];
+    if (manifestEntryCount(manifest) < 0) {
+        Warn(@"CBL_BlobStore: Invalid manifest %@", [self manifestPathForKey: key]);
+        return nil;
+    }
+    return manifest;
+}
+
+
+- (BOOL) writeManifest: (NSData*)manifest
+                forKey: (CBLBlobKey)key
+                 error: (NSError**)outError
+{
+    if (_encryptionKey) {
+        manifest = [_encryptionKey encryptDataInChunks: manifest];
+        if (!manifest)
+            return CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+    }
+    if (![manifest writeToFile: [self manifestPathForKey: key]
+                       options: NSDataWritingAtomic error: outError])
+        return NO;
+    [self noteBlobAdded: 0];        // (the chunks' sizes are counted by the chunk store)
+    return YES;
+}
+
+
+// Reads a blob from a stream, stores its chunks, and returns its manifest. The chunks' keys are
+// added to `pending` (and marked pending) as they're stored; the caller must remove them with
+// -removePendingChunks: once the manifest is written, or on failure.
+- (NSData*) storeChunksFromStream: (NSInputStream*)stream
+                          pending: (NSMutableArray*)pending
+                            error: (NSError**)outError
+{
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: YES];
+    if (!chunkStore) {
+        CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+        return nil;
+    }
+    NSMutableData* manifest = [NSMutableData dataWithLength: sizeof(CBLManifestHeader)];
+    NSMutableData* chunk = [NSMutableData dataWithCapacity: kMaxChunkLength];
+    NSMutableData* buffer = [NSMutableData dataWithLength: 64*1024];
+    CBLChunker chunker = {0, 0};
+    uint64_t totalLength = 0;
+
+    BOOL (^addChunk)(void) = ^BOOL{
+        CBLManifestEntry entry;
+        entry.key = [CBL_BlobStore keyForBlob: chunk];
+        // Mark it pending before storing it, in case it's already there but about to be compacted:
+        NSData* keyData = [NSData dataWithBytes: &entry.key length: sizeof(entry.key)];
+        [self addPendingChunks: @[keyData]];
+        [pending addObject: keyData];
+        if (![chunkStore storeBlob: chunk withKey: entry.key])
+            return NO;
+        entry.length = CFSwapInt32HostToBig((uint32_t)chunk.length);
+        [manifest appendBytes: &entry length: sizeof(entry)];
+        chunk.length = 0;
+        return YES;
+    };
+
+    for (;;) {
+        NSInteger bytesRead = [stream read: buffer.mutableBytes maxLength: buffer.length];
+        if (bytesRead < 0) {
+            if (outError)
+                *outError = stream.streamError;
+            return nil;
+        } else if (bytesRead == 0) {
+            break;
+        }
+        totalLength += bytesRead;
+        const uint8_t* bytes = buffer.bytes;
+        while (bytesRead > 0) {
+            BOOL complete;
+            size_t n = chunkerScan(&chunker, bytes, bytesRead, &complete);
+            [chunk appendBytes: bytes length: n];
+            bytes += n;
+            bytesRead -= n;
+            if (complete && !addChunk()) {
+                CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+                return nil;
+            }
+        }
+    }
+    if (chunk.length > 0 && !addChunk()) {
+        CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+        return nil;
+    }
+    setManifestHeader(manifest, totalLength);
+    LogVerbose(Database, @"CBL_BlobStore: Split %llu-byte blob into %ld chunks",
+               totalLength, (long)manifestEntryCount(manifest));
+    return manifest;
+}
+
+
+- (BOOL) storeChunkedBlobFromStream: (NSInputStream*)stream
+                             forKey: (CBLBlobKey)key
+                              error: (NSError**)outError
+{
+    NSMutableArray* pending = [NSMutableArray array];
+    NSData* manifest = [self storeChunksFromStream: stream pending: pending error: outError];
+    BOOL ok = manifest && [self writeManifest: manifest forKey: key error: outError];
+    [self removePendingChunks: pending];
+    return ok;
+}
+
+
+// Returns the contents of a chunked blob, concatenated from its chunks.
+- (NSData*) readChunkedBlobWithManifest: (NSData*)manifest {
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: NO];
+    NSMutableData* blob = [NSMutableData dataWithCapacity:
+                                                    (NSUInteger)manifestBlobLength(manifest)];
+    const CBLManifestEntry* entries = manifestEntries(manifest);
+    NSInteger count = manifestEntryCount(manifest);
+    for (NSInteger i = 0; i < count; ++i) {
+        @autoreleasepool {
+            NSData* chunk = [chunkStore blobForKey: entries[i].key];
+            if (!chunk) {
+                Warn(@"CBL_BlobStore: Chunk #%ld of a blob is missing", (long)i);
+                return nil;
+            }
+            [blob appendData: chunk];
+        }
+    }
+    return blob;
+}
+
+
+// Returns a stream that reads a chunked blob, loading one chunk at a time as it's read.
+// Returns nil if any of the chunks are missing; if one turns out to be unreadable, the stream fails
+// with an error. The chunks are kept pending until the stream is closed, so compaction can't delete
+// them partway through.
+- (NSInputStream*) inputStreamWithManifest: (NSData*)manifest {
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: NO];
+    NSArray* chunkKeys = manifestChunkKeys(manifest);
+    [self addPendingChunks: chunkKeys];
+    if (!chunkStore || [self missingChunkKeys: chunkKeys].count > 0) {
+        Warn(@"CBL_BlobStore: Chunks of a blob are missing");
+        [self removePendingChunks: chunkKeys];
+        return nil;
+    }
+#ifdef GNUSTEP
+    NSData* blob = [self readChunkedBlobWithManifest: manifest];
+    [self removePendingChunks: chunkKeys];
+    return blob ? [NSInputStream inputStreamWithData: blob] : nil;
+#else
+    NSInputStream* stream = [[CBLChunkedBlobInputStream alloc]
+                                    initWithChunkStore: chunkStore
+                                             chunkKeys: chunkKeys
+                                               onClose: ^{ [self removePendingChunks: chunkKeys]; }];
+    [stream open];
+    return stream;
+#endif
+}
+
+
+- (BOOL) deleteManifestForKey: (CBLBlobKey)key {
+    if (unlink([self manifestPathForKey: key].fileSystemRepresentation) != 0)
+        return NO;
+    [self noteBlobRemoved: 0];
+    return YES;
+}
+
+
+// Keys (as NSData) of all chunked blobs.
+- (NSArray*) chunkedKeys {
+    NSString* dir = [_path stringByAppendingPathComponent: kChunkDirName];
+    NSArray* names = [[NSFileManager defaultManager] contentsOfDirectoryAtPath: dir error: NULL];
+    NSMutableArray* keys = [NSMutableArray array];
+    for (NSString* name in [names pathsMatchingExtensions: @[kManifestFileExtension]]) {
+        CBLBlobKey key;
+        NSString* blobName = [name.stringByDeletingPathExtension
+                                            stringByAppendingPathExtension: @kFileExtension];
+        if ([[self class] getKey: &key forFilename: blobName])
+            [keys addObject: [NSData dataWithBytes: &key length: sizeof(key)]];
+    }
+    return keys;
+}
+
+
+- (NSArray*) chunkKeysForKey: (CBLBlobKey)key {
+    NSData* manifest = [self manifestForKey: key];
+    if (!manifest)
+        return nil;
+    return manifestChunkKeys(manifest);
+}
+
+
+- (NSArray*) missingChunkKeys: (NSArray*)chunkKeys {
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: NO];
+    if (!chunkStore)
+        return chunkKeys;
+    NSMutableArray* missing = [NSMutableArray array];
+    for (NSData* keyData in chunkKeys) {
+        CBLBlobKey key;
+        [keyData getBytes: &key length: sizeof(key)];
+        if (![chunkStore hasBlobForKey: key])
+            [missing addObject: keyData];
+    }
+    return missing;
+}
+
+
+- (NSData*) chunkForKey: (CBLBlobKey)key {
+    return [[self chunkStoreCreating: NO] blobForKey: key];
+}
+
+
+- (BOOL) storeChunk: (NSData*)chunk creatingKey: (CBLBlobKey*)outKey {
+    *outKey = [CBL_BlobStore keyForBlob: chunk];
+    [self addPendingChunks: @[[NSData dataWithBytes: outKey length: sizeof(*outKey)]]];
+    return [[self chunkStoreCreating: YES] storeBlob: chunk withKey: *outKey];
+}
+
+
+- (BOOL) storeBlobForKey: (CBLBlobKey)key
+              fromChunks: (NSArray*)chunkKeys
+                   error: (NSError**)outError
 {
-    self = [self initInternalWithPath: dir encryptionKey: encryptionKey];
-    if (self) {
-        BOOL isDir;
-        if ([[NSFileManager defaultManager] fileExistsAtPath: dir isDirectory: &isDir] && isDir) {
-            // Existing blob-store.
-            if (![self verifyExistingStore: outError])
-                return nil;
-        } else {
-            // New blob store; create directory:
-            if (![[NSFileManager defaultManager] createDirectoryAtPath: dir
-                                           withIntermediateDirectories: NO
-                                                            attributes: nil
-                                                                 error: outError]) {
-                return nil;
-            }
-            if (encryptionKey) {
-                if (![self markEncrypted: YES error: outError])  // note it's encrypted
-                    return nil;
-            }
+    if ([self hasBlobForKey: key])
+        return YES;
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: NO];
+    NSMutableData* manifest = [NSMutableData dataWithLength: sizeof(CBLManifestHeader)];
+    uint64_t totalLength = 0;
+    SHA_CTX sha;
+    SHA1_Init(&sha);
+    for (NSData* keyData in chunkKeys) {
+        @autoreleasepool {
+            CBLManifestEntry entry;
+            [keyData getBytes: &entry.key length: sizeof(entry.key)];
+            NSData* chunk = [chunkStore blobForKey: entry.key];
+            if (!chunk)
+                return CBLStatusToOutNSError(kCBLStatusNotFound, outError);
+            SHA1_Update(&sha, chunk.bytes, chunk.length);
+            totalLength += chunk.length;
+            entry.length = CFSwapInt32HostToBig((uint32_t)chunk.length);
+            [manifest appendBytes: &entry length: sizeof(entry)];
         }
     }
-    return self;
+    CBLBlobKey actualKey;
+    SHA1_Final(actualKey.bytes, &sha);
+    if (memcmp(&actualKey, &key, sizeof(key)) != 0) {
+        Warn(@"CBL_BlobStore: Chunks don't match the digest of blob %@",
+             [NSData dataWithBytes: &key length: sizeof(key)]);
+        return CBLStatusToOutNSError(kCBLStatusBadAttachment, outError);
+    }
+    setManifestHeader(manifest, totalLength);
+    if (![self writeManifest: manifest forKey: key error: outError])
+        return NO;
+    [self removePendingChunks: chunkKeys];     // the manifest protects them now
+    return YES;
 }
 
 
-- (BOOL) verifyExistingStore: (NSError**)outError {
-    NSString* markerPath = [_path stringByAppendingPathComponent: kEncryptionMarkerFilename];
+#pragma mark - LAYOUT:
+
+
+- (BOOL) readLayout: (NSError**)outError {
+    NSString* markerPath = [_path stringByAppendingPathComponent: kLayoutMarkerFilename];
     NSError* error;
-    NSString* encryptionAlg = [NSString stringWithContentsOfFile: markerPath
-                                                 encoding: NSUTF8StringEncoding
-                                                    error: &error];
-    if (encryptionAlg) {
-        // "_encryption" file is present, so make sure we support its format & have a key:
-        if (!_encryptionKey) {
-            Warn(@"Opening encrypted blob-store without providing a key");
-            return CBLStatusToOutNSError(kCBLStatusUnauthorized, outError);
-        } else if (!$equal(encryptionAlg, kEncryptionAlgorithm)) {
-            Warn(@"Blob-store uses unrecognized encryption '%@'", encryptionAlg);
-            return CBLStatusToOutNSError(kCBLStatusUnauthorized, outError);
+    NSString* layoutName = [NSString stringWithContentsOfFile: markerPath
+                                                     encoding: NSUTF8StringEncoding
+                                                        error: &error];
+    if (layoutName) {
+        if (!$equal(layoutName, kShardedLayoutName)) {
+            Warn(@"Blob-store uses unrecognized layout '%@'", layoutName);
+            return CBLStatusToOutNSError(kCBLStatusNotImplemented, outError);
         }
+        _layout = kCBLBlobStoreSharded;
     } else if (CBLIsFileNotFoundError(error)) {
-        // No "_encryption" file was found, so on-disk store isn't encrypted:
-        CBLSymmetricKey* encryptionKey = _encryptionKey;
-        if (encryptionKey) {
-            // This store was created before the db encryption fix, so its files are not
-            // encrypted, even though they should be. Remedy that:
-            NSLog(@"**** BlobStore should be encrypted; fixing it now...");
-            _encryptionKey = nil;
-            if (![self changeEncryptionKey: encryptionKey error: outError])
-                return NO;
-        }
+        _layout = kCBLBlobStoreFlat;
     } else {
-        // "_encryption" file was unreadable:
         if (outError) *outError = error;
         return NO;
     }
@@ -124,9 +1467,138 @@ UsingLogDomain(Database);
 }
 
 
-- (void) dealloc {
-    if (_tempDir)
-        [[NSFileManager defaultManager] removeItemAtPath: _tempDir error: NULL];
+// Records the layout in the "_layout" marker file. Blobs are not moved.
+- (BOOL) writeLayout: (CBLBlobStoreLayout)layout error: (NSError**)outError {
+    NSString* markerPath = [_path stringByAppendingPathComponent: kLayoutMarkerFilename];
+    BOOL ok;
+    if (layout == kCBLBlobStoreSharded)
+        ok = [kShardedLayoutName writeToFile: markerPath atomically: YES
+                                    encoding: NSUTF8StringEncoding error: outError];
+    else
+        ok = CBLRemoveFileIfExists(markerPath, outError);
+    if (ok)
+        _layout = layout;
+    return ok;
+}
+
+
+- (BOOL) isMigrating {
+    CBLBlobStoreState* state = _state;
+    if (!state)
+        return NO;
+    @synchronized(state) {
+        return state->migrating;
+    }
+}
+
+
+// If any blob files aren't where the current layout puts them, moves them in the background.
+// Until that finishes, lookups check both locations.
+- (void) resumeMigration {
+    CBLBlobStoreState* state = _state;
+    CBLBlobStoreLayout fromLayout = (_layout == kCBLBlobStoreSharded) ? kCBLBlobStoreFlat
+                                                                     : kCBLBlobStoreSharded;
+    if (![self hasBlobsInLayout: fromLayout])
+        return;
+    @synchronized(state) {
+        if (state->migrating)
+            return;     // another instance is already doing it
+        state->migrating = YES;
+    }
+    Log(@"CBL_BlobStore: Migrating %@ to %@ layout in the background...",
+        _path, (_layout == kCBLBlobStoreSharded ? @"sharded" : @"flat"));
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+        NSError* error;
+        if (![self moveBlobsFromLayout: fromLayout error: &error])
+            Warn(@"CBL_BlobStore: Migrating %@ failed: %@", _path, error.my_compactDescription);
+        @synchronized(state) {
+            state->migrating = NO;
+        }
+    });
+}
+
+
+- (BOOL) hasBlobsInLayout: (CBLBlobStoreLayout)layout {
+    __block BOOL found = NO;
+    [self forEachBlobInLayout: layout block: ^(CBLBlobKey key, NSString* path, BOOL* stop) {
+        found = *stop = YES;
+    }];
+    return found;
+}
+
+
+// Moves every blob file stored according to `fromLayout` to where the current layout puts it.
+- (BOOL) moveBlobsFromLayout: (CBLBlobStoreLayout)fromLayout error: (NSError**)outError {
+    __block NSUInteger numMoved = 0;
+    __block NSError* error = nil;
+    [self forEachBlobInLayout: fromLayout block: ^(CBLBlobKey key, NSString* path, BOOL* stop) {
+        @autoreleasepool {
+            NSString* dstPath = [self pathForKey: key layout: _layout createDir: YES];
+            if (rename(path.fileSystemRepresentation, dstPath.fileSystemRepresentation) == 0) {
+                ++numMoved;
+            } else if (errno != ENOENT) {
+                error = [NSError errorWithDomain: NSPOSIXErrorDomain code: errno userInfo: nil];
+                *stop = YES;
+            }
+        }
+    }];
+    if (fromLayout == kCBLBlobStoreSharded)
+        [self removeShardDirectories];
+    LogTo(Database, @"CBL_BlobStore: Moved %lu blobs in %@", (unsigned long)numMoved, _path);
+    if (error && outError)
+        *outError = error;
+    return error == nil;
+}
+
+
+- (void) removeShardDirectories {
+    NSFileManager* fmgr = [NSFileManager defaultManager];
+    for (NSString* name in [fmgr contentsOfDirectoryAtPath: _path error: NULL]) {
+        if (isShardName(name)) {
+            NSString* shardPath = [_path stringByAppendingPathComponent: name];
+            for (NSString* subName in [fmgr contentsOfDirectoryAtPath: shardPath error: NULL])
+                rmdir([shardPath stringByAppendingPathComponent: subName].fileSystemRepresentation);
+            rmdir(shardPath.fileSystemRepresentation);     // fails harmlessly if not empty
+        }
+    }
+}
+
+
+- (BOOL) changeLayout: (CBLBlobStoreLayout)layout error: (NSError**)outError {
+    if (layout == _layout && !self.isMigrating)
+        return YES;
+    CBLBlobStoreLayout oldLayout = _layout;
+    if (![self writeLayout: layout error: outError])
+        return NO;
+    CBLBlobStoreState* state = _state;
+    @synchronized(state) {
+        state->migrating = YES;
+    }
+    BOOL ok = [self moveBlobsFromLayout: oldLayout error: outError];
+    if (ok && oldLayout == layout) {
+        // Finish an interrupted migration in the same direction:
+        ok = [self moveBlobsFromLayout: (layout == kCBLBlobStoreSharded ? kCBLBlobStoreFlat
+                                                                        : kCBLBlobStoreSharded)
+                                 error: outError];
+    }
+    @synchronized(state) {
+        state->migrating = NO;
+    }
+    return ok;
+}
+
+
+- (BOOL) directoryReplaced: (NSError**)outError {
+    CBLBlobStoreLayout wantedLayout = _layout;
+    [self resetState];
+    if (![self readLayout: outError])
+        return NO;
+    if (wantedLayout == kCBLBlobStoreSharded && _layout == kCBLBlobStoreFlat) {
+        if (![self writeLayout: kCBLBlobStoreSharded error: outError])
+            return NO;
+    }
+    [self resumeMigration];
+    return YES;
 }
 
 
@@ -146,23 +1618,98 @@ UsingLogDomain(Database);
 }
 
 
-// Internal only. This file might be encrypted.
-- (NSString*) rawPathForKey: (CBLBlobKey)key {
-    char out[2*sizeof(key.bytes) + 1 + strlen(kFileExtension) + 1];
+// The path of the file that stores the blob in the given layout. Flat: "ABCD...EF.blob".
+// Sharded: "AB/CD/ABCD...EF.blob", which keeps each directory down to a manageable size.
+- (NSString*) pathForKey: (CBLBlobKey)key
+                  layout: (CBLBlobStoreLayout)layout
+               createDir: (BOOL)createDir
+{
+    char out[6 + 2*sizeof(key.bytes) + 1 + strlen(kFileExtension) + 1];
     char *dst = &out[0];
+    if (layout == kCBLBlobStoreSharded) {
+        dst += sprintf(dst, "%02X/%02X/", key.bytes[0], key.bytes[1]);
+        if (createDir) {
+            *dst = 0;
+            NSString* dir = [_path stringByAppendingPathComponent: @(out)];
+            mkdir([dir stringByDeletingLastPathComponent].fileSystemRepresentation, 0700);
+            mkdir(dir.fileSystemRepresentation, 0700);
+        }
+    }
     for( size_t i=0; i<sizeof(key.bytes); i+=1 )
         dst += sprintf(dst,"%02X", key.bytes[i]);
     strlcat(out, ".", sizeof(out));
     strlcat(out, kFileExtension, sizeof(out));
     NSString* name =  [[NSString alloc] initWithCString: out encoding: NSASCIIStringEncoding];
-    NSString* path = [_path stringByAppendingPathComponent: name];
+    return [_path stringByAppendingPathComponent: name];
+}
+
+
+// Internal only. This file might be encrypted.
+// Returns the path of the blob's file, or the path where it would be stored if it doesn't exist.
+- (NSString*) rawPathForKey: (CBLBlobKey)key {
+    NSString* path = [self pathForKey: key layout: _layout createDir: NO];
+    if (!self.isMigrating)
+        return path;
+    // During a migration the file might be in the old location. The 2nd check of the new location
+    // avoids a race with the migrator moving the file in between the first two checks.
+    NSFileManager* fmgr = [NSFileManager defaultManager];
+    if ([fmgr fileExistsAtPath: path])
+        return path;
+    NSString* oldPath = [self pathForKey: key
+                                  layout: (_layout == kCBLBlobStoreSharded ? kCBLBlobStoreFlat
+                                                                           : kCBLBlobStoreSharded)
+                               createDir: NO];
+    if ([fmgr fileExistsAtPath: oldPath])
+        return oldPath;
     return path;
 }
 
+
+// Moves a finished file into the store as the blob with the given key.
+// Returns NO if the blob already exists (or the move fails for some other reason.)
+- (BOOL) installFileAtPath: (NSString*)tempPath forKey: (CBLBlobKey)key {
+    NSDictionary* attrs = [[NSFileManager defaultManager] attributesOfItemAtPath: tempPath
+                                                                           error: NULL];
+    if (attrs && _maxPackedBlobLength > 0 && attrs.fileSize <= _maxPackedBlobLength) {
+        if ([self hasBlobForKey: key])
+            return NO;
+        NSData* data = [NSData dataWithContentsOfFile: tempPath];
+        if (!data || ![self packBlob: data forKey: key])
+            return NO;
+        [[NSFileManager defaultManager] removeItemAtPath: tempPath error: NULL];
+        return YES;
+    }
+    if (_minChunkedBlobLength > 0 && attrs.fileSize >= _minChunkedBlobLength) {
+        if ([self hasBlobForKey: key])
+            return NO;
+        NSInputStream* stream = [NSInputStream inputStreamWithFileAtPath: tempPath];
+        [stream open];
+        if (_encryptionKey)
+            stream = [_encryptionKey decryptStream: stream];
+        BOOL ok = [self storeChunkedBlobFromStream: stream forKey: key error: NULL];
+        [stream close];
+        if (ok)
+            [[NSFileManager defaultManager] removeItemAtPath: tempPath error: NULL];
+        return ok;
+    }
+    if (self.isMigrating && [self hasBlobForKey: key])
+        return NO;
+    NSString* dstPath = [self pathForKey: key layout: _layout createDir: YES];
+    if (![[NSFileManager defaultManager] moveItemAtPath: tempPath toPath: dstPath error: NULL])
+        return NO;
+    [self noteBlobAdded: attrs.fileSize];
+    return YES;
+}
+
+
 - (NSString*) blobPathForKey: (CBLBlobKey)key {
-    if (_encryptionKey)
+    if (_encryptionKey || [self packedBlobForKey: key])
         return nil;
-    return [self rawPathForKey: key];
+    NSString* path = [self rawPathForKey: key];
+    if (![[NSFileManager defaultManager] fileExistsAtPath: path]
+            && [[NSFileManager defaultManager] fileExistsAtPath: [self manifestPathForKey: key]])
+        return nil;     // it's chunked
+    return path;
 }
 
 
@@ -186,12 +1733,35 @@ UsingLogDomain(Database);
 
 
 - (BOOL) hasBlobForKey: (CBLBlobKey)key {
-    return [[NSFileManager defaultManager] fileExistsAtPath: [self rawPathForKey: key]
-                                                isDirectory: NULL];
+    if ([self packedBlobForKey: key])
+        return YES;
+    NSFileManager* fmgr = [NSFileManager defaultManager];
+    return [fmgr fileExistsAtPath: [self rawPathForKey: key] isDirectory: NULL]
+        || [fmgr fileExistsAtPath: [self manifestPathForKey: key] isDirectory: NULL];
 }
 
 
 - (uint64_t) lengthOfBlobForKey: (CBLBlobKey)key {
+    CBLBlobStoreState* state = _state;
+    if (state) {
+        NSData* keyData = [NSData dataWithBytes: &key length: sizeof(key)];
+        @synchronized(state) {
+            CBLCachedBlob* cached = state->cache[keyData];   // (peek; not a hit or a miss)
+            if (cached)
+                return cached->data.length;
+        }
+    }
+    CBLPackedBlob* entry = [self packedBlobForKey: key];
+    if (entry)
+        return _encryptionKey ? [self blobForKey: key].length : entry->length;
+    NSData* manifest = [self manifestForKey: key];
+    if (manifest)
+        return manifestBlobLength(manifest);
+    if (_encryptionKey) {
+        NSData* contents = [_encryptionKey decryptedContentsOfFile: [self rawPathForKey: key]];
+        if (contents)
+            return contents.length;     // chunked format knows its length without decrypting
+    }
     return [[[NSFileManager defaultManager] attributesOfItemAtPath: [self rawPathForKey: key]
                                                              error: NULL]
                                                 fileSize];
@@ -199,26 +1769,98 @@ UsingLogDomain(Database);
 
 
 - (NSData*) blobForKey: (CBLBlobKey)key {
-    NSString* path = [self rawPathForKey: key];
-    NSData* blob = [NSData dataWithContentsOfFile: path options: NSDataReadingUncached error: NULL];
+    NSData* blob = [self cachedBlobForKey: key];
+    if (!blob) {
+        blob = [self readBlobForKey: key];
+        [self cacheBlob: blob forKey: key];
+    }
+    return blob;
+}
+
+
+// Reads a blob from storage, bypassing the cache.
+- (NSData*) readBlobForKey: (CBLBlobKey)key {
+    NSData* blob = [self readPackedBlobForKey: key];
+    if (!blob) {
+        NSString* path = [self rawPathForKey: key];
+        blob = [NSData dataWithContentsOfFile: path options: NSDataReadingUncached error: NULL];
+    }
+    if (!blob) {
+        NSData* manifest = [self manifestForKey: key];
+        if (manifest) {
+            // The chunk store checks each chunk's digest if it's encrypted, but not the whole:
+            blob = [self readChunkedBlobWithManifest: manifest];
+            if (blob) {
+                CBLBlobKey decodedKey = [[self class] keyForBlob: blob];
+                if (memcmp(&key, &decodedKey, sizeof(key)) != 0) {
+                    Warn(@"Chunked attachment %@ is corrupt!",
+                         [NSData dataWithBytes: &key length: sizeof(key)]);
+                    blob = nil;
+                }
+            }
+            return blob;
+        }
+    }
     if (_encryptionKey && blob) {
         blob = [_encryptionKey decryptData: blob];
         CBLBlobKey decodedKey = [[self class] keyForBlob: blob];
         if (memcmp(&key, &decodedKey, sizeof(key)) != 0) {
-            Warn(@"Attachment %@ decoded incorrectly!", path);
+            Warn(@"Attachment %@ decoded incorrectly!",
+                 [NSData dataWithBytes: &key length: sizeof(key)]);
             blob = nil;
         }
     }
     return blob;
 }
 
+- (NSData*) mappedBlobForKey: (CBLBlobKey)key {
+    NSData* cached = [self cachedBlobForKey: key];
+    if (cached)
+        return cached;
+    if ([self packedBlobForKey: key]) {
+        // It's small, so no point mapping it:
+        NSData* blob = [self readBlobForKey: key];
+        [self cacheBlob: blob forKey: key];
+        return blob;
+    }
+    if (_encryptionKey) {
+        // Blobs in the chunked format can be decrypted a piece at a time:
+        return [_encryptionKey decryptedContentsOfFile: [self rawPathForKey: key]];
+    }
+    NSString* path = [self blobPathForKey: key];
+    if (!path)
+        return nil;
+    return [NSData dataWithContentsOfFile: path options: NSDataReadingMappedIfSafe error: NULL];
+}
+
 - (NSInputStream*) blobInputStreamForKey: (CBLBlobKey)key
                                   length: (UInt64*)outLength
 {
+    NSData* blob = [self cachedBlobForKey: key];
+    if (!blob && [self packedBlobForKey: key]) {
+        blob = [self readBlobForKey: key];
+        [self cacheBlob: blob forKey: key];
+    }
+    if (blob) {
+        if (outLength)
+            *outLength = blob.length;
+        NSInputStream* stream = [NSInputStream inputStreamWithData: blob];
+        [stream open];
+        return stream;
+    }
     NSString* path = [self rawPathForKey: key];
+    if (![[NSFileManager defaultManager] fileExistsAtPath: path]) {
+        NSData* manifest = [self manifestForKey: key];
+        if (manifest) {
+            if (outLength)
+                *outLength = manifestBlobLength(manifest);
+            return [self inputStreamWithManifest: manifest];
+        }
+    }
     if (outLength) {
         if (_encryptionKey) {
-            *outLength = 0; // not known
+            // Known only if it's in the chunked format:
+            *outLength = [_encryptionKey decryptedContentsOfFile: path].length;
         } else {
             NSDictionary* info = [[NSFileManager defaultManager] attributesOfItemAtPath: path
                                                                                   error: NULL];
@@ -242,71 +1884,145 @@ UsingLogDomain(Database);
        creatingKey: (CBLBlobKey*)outKey
 {
     *outKey = [[self class] keyForBlob: blob];
-    NSString* path = [self rawPathForKey: *outKey];
-    if ([[NSFileManager defaultManager] isReadableFileAtPath: path])
+    return [self storeBlob: blob withKey: *outKey];
+}
+
+
+// Stores a blob whose key the caller has already computed.
+- (BOOL) storeBlob: (NSData*)blob withKey: (CBLBlobKey)key {
+    NSString* path = [self rawPathForKey: key];
+    if ([[NSFileManager defaultManager] isReadableFileAtPath: path]
+            || [self packedBlobForKey: key]
+            || [[NSFileManager defaultManager] fileExistsAtPath: [self manifestPathForKey: key]])
         return YES;
 
+    if (_minChunkedBlobLength > 0 && blob.length >= _minChunkedBlobLength) {
+        NSInputStream* stream = [NSInputStream inputStreamWithData: blob];
+        [stream open];
+        BOOL ok = [self storeChunkedBlobFromStream: stream forKey: key error: NULL];
+        [stream close];
+        return ok;
+    }
+
     if (_encryptionKey) {
-        blob = [_encryptionKey encryptData: blob];
+        blob = [_encryptionKey encryptDataInChunks: blob];
         if (!blob) {
             Warn(@"CBL_BlobStore: Failed to encode data for %@", path);
             return NO;
         }
     }
 
+    if (_maxPackedBlobLength > 0 && blob.length <= _maxPackedBlobLength)
+        return [self packBlob: blob forKey: key];
+
+    path = [self pathForKey: key layout: _layout createDir: YES];
     NSError* error;
     if (![blob writeToFile: path options: NSDataWritingAtomic error: &error]) {
         Warn(@"CBL_BlobStore: Couldn't write to %@: %@", path, error.my_compactDescription);
         return NO;
     }
+    [self noteBlobAdded: blob.length];
     return YES;
 }
 
 
 - (BOOL) deleteBlobForKey: (CBLBlobKey)key {
-    return [[NSFileManager defaultManager] removeItemAtPath: [self rawPathForKey: key]
-                                                      error: nil];
+    [self uncacheBlobForKey: key];
+    if ([self unpackBlobForKey: key] || [self deleteManifestForKey: key])
+        return YES;     // (the chunks are left for -deleteBlobsExceptMatching: to clean up)
+    NSString* path = [self rawPathForKey: key];
+    NSDictionary* attrs = [[NSFileManager defaultManager] attributesOfItemAtPath: path error: NULL];
+    if (![[NSFileManager defaultManager] removeItemAtPath: path error: nil])
+        return NO;
+    [self noteBlobRemoved: attrs.fileSize];
+    return YES;
+}
+
+
+// Calls the block for every blob file stored according to the given layout.
+- (void) forEachBlobInLayout: (CBLBlobStoreLayout)layout
+                       block: (void(^)(CBLBlobKey key, NSString* path, BOOL* stop))block
+{
+    NSFileManager* fmgr = [NSFileManager defaultManager];
+    BOOL stop = NO;
+    if (layout == kCBLBlobStoreFlat) {
+        for (NSString* filename in [fmgr contentsOfDirectoryAtPath: _path error: NULL]) {
+            CBLBlobKey key;
+            if ([[self class] getKey: &key forFilename: filename]) {
+                block(key, [_path stringByAppendingPathComponent: filename], &stop);
+                if (stop)
+                    return;
+            }
+        }
+    } else {
+        for (NSString* name1 in [fmgr contentsOfDirectoryAtPath: _path error: NULL]) {
+            if (!isShardName(name1))
+                continue;
+            NSString* dir1 = [_path stringByAppendingPathComponent: name1];
+            for (NSString* name2 in [fmgr contentsOfDirectoryAtPath: dir1 error: NULL]) {
+                if (!isShardName(name2))
+                    continue;
+                @autoreleasepool {
+                    NSString* dir2 = [dir1 stringByAppendingPathComponent: name2];
+                    for (NSString* filename in [fmgr contentsOfDirectoryAtPath: dir2 error: NULL]) {
+                        CBLBlobKey key;
+                        if ([[self class] getKey: &key forFilename: filename]) {
+                            block(key, [dir2 stringByAppendingPathComponent: filename], &stop);
+                            if (stop)
+                                return;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+// Calls the block for every blob file, including ones not yet migrated to the current layout.
+- (void) forEachBlob: (void(^)(CBLBlobKey key, NSString* path))block {
+    void (^wrapper)(CBLBlobKey, NSString*, BOOL*) = ^(CBLBlobKey key, NSString* path, BOOL* stop) {
+        block(key, path);
+    };
+    BOOL migrating = self.isMigrating;
+    if (_layout == kCBLBlobStoreSharded || migrating)
+        [self forEachBlobInLayout: kCBLBlobStoreSharded block: wrapper];
+    if (_layout == kCBLBlobStoreFlat || migrating)
+        [self forEachBlobInLayout: kCBLBlobStoreFlat block: wrapper];
 }
 
 
 - (NSArray*) allKeys {
-    NSArray* blob = [[NSFileManager defaultManager] contentsOfDirectoryAtPath: _path
-                                                                            error: NULL];
-    if (!blob)
+    if (![[NSFileManager defaultManager] fileExistsAtPath: _path])
         return nil;
-    return [blob my_map: ^NSData*(id filename) {
-        CBLBlobKey key;
-        if ([[self class] getKey: &key forFilename: filename])
-            return [NSData dataWithBytes: &key length: sizeof(key)];
-        else
-            return nil;
+    NSMutableArray* keys = [NSMutableArray array];
+    [self forEachBlob: ^(CBLBlobKey key, NSString* path) {
+        [keys addObject: [NSData dataWithBytes: &key length: sizeof(key)]];
     }];
+    [keys addObjectsFromArray: self.packedKeys];
+    [keys addObjectsFromArray: self.chunkedKeys];
+    return keys;
 }
 
 
 - (NSUInteger) count {
-    NSUInteger n = 0;
-    NSFileManager* fmgr = [NSFileManager defaultManager];
-    for (NSString* filename in [fmgr contentsOfDirectoryAtPath: _path error: NULL]) {
-        if ([[self class] getKey: NULL forFilename: filename])
-            ++n;
+    CBLBlobStoreState* state = [self validSummary];
+    if (!state)
+        return 0;
+    @synchronized(state) {
+        return state->blobCount;
     }
-    return n;
 }
 
 
 - (UInt64) totalDataSize {
-    UInt64 total = 0;
-    NSFileManager* fmgr = [NSFileManager defaultManager];
-    for (NSString* filename in [fmgr contentsOfDirectoryAtPath: _path error: NULL]) {
-        if ([[self class] getKey: NULL forFilename: filename]) {
-            NSString* itemPath = [_path stringByAppendingPathComponent: filename];
-            NSDictionary* attrs = [fmgr attributesOfItemAtPath: itemPath error: NULL];
-            if (attrs)
-                total += attrs.fileSize;
-        }
+    CBLBlobStoreState* state = [self validSummary];
+    if (!state)
+        return 0;
+    UInt64 chunkSize = [self chunkStoreCreating: NO].totalDataSize;
+    @synchronized(state) {
+        return state->blobSize + chunkSize;
     }
-    return total;
 }
 
 
@@ -314,26 +2030,45 @@ UsingLogDomain(Database);
                                   error: (NSError**)outError
 {
     NSFileManager* fmgr = [NSFileManager defaultManager];
-    NSArray* blob = [fmgr contentsOfDirectoryAtPath: _path error: outError];
-    if (!blob)
-        return -1;
-    NSUInteger numDeleted = 0;
-    NSError* error = nil;
-    for (NSString* filename in blob) {
-        CBLBlobKey curKey;
-        if ([[self class] getKey: &curKey forFilename: filename]) {
-            if (!predicate(curKey)) {
-                NSError* error1;
-                if ([fmgr removeItemAtPath: [_path stringByAppendingPathComponent: filename]
-                                     error: &error1])
-                    ++numDeleted;
-                else {
-                    if (!error)
-                        error = error1;
-                    Warn(@"%@: Failed to delete '%@': %@", self, filename, error.my_compactDescription);
-                }
+    if (![fmgr fileExistsAtPath: _path])
+        return CBLStatusToOutNSError(kCBLStatusNotFound, outError) ? 0 : -1;
+    __block NSUInteger numDeleted = 0;
+    __block NSError* error = nil;
+    [self forEachBlob: ^(CBLBlobKey curKey, NSString* path) {
+        if (!predicate(curKey)) {
+            [self uncacheBlobForKey: curKey];
+            NSError* error1;
+            NSDictionary* attrs = [fmgr attributesOfItemAtPath: path error: NULL];
+            if ([fmgr removeItemAtPath: path error: &error1]) {
+                ++numDeleted;
+                [self noteBlobRemoved: attrs.fileSize];
+            } else {
+                if (!error)
+                    error = error1;
+                Warn(@"%@: Failed to delete '%@': %@", self, path.lastPathComponent,
+                     error1.my_compactDescription);
             }
         }
+    }];
+    for (NSData* keyData in self.packedKeys) {
+        CBLBlobKey curKey;
+        [keyData getBytes: &curKey length: sizeof(curKey)];
+        if (!predicate(curKey)) {
+            [self uncacheBlobForKey: curKey];
+            if ([self unpackBlobForKey: curKey])
+                ++numDeleted;
+        }
+    }
+    for (NSData* keyData in self.chunkedKeys) {
+        CBLBlobKey curKey;
+        [keyData getBytes: &curKey length: sizeof(curKey)];
+        if (!predicate(curKey) && [self deleteManifestForKey: curKey])
+            ++numDeleted;
+    }
+    if (!error) {
+        NSError* error1;
+        if (![self compactStorage: &error1])
+            error = error1;
     }
     if (error) {
         if (outError)
@@ -344,6 +2079,35 @@ UsingLogDomain(Database);
 }
 
 
+- (BOOL) compactStorage: (NSError**)outError {
+    if (![self compactPacks: outError])
+        return NO;
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: NO];
+    if (!chunkStore)
+        return YES;
+    // Delete the chunks that no chunked blob uses any more, and that aren't pending. Writers can't
+    // mark chunks pending during the sweep, so a chunk can't be revived after it's judged dead:
+    CBLBlobStoreState* state = _state;
+    NSCountedSet* pending = state ? state->pendingChunks : [NSCountedSet set];
+    NSInteger numChunks;
+    @synchronized(pending) {
+        NSMutableSet* liveChunks = [NSMutableSet set];
+        for (NSData* keyData in self.chunkedKeys) {
+            CBLBlobKey key;
+            [keyData getBytes: &key length: sizeof(key)];
+            [liveChunks addObjectsFromArray: [self chunkKeysForKey: key]];
+        }
+        numChunks = [chunkStore deleteBlobsExceptMatching: ^BOOL(CBLBlobKey chunkKey) {
+            NSData* keyData = [NSData dataWithBytes: &chunkKey length: sizeof(chunkKey)];
+            return [liveChunks containsObject: keyData] || [pending containsObject: keyData];
+        } error: outError];
+    }
+    if (numChunks > 0)
+        LogTo(Database, @"CBL_BlobStore: Deleted %ld unused chunks", (long)numChunks);
+    return numChunks >= 0;
+}
+
+
 // Adds/removes the "_encryption" file that marks an encrypted blob-store
 - (BOOL) markEncrypted: (BOOL)encrypted error: (NSError**)outError {
     NSString* encMarkerPath = [_path stringByAppendingPathComponent: kEncryptionMarkerFilename];
@@ -357,16 +2121,35 @@ UsingLogDomain(Database);
 
 
 - (MYAction*) actionToChangeEncryptionKey: (CBLSymmetricKey*)newKey {
+    return [self actionToChangeEncryptionKey: newKey progress: nil];
+}
+
+
+- (MYAction*) actionToChangeEncryptionKey: (CBLSymmetricKey*)newKey
+                                 progress: (CBLProgressGroup*)progress
+{
     MYAction* action = [MYAction new];
 
     // Find all the blob files:
-    __block NSArray* blobs = nil;
+    NSMutableArray* blobs = [NSMutableArray array];
+    __block int64_t totalBytes = 0;
     CBLSymmetricKey* oldKey = _encryptionKey;
 
     NSFileManager* fmgr = [NSFileManager defaultManager];
-    blobs = [fmgr contentsOfDirectoryAtPath: _path error: NULL];
-    blobs = [blobs pathsMatchingExtensions: @[@kFileExtension]];
-    if (blobs.count == 0) {
+    [self forEachBlob: ^(CBLBlobKey key, NSString* path) {
+        [blobs addObject: path];
+        totalBytes += [fmgr attributesOfItemAtPath: path error: NULL].fileSize;
+    }];
+    NSArray* packedKeys = self.packedKeys;
+    // ...and the chunks of chunked blobs, which are in their own store:
+    CBL_BlobStore* chunkStore = [self chunkStoreCreating: NO];
+    NSMutableArray* chunkFiles = [NSMutableArray array];
+    [chunkStore forEachBlob: ^(CBLBlobKey key, NSString* path) {
+        [chunkFiles addObject: path];
+        totalBytes += [fmgr attributesOfItemAtPath: path error: NULL].fileSize;
+    }];
+    NSArray* chunkedKeys = self.chunkedKeys;
+    if (blobs.count == 0 && packedKeys.count == 0 && chunkedKeys.count == 0) {
         // No blobs, so nothing to encrypt. Just add/remove the encryption marker file:
         [action addPerform: ^BOOL(NSError** outError) {
             Log(@"CBLBlobStore: %@ %@", (newKey ? @"encrypting" : @"decrypting"), _path);
@@ -380,52 +2163,99 @@ UsingLogDomain(Database);
         return action;
     }
 
-    // Create a new directory for the new blob store. Have to do this now, before starting the
-    // action, because farther down we create an action to move it...
-    NSError* createTempDirError;
-    NSString* tempPath = [self createTempDir: &createTempDirError];
-    [action addPerform:^BOOL(NSError** _Nonnull outError) {
+    // The new blob store is built in a directory next to this one. If a previous attempt with the
+    // same new key was interrupted, its directory is reused and the blobs it already copied are
+    // skipped. (It's deliberately not deleted on failure, so a retry can resume.)
+    NSString* tempPath = [_path stringByAppendingPathExtension: kRekeyDirExtension];
+    [action addPerform:^BOOL(NSError** outError) {
         Log(@"CBLBlobStore: %@ %@", (newKey ? @"encrypting" : @"decrypting"), _path);
-        *outError = createTempDirError;
-        return tempPath != nil;
-    } backOut:^BOOL(NSError** outError) {
-        return [fmgr removeItemAtPath: tempPath error: outError];
-    } cleanUp: nil];
+        return [self prepareRekeyDir: tempPath forKey: newKey error: outError];
+    } backOut: nil cleanUp: nil];
 
     __block CBL_BlobStore* tempStore;
     [action addPerform:^BOOL(NSError** outError) {
         tempStore = [[CBL_BlobStore alloc] initInternalWithPath: tempPath
                                                   encryptionKey: newKey];
-        return [tempStore markEncrypted: (newKey != nil) error: outError];
+        // Give it a private state so it can write pack files:
+        tempStore->_state = [CBLBlobStoreState new];
+        tempStore->_state->openCount = 1;
+        tempStore->_maxPackedBlobLength = _maxPackedBlobLength;
+        tempStore->_minChunkedBlobLength = _minChunkedBlobLength;
+        return [tempStore markEncrypted: (newKey != nil) error: outError]
+            && [tempStore writeLayout: _layout error: outError]
+            && tempStore.tempDir != nil;   // create it now, not from several threads at once
     } backOut: nil cleanUp: nil];
 
     // Copy each of my blobs into the new store (which will update its encryption):
     [action addPerform:^BOOL(NSError** outError) {
-        for (NSString* blobName in blobs) {
-            // Copy file by reading with old key and writing with new one:
-            Log(@"    Copying %@", blobName);
-            NSString* srcFile = [_path stringByAppendingPathComponent: blobName];
-            NSInputStream* readStream = [NSInputStream inputStreamWithFileAtPath: srcFile];
-            [readStream open];
-            if (readStream.streamError) {
-                *outError = readStream.streamError;
-                return NO;
-            }
-            if (_encryptionKey)
-                readStream = [_encryptionKey decryptStream: readStream];
-
-            CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: tempStore];
-            BOOL ok = [writer appendInputStream: readStream error: outError];
-            [readStream close];
-            if (ok) {
-                [writer finish];
-                [writer install];
-            } else {
-                [writer cancel];
-                return NO;
-            }
+        // The group calls its cancellationHandler when its last NSProgress is canceled, possibly
+        // on another thread; that sets a flag the copying checks. (The group's isCanceled can't be
+        // used, since it's also YES if the caller never gave it any NSProgress.)
+        __block atomic_bool canceled = false;
+        void (^prevCancellationHandler)(void) = progress.cancellationHandler;
+        progress.cancellationHandler = ^{
+            atomic_store(&canceled, true);
+            if (prevCancellationHandler)
+                prevCancellationHandler();
+        };
+        BOOL (^isCanceled)(void) = ^BOOL{
+            return atomic_load(&canceled);
+        };
+
+        int64_t bytesCopied = 0;
+        [progress setTotalUnitCount: totalBytes];
+        BOOL ok = [self copyBlobFiles: blobs toStore: tempStore
+                             progress: progress canceled: isCanceled
+                          bytesCopied: &bytesCopied error: outError];
+        if (ok && chunkFiles.count > 0) {
+            CBL_BlobStore* tempChunkStore = [tempStore chunkStoreCreating: YES];
+            ok = tempChunkStore && tempChunkStore.tempDir != nil
+                && [chunkStore copyBlobFiles: chunkFiles toStore: tempChunkStore
+                                    progress: progress canceled: isCanceled
+                                 bytesCopied: &bytesCopied error: outError];
         }
-        return YES;
+        progress.cancellationHandler = prevCancellationHandler;
+        for (NSData* keyData in chunkedKeys) {
+            if (!ok)
+                break;
+            CBLBlobKey key;
+            [keyData getBytes: &key length: sizeof(key)];
+            if ([tempStore hasBlobForKey: key])
+                continue;
+            NSData* manifest = [self manifestForKey: key];
+            if (!manifest && ![self hasBlobForKey: key])
+                continue;   // deleted since the rekey started
+            ok = manifest && [tempStore writeManifest: manifest forKey: key error: outError];
+        }
+        for (NSData* keyData in packedKeys) {
+            if (!ok)
+                break;
+            CBLBlobKey key, copiedKey;
+            [keyData getBytes: &key length: sizeof(key)];
+            if ([tempStore hasBlobForKey: key])
+                continue;
+            NSData* blob = [self blobForKey: key];
+            if (!blob && ![self hasBlobForKey: key])
+                continue;   // deleted since the rekey started
+            ok = blob && [tempStore storeBlob: blob creatingKey: &copiedKey];
+            if (!ok)
+                CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+        }
+        // If this resumed an interrupted rekey, the directory may hold blobs that have since been
+        // deleted from me; they mustn't come back to life:
+        if (ok && [tempStore deleteBlobsExceptMatching: ^BOOL(CBLBlobKey key) {
+                                                    return [self hasBlobForKey: key];
+                                                } error: outError] < 0)
+            ok = NO;
+        [tempStore close];
+        if (!ok) {
+            [progress failedWithError: (outError ? *outError : nil)];
+            return NO;
+        }
+        [progress finished];
+        // It's about to become the real store, so it no longer needs the journal marker:
+        return CBLRemoveFileIfExists([tempPath stringByAppendingPathComponent: kRekeyMarkerFilename],
+                                     outError);
     } backOut: nil cleanUp: nil];
 
     // Replace the attachment dir with the new one:
@@ -434,6 +2264,7 @@ UsingLogDomain(Database);
     // Finally update _encryptionKey:
     [action addPerform:^BOOL(NSError** outError) {
         _encryptionKey = newKey;
+        [self resetState];     // file sizes have changed, and pack files are new
         return YES;
     } backOut: ^BOOL(NSError** outError) {
         _encryptionKey = oldKey;
@@ -443,6 +2274,157 @@ UsingLogDomain(Database);
 }
 
 
+// Identifies the key a rekey directory is being built with, without revealing the key.
+static NSString* rekeyFingerprint(CBLSymmetricKey* key) {
+    if (!key)
+        return @"none";
+    NSData* label = [@"CBL rekey" dataUsingEncoding: NSUTF8StringEncoding];
+    NSData* digest = CBLHMACSHA256(key.keyData, label);
+    return CBLHexFromBytes(digest.bytes, digest.length);
+}
+
+
+// Creates the directory the rekeyed store is built in, or reuses it if it's left over from an
+// interrupted rekey to the same key. The marker file in it serves as the journal: every blob
+// that's been installed in the directory is complete, since installation is an atomic move.
+- (BOOL) prepareRekeyDir: (NSString*)tempPath
+                  forKey: (CBLSymmetricKey*)newKey
+                   error: (NSError**)outError
+{
+    NSFileManager* fmgr = [NSFileManager defaultManager];
+    NSString* markerPath = [tempPath stringByAppendingPathComponent: kRekeyMarkerFilename];
+    NSString* fingerprint = rekeyFingerprint(newKey);
+    NSString* existing = [NSString stringWithContentsOfFile: markerPath
+                                                   encoding: NSUTF8StringEncoding error: NULL];
+    if ($equal(existing, fingerprint)) {
+        Log(@"    Resuming interrupted rekey in %@", tempPath);
+        return YES;
+    }
+    if (![fmgr removeItemAtPath: tempPath error: outError] && [fmgr fileExistsAtPath: tempPath])
+        return NO;
+    return [fmgr createDirectoryAtPath: tempPath withIntermediateDirectories: NO
+                            attributes: nil error: outError]
+        && [fingerprint writeToFile: markerPath atomically: YES
+                           encoding: NSUTF8StringEncoding error: outError];
+}
+
+
+// Re-encrypts blob files into another store, on up to kMaxConcurrentRekeys threads.
+// Blobs that are already in the destination store, or no longer in mine, are skipped. Stops with a kCBLStatusCanceled
+// error once the isCanceled block (which must be thread-safe) returns YES.
+- (BOOL) copyBlobFiles: (NSArray*)blobs
+               toStore: (CBL_BlobStore*)dstStore
+              progress: (CBLProgressGroup*)progress
+              canceled: (BOOL (^)(void))isCanceled
+           bytesCopied: (int64_t*)ioBytesCopied
+                 error: (NSError**)outError
+{
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_group_t group = dispatch_group_create();
+    dispatch_semaphore_t slots = dispatch_semaphore_create(kMaxConcurrentRekeys);
+    __block NSError* firstError = nil;
+    __block int64_t bytesCopied = *ioBytesCopied;
+    __block NSUInteger numCopied = 0;
+    NSObject* lock = [NSObject new];
+
+    // The progress object isn't thread-safe, so it's only updated on this thread, while waiting:
+    dispatch_time_t (^nextUpdate)(void) = ^{
+        return dispatch_time(DISPATCH_TIME_NOW, (int64_t)(kRekeyProgressInterval * NSEC_PER_SEC));
+    };
+    void (^updateProgress)(void) = ^{
+        @synchronized(lock) {
+            [progress setCompletedUnitCount: bytesCopied];
+        }
+    };
+
+    for (NSString* srcFile in blobs) {
+        while (dispatch_semaphore_wait(slots, nextUpdate()) != 0)
+            updateProgress();
+        BOOL failed;
+        @synchronized(lock) {
+            failed = (firstError != nil);
+        }
+        if (failed || (isCanceled && isCanceled())) {
+            dispatch_semaphore_signal(slots);
+            break;
+        }
+        dispatch_group_async(group, queue, ^{
+            @autoreleasepool {
+                UInt64 size = [[NSFileManager defaultManager] attributesOfItemAtPath: srcFile
+                                                                               error: NULL].fileSize;
+                NSError* error;
+                CBLBlobKey key;
+                BOOL ok = YES, copied = NO;
+                BOOL hasKey = [[self class] getKey: &key forFilename: srcFile.lastPathComponent];
+                if (hasKey && ![self hasBlobForKey: key]) {
+                    // Deleted since the rekey started, so don't copy it
+                } else if (!hasKey || ![dstStore hasBlobForKey: key]) {
+                    ok = [self copyBlobFile: srcFile toStore: dstStore error: &error];
+                    copied = YES;
+                }
+                @synchronized(lock) {
+                    if (!ok && !firstError)
+                        firstError = error;
+                    bytesCopied += size;
+                    if (copied)
+                        ++numCopied;
+                }
+            }
+            dispatch_semaphore_signal(slots);
+        });
+    }
+    while (dispatch_group_wait(group, nextUpdate()) != 0)
+        updateProgress();
+    updateProgress();
+    *ioBytesCopied = bytesCopied;
+
+    if (!firstError && isCanceled && isCanceled())
+        firstError = CBLStatusToNSError(kCBLStatusCanceled);
+    LogTo(Database, @"    Re-encrypted %lu of %lu blob files (%lld bytes)",
+          (unsigned long)numCopied, (unsigned long)blobs.count, bytesCopied);
+    if (firstError) {
+        if (outError)
+            *outError = firstError;
+        return NO;
+    }
+    return YES;
+}
+
+
+// Copies a blob file by reading with my key and writing with the other store's.
+- (BOOL) copyBlobFile: (NSString*)srcFile
+              toStore: (CBL_BlobStore*)dstStore
+                error: (NSError**)outError
+{
+    LogVerbose(Database, @"    Copying %@", srcFile.lastPathComponent);
+#if DEBUG
+    if (CBLBlobStoreRekeyFileFilter && !CBLBlobStoreRekeyFileFilter(srcFile))
+        return CBLStatusToOutNSError(kCBLStatusAttachmentError, outError);
+#endif
+    NSInputStream* readStream = [NSInputStream inputStreamWithFileAtPath: srcFile];
+    [readStream open];
+    if (readStream.streamError) {
+        if (outError)
+            *outError = readStream.streamError;
+        return NO;
+    }
+    if (_encryptionKey)
+        readStream = [_encryptionKey decryptStream: readStream];
+
+    CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: dstStore];
+    writer.computesMD5 = NO;    // only the key (SHA-1) is needed
+    BOOL ok = [writer appendInputStream: readStream error: outError];
+    [readStream close];
+    if (ok) {
+        [writer finish];
+        [writer install];
+    } else {
+        [writer cancel];
+    }
+    return ok;
+}
+
+
 - (BOOL) changeEncryptionKey: (CBLSymmetricKey*)newKey
                        error: (NSError**)outError
 {
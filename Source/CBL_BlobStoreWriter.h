@@ -25,7 +25,13 @@
 
 @property CBLProgressGroup* progress;
 
-/** Appends data to the blob. Call this when new data is available. */
+/** Whether to compute an MD5 digest as well as the SHA-1 digest. Defaults to YES; set it to NO
+    before appending any data if nothing will need MD5DigestString (e.g. the expected digest is
+    known to be SHA-1), to save CPU time. */
+@property (nonatomic) BOOL computesMD5;
+
+/** Appends data to the blob. Call this when new data is available.
+    The data is copied, so the caller may reuse its buffer afterwards. */
 - (void) appendData: (NSData*)data;
 
 - (BOOL) appendInputStream: (NSInputStream*)readStream
@@ -54,7 +60,8 @@
 @property (readonly) CBLBlobKey blobKey;
 
 /** After finishing, this is the MD5 digest of the blob, in base64 with an "md5-" prefix.
-    (This is useful for compatibility with CouchDB, which stores MD5 digests of attachments.) */
+    (This is useful for compatibility with CouchDB, which stores MD5 digests of attachments.)
+    Will be nil if computesMD5 is NO. */
 @property (readonly) NSString* MD5DigestString;
 @property (readonly) NSString* SHA1DigestString;
 
@@ -24,6 +24,14 @@ typedef struct {
 } CBLMD5Key;
 
 
+// Appended data is coalesced into batches of at least this size before being handed to the
+// hashing queues, so small appends (like 4KB network reads) don't each pay for a dispatch.
+#define kHashBatchSize (64*1024)
+
+// Max number of batches that can be waiting to be hashed before -appendData: blocks.
+#define kMaxPendingHashBatches 8
+
+
 @implementation CBL_BlobStoreWriter
 {
     @private
@@ -34,11 +42,15 @@ typedef struct {
     SHA_CTX _shaCtx;
     MD5_CTX _md5Ctx;
     CBLMD5Key _MD5Digest;
+    BOOL _computesMD5;
+    NSMutableData* _hashBatch;          // Data appended but not yet sent to the hash queues
+    dispatch_queue_t _sha1Queue, _md5Queue;
+    dispatch_semaphore_t _sha1Backlog, _md5Backlog;
     CBLCryptorBlock _encryptor;
     CBLProgressGroup* _progress;
 }
 @synthesize name=_name, bytesWritten=_bytesWritten, contentLength=_contentLength;
-@synthesize blobKey=_blobKey, eTag=_eTag;
+@synthesize blobKey=_blobKey, eTag=_eTag, computesMD5=_computesMD5;
 
 
 - (instancetype) initWithStore: (CBL_BlobStore*)store {
@@ -47,6 +59,13 @@ typedef struct {
         _store = store;
         SHA1_Init(&_shaCtx);
         MD5_Init(&_md5Ctx);
+        _computesMD5 = YES;
+        // The two digests are computed on their own serial queues, so they run in parallel with
+        // each other and with the file I/O and encryption done on the caller's thread:
+        _sha1Queue = dispatch_queue_create("CBL_BlobStoreWriter SHA-1", DISPATCH_QUEUE_SERIAL);
+        _md5Queue  = dispatch_queue_create("CBL_BlobStoreWriter MD5", DISPATCH_QUEUE_SERIAL);
+        _sha1Backlog = dispatch_semaphore_create(kMaxPendingHashBatches);
+        _md5Backlog  = dispatch_semaphore_create(kMaxPendingHashBatches);
                 
         // Open a temporary file in the store's temporary directory: 
         NSString* filename = [CBLCreateUUID() stringByAppendingPathExtension: @"blobtmp"];
@@ -66,7 +85,7 @@ typedef struct {
             return nil;
         CBLSymmetricKey* encryptionKey = _store.encryptionKey;
         if (encryptionKey)
-            _encryptor = [encryptionKey createEncryptor];
+            _encryptor = [encryptionKey createChunkedEncryptor];
 }
     return self;
 }
@@ -89,13 +108,56 @@ typedef struct {
     return _progress;
 }
 
+- (void) setComputesMD5: (BOOL)computesMD5 {
+    Assert(_bytesWritten == 0, @"Too late to change computesMD5");
+    _computesMD5 = computesMD5;
+}
+
+
+// Hands a batch of data to the hashing queues. The batch must not be modified afterwards.
+// Blocks if too many earlier batches are still waiting to be hashed, to bound memory use.
+- (void) hashBatch: (NSData*)batch {
+    dispatch_semaphore_t sha1Backlog = _sha1Backlog;
+    dispatch_semaphore_wait(sha1Backlog, DISPATCH_TIME_FOREVER);
+    dispatch_async(_sha1Queue, ^{
+        SHA1_Update(&_shaCtx, batch.bytes, batch.length);
+        dispatch_semaphore_signal(sha1Backlog);
+    });
+    if (_computesMD5) {
+        dispatch_semaphore_t md5Backlog = _md5Backlog;
+        dispatch_semaphore_wait(md5Backlog, DISPATCH_TIME_FOREVER);
+        dispatch_async(_md5Queue, ^{
+            MD5_Update(&_md5Ctx, batch.bytes, batch.length);
+            dispatch_semaphore_signal(md5Backlog);
+        });
+    }
+}
+
+
+// Sends any partial batch to the hash queues and waits until they've processed everything.
+- (void) flushHashes {
+    if (_hashBatch.length > 0)
+        [self hashBatch: _hashBatch];
+    _hashBatch = nil;
+    dispatch_sync(_sha1Queue, ^{ });
+    dispatch_sync(_md5Queue, ^{ });
+}
+
 - (void) appendData: (NSData*)data {
     Assert(_out, @"Not open");
     NSUInteger dataLen = data.length;
     _bytesWritten += dataLen;
     _progress.completedUnitCount = _bytesWritten;
-    SHA1_Update(&_shaCtx, data.bytes, dataLen);
-    MD5_Update(&_md5Ctx, data.bytes, dataLen);
+
+    // Hashing happens asynchronously, and callers often pass data that points into a reusable
+    // buffer, so the bytes have to be copied. (Copying is far cheaper than hashing.)
+    if (!_hashBatch)
+        _hashBatch = [[NSMutableData alloc] initWithCapacity: MAX(dataLen, kHashBatchSize)];
+    [_hashBatch appendData: data];
+    if (_hashBatch.length >= kHashBatchSize) {
+        [self hashBatch: _hashBatch];
+        _hashBatch = nil;
+    }
 
     if (_encryptor)
         data = _encryptor(data);
@@ -147,6 +209,8 @@ typedef struct {
 
 - (void) reset {
     [_out truncateFileAtOffset: 0];
+    _hashBatch = nil;
+    [self flushHashes];
     SHA1_Init(&_shaCtx);
     MD5_Init(&_md5Ctx);
     _progress.completedUnitCount = 0;
@@ -160,12 +224,15 @@ typedef struct {
         _encryptor = nil;
     }
     [self closeFile];
+    [self flushHashes];
     SHA1_Final(_blobKey.bytes, &_shaCtx);
     MD5_Final(_MD5Digest.bytes, &_md5Ctx);
 }
 
 
 - (NSString*) MD5DigestString {
+    if (!_computesMD5)
+        return nil;
     return [@"md5-" stringByAppendingString: [CBLBase64 encode: &_MD5Digest
                                                         length: sizeof(_MD5Digest)]];
 }
@@ -181,10 +248,16 @@ typedef struct {
     if (digestString == nil)
         return YES;
     NSString* actualDigest;
-    if ([digestString hasPrefix: @"md5-"])
+    if ([digestString hasPrefix: @"md5-"]) {
         actualDigest = self.MD5DigestString;
-    else
+        if (!actualDigest) {
+            Warn(@"Can't verify attachment '%@' against %@: MD5 digest wasn't computed",
+                 _name, digestString);
+            return NO;
+        }
+    } else {
         actualDigest = self.SHA1DigestString;
+    }
     if ([actualDigest isEqualToString: digestString]) {
         return YES;
     } else {
@@ -228,9 +301,7 @@ typedef struct {
         return YES;  // already installed
     Assert(!_out, @"Not finished");
     // Move temp file to correct location in blob store:
-    NSString* dstPath = [_store rawPathForKey: _blobKey];
-    if ([[NSFileManager defaultManager] moveItemAtPath: _tempPath
-                                                toPath: dstPath error:NULL]) {
+    if ([_store installFileAtPath: _tempPath forKey: _blobKey]) {
         _tempPath = nil;
     } else {
         // If the move fails, assume it means a file with the same name already exists; in that
@@ -150,6 +150,18 @@
 
 - (id) asObject {
     if (!_object && !_error) {
+        // An object's values are parsed lazily, since callers often look at only a few of them:
+        const char* start = _json.bytes;
+        size_t length = _json.length;
+        while (length > 0 && isspace(*start)) {
+            ++start;
+            --length;
+        }
+        if (length > 0 && *start == '{') {
+            _object = [[CBLLazyDictionaryOfJSON alloc] initWithJSON: _json extraProperties: nil];
+            if (_object)
+                return _object;
+        }
         NSError* error = nil;
         _object = [[CBLJSON JSONObjectWithData: _json options: 0 error: &error] copy];
         if (!_object) {
@@ -328,6 +328,48 @@ static CBLStatus selectRev(C4Document* doc, CBL_RevID* revID, BOOL withBody) {
 }
 
 
+- (NSArray*) getDocumentsWithIDs: (NSArray<NSString*>*)docIDs
+                        withBody: (BOOL)withBody
+                          status: (CBLStatus*)outStatus
+{
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity: docIDs.count];
+    for (NSUInteger i = 0; i < docIDs.count; i++)
+        [results addObject: [NSNull null]];
+
+    // Look up the docs in sorted order, so consecutive reads hit nearby parts of the B-tree:
+    NSMutableArray<NSNumber*>* order = [NSMutableArray arrayWithCapacity: docIDs.count];
+    for (NSUInteger i = 0; i < docIDs.count; i++)
+        [order addObject: @(i)];
+    [order sortUsingComparator: ^NSComparisonResult(NSNumber* a, NSNumber* b) {
+        return [docIDs[a.unsignedIntegerValue] compare: docIDs[b.unsignedIntegerValue]
+                                               options: NSLiteralSearch];
+    }];
+
+    for (NSNumber* index in order) {
+        NSUInteger i = index.unsignedIntegerValue;
+        CBLStatus status;
+        CLEANUP(C4Document) *doc = [self getC4Doc: docIDs[i] status: &status];
+        if (!doc) {
+            if (status == kCBLStatusNotFound)
+                continue;
+            *outStatus = status;
+            return nil;
+        }
+        if (selectRev(doc, nil, withBody) != kCBLStatusOK
+                || (doc->selectedRev.flags & kRevDeleted))
+            continue;
+        CBL_MutableRevision* rev = [CBLForestBridge revisionObjectFromForestDoc: doc
+                                                                          docID: docIDs[i]
+                                                                          revID: nil
+                                                                       withBody: withBody
+                                                                         status: &status];
+        if (rev)
+            results[i] = rev;
+    }
+    return results;
+}
+
+
 - (NSDictionary*) getBodyWithID: (NSString*)docID
                        sequence: (SequenceNumber)sequence
                          status: (CBLStatus*)outStatus
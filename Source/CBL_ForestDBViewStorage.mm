@@ -353,7 +353,7 @@ static NSString* keyToJSONStr(id key) { // only used for logging
     }
 
     // Set up the emit block:
-    __block NSMutableDictionary* body;
+    __block NSDictionary* body;
     NSMutableArray* emittedJSONValues = [NSMutableArray new];
     CLEANUP(C4KeyValueList)* emitted = c4kv_new();
     CBLMapEmitBlock emit = ^(id key, id value) {
@@ -399,14 +399,15 @@ static NSString* keyToJSONStr(id key) { // only used for logging
             if (doc->docID.size >= 8 && memcmp(doc->docID.buf, "_design/", 8) == 0)
                 continue;
 
-            // Read the document body:
-            body = [CBLForestBridge bodyOfSelectedRevision: doc];
-            [body cbl_setID: slice2string(doc->docID)
-                     revStr: slice2string(doc->revID)];
-            body[@"_local_seq"] = @(doc->sequence);
+            // Read the document body. Its values are parsed lazily, since map functions often
+            // look at only a few of them:
+            NSMutableDictionary* extra = $mdict({@"_local_seq", @(doc->sequence)});
+            [extra cbl_setID: slice2string(doc->docID)
+                      revStr: slice2string(doc->revID)];
             if (doc->flags & kConflicted) {
-                body[@"_conflicts"] = [self getConflictingRevisionIDs: doc];
+                extra[@"_conflicts"] = [self getConflictingRevisionIDs: doc];
             }
+            body = [CBLForestBridge lazyBodyOfSelectedRevision: doc extraProperties: extra];
             LogVerbose(View, @"Mapping %@ rev %@", body.cbl_id, body.cbl_rev);
 
             // Feed it to each view's map function:
@@ -143,6 +143,7 @@
     if (num_docs == NSNotFound || update_seq == NSNotFound)
         return kCBLStatusDBError;
     UInt64 startTime = (UInt64)(db.startTime.timeIntervalSince1970 * 1.0e6); // it's in microseconds
+    NSDictionary* compaction = db.compactionInfo;
     _response.bodyObject = $dict({@"db_name", db.name},
                                  {@"db_uuid", db.publicUUID},
                                  {@"doc_count", @(num_docs)},
@@ -151,7 +152,10 @@
                                  {@"purge_seq", @(0)}, // TODO: Implement
                                  {@"disk_size", @(db.totalDataSize)},
                                  {@"instance_start_time", @(startTime)},
-                                 {@"revs_limit", @(db.maxRevTreeDepth)});
+                                 {@"revs_limit", @(db.maxRevTreeDepth)},
+                                 {@"compact_running", @([compaction[@"compacting"] boolValue])},
+                                 {@"compaction", compaction},
+                                 {@"doc_id_cache", db.docIDCacheInfo});
     return kCBLStatusOK;
 }
 
@@ -187,6 +191,7 @@
     CBLStatus status = [db.storage purgeRevisions: body result: &purgedDocs];
     if (CBLStatusIsError(status))
         return status;
+    [db garbageCollectAttachmentsInBackground];
     _response.bodyObject = $dict({@"purged", purgedDocs});
     return status;
 }
@@ -218,29 +223,32 @@
     return [self doAllDocs: options];
 }
 
+- (NSDictionary*) JSONForQueryRow: (CBLQueryRow*)row options: (CBLContentOptions)options {
+    NSDictionary* dict = row.asJSONDictionary;
+    if (options != 0) {
+        NSDictionary* doc = dict[@"doc"];
+        if (doc) {
+            // Add content options:
+            CBL_Revision* rev = [CBL_Revision revisionWithProperties: doc];
+            CBLStatus status;
+            rev = [self applyOptions: options toRevision: rev status: &status];
+            if (rev) {
+                NSMutableDictionary* mdict = [dict mutableCopy];
+                mdict[@"doc"] = rev.properties;
+                dict = mdict;
+            }
+        }
+    }
+    return dict;
+}
+
 - (NSArray*) queryIteratorAllRows: (CBLQueryEnumerator*) iterator
 {
     CBLContentOptions options = self.contentOptions;
     NSMutableArray* result = $marray();
     CBLQueryRow* row;
-    while (nil != (row = iterator.nextObject)) {
-        NSDictionary* dict = row.asJSONDictionary;
-        if (options != 0) {
-            NSDictionary* doc = dict[@"doc"];
-            if (doc) {
-                // Add content options:
-                CBL_Revision* rev = [CBL_Revision revisionWithProperties: doc];
-                CBLStatus status;
-                rev = [self applyOptions: options toRevision: rev status: &status];
-                if (rev) {
-                    NSMutableDictionary* mdict = [dict mutableCopy];
-                    mdict[@"doc"] = rev.properties;
-                    dict = mdict;
-                }
-            }
-        }
-        [result addObject: dict];
-    }
+    while (nil != (row = iterator.nextObject))
+        [result addObject: [self JSONForQueryRow: row options: options]];
     return result;
 }
 
@@ -250,15 +258,35 @@
     CBLQueryEnumerator* iterator = [_db getAllDocs: options status: &status];
     if (!iterator)
         return status;
+    id updateSeq = options->updateSeq ? @(_db.lastSequenceNumber) : nil;
+    if (self.canStreamResponse) {
+        return [self streamQueryRows: iterator trailer: ^NSDictionary*(NSUInteger rowCount) {
+            return $dict({@"total_rows", @(rowCount)},
+                         {@"offset", @(options->skip)},
+                         {@"update_seq", updateSeq});
+        }];
+    }
     NSArray* result = [self queryIteratorAllRows: iterator];
     _response.bodyObject = $dict({@"rows", result},
                                  {@"total_rows", @(result.count)},
                                  {@"offset", @(options->skip)},
-                                 {@"update_seq", (options->updateSeq ? @(_db.lastSequenceNumber) : nil)});
+                                 {@"update_seq", updateSeq});
     return kCBLStatusOK;
 }
 
 
+// The item in a _bulk_docs response for a doc that couldn't be saved.
+static NSDictionary* bulkDocsError(NSString* docID, CBLStatus status, NSError* error) {
+    NSString* errorMessage = nil;
+    status = CBLStatusToHTTPStatus(status, &errorMessage);
+    NSString* reason = error.localizedFailureReason;
+    if (reason)
+        return $dict({@"id", docID}, {@"error", errorMessage}, {@"reason", reason}, {@"status", @(status)});
+    else
+        return $dict({@"id", docID}, {@"error", errorMessage}, {@"status", @(status)});
+}
+
+
 - (CBLStatus) do_POST_bulk_docs: (CBLDatabase*)db {
     // http://wiki.apache.org/couchdb/HTTP_Bulk_Document_API
     NSDictionary* body = self.bodyAsDictionary;
@@ -269,6 +297,18 @@
     BOOL allOrNothing = (allObj && allObj != $false);
     BOOL noNewEdits = (body[@"new_edits"] == $false);
 
+    // New revisions can be saved in bulk, unless there are local docs or expiration times:
+    BOOL bulk = !noNewEdits;
+    for (NSDictionary* doc in docs) {
+        if (![doc isKindOfClass: [NSDictionary class]] || [doc.cbl_id hasPrefix: @"_local/"]
+                                                       || doc[@"_exp"]) {
+            bulk = NO;
+            break;
+        }
+    }
+    if (bulk)
+        return [self bulkSaveDocs: docs toDatabase: db allOrNothing: allOrNothing];
+
     return [_db.storage inTransaction: ^CBLStatus {
         NSMutableArray* results = [NSMutableArray arrayWithCapacity: docs.count];
         for (NSDictionary* doc in docs) {
@@ -307,13 +347,7 @@
                         _response.statusReason = error.localizedFailureReason;
                     return status;  // all_or_nothing backs out if there's any error
                 } else {
-                    NSString* errorMessage = nil;
-                    status = CBLStatusToHTTPStatus(status, &errorMessage);
-                    NSString* reason = error.localizedFailureReason;
-                    if (reason)
-                        result = $dict({@"id", docID}, {@"error", errorMessage}, {@"reason", reason}, {@"status", @(status)});
-                    else
-                        result = $dict({@"id", docID}, {@"error", errorMessage}, {@"status", @(status)});
+                    result = bulkDocsError(docID, status, error);
                 }
                 if (result)
                     [results addObject: result];
@@ -325,6 +359,45 @@
 }
 
 
+// Saves new revisions of the docs in a _bulk_docs request with -putDocuments:.
+- (CBLStatus) bulkSaveDocs: (NSArray*)docs
+                toDatabase: (CBLDatabase*)db
+              allOrNothing: (BOOL)allOrNothing
+{
+    return [_db.storage inTransaction: ^CBLStatus {
+        NSMutableArray* docsToPut = [NSMutableArray arrayWithCapacity: docs.count];
+        for (NSDictionary* doc in docs)
+            [docsToPut addObject: [doc mutableCopy]];
+        NSError* error;
+        NSArray* revs = [db putDocuments: docsToPut allowConflict: allOrNothing
+                                  source: self.source error: &error];
+        if (!revs)
+            return CBLStatusFromNSError(error, kCBLStatusDBError);
+
+        NSMutableArray* results = [NSMutableArray arrayWithCapacity: revs.count];
+        for (NSUInteger i = 0; i < revs.count; i++) {
+            CBL_Revision* rev = $castIf(CBL_Revision, revs[i]);
+            if (rev) {
+                [results addObject: $dict({@"id", rev.docID}, {@"rev", rev.revIDString},
+                                          {@"ok", $true})];
+                continue;
+            }
+            NSError* error = revs[i];
+            CBLStatus status = CBLStatusFromNSError(error, kCBLStatusDBError);
+            if (status >= 500) {
+                return status;  // abort the whole thing if something goes badly wrong
+            } else if (allOrNothing) {
+                _response.statusReason = error.localizedFailureReason;
+                return status;  // all_or_nothing backs out if there's any error
+            }
+            [results addObject: bulkDocsError([docs[i] cbl_id], status, error)];
+        }
+        _response.bodyObject = results;
+        return kCBLStatusCreated;
+    }];
+}
+
+
 - (CBLStatus) do_POST_revs_diff: (CBLDatabase*)db {
     // http://wiki.apache.org/couchdb/HttpPostRevsDiff
     // Collect all of the input doc/revision IDs as CBL_Revisions:
@@ -390,16 +463,28 @@
 
 
 - (CBLStatus) do_POST_compact: (CBLDatabase*)db {
-    if ([db compact: NULL])
+    if ([db compactInBackground])
         return kCBLStatusAccepted;   // CouchDB returns 202 'cause it's async
     else
-        return kCBLStatusDBError;
+        return kCBLStatusForbidden;
 }
 
 - (CBLStatus) do_POST_ensure_full_commit: (CBLDatabase*)db {
     return kCBLStatusOK;
 }
 
+// Not a CouchDB API; a diagnostic for finding hot or slow queries. "?collect=" turns collection
+// of per-statement statistics on or off.
+- (CBLStatus) do_GET_statement_stats: (CBLDatabase*)db {
+    if ([self query: @"collect"])
+        db.collectsStatementStats = [self boolQuery: @"collect"];
+    NSDictionary* stats = db.statementStats;
+    if (!stats)
+        return kCBLStatusNotImplemented;
+    _response.bodyObject = stats;
+    return kCBLStatusOK;
+}
+
 
 #pragma mark - REPLICATION & ACTIVE TASKS
 
@@ -824,6 +909,12 @@ static NSArray* parseJSONRevArrayQuery(NSString* queryStr) {
     if (!attachment)
         return status;
 
+    NSString* type = attachment.contentType;
+    if (type)
+        _response[@"Content-Type"] = type;
+    if (acceptEncoding && attachment->encoding == kCBLAttachmentEncodingGZIP)
+        _response[@"Content-Encoding"] = @"gzip";
+
     if ($equal(_request.HTTPMethod, @"HEAD")) {
         if (_local) {
             // Let in-app clients know the location of the attachment file:
@@ -836,16 +927,25 @@ static NSArray* parseJSONRevArrayQuery(NSString* queryStr) {
         _response[@"Content-Length"] = $sprintf(@"%llu", length);
         
     } else {
-        NSData* contents = acceptEncoded ? attachment.encodedContent : attachment.content;
+        BOOL sendRaw = acceptEncoded || attachment->encoding == kCBLAttachmentEncodingNone;
+        // If the blob can be sent as-is, map it (or decrypt it on demand) instead of reading it;
+        // range requests then only touch the pages or chunks they need:
+        NSData* contents = sendRaw ? attachment.mappedEncodedContent : nil;
+        if (!contents) {
+            if (sendRaw && self.canStreamResponse
+                        && [_request valueForHTTPHeaderField: @"Range"] == nil) {
+                // Blob encrypted in the old format: decrypt it on the fly rather than into one
+                // big NSData:
+                NSInputStream* stream = [attachment getContentStreamDecoded: NO andLength: NULL];
+                if (stream)
+                    return [self streamInputStream: stream];
+            }
+            contents = acceptEncoded ? attachment.encodedContent : attachment.content;
+        }
         if (!contents)
             return kCBLStatusNotFound;
         _response.body = [CBL_Body bodyWithJSON: contents];   //FIX: This is a lie, it's not JSON
     }
-    NSString* type = attachment.contentType;
-    if (type)
-        _response[@"Content-Type"] = type;
-    if (acceptEncoding && attachment->encoding == kCBLAttachmentEncodingGZIP)
-        _response[@"Content-Encoding"] = @"gzip";
     return kCBLStatusOK;
 }
 
@@ -1204,10 +1304,18 @@ static NSArray* parseJSONRevArrayQuery(NSString* queryStr) {
     CBLQueryEnumerator* iterator = [view _queryWithOptions: options status: &status];
     if (!iterator)
         return status;
-    NSArray* rows = [self queryIteratorAllRows: iterator];
     id updateSeq = options->updateSeq ? @(view.lastSequenceIndexed) : nil;
+    NSUInteger totalRows = view.currentTotalRows;
+    if (self.canStreamResponse) {
+        return [self streamQueryRows: iterator trailer: ^NSDictionary*(NSUInteger rowCount) {
+            return $dict({@"total_rows", @(totalRows)},
+                         {@"offset", @(options->skip)},
+                         {@"update_seq", updateSeq});
+        }];
+    }
+    NSArray* rows = [self queryIteratorAllRows: iterator];
     _response.bodyObject = $dict({@"rows", rows},
-                                 {@"total_rows", @(view.currentTotalRows)},
+                                 {@"total_rows", @(totalRows)},
                                  {@"offset", @(options->skip)},
                                  {@"update_seq", updateSeq});
     return kCBLStatusOK;
@@ -1249,6 +1357,8 @@ static NSArray* parseJSONRevArrayQuery(NSString* queryStr) {
     if (CBLStatusIsError(status))
         return status;
 
+    // The temp view is deleted before returning, so its rows can't be streamed lazily:
+    _streamQueryRows = NO;
     @try {
         CBLStatus status = [view _updateIndex];
         if (status >= kCBLStatusBadRequest)
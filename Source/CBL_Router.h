@@ -8,7 +8,8 @@
 
 #import "CBLDatabase+Internal.h"
 #import "CBLManager+Internal.h"
-@class CBL_Server, CBLResponse, CBL_Body, CBLMultipartWriter, CBLQueryOptions;
+@class CBL_Server, CBLResponse, CBL_Body, CBLMultipartWriter, CBLQueryOptions, CBLQueryEnumerator,
+       CBLQueryRow;
 
 
 UsingLogDomain(Router);
@@ -24,6 +25,9 @@ typedef CBLStatus (^OnAccessCheckBlock)(CBLDatabase*, NSString *docID, SEL actio
 typedef void (^OnResponseReadyBlock)(CBLResponse*);
 typedef void (^OnDataAvailableBlock)(NSData* data, BOOL finished);
 typedef void (^OnFinishedBlock)();
+typedef BOOL (^ShouldPauseOutputBlock)();
+typedef NSDictionary* (^CBLRowStreamTrailerBlock)(NSUInteger rowCount);
+typedef NSData* (^CBLStreamProducerBlock)(BOOL* outFinished);
 
 
 typedef enum : NSUInteger {
@@ -60,10 +64,13 @@ enum {
     BOOL _local;
     BOOL _responseSent;
     BOOL _processRanges;
+    BOOL _streamQueryRows;
     OnAccessCheckBlock _onAccessCheck;
     OnResponseReadyBlock _onResponseReady;
     OnDataAvailableBlock _onDataAvailable;
     OnFinishedBlock _onFinished;
+    OnFinishedBlock _onAborted;
+    ShouldPauseOutputBlock _shouldPauseOutput;
     BOOL _running;
     CBLChangesFeedMode _changesMode;
     CBLContentOptions _changesContentOptions;
@@ -75,6 +82,7 @@ enum {
     NSTimer *_changesTimeoutTimer;
     NSTimeInterval _changesTimeout;
     SequenceNumber _changesSince;
+    CBLStreamProducerBlock _streamProducer;
 }
 
 - (instancetype) initWithServer: (CBL_Server*)server
@@ -84,17 +92,34 @@ enum {
 @property (copy) NSURL* source;
 @property BOOL processRanges;
 
+/** If YES, potentially large responses (_all_docs and view query results, encrypted attachments)
+    are written incrementally via onDataAvailable instead of being collected into the response
+    body first. Such responses are sent without a Content-Length. Defaults to NO. */
+@property BOOL streamQueryRows;
+
 @property (copy) OnAccessCheckBlock onAccessCheck;
 @property (copy) OnResponseReadyBlock onResponseReady;
 @property (copy) OnDataAvailableBlock onDataAvailable;
 @property (copy) OnFinishedBlock onFinished;
 
+/** Called instead of onFinished if a streamed response fails partway through, after its headers
+    and some of its body have been sent. The client should drop the connection so the truncated
+    body isn't mistaken for a complete one. */
+@property (copy) OnFinishedBlock onAborted;
+
+/** Called between chunks of a streamed response. If it returns YES, the router stops producing
+    output until -resumeOutput is called. */
+@property (copy) ShouldPauseOutputBlock shouldPauseOutput;
+
 @property (readonly) NSURLRequest* request;
 @property (readonly) CBLResponse* response;
 
 - (void) start;
 - (void) stop;
 
+/** Tells a router whose output was paused by shouldPauseOutput to continue. Thread-safe. */
+- (void) resumeOutput;
+
 @end
 
 
@@ -116,7 +141,14 @@ enum {
 - (void) sendData: (NSData*)data;
 - (void) sendContinuousLine: (NSDictionary*)changeDict;
 - (void) sendResponseBodyAndFinish: (BOOL)finished;
+- (BOOL) canStreamResponse;
+- (CBLStatus) streamResponseFrom: (CBLStreamProducerBlock)producer;
+- (CBLStatus) streamQueryRows: (CBLQueryEnumerator*)rows
+                      trailer: (CBLRowStreamTrailerBlock)trailer;
+- (CBLStatus) streamInputStream: (NSInputStream*)stream;
+- (BOOL) sendDecryptedResponseBody;
 - (void) finished;
+- (void) aborted;
 - (void) startHeartbeat: (NSString*)response interval: (NSTimeInterval)interval;
 - (void) stopHeartbeat;
 @end
@@ -127,6 +159,7 @@ enum {
 - (CBL_Revision*) applyOptions: (CBLContentOptions)options
                     toRevision: (CBL_Revision*)rev
                         status: (CBLStatus*)outStatus;
+- (NSDictionary*) JSONForQueryRow: (CBLQueryRow*)row options: (CBLContentOptions)options;
 @end
 
 
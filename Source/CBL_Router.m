@@ -22,6 +22,8 @@
 #import "CBLJSON.h"
 #import "CBLMisc.h"
 #import "CBLGeometry.h"
+#import "CBLGZip.h"
+#import "CBLSymmetricKey.h"
 
 #import "ExceptionUtils.h"
 #import "CollectionUtils.h"
@@ -39,6 +41,11 @@
 DefineLogDomain(Router);
 
 
+// Approximate size of each chunk of a streamed response.
+#define kStreamChunkSize (32*1024)
+#define kDecryptedStreamChunkSize (64*1024)     // same as the encrypted format's chunk size
+
+
 @implementation CBL_Router
 
 
@@ -86,8 +93,10 @@ static NSMutableSet* sRunningRouters;
 
 
 @synthesize onAccessCheck=_onAccessCheck, onResponseReady=_onResponseReady,
-            onDataAvailable=_onDataAvailable, onFinished=_onFinished, source=_source,
-            request=_request, response=_response, processRanges=_processRanges;
+            onDataAvailable=_onDataAvailable, onFinished=_onFinished, onAborted=_onAborted,
+            source=_source,
+            request=_request, response=_response, processRanges=_processRanges,
+            streamQueryRows=_streamQueryRows, shouldPauseOutput=_shouldPauseOutput;
 
 
 - (NSDictionary*) queries {
@@ -147,10 +156,42 @@ static NSMutableSet* sRunningRouters;
 }
 
 
+static NSData* readStream(NSInputStream* in) {
+    NSMutableData* data = [NSMutableData data];
+    uint8_t buffer[16384];
+    [in open];
+    NSInteger n;
+    while ((n = [in read: buffer maxLength: sizeof(buffer)]) > 0)
+        [data appendBytes: buffer length: n];
+    [in close];
+    return n < 0 ? nil : data;
+}
+
+
 - (NSDictionary*) bodyAsDictionary {
     id object;
     NSError* error;
     NSData* body = _request.HTTPBody;
+    NSString* contentEncoding = [_request valueForHTTPHeaderField: @"Content-Encoding"];
+    if (contentEncoding && !$equal(contentEncoding, @"identity")) {
+        // Compressed request body:
+        CBLContentCoding* coding = [CBLContentCoding codingNamed: contentEncoding];
+        if (!coding) {
+            Warn(@"CBL_Router: Unsupported request Content-Encoding '%@'", contentEncoding);
+            return nil;
+        }
+        if (!body) {
+            NSInputStream* in = _request.HTTPBodyStream;
+            if (!in)
+                return nil;
+            body = readStream(in);
+        }
+        body = [coding decompressData: body];
+        if (!body) {
+            Warn(@"CBL_Router: Couldn't decode %@ request body", contentEncoding);
+            return nil;
+        }
+    }
     if (body) {
         object = [CBLJSON JSONObjectWithData: body options: 0 error: &error];
     } else {
@@ -528,9 +569,11 @@ static NSArray* splitPath( NSURL* url ) {
         // If response is ready (nonzero status), tell my client about it:
         _response.internalStatus = status;
         [self processRequestRanges];
-        [self sendResponseHeaders];
-        [self sendResponseBodyAndFinish: YES];
-    } else {
+        if (![self sendDecryptedResponseBody]) {
+            [self sendResponseHeaders];
+            [self sendResponseBodyAndFinish: YES];
+        }
+    } else if (_running) {
         // If I will keep running asynchronously (i.e. a _changes feed handler), listen for the
         // database closing so I can stop then:
         if (_db) {
@@ -607,7 +650,20 @@ static NSArray* splitPath( NSURL* url ) {
     if (from == 0 && to == bodyLength - 1)
         return; // No-op; entire body still causes a 200 response
 
-    body = [body subdataWithRange: NSMakeRange(from, to - from + 1)];
+    NSRange range = NSMakeRange(from, to - from + 1);
+    if ([body conformsToProtocol: @protocol(CBLDecryptedData)]) {
+        // Decrypt just the requested range, failing if it's corrupt:
+        NSError* error;
+        body = [(NSData<CBLDecryptedData>*)body decryptedDataInRange: range error: &error];
+        if (!body) {
+            Warn(@"CBL_Router: Couldn't decrypt attachment: %@", error.my_compactDescription);
+            [_response reset];
+            _response.internalStatus = kCBLStatusCorruptError;
+            return;
+        }
+    } else {
+        body = [body subdataWithRange: range];
+    }
     _response.body = [CBL_Body bodyWithJSON: body];  // not actually JSON
 
     // Content-Range: http://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html#sec14.16
@@ -625,6 +681,8 @@ static NSArray* splitPath( NSURL* url ) {
     _responseSent = YES;
 
     _response[@"Server"] = $sprintf(@"CouchbaseLite %@", CBLVersion());
+    // Tell clients which content-codings they can compress request bodies with (RFC 7694):
+    _response[@"Accept-Encoding"] = [CBLContentCoding acceptEncoding];
 
     // Check for a mismatch between the Accept request header and the response type:
     NSString* accept = [_request valueForHTTPHeaderField: @"Accept"];
@@ -695,6 +753,172 @@ static NSArray* splitPath( NSURL* url ) {
 }
 
 
+#pragma mark - STREAMED RESPONSES:
+
+
+- (BOOL) canStreamResponse {
+    return _streamQueryRows && _onDataAvailable != nil && !$equal(_request.HTTPMethod, @"HEAD");
+}
+
+
+// Sends the response headers, then sends the body in chunks returned by the producer block until
+// it sets its 'finished' flag. If the producer instead returns nil without setting the flag, the
+// response is aborted (see -aborted). Returns 0 since the response is (or will be) finished
+// asynchronously. The response's Content-Type should already be set.
+- (CBLStatus) streamResponseFrom: (CBLStreamProducerBlock)producer {
+    _response.internalStatus = kCBLStatusOK;
+    _response.body = nil;       // setting the status may have added a default body
+    [self sendResponseHeaders];
+    if (_response.status != 200) {
+        // sendResponseHeaders may have replaced the response with an error:
+        [self sendResponseBodyAndFinish: YES];
+        return 0;
+    }
+    _streamProducer = [producer copy];
+    [self pumpOutput];
+    return 0;
+}
+
+
+// Sends chunks from _streamProducer until it's finished or the client asks to pause.
+- (void) pumpOutput {
+    while (_running && _streamProducer) {
+        BOOL finished = NO;
+        NSData* chunk;
+        @autoreleasepool {
+            chunk = _streamProducer(&finished);
+        }
+        if (finished) {
+            _streamProducer = nil;
+            __typeof(_onDataAvailable) onDataAvailable = _onDataAvailable;
+            if (onDataAvailable)
+                onDataAvailable(chunk ?: [NSData data], YES);
+            [self finished];
+            return;
+        }
+        if (!chunk) {
+            [self aborted];
+            return;
+        }
+        if (chunk.length > 0)
+            [self sendData: chunk];
+        __typeof(_shouldPauseOutput) shouldPauseOutput = _shouldPauseOutput;
+        if (shouldPauseOutput && shouldPauseOutput()) {
+            LogVerbose(Router, @"Pausing streamed output");
+            return;     // -resumeOutput will call me again
+        }
+    }
+}
+
+
+- (void) resumeOutput {
+    if (_server)
+        [_server queue: ^{ [self pumpOutput]; }];
+    else
+        [self pumpOutput];
+}
+
+
+// Writes a JSON object of the form {"rows":[...], ...} with one row at a time pulled from the
+// enumerator. The properties returned by the trailer block are appended after the rows.
+- (CBLStatus) streamQueryRows: (CBLQueryEnumerator*)rows
+                      trailer: (CBLRowStreamTrailerBlock)trailer
+{
+    _response[@"Content-Type"] = @"application/json";
+    CBLContentOptions options = self.contentOptions;
+    __block NSUInteger rowCount = 0;
+    __block BOOL started = NO;
+    return [self streamResponseFrom: ^NSData*(BOOL* outFinished) {
+        NSMutableData* chunk = [NSMutableData dataWithCapacity: kStreamChunkSize + 1024];
+        if (!started) {
+            [chunk appendBytes: "{\"rows\":[" length: 9];
+            started = YES;
+        }
+        while (chunk.length < kStreamChunkSize) {
+            CBLQueryRow* row = rows.nextObject;
+            if (!row) {
+                [chunk appendBytes: "]" length: 1];
+                NSDictionary* trailerDict = trailer ? trailer(rowCount) : nil;
+                NSData* trailerJSON = [CBLJSON dataWithJSONObject: (trailerDict ?: @{})
+                                                          options: 0 error: NULL];
+                // Append the trailer's properties, omitting its opening brace:
+                if (trailerDict.count > 0)
+                    [chunk appendBytes: "," length: 1];
+                [chunk appendBytes: (const char*)trailerJSON.bytes + 1
+                            length: trailerJSON.length - 1];
+                LogTo(Router, @"Streamed %lu query rows", (unsigned long)rowCount);
+                *outFinished = YES;
+                break;
+            }
+            NSDictionary* dict = [self JSONForQueryRow: row options: options];
+            if (rowCount++ > 0)
+                [chunk appendBytes: "," length: 1];
+            [chunk appendData: [CBLJSON dataWithJSONObject: dict options: 0 error: NULL]];
+        }
+        return chunk;
+    }];
+}
+
+
+// Sends the contents of an already-opened stream as the response body, then closes it.
+- (CBLStatus) streamInputStream: (NSInputStream*)stream {
+    return [self streamResponseFrom: ^NSData*(BOOL* outFinished) {
+        NSMutableData* chunk = [NSMutableData dataWithLength: kStreamChunkSize];
+        NSInteger bytesRead = [stream read: chunk.mutableBytes maxLength: kStreamChunkSize];
+        if (bytesRead <= 0) {
+            if (bytesRead < 0)
+                Warn(@"CBL_Router: Error reading response stream: %@",
+                     stream.streamError.my_compactDescription);
+            [stream close];
+            *outFinished = (bytesRead == 0);
+            return nil;     // if not finished, this aborts the response
+        }
+        chunk.length = bytesRead;
+        return chunk;
+    }];
+}
+
+
+// An encrypted attachment's body is an NSData that decrypts the file as it's read, and NSData
+// can't report a corrupt chunk. So send such a body here instead: streamed if possible, aborting
+// the response if a chunk fails to decrypt, or else decrypted all at once before the status is
+// sent. Returns YES if it took care of sending the response.
+- (BOOL) sendDecryptedResponseBody {
+    NSData<CBLDecryptedData>* body = (id)_response.body.asJSON;
+    if (_response.status != 200 || $equal(_request.HTTPMethod, @"HEAD")
+                                || ![body conformsToProtocol: @protocol(CBLDecryptedData)])
+        return NO;
+    if (!self.canStreamResponse) {
+        NSError* error;
+        NSData* contents = [body decryptedDataInRange: NSMakeRange(0, body.length) error: &error];
+        if (contents) {
+            _response.body = [CBL_Body bodyWithJSON: contents];  // not actually JSON
+        } else {
+            Warn(@"CBL_Router: Couldn't decrypt attachment: %@", error.my_compactDescription);
+            [_response reset];
+            _response.internalStatus = kCBLStatusCorruptError;
+        }
+        return NO;
+    }
+
+    NSUInteger length = body.length;
+    __block NSUInteger offset = 0;
+    [self streamResponseFrom: ^NSData*(BOOL* outFinished) {
+        NSRange range = NSMakeRange(offset, MIN(length - offset, kDecryptedStreamChunkSize));
+        NSError* error;
+        NSData* chunk = [body decryptedDataInRange: range error: &error];
+        if (!chunk) {
+            Warn(@"CBL_Router: Couldn't decrypt attachment: %@", error.my_compactDescription);
+            return nil;     // aborts the response
+        }
+        offset = NSMaxRange(range);
+        *outFinished = (offset >= length);
+        return chunk;
+    }];
+    return YES;
+}
+
+
 - (void) finished {
     if (WillLogTo(Router)) {
         NSMutableString* output = [NSMutableString stringWithFormat: @"Response -- status=%d, body=%llu bytes",
@@ -711,6 +935,17 @@ static NSArray* splitPath( NSURL* url ) {
 }
 
 
+// Gives up on a streamed response whose headers have already been sent. The status can't be
+// changed any more, so the only way to tell the client is to break the connection.
+- (void) aborted {
+    LogTo(Router, @"Aborting streamed response -- status=%d", _response.status);
+    OnFinishedBlock onAborted = _onAborted ?: _onFinished;
+    [self stopNow];
+    if (onAborted)
+        onAborted();
+}
+
+
 - (void) stopNow {
     _running = NO;
     [self stopHeartbeat];
@@ -719,6 +954,9 @@ static NSArray* splitPath( NSURL* url ) {
     self.onResponseReady = nil;
     self.onDataAvailable = nil;
     self.onFinished = nil;
+    self.onAborted = nil;
+    self.shouldPauseOutput = nil;
+    _streamProducer = nil;
     [[NSNotificationCenter defaultCenter] removeObserver: self];
 
     @synchronized ([self class]) {
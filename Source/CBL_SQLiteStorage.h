@@ -18,6 +18,9 @@
 
 - (void) optimizeSQLIndexes;
 
+/** Runs the block while holding the database's read lock, catching exceptions. */
+- (CBLStatus) withReadLock: (CBLStatus(^)())block;
+
 - (BOOL) runStatements: (NSString*)statements error: (NSError**)outError;
 
 - (NSMutableDictionary*) documentPropertiesFromJSON: (NSData*)json
@@ -26,6 +29,13 @@
                                             deleted: (BOOL)deleted
                                            sequence: (SequenceNumber)sequence;
 
+/** Returns the properties of a (non-deleted) revision for a map function: an immutable
+    dictionary whose values are only parsed from the JSON when they're accessed. */
+- (NSDictionary*) lazyDocumentPropertiesFromJSON: (NSData*)json
+                                           docID: (NSString*)docID
+                                           revID: (CBL_RevID*)revID
+                                 extraProperties: (NSDictionary*)extraProperties;
+
 /** Loads revision given its sequence. Assumes the given docID is valid. */
 - (CBL_MutableRevision*) getDocumentWithID: (NSString*)docID
                                   sequence: (SequenceNumber)sequence
@@ -36,6 +46,12 @@
                                    deleted: (BOOL)deleted
                                   sequence: (SequenceNumber)sequence
                                       json: (NSData*)json;
+
+/** Returns the JSON of a revision body as stored in the 'json' column of the revs table, which
+    may be compressed (see compressesDocuments.) The block returns the compression dictionary with
+    a given number, which is stored in the info table under the key "body_dict_<number>". */
++ (NSData*) JSONFromStoredBody: (NSData*)body
+                  dictionaries: (NSData* (^)(unsigned number))dictionaryNumbered;
 @end
 
 
@@ -44,6 +60,12 @@
 NSString* CBLJoinSQLQuotedStrings(NSArray* strings);
 
 
+/** Max number of rows a lazy query enumerator reads with one SQLite statement. Each page's
+    statement is finished before its rows are returned, so that a slow consumer doesn't hold a read
+    snapshot open, which would block WAL checkpoints and compaction. */
+#define kCBLQueryPageSize 100
+
+
 @interface CBL_FMResultSet (CBL_RevID)
 - (CBL_RevID*)revIDForColumnIndex:(int)columnIdx;
 @end
@@ -27,6 +27,7 @@
 #import "ExceptionUtils.h"
 #import "MYAction.h"
 #import "CBL_RevID.h"
+#import "CBLGZip.h"
 
 #import "FMDatabase.h"
 #import "FMDatabaseAdditions.h"
@@ -37,13 +38,26 @@
 
 #define kSQLiteMMapSize (50*1024*1024)
 
-#define kDocIDCacheSize 1000
-
 #define kSQLiteBusyTimeout 5.0 // seconds
 
 #define kTransactionMaxRetries 10
 #define kTransactionRetryDelay 0.050
 
+#define kCompactBatchSize 500 // Number of revisions compaction strips/recompresses per transaction
+
+#define kBulkLookupBatchSize 500 // Max number of docs looked up by one query in -addDocuments:
+#define kBulkInsertBatchSize 100 // Max number of revs inserted by one statement (8 params each)
+#define kAttachmentRefsBatchSize 500 // Number of revision bodies read at a time to index attachments
+#define kAttachmentRefsSequenceKey @"attachment_refs_seq" // info key: last sequence known indexed
+
+#define kCompressedBodiesSchemaVersion 200 // Schema version of a db with compressed revision bodies
+
+#define kStatementCacheSize 128 // Max number of prepared statements kept for reuse
+#define kMaxStatementStats 1000 // Max number of distinct statements to collect statistics on
+#define kStatementStatsLimit 10 // Number of statements listed per category by -statementStats
+
+#define kLowMemoryCacheSizeKB 512 // Page cache size of kCBLSQLiteProfileLowMemory
+
 #define kLocalCheckpointDocId @"CBL_LocalCheckpoint"
 
 #ifdef MOCK_ENCRYPTION
@@ -65,18 +79,386 @@ static void CBLComputeFTSRank(sqlite3_context *pCtx, int nVal, sqlite3_value **a
 @end
 
 
+/** A document being updated by -addDocuments:... */
+@interface CBLBulkInsertDoc : NSObject
+{
+    @public
+    NSMutableDictionary* properties;
+    NSString* docID;
+    SInt64 docNumericID;
+    CBL_RevID* prevRevID;
+    BOOL deleting;
+    NSData* json;                   // Canonical JSON of the new revision
+    CBL_MutableRevision* newRev;
+    SequenceNumber parentSequence;
+    CBL_RevID* oldWinningRevID;
+    BOOL oldWinnerWasDeletion;
+    BOOL inConflict;
+}
+@end
+
+@implementation CBLBulkInsertDoc
+@end
+
+
+// Returns a comma-separated list of `count` copies of `item`, for building SQL statements.
+static NSString* repeatedSQL(NSString* item, NSUInteger count) {
+    NSMutableString* sql = [NSMutableString stringWithCapacity: (item.length + 1) * count];
+    for (NSUInteger i = 0; i < count; i++) {
+        if (i > 0)
+            [sql appendString: @","];
+        [sql appendString: item];
+    }
+    return sql;
+}
+
+
+
+
+#pragma mark - STATEMENT CACHE:
+
+
+// FMDB's internal hooks for looking up and adding prepared statements in its cache:
+@interface CBL_FMDatabase (StatementCache)
+- (CBL_FMStatement*) cachedStatementForQuery: (NSString*)query;
+- (void) setCachedStatement: (CBL_FMStatement*)statement forQuery: (NSString*)query;
+@end
+
+
+/** Execution statistics of one SQL statement. */
+@interface CBLStatementStats : NSObject
+{
+    @public
+    NSString* sql;
+    UInt64 count;               // Number of times it's been run
+    UInt64 nanos, maxNanos;     // Total and longest run time
+    UInt64 vmSteps;             // Virtual-machine operations performed
+    UInt64 fullScanSteps;       // Rows stepped through by full table scans
+    UInt64 sorts;               // Sort operations performed
+}
+@end
+
+@implementation CBLStatementStats
+@end
+
+
+/** A prepared statement in the cache; also a node in its LRU list. */
+@interface CBLCachedStatement : NSObject
+{
+    @public
+    NSString* sql;
+    CBL_FMStatement* statement;
+    CBLStatementStats* stats;
+    __unsafe_unretained CBLCachedStatement *prev, *next; // (the cache dictionary retains entries)
+}
+@end
+
+@implementation CBLCachedStatement
+@end
+
+
+/** A CBL_FMDatabase whose prepared-statement cache holds a limited number of statements, evicting
+    the least recently used one when it's full. It can also record how often each statement is run
+    and how long it takes. */
+@interface CBL_SQLiteFMDatabase : CBL_FMDatabase
+@property (nonatomic) NSUInteger statementCacheSize;
+@property (nonatomic) BOOL collectsStatementStats;
+- (NSDictionary*) statementStatsWithLimit: (NSUInteger)limit;
+@end
+
+@implementation CBL_SQLiteFMDatabase
+{
+    NSMutableDictionary* _statements;   // Maps SQL -> CBLCachedStatement
+    CBLCachedStatement *_newest, *_oldest;  // Ends of the LRU list
+    NSMapTable* _statsBySQLPtr;         // Maps sqlite3_sql() of cached statements -> stats
+    NSMutableDictionary* _stats;        // Maps SQL -> CBLStatementStats
+    CBLStatementStats* _otherStats;     // Totals of statements that weren't cached
+    UInt64 _cacheHits, _cacheMisses, _evictions;
+}
+
+@synthesize statementCacheSize=_statementCacheSize, collectsStatementStats=_collectsStatementStats;
+
+
+- (instancetype) initWithPath: (NSString*)path {
+    self = [super initWithPath: path];
+    if (self) {
+        _statements = [[NSMutableDictionary alloc] init];
+        _statementCacheSize = kStatementCacheSize;
+    }
+    return self;
+}
+
+
+// SQLite calls this when a statement finishes running.
+static void statementProfiled(void* context, const char* sql, sqlite3_uint64 nanos) {
+    CBL_SQLiteFMDatabase* db = (__bridge CBL_SQLiteFMDatabase*)context;
+    // `sql` is the statement's own copy of its SQL, the same pointer sqlite3_sql() returns:
+    CBLStatementStats* stats = [db->_statsBySQLPtr objectForKey: (__bridge id)(void*)sql];
+    if (!stats)
+        stats = db->_otherStats;
+    ++stats->count;
+    stats->nanos += nanos;
+    stats->maxNanos = MAX(stats->maxNanos, nanos);
+}
+
+
+- (void) setCollectsStatementStats: (BOOL)collect {
+    if (collect == _collectsStatementStats)
+        return;
+    _collectsStatementStats = collect;
+    if (collect) {
+        _stats = [[NSMutableDictionary alloc] init];
+        _statsBySQLPtr = [NSMapTable mapTableWithKeyOptions: NSPointerFunctionsOpaqueMemory |
+                                                             NSPointerFunctionsOpaquePersonality
+                                               valueOptions: NSPointerFunctionsStrongMemory];
+        _otherStats = [[CBLStatementStats alloc] init];
+        _otherStats->sql = @"(uncached statements)";
+        for (CBLCachedStatement* entry in _statements.allValues)
+            [self startCollectingStatsFor: entry];
+    } else {
+        _stats = nil;
+        _statsBySQLPtr = nil;
+        _otherStats = nil;
+        for (CBLCachedStatement* entry in _statements.allValues)
+            entry->stats = nil;
+    }
+    [self registerProfiler];
+}
+
+
+- (void) registerProfiler {
+    if (!self.sqliteHandle)
+        return;     // not open yet; -openWithFlags: will do it
+    // (sqlite3_trace_v2 replaces this, but needs SQLite 3.14, which older OSs don't have)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+    sqlite3_profile(self.sqliteHandle, (_collectsStatementStats ? statementProfiled : NULL),
+                    (__bridge void*)self);
+#pragma clang diagnostic pop
+}
+
+
+- (BOOL) openWithFlags: (int)flags {
+    if (![super openWithFlags: flags])
+        return NO;
+    if (_collectsStatementStats)
+        [self registerProfiler];
+    return YES;
+}
+
+
+- (void) startCollectingStatsFor: (CBLCachedStatement*)entry {
+    CBLStatementStats* stats = _stats[entry->sql];
+    if (!stats) {
+        if (_stats.count >= kMaxStatementStats)
+            return;
+        stats = [[CBLStatementStats alloc] init];
+        stats->sql = entry->sql;
+        _stats[entry->sql] = stats;
+    }
+    entry->stats = stats;
+    [_statsBySQLPtr setObject: stats
+                       forKey: (__bridge id)(void*)sqlite3_sql(entry->statement.statement)];
+}
+
+
+// Adds a cached statement's operation counters to its stats, and resets them.
+static void harvestStatementCounters(CBLCachedStatement* entry) {
+    CBLStatementStats* stats = entry->stats;
+    if (!stats)
+        return;
+    sqlite3_stmt* stmt = entry->statement.statement;
+    stats->vmSteps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+    stats->fullScanSteps += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    stats->sorts += sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_SORT, 1);
+}
+
+
+- (void) unlinkStatement: (CBLCachedStatement*)entry {
+    if (entry->prev)
+        entry->prev->next = entry->next;
+    else
+        _newest = entry->next;
+    if (entry->next)
+        entry->next->prev = entry->prev;
+    else
+        _oldest = entry->prev;
+    entry->prev = entry->next = nil;
+}
+
+- (void) linkStatement: (CBLCachedStatement*)entry {
+    entry->next = _newest;
+    if (_newest)
+        _newest->prev = entry;
+    else
+        _oldest = entry;
+    _newest = entry;
+}
+
+
+- (CBL_FMStatement*) cachedStatementForQuery: (NSString*)query {
+    CBLCachedStatement* entry = _statements[query];
+    if (!entry || entry->statement.inUse) {
+        // (A statement is in use while a result set is still stepping through it, like that of a
+        // lazily-enumerated query; FMDB will prepare another one, which replaces it in the cache.)
+        ++_cacheMisses;
+        return nil;
+    }
+    ++_cacheHits;
+    if (entry != _newest) {
+        [self unlinkStatement: entry];
+        [self linkStatement: entry];
+    }
+    harvestStatementCounters(entry);
+    return entry->statement;
+}
+
+
+- (void) setCachedStatement: (CBL_FMStatement*)statement forQuery: (NSString*)query {
+    [self uncacheStatementForQuery: query];
+    if (_statementCacheSize == 0)
+        return;
+    while (_statements.count >= _statementCacheSize) {
+        ++_evictions;
+        [self uncacheStatementForQuery: _oldest->sql];
+    }
+    CBLCachedStatement* entry = [[CBLCachedStatement alloc] init];
+    entry->sql = [query copy];
+    entry->statement = statement;
+    _statements[entry->sql] = entry;
+    [self linkStatement: entry];
+    if (_collectsStatementStats)
+        [self startCollectingStatsFor: entry];
+}
+
+
+// Removes a statement from the cache. This doesn't finalize it, since a result set may still be
+// using it; that happens when the statement object is dealloced.
+- (void) uncacheStatementForQuery: (NSString*)query {
+    CBLCachedStatement* entry = _statements[query];
+    if (entry) {
+        harvestStatementCounters(entry);
+        if (entry->stats)
+            [_statsBySQLPtr removeObjectForKey:
+                                (__bridge id)(void*)sqlite3_sql(entry->statement.statement)];
+        [self unlinkStatement: entry];
+        [_statements removeObjectForKey: query];
+    }
+}
+
+
+- (void) clearCachedStatements {
+    for (CBLCachedStatement* entry in _statements.allValues) {
+        // A statement that a lazy result set is still stepping through is only uncached, as in
+        // -uncacheStatementForQuery:, so the result set can keep using it.
+        BOOL inUse = entry->statement.inUse;
+        [self uncacheStatementForQuery: entry->sql];
+        if (!inUse)
+            [entry->statement close];
+    }
+    [super clearCachedStatements];
+}
+
+
+static NSDictionary* statsInfo(CBLStatementStats* stats) {
+    return @{@"sql": stats->sql,
+             @"count": @(stats->count),
+             @"total_ms": @(stats->nanos / 1.0e6),
+             @"average_ms": @(stats->count ? stats->nanos / 1.0e6 / stats->count : 0.0),
+             @"max_ms": @(stats->maxNanos / 1.0e6),
+             @"vm_steps": @(stats->vmSteps),
+             @"fullscan_steps": @(stats->fullScanSteps),
+             @"sorts": @(stats->sorts)};
+}
+
+
+// Uses SQLite directly, since FMDB won't run a statement whose parameters aren't all bound.
+- (NSArray*) queryPlanOf: (NSString*)sql {
+    sql = [@"EXPLAIN QUERY PLAN " stringByAppendingString: sql];
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(self.sqliteHandle, sql.UTF8String, -1, &stmt, NULL) != SQLITE_OK)
+        return nil;
+    int detailColumn = sqlite3_column_count(stmt) - 1;     // "detail" is always the last column
+    NSMutableArray* plan = [NSMutableArray array];
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* detail = (const char*)sqlite3_column_text(stmt, detailColumn);
+        if (detail)
+            [plan addObject: @(detail)];
+    }
+    sqlite3_finalize(stmt);
+    return plan;
+}
+
+
+/** Returns the statements that have been run the most times, and those that have taken the
+    most total time, each with its EXPLAIN QUERY PLAN; plus statistics about the cache itself. */
+- (NSDictionary*) statementStatsWithLimit: (NSUInteger)limit {
+    NSMutableDictionary* info = [@{@"collecting": @(_collectsStatementStats),
+                                   @"cached_statements": @(_statements.count),
+                                   @"cache_size": @(_statementCacheSize),
+                                   @"cache_hits": @(_cacheHits),
+                                   @"cache_misses": @(_cacheMisses),
+                                   @"cache_evictions": @(_evictions)} mutableCopy];
+    if (!_collectsStatementStats)
+        return info;
+
+    for (CBLCachedStatement* entry in _statements.allValues)
+        harvestStatementCounters(entry);
+    NSArray* all = _stats.allValues;
+    NSArray* (^top)(NSComparator) = ^NSArray*(NSComparator cmp) {
+        NSArray* sorted = [all sortedArrayUsingComparator: cmp];
+        sorted = [sorted subarrayWithRange: NSMakeRange(0, MIN(limit, sorted.count))];
+        NSMutableArray* result = [NSMutableArray arrayWithCapacity: sorted.count];
+        for (CBLStatementStats* stats in sorted) {
+            NSMutableDictionary* item = [statsInfo(stats) mutableCopy];
+            item[@"query_plan"] = [self queryPlanOf: stats->sql];
+            [result addObject: item];
+        }
+        return result;
+    };
+    info[@"hottest"] = top(^NSComparisonResult(CBLStatementStats* a, CBLStatementStats* b) {
+        return a->count > b->count ? NSOrderedAscending
+                                   : (a->count < b->count ? NSOrderedDescending : NSOrderedSame);
+    });
+    info[@"slowest"] = top(^NSComparisonResult(CBLStatementStats* a, CBLStatementStats* b) {
+        return a->nanos > b->nanos ? NSOrderedAscending
+                                   : (a->nanos < b->nanos ? NSOrderedDescending : NSOrderedSame);
+    });
+    info[@"uncached"] = statsInfo(_otherStats);
+    return info;
+}
+
+
+@end
+
+
 
 
 @implementation CBL_SQLiteStorage
 {
     NSString* _directory;
     BOOL _readOnly;
-    NSCache* _docIDs;
+    CBL_DocIDCache* _docIDs;
+    NSMutableArray* _newDocIDs;         // docIDs added to 'docs' in the current transaction
+    NSMutableArray* _newDocIDMarks;     // _newDocIDs.count at the start of each nested transaction
     CBLSymmetricKey* _encryptionKey;
+    BOOL _compacting;                   // Is an incremental compaction partway through?
+    BOOL _compactStripped;              // Has it finished stripping old revision bodies?
+    SequenceNumber _compactSequence;    // Last sequence it's stripped (or skipped)
+    NSUInteger _compactStrippedCount;   // Number of revision bodies it's stripped
+    BOOL _compactRecompressed;          // Has it finished recompressing current revision bodies?
+    SequenceNumber _recompressSequence; // Last sequence it's recompressed (or skipped)
+    NSUInteger _compactRecompressedCount; // Number of revision bodies it's recompressed
+    NSMutableDictionary* _bodyDictionaries; // Compression dictionaries, keyed by number
+    NSData* _bodyDictionary;            // Dictionary to compress new revision bodies with
+    unsigned _bodyDictionaryNumber;     // Number of _bodyDictionary, or 0 if none
+    BOOL _schemaHasCompressedBodies;    // Is user_version >= kCompressedBodiesSchemaVersion?
+    NSDictionary* _pragmas;             // Tuning pragmas to set on open, from the SQLite profile
 }
 
 @synthesize delegate=_delegate, autoCompact=_autoCompact,
-            maxRevTreeDepth=_maxRevTreeDepth, fmdb=_fmdb;
+            maxRevTreeDepth=_maxRevTreeDepth, fmdb=_fmdb,
+            compressesDocuments=_compressesDocuments;
 
 
 + (void) firstTimeSetup {
@@ -134,7 +516,66 @@ static void errorLogCallback(void *pArg, int errCode, const char *msg) {
 }
 
 
+// The pragmas that can be tuned by -setSQLiteProfile:settings:, in the order they're set.
+static NSArray* tunablePragmas(void) {
+    return @[@"cache_size", @"mmap_size", @"temp_store", @"synchronous", @"wal_autocheckpoint"];
+}
+
+// Returns YES if a value is legal for a tunable pragma: a number, or for the pragmas that take
+// one, a keyword. (Values are pasted into the PRAGMA statement, so nothing else is allowed.)
+static BOOL isValidPragmaValue(NSString* name, id value) {
+    if ($castIf(NSNumber, value))
+        return YES;
+    NSString* keyword = [$castIf(NSString, value) uppercaseString];
+    if ([name isEqualToString: @"temp_store"])
+        return [@[@"DEFAULT", @"FILE", @"MEMORY"] containsObject: keyword];
+    else if ([name isEqualToString: @"synchronous"])
+        return [@[@"OFF", @"NORMAL", @"FULL", @"EXTRA"] containsObject: keyword];
+    return NO;
+}
+
+// Returns the pragma values of a kCBLSQLiteProfile... preset, or nil if it's not a known one.
+// Pragmas not listed are left at SQLite's defaults. (A negative cache_size is in KB.)
+static NSDictionary* pragmasForProfile(NSString* profile) {
+    static NSDictionary* sProfiles;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        sProfiles = @{kCBLSQLiteProfileDefault: @{},
+                      kCBLSQLiteProfileServer: @{@"cache_size": @(-64 * 1024),
+                                                 @"mmap_size": @(1LL << 30),
+                                                 @"temp_store": @"MEMORY",
+                                                 @"synchronous": @"NORMAL",
+                                                 @"wal_autocheckpoint": @10000},
+                      kCBLSQLiteProfileLowMemory: @{@"cache_size": @(-kLowMemoryCacheSizeKB),
+                                                    @"mmap_size": @0,
+                                                    @"temp_store": @"FILE",
+                                                    @"wal_autocheckpoint": @250}};
+    });
+    return sProfiles[profile];
+}
+
+- (void) setSQLiteProfile: (NSString*)profile settings: (NSDictionary*)settings {
+    NSMutableDictionary* pragmas = [pragmasForProfile(profile ?: kCBLSQLiteProfileDefault)
+                                                                                mutableCopy];
+    if (!pragmas) {
+        Warn(@"%@: Unknown SQLite profile '%@'; using the default", self, profile);
+        pragmas = [NSMutableDictionary dictionary];
+    }
+    for (NSString* name in settings) {
+        id value = settings[name];
+        if (![tunablePragmas() containsObject: name])
+            Warn(@"%@: Ignoring unknown SQLite setting '%@'", self, name);
+        else if (!isValidPragmaValue(name, value))
+            Warn(@"%@: Ignoring invalid value of SQLite setting '%@': %@", self, name, value);
+        else
+            pragmas[name] = value;
+    }
+    _pragmas = [pragmas copy];
+}
+
+
 DefineLogDomain(SQL);
+DefineLogDomain(SQLStats);
 
 
 /** Opens storage. Files will be created in the directory, which must already exist. */
@@ -151,7 +592,7 @@ DefineLogDomain(SQL);
     _directory = [directory copy];
     _readOnly = readOnly;
     NSString* path = [_directory stringByAppendingPathComponent: kDBFilename];
-    _fmdb = [[CBL_FMDatabase alloc] initWithPath: path];
+    _fmdb = [[CBL_SQLiteFMDatabase alloc] initWithPath: path];
     _fmdb.dispatchQueue = manager.dispatchQueue;
     _fmdb.databaseLock = [manager.shared lockForDatabaseNamed: path];
 #if DEBUG
@@ -162,7 +603,6 @@ DefineLogDomain(SQL);
     _fmdb.traceExecution = WillLogTo(SQL);
 
     _docIDs = [manager.shared docIDCacheForDatabaseNamed: path];
-    _docIDs.countLimit = kDocIDCacheSize;
 
     if (![self open: error]) {
         [self close];
@@ -419,16 +859,30 @@ DefineLogDomain(SQL);
     __unused int dbVersion = self.schemaVersion;
     
     // Incompatible version changes increment the hundreds' place:
-    if (dbVersion >= 200) {
+    if (dbVersion >= kCompressedBodiesSchemaVersion + 100) {
         Warn(@"CBLDatabase: Database version (%d) is newer than I know how to work with", dbVersion);
         if (outError) *outError = [NSError errorWithDomain: @"CouchbaseLite" code: 1 userInfo: nil]; //FIX: Real code
         return NO;
     }
 
+    // New databases can give free pages back to the filesystem a few at a time, instead of
+    // needing a full VACUUM (see -compactFor:finished:error:.) This must precede creating tables.
+    if (dbVersion == 0 && ![self initialize: @"PRAGMA auto_vacuum=INCREMENTAL" error: outError])
+        return NO;
+
     // Always make sure WAL is enabled because our concurrency support relies on it
     if (![self initialize: @"PRAGMA journal_mode=WAL" error: outError])
         return NO;
 
+    // Memory and durability tuning, from the SQLite profile. A setting that fails isn't fatal:
+    for (NSString* name in tunablePragmas()) {
+        id value = _pragmas[name];
+        if (value && ![_fmdb executeUpdate: $sprintf(@"PRAGMA %@=%@", name, value)])
+            Warn(@"%@: Couldn't set PRAGMA %@=%@: %@", self, name, value, _fmdb.lastErrorMessage);
+    }
+    if (_pragmas.count > 0)
+        LogTo(Database, @"%@: SQLite settings %@", self, _pragmas);
+
     BOOL isNew = (dbVersion == 0);
     if (isNew && ![self initialize: @"BEGIN TRANSACTION" error: outError])
         return NO;
@@ -517,20 +971,65 @@ DefineLogDomain(SQL);
         dbVersion = 102;
     }
 
+    if (dbVersion < 103) {
+        // Index of the attachments referred to by each revision body, so that attachment garbage
+        // collection can tell whether a blob is in use without scanning every revision.
+        // Rows disappear along with their revision, or when compaction removes its body.
+        NSString *schema = @"\
+            CREATE TABLE attachment_refs (\
+                sequence INTEGER NOT NULL REFERENCES revs(sequence) ON DELETE CASCADE,\
+                key BLOB NOT NULL);\
+            CREATE INDEX attachment_refs_key ON attachment_refs(key);\
+            CREATE INDEX attachment_refs_sequence ON attachment_refs(sequence)";
+        if (!isNew && ![self initialize: @"BEGIN TRANSACTION" error: outError])
+            return NO;
+        if (![self initialize: schema error: outError])
+            return NO;
+        if (!isNew && ![self indexAttachmentRefsAfterSequence: 0]) {
+            Warn(@"CBLDatabase: Couldn't index attachments of %@; SQLite error: %@",
+                 _directory, _fmdb.lastErrorMessage);
+            if (outError) *outError = self.fmdbError;
+            [_fmdb close];
+            return NO;
+        }
+        if (!isNew && [self setInfo: $sprintf(@"%lld", self.lastSequence)
+                              forKey: kAttachmentRefsSequenceKey] != kCBLStatusOK) {
+            if (outError) *outError = self.fmdbError;
+            [_fmdb close];
+            return NO;
+        }
+        if (![self initialize: @"PRAGMA user_version = 103" error: outError])
+            return NO;
+        if (!isNew && ![self initialize: @"END TRANSACTION" error: outError])
+            return NO;
+        dbVersion = 103;
+    }
+
     if (isNew && ![self initialize: @"END TRANSACTION" error: outError])
         return NO;
 
+    // (Schema version kCompressedBodiesSchemaVersion is set when the first compressed body is
+    // written; see -storedBodyForJSON:.)
+    _schemaHasCompressedBodies = (dbVersion >= kCompressedBodiesSchemaVersion);
+
     if (isNew)
         [self setInfo: @"true" forKey: @"pruned"];  // See -compact: for explanation
 
     if (!isNew)
         [self optimizeSQLIndexes];          // runs ANALYZE query
 
+    // An older version may have added revisions without indexing their attachments:
+    if (!isNew && !_readOnly && ![self updateAttachmentRefs: outError]) {
+        [_fmdb close];
+        return NO;
+    }
+
 #if DEBUG
     _fmdb.crashOnErrors = YES;
 #endif
 
     _fmdb.shouldCacheStatements = YES;      // Saves the time to recompile SQL statements
+    ((CBL_SQLiteFMDatabase*)_fmdb).collectsStatementStats = WillLogTo(SQLStats);
     return YES;
 }
 
@@ -540,7 +1039,8 @@ DefineLogDomain(SQL);
     // managed by the CBLShared object it won't be dealloced. To free up memory, clear it
     // when closing a database. (This also prevents it from containing incorrect values if a
     // different database gets moved to this path and then opened!)
-    [_docIDs removeAllObjects];
+    LogTo(Database, @"%@: DocID cache hits=%llu, misses=%llu", self, _docIDs.hits, _docIDs.misses);
+    [_docIDs removeAllDocIDs];
 
     [_fmdb close]; // this returns BOOL, but its implementation never returns NO
     _fmdb = nil;
@@ -620,6 +1120,11 @@ DefineLogDomain(SQL);
         Warn(@"Failed to create SQLite transaction!");
         return NO;
     }
+    if (!_newDocIDs) {
+        _newDocIDs = [[NSMutableArray alloc] init];
+        _newDocIDMarks = [[NSMutableArray alloc] init];
+    }
+    [_newDocIDMarks addObject: @(_newDocIDs.count)];
     LogTo(Database, @"{{ Begin transaction (level %d)...", _fmdb.transactionLevel);
     return YES;
 }
@@ -632,8 +1137,20 @@ DefineLogDomain(SQL);
     if (!ok)
         Warn(@"Failed to end transaction!");
 
-    if (!commit)
-        [self invalidateDocNumericIDs]; // Forget the rowids of any aborted new docs
+    NSUInteger mark = [_newDocIDMarks.lastObject unsignedIntegerValue];
+    [_newDocIDMarks removeLastObject];
+    if (!commit) {
+        // Forget the rowids of the docs this transaction added, since they'll be reused. (If it
+        // was nested, the ones the outer transaction added are still valid.)
+        NSRange added = NSMakeRange(mark, _newDocIDs.count - mark);
+        for (NSString* docID in [_newDocIDs subarrayWithRange: added])
+            [_docIDs removeDocID: docID];
+        [_newDocIDs removeObjectsInRange: added];
+        if (_schemaHasCompressedBodies) // The schema version bump may have been rolled back too
+            _schemaHasCompressedBodies = (self.schemaVersion >= kCompressedBodiesSchemaVersion);
+    }
+    if (_newDocIDMarks.count == 0)
+        [_newDocIDs removeAllObjects];
 
     [_delegate storageExitedTransaction: commit];
     return ok;
@@ -715,14 +1232,14 @@ DefineLogDomain(SQL);
     // require that the caller is performing the operation within a read or write transaction.
     Assert(_fmdb.hasLock);
 #endif
-    NSNumber* cached = [_docIDs objectForKey: docID];
-    if (cached) {
-        return cached.longLongValue;
+    SInt64 cached = [_docIDs numericIDForDocID: docID];
+    if (cached > 0) {
+        return cached;
     } else {
         SInt64 result = [self _readDocNumericID: docID];
         if (result <= 0)
             return result;
-        [_docIDs setObject: @(result) forKey: docID];
+        [_docIDs setNumericID: result forDocID: docID];
         return result;
     }
 }
@@ -736,6 +1253,7 @@ DefineLogDomain(SQL);
         return -1;
     if (_fmdb.changes == 0)
         return 0;
+    [_newDocIDs addObject: docID];
     return _fmdb.lastInsertRowId;
 }
 
@@ -744,10 +1262,10 @@ DefineLogDomain(SQL);
 // On return, *ioIsNew will be YES iff the docID is newly-created (was not known before.)
 // Return value is the positive row ID of this doc, or <= 0 on error.
 - (SInt64) createOrGetDocNumericID: (UU NSString*)docID isNew: (BOOL*)ioIsNew {
-    NSNumber* cached = [_docIDs objectForKey: docID];
-    if (cached) {
+    SInt64 cached = [_docIDs numericIDForDocID: docID];
+    if (cached > 0) {
         *ioIsNew = NO;
-        return cached.longLongValue;
+        return cached;
     }
 
     SInt64 row = *ioIsNew ? [self _createDocNumericID: docID] : [self _readDocNumericID: docID];
@@ -759,17 +1277,90 @@ DefineLogDomain(SQL);
     }
 
     if (row > 0)
-        [_docIDs setObject: @(row) forKey: docID];
+        [_docIDs setNumericID: row forDocID: docID];
     return row;
 }
 
 
 - (void) invalidateDocNumericID: (UU NSString*)docID {
-    [_docIDs removeObjectForKey: docID];
+    [_docIDs removeDocID: docID];
 }
 
 - (void) invalidateDocNumericIDs {
-    [_docIDs removeAllObjects];
+    [_docIDs removeAllDocIDs];
+}
+
+- (void) preloadDocIDs {
+    if (_docIDs.count > 0)
+        return;     // another connection has already warmed it up
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    __block NSUInteger n = 0;
+    [self withReadLock: ^CBLStatus {
+        // Load the most recently created docs first, until the cache is full:
+        CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT doc_id, docid FROM docs "
+                                                   "ORDER BY doc_id DESC"];
+        if (!r)
+            return self.lastDbError;
+        while ([r next]) {
+            if (![_docIDs preloadNumericID: [r longLongIntForColumnIndex: 0]
+                                  forDocID: [r stringForColumnIndex: 1]])
+                break;
+            ++n;
+        }
+        [r close];
+        return kCBLStatusOK;
+    }];
+    LogTo(Database, @"%@: Preloaded %lu docIDs in %.3f sec (%zu bytes)",
+          self, (unsigned long)n, CFAbsoluteTimeGetCurrent() - start, _docIDs.memoryUsed);
+}
+
+- (size_t) docIDCacheBudget {
+    return _docIDs.memoryBudget;
+}
+
+- (void) setDocIDCacheBudget: (size_t)budget {
+    _docIDs.memoryBudget = budget;
+}
+
+- (NSDictionary*) docIDCacheInfo {
+    return @{@"count": @(_docIDs.count),
+             @"memory_used": @(_docIDs.memoryUsed),
+             @"memory_budget": @(_docIDs.memoryBudget),
+             @"hits": @(_docIDs.hits),
+             @"misses": @(_docIDs.misses)};
+}
+
+- (void) lowMemoryWarning {
+    [_docIDs removeAllDocIDs];
+
+    // Shrink the page cache to the low-memory profile's size, if it's bigger, and give the memory
+    // back. It stays that size until the database is reopened.
+    SInt64 cacheSize = [_fmdb longLongForQuery: @"PRAGMA cache_size"];
+    SInt64 cacheKB = cacheSize < 0 ? -cacheSize
+                                   : cacheSize * [_fmdb intForQuery: @"PRAGMA page_size"] / 1024;
+    if (cacheKB > kLowMemoryCacheSizeKB) {
+        LogTo(Database, @"%@: Low memory; shrinking page cache from %lldKB to %dKB",
+              self, cacheKB, kLowMemoryCacheSizeKB);
+        [_fmdb executeUpdate: $sprintf(@"PRAGMA cache_size=%d", -kLowMemoryCacheSizeKB)];
+    }
+    [_fmdb executeUpdate: @"PRAGMA shrink_memory"];
+}
+
+- (BOOL) collectsStatementStats {
+    return ((CBL_SQLiteFMDatabase*)_fmdb).collectsStatementStats;
+}
+
+- (void) setCollectsStatementStats: (BOOL)collect {
+    ((CBL_SQLiteFMDatabase*)_fmdb).collectsStatementStats = collect;
+}
+
+- (NSDictionary*) statementStats {
+    __block NSDictionary* stats = nil;
+    [self withReadLock: ^CBLStatus {
+        stats = [(CBL_SQLiteFMDatabase*)_fmdb statementStatsWithLimit: kStatementStatsLimit];
+        return kCBLStatusOK;
+    }];
+    return stats;
 }
 
 
@@ -806,17 +1397,21 @@ DefineLogDomain(SQL);
         } else {
             CBL_RevID* actualRevID = revID ?:  [r revIDForColumnIndex: 0];
             BOOL deleted = [r boolForColumnIndex: 1];
+            CBLStatus status = deleted ? kCBLStatusDeleted : kCBLStatusOK;
             if (revID || !deleted) {
                 result = [[CBL_MutableRevision alloc] initWithDocID: docID revID: actualRevID
                                                             deleted: deleted];
                 result.sequence = [r longLongIntForColumnIndex: 2];
                 if (withBody)
-                    result.asJSON = [r dataNoCopyForColumnIndex: 3];
+                    result.asJSON = [self JSONFromStoredBody: [r dataNoCopyForColumnIndex: 3]
+                                                      status: &status];
                 else
                     result.missing = ![r boolForColumnIndex: 3];
             }
             [r close];
-            return deleted ? kCBLStatusDeleted : kCBLStatusOK;
+            if (CBLStatusIsError(status))
+                result = nil;
+            return status;
         }
     }];
     if (outStatus)
@@ -831,6 +1426,85 @@ DefineLogDomain(SQL);
 }
 
 
+- (NSArray*) getDocumentsWithIDs: (NSArray<NSString*>*)docIDs
+                        withBody: (BOOL)withBody
+                          status: (CBLStatus*)outStatus
+{
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity: docIDs.count];
+    for (NSUInteger i = 0; i < docIDs.count; i++)
+        [results addObject: [NSNull null]];
+    if (docIDs.count == 0)
+        return results;
+    CBLStatus status = [self withReadLock: ^CBLStatus {
+        return [self withDocIDLookupTable: docIDs do: ^CBLStatus {
+            CBLStatus status = kCBLStatusOK;
+            // Each doc's current revisions come out together, winner first:
+            NSString* sql = $sprintf(@"SELECT pos, revid, deleted, sequence, %@ "
+                                      "FROM temp.lookup_docids, docs, revs "
+                                      "WHERE docs.docid = lookup_docids.docid "
+                                      "AND revs.doc_id = docs.doc_id AND current=1 "
+                                      "ORDER BY pos, deleted ASC, revid DESC",
+                                     (withBody ? @"json" : @"json is not null"));
+            CBL_FMResultSet *r = [_fmdb executeQuery: sql];
+            if (!r)
+                return self.lastDbError;
+            SInt64 lastPos = -1;
+            while ([r next]) {
+                SInt64 pos = [r longLongIntForColumnIndex: 0];
+                if (pos == lastPos || [r boolForColumnIndex: 2])
+                    continue;       // skip losing conflicts, and deleted docs
+                lastPos = pos;
+                NSString* docID = docIDs[(NSUInteger)pos];
+                CBL_MutableRevision* rev = [[CBL_MutableRevision alloc]
+                                                    initWithDocID: docID
+                                                            revID: [r revIDForColumnIndex: 1]
+                                                          deleted: NO];
+                rev.sequence = [r longLongIntForColumnIndex: 3];
+                if (withBody)
+                    rev.asJSON = [self JSONFromStoredBody: [r dataNoCopyForColumnIndex: 4]
+                                                   status: &status];
+                else
+                    rev.missing = ![r boolForColumnIndex: 4];
+                results[(NSUInteger)pos] = rev;
+            }
+            [r close];
+            return status;
+        }];
+    }];
+    if (CBLStatusIsError(status)) {
+        if (outStatus)
+            *outStatus = status;
+        return nil;
+    }
+    return results;
+}
+
+
+// Stores doc IDs in the temporary table `lookup_docids`, numbered in order by its `pos` column,
+// so that queries run by the block can look them all up with a join; then empties the table
+// again, so the IDs don't linger in memory. Must be called within a read lock.
+- (CBLStatus) withDocIDLookupTable: (NSArray<NSString*>*)docIDs do: (CBLStatus(^)())block {
+    // (A TEMP table is private to this connection, so this doesn't need a write lock.)
+    if (![_fmdb executeUpdate: @"CREATE TEMP TABLE IF NOT EXISTS lookup_docids "
+                                "(pos INTEGER PRIMARY KEY, docid TEXT NOT NULL)"]
+            || ![_fmdb executeUpdate: @"DELETE FROM temp.lookup_docids"])
+        return self.lastDbError;
+    CBLStatus status = kCBLStatusOK;
+    NSUInteger pos = 0;
+    for (NSString* docID in docIDs) {
+        if (![_fmdb executeUpdate: @"INSERT INTO temp.lookup_docids (pos, docid) VALUES (?, ?)",
+                                   @(pos++), docID]) {
+            status = self.lastDbError;
+            break;
+        }
+    }
+    if (!CBLStatusIsError(status))
+        status = block();
+    [_fmdb executeUpdate: @"DELETE FROM temp.lookup_docids"];
+    return status;
+}
+
+
 // Loads revision given its sequence. Assumes the given docID is valid.
 - (CBL_MutableRevision*) getDocumentWithID: (NSString*)docID
                                   sequence: (SequenceNumber)sequence
@@ -852,8 +1526,10 @@ DefineLogDomain(SQL);
                                                       revID: revID
                                                     deleted: deleted];
         result.sequence = sequence;
-        result.asJSON = [r dataNoCopyForColumnIndex: 2];
         status = kCBLStatusOK;
+        result.asJSON = [self JSONFromStoredBody: [r dataNoCopyForColumnIndex: 2] status: &status];
+        if (CBLStatusIsError(status))
+            result = nil;
     }
     [r close];
     if (outStatus)
@@ -877,7 +1553,8 @@ DefineLogDomain(SQL);
         if ([r next]) {
             // Found the rev. But the JSON still might be null if the database has been compacted.
             rev.sequence = [r longLongIntForColumnIndex: 0];
-            NSData* json = [r dataNoCopyForColumnIndex: 1];
+            NSData* body = [r dataNoCopyForColumnIndex: 1];
+            NSData* json = [self JSONFromStoredBody: body status: &status];
             rev.asJSON = json;
             if (json)
                 status = kCBLStatusOK;
@@ -897,7 +1574,7 @@ DefineLogDomain(SQL);
     CBL_MutableRevision* rev = [[CBL_MutableRevision alloc] initWithDocID: docID revID: revID
                                                                   deleted: deleted];
     rev.sequence = sequence;
-    rev.asJSON = json;
+    rev.asJSON = [self JSONFromStoredBody: json];
     return rev;
 }
 
@@ -1232,8 +1909,17 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
                                                                             revID: revID
                                                                           deleted: deleted];
             rev.sequence = [r longLongIntForColumnIndex: 0];
-            if (includeDocs)
-                rev.asJSON = [r dataNoCopyForColumnIndex: 5];
+            if (includeDocs) {
+                CBLStatus status = kCBLStatusOK;
+                rev.asJSON = [self JSONFromStoredBody: [r dataNoCopyForColumnIndex: 5]
+                                               status: &status];
+                if (CBLStatusIsError(status)) {
+                    [r close];
+                    if (outStatus)
+                        *outStatus = status;
+                    return nil;
+                }
+            }
             if (!filter || filter(rev))
                 [changes addRev: rev];
         }
@@ -1287,7 +1973,6 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
     CBLQueryRowFilter filter = options.filter;
     
     // Generate the SELECT statement, based on the options:
-    BOOL cacheQuery = YES;
     NSMutableString* sql = [@"SELECT revs.doc_id, docid, revid, sequence" mutableCopy];
     if (includeDocs)
         [sql appendString: @", json, no_attachments"];
@@ -1295,8 +1980,9 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
         [sql appendString: @", deleted"];
     [sql appendString: @" FROM revs, docs WHERE"];
     if (options.keys) {
-        [sql appendFormat: @" revs.doc_id IN (SELECT doc_id FROM docs WHERE docid IN (%@)) AND", CBLJoinSQLQuotedStrings(options.keys)];
-        cacheQuery = NO; // we've put hardcoded key strings in the query
+        // The keys are put in a temp table (below) so the statement doesn't depend on them:
+        [sql appendString: @" revs.doc_id IN (SELECT doc_id FROM docs WHERE docid IN "
+                            "(SELECT docid FROM temp.lookup_docids)) AND"];
     }
     [sql appendString: @" docs.doc_id = revs.doc_id AND current=1"];
     if (!includeDeletedDocs)
@@ -1320,77 +2006,126 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
         [args addObject: maxKey];
     }
     
-    [sql appendFormat: @" ORDER BY docid %@, %@ revid DESC LIMIT ? OFFSET ?",
-                       (options->descending ? @"DESC" : @"ASC"),
-                       (includeDeletedDocs ? @"deleted ASC," : @"")];
-    [args addObject: @(options->limit)];
-    [args addObject: @(options->skip)];
+    NSString* orderBy = $sprintf(@" ORDER BY docid %@, %@ revid DESC",
+                                 (options->descending ? @"DESC" : @"ASC"),
+                                 (includeDeletedDocs ? @"deleted ASC," : @""));
+
+    // Reads the next document's row from the result set `r`; returns nil at the end:
+    __block CBL_FMResultSet* r = nil;
+    __block BOOL keepGoing = NO;
+    __block NSString* lastDocID = nil;      // last document whose rows have all been read
+    __block unsigned rowsRead = 0;          // result rows read so far, after the skipped ones
+    CBLQueryRowGenerator readRow = ^CBLQueryRow*{
+        while (keepGoing) {
+            // Get row values now, before the code below advances 'r':
+            int64_t docNumericID = [r longLongIntForColumnIndex: 0];
+            NSString* docID = [r stringForColumnIndex: 1];
+            CBL_RevID* revID = [r revIDForColumnIndex: 2];
+            SequenceNumber sequence = [r longLongIntForColumnIndex: 3];
+            BOOL deleted = includeDeletedDocs && [r boolForColumn: @"deleted"];
+            ++rowsRead;
+
+            CBL_Revision* docRevision = nil;
+            if (includeDocs) {
+                // Fill in the document contents:
+                docRevision = [self revisionWithDocID: docID
+                                                revID: revID
+                                              deleted: deleted
+                                             sequence: sequence
+                                                 json: [r dataForColumnIndex: 4]];
+                Assert(docRevision);
+            }
 
-    // Now run the database query:
-    NSMutableArray* rows = $marray();
-    *outStatus = [self withReadLock: ^CBLStatus {
-        if (!cacheQuery)
-            _fmdb.shouldCacheStatements = NO;
-        CBL_FMResultSet* r = [_fmdb executeQuery: sql withArgumentsInArray: args];
-        if (!cacheQuery)
-            _fmdb.shouldCacheStatements = YES;
+            // Iterate over following rows with the same doc_id -- these are conflicts.
+            // Skip them, but collect their revIDs if the 'conflicts' option is set:
+            NSMutableArray<NSString*>* conflicts = nil;
+            while ((keepGoing = [r next]) && [r longLongIntForColumnIndex: 0] == docNumericID) {
+                ++rowsRead;
+                if (options->allDocsMode >= kCBLShowConflicts) {
+                    if (!conflicts)
+                        conflicts = $marray(revID.asString);
+                    [conflicts addObject: [r stringForColumnIndex: 2]];
+                }
+            }
+            lastDocID = docID;
+            if (options->allDocsMode == kCBLOnlyConflicts && !conflicts)
+                continue;
+
+            NSDictionary* value = $dict({@"rev", revID.asString},
+                                        {@"deleted", (deleted ?$true : nil)},
+                                        {@"_conflicts", conflicts});  // (not found in CouchDB)
+            return [[CBLQueryRow alloc] initWithDocID: docID
+                                             sequence: sequence
+                                                  key: docID
+                                                value: value
+                                          docRevision: docRevision];
+        }
+        [r close];
+        return nil;
+    };
+
+    // Reads the next page of rows (without explicit keys), resuming after lastDocID, and
+    // finishes the statement before returning, so no read snapshot is held between pages:
+    __block NSMutableArray* page = nil;
+    __block NSUInteger pageIndex = 0;
+    __block BOOL finished = NO;
+    CBLStatus (^readPage)() = ^CBLStatus {
+        NSMutableString* pageSQL = [sql mutableCopy];
+        NSMutableArray* pageArgs = [args mutableCopy];
+        if (lastDocID) {
+            [pageSQL appendString: (options->descending ? @" AND docid < ?" : @" AND docid > ?")];
+            [pageArgs addObject: lastDocID];
+        }
+        [pageSQL appendString: orderBy];
+        [pageSQL appendString: @" LIMIT ? OFFSET ?"];
+        [pageArgs addObject: @(options->limit - rowsRead)];
+        [pageArgs addObject: @(lastDocID ? 0 : options->skip)];
+        r = [_fmdb executeQuery: pageSQL withArgumentsInArray: pageArgs];
         if (!r)
             return self.lastDbError;
-
-        NSMutableDictionary* docs = options.keys ? $mdict() : nil;
-
-        BOOL keepGoing = [r next]; // Go to first result row
-        while (keepGoing) {
+        keepGoing = [r next];
+        page = [[NSMutableArray alloc] initWithCapacity: kCBLQueryPageSize];
+        pageIndex = 0;
+        for (unsigned n = 0; keepGoing && n < kCBLQueryPageSize; ++n) {
             @autoreleasepool {
-                // Get row values now, before the code below advances 'r':
-                int64_t docNumericID = [r longLongIntForColumnIndex: 0];
-                NSString* docID = [r stringForColumnIndex: 1];
-                CBL_RevID* revID = [r revIDForColumnIndex: 2];
-                SequenceNumber sequence = [r longLongIntForColumnIndex: 3];
-                BOOL deleted = includeDeletedDocs && [r boolForColumn: @"deleted"];
-
-                CBL_Revision* docRevision = nil;
-                if (includeDocs) {
-                    // Fill in the document contents:
-                    docRevision = [self revisionWithDocID: docID
-                                                    revID: revID
-                                                  deleted: deleted
-                                                 sequence: sequence
-                                                     json: [r dataForColumnIndex: 4]];
-                    Assert(docRevision);
-                }
-                
-                // Iterate over following rows with the same doc_id -- these are conflicts.
-                // Skip them, but collect their revIDs if the 'conflicts' option is set:
-                NSMutableArray<NSString*>* conflicts = nil;
-                while ((keepGoing = [r next]) && [r longLongIntForColumnIndex: 0] == docNumericID) {
-                    if (options->allDocsMode >= kCBLShowConflicts) {
-                        if (!conflicts)
-                            conflicts = $marray(revID.asString);
-                        [conflicts addObject: [r stringForColumnIndex: 2]];
-                    }
-                }
-                if (options->allDocsMode == kCBLOnlyConflicts && !conflicts)
-                    continue;
-
-                NSDictionary* value = $dict({@"rev", revID.asString},
-                                            {@"deleted", (deleted ?$true : nil)},
-                                            {@"_conflicts", conflicts});  // (not found in CouchDB)
-                CBLQueryRow* row = [[CBLQueryRow alloc] initWithDocID: docID
-                                                             sequence: sequence
-                                                                  key: docID
-                                                                value: value
-                                                          docRevision: docRevision];
-                if (options.keys)
-                    docs[docID] = row;
-                else if (!filter || [self row: row passesFilter: filter])
-                    [rows addObject: row];
+                CBLQueryRow* row = readRow();
+                if (row && (!filter || [self row: row passesFilter: filter]))
+                    [page addObject: row];
             }
         }
+        // If the page stopped early, `r` is on the first row of a document that the next page
+        // will read again from the start:
         [r close];
+        r = nil;
+        finished = !keepGoing;
+        return kCBLStatusOK;
+    };
 
-        // If given doc IDs, sort the output into that order, and add entries for missing docs:
-        if (options.keys) {
+    // Now run the database query:
+    NSMutableArray* rows = options.keys ? $marray() : nil;
+    *outStatus = [self withReadLock: ^CBLStatus {
+        if (!options.keys)
+            return readPage();
+        return [self withDocIDLookupTable: options.keys do: ^CBLStatus {
+            NSString* keysSQL = [sql stringByAppendingFormat: @"%@ LIMIT ? OFFSET ?", orderBy];
+            r = [_fmdb executeQuery: keysSQL
+               withArgumentsInArray: [args arrayByAddingObjectsFromArray: @[@(options->limit),
+                                                                            @(options->skip)]]];
+            if (!r)
+                return self.lastDbError;
+            keepGoing = [r next]; // Go to first result row
+
+            // Given doc IDs, so sort the output into that order, and add entries for missing docs.
+            // (The result is no bigger than the list of IDs, so it's read all at once.)
+            NSMutableDictionary* docs = $mdict();
+            while (keepGoing) {
+                @autoreleasepool {
+                    CBLQueryRow* row = readRow();
+                    if (row)
+                        docs[row.sourceDocumentID] = row;
+                }
+            }
+            [r close];
             for (NSString* docID in options.keys) {
                 CBLQueryRow* row = docs[docID];
                 if (!row) {
@@ -1417,14 +2152,30 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
                 if (!filter || [self row: row passesFilter: filter])
                     [rows addObject: row];
             }
-        }
-        return kCBLStatusOK;
+            return kCBLStatusOK;
+        }];
     }];
     if (CBLStatusIsError(*outStatus))
         return nil;
+    if (rows)
+        return [[CBLQueryEnumerator alloc] initWithSequenceNumber: lastSeq rows: rows];
 
-    //OPT: Return objects from enum as they're found, without collecting them in an array first
-    return [[CBLQueryEnumerator alloc] initWithSequenceNumber: lastSeq rows: rows];
+    // Otherwise return rows from the enumerator a page at a time, so they never all have to be
+    // in memory at once:
+    return [[CBLQueryEnumerator alloc] initWithSequenceNumber: lastSeq
+                                                 rowGenerator: ^CBLQueryRow*
+    {
+        while (pageIndex >= page.count) {
+            if (finished)
+                return nil;
+            CBLStatus status = [self withReadLock: readPage];
+            if (CBLStatusIsError(status)) {
+                Warn(@"%@: Couldn't read all-docs rows (status %d)", self, status);
+                return nil;
+            }
+        }
+        return page[pageIndex++];
+    }];
 }
 
 
@@ -1445,6 +2196,7 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 {
     CBL_MutableRevision* rev = [[CBL_MutableRevision alloc] initWithDocID: docID revID: revID
                                                                   deleted: deleted];
+    json = [self JSONFromStoredBody: json];
     rev.sequence = sequence;
     rev.missing = (json == nil);
     NSMutableDictionary* docProperties;
@@ -1466,8 +2218,36 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 }
 
 
-/** Returns the rev ID of the 'winning' revision of this document, and whether it's deleted. */
-- (CBL_RevID*) winningRevIDOfDocNumericID: (SInt64)docNumericID
+- (NSDictionary*) lazyDocumentPropertiesFromJSON: (NSData*)json
+                                           docID: (NSString*)docID
+                                           revID: (CBL_RevID*)revID
+                                 extraProperties: (NSDictionary*)extraProperties
+{
+    json = [self JSONFromStoredBody: json];
+    if (json.length == 0)
+        json = [NSData dataWithBytes: "{}" length: 2];  // workaround for issue #44
+    NSMutableDictionary* extra = extraProperties ? [extraProperties mutableCopy] : $mdict();
+    [extra cbl_setID: docID rev: revID];
+    NSDictionary* properties = [[CBLLazyDictionaryOfJSON alloc] initWithJSON: json
+                                                              extraProperties: extra];
+    if (!properties) {
+        // The lazy dictionary rejects some JSON the full parser accepts (such as very deep
+        // nesting), so fall back to parsing all of it now:
+        NSDictionary* parsed = $castIf(NSDictionary, [CBLJSON JSONObjectWithData: json
+                                                                          options: 0
+                                                                            error: NULL]);
+        if (parsed) {
+            NSMutableDictionary* merged = [parsed mutableCopy];
+            [merged addEntriesFromDictionary: extra];
+            properties = merged;
+        }
+    }
+    return properties;
+}
+
+
+/** Returns the rev ID of the 'winning' revision of this document, and whether it's deleted. */
+- (CBL_RevID*) winningRevIDOfDocNumericID: (SInt64)docNumericID
                                 isDeleted: (BOOL*)outIsDeleted
                                isConflict: (BOOL*)outIsConflict // optional
                                    status: (CBLStatus*)outStatus
@@ -1640,6 +2420,43 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 
 #pragma mark - INSERTION:
 
+
+// https://github.com/couchbase/couchbase-lite-ios/issues/1440
+// Need to ensure revpos is correct for a revision inserted on top
+// of a deletion revision:
+static void fixAttachmentRevpos(NSMutableDictionary* properties, CBL_RevID* prevRevID) {
+    NSDictionary* attachments = properties.cbl_attachments;
+    if (attachments) {
+        NSMutableDictionary* editedAttachments = [attachments mutableCopy];
+        for (NSString* name in attachments) {
+            NSMutableDictionary* nuMeta = [attachments[name] mutableCopy];
+            nuMeta[@"revpos"] = @(prevRevID.generation + 1);
+            editedAttachments[name] = nuMeta;
+        }
+        properties[@"_attachments"] = editedAttachments;
+    }
+}
+
+
+// Called when inserting a revision fails because it already exists (with identical contents and
+// the same parent.) The pre-existing revision may have a nulled-out parent link since its original
+// parent may have been pruned earlier. Fix that link:
+- (BOOL) relinkDuplicateRevID: (CBL_RevID*)revID
+                 docNumericID: (SInt64)docNumericID
+               parentSequence: (SequenceNumber)parentSequence
+{
+    if (parentSequence) {
+        if (![_fmdb executeUpdate: @"UPDATE revs SET parent=? "
+                                    "WHERE doc_id=? and revid=? and parent isnull",
+              @(parentSequence), @(docNumericID), revID]) {
+            return NO;
+        }
+        if (_fmdb.changes > 0)
+            LogVerbose(Database, @"    fixed parent link of pre-existing rev");
+    }
+    return YES;
+}
+
 - (CBL_Revision*) addDocID: (NSString*)inDocID
                  prevRevID: (CBL_RevID*)inPrevRevID
                 properties: (NSMutableDictionary*)properties
@@ -1742,21 +2559,8 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 
         //// PART II: In which we prepare for insertion...
         
-        // https://github.com/couchbase/couchbase-lite-ios/issues/1440
-        // Need to ensure revpos is correct for a revision inserted on top
-        // of a deletion revision:
-        if (oldWinnerWasDeletion) {
-            NSDictionary* attachments = properties.cbl_attachments;
-            if (attachments) {
-                NSMutableDictionary* editedAttachments = [attachments mutableCopy];
-                for (NSString* name in attachments) {
-                    NSMutableDictionary* nuMeta = [attachments[name] mutableCopy];
-                    nuMeta[@"revpos"] = @(prevRevID.generation + 1);
-                    editedAttachments[name] = nuMeta;
-                }
-                properties[@"_attachments"] = editedAttachments;
-            }
-        }
+        if (oldWinnerWasDeletion)
+            fixAttachmentRevpos(properties, prevRevID);
         
         NSData* json = nil;
         if (properties) {
@@ -1814,18 +2618,9 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
             LogTo(Database, @"Duplicate rev PUT: %@ / %@ (parent seq %lld)",
                   docID, newRevID, parentSequence);
             newRev.body = nil;
-
-            // The pre-existing revision may have a nulled-out parent link since its original
-            // parent may have been pruned earlier. Fix that link:
-            if (parentSequence) {
-                if (![_fmdb executeUpdate: @"UPDATE revs SET parent=? "
-                                            "WHERE doc_id=? and revid=? and parent isnull",
-                      @(parentSequence), @(docNumericID), newRevID]) {
-                    return self.lastDbError;
-                }
-                if (_fmdb.changes > 0)
-                    LogVerbose(Database, @"    fixed parent link of pre-existing rev");
-            }
+            if (![self relinkDuplicateRevID: newRevID docNumericID: docNumericID
+                             parentSequence: parentSequence])
+                return self.lastDbError;
             // Keep going, to make the parent rev non-current, before returning...
         }
         
@@ -1880,6 +2675,416 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 }
 
 
+- (NSArray*) addDocuments: (NSArray<NSMutableDictionary*>*)docs
+            allowConflict: (BOOL)allowConflict
+          validationBlock: (CBL_StorageValidationBlock)validationBlock
+                    error: (NSError**)outError
+{
+    __block NSMutableArray* results = nil;
+    CBLStatus status = [self inTransaction: ^CBLStatus {
+        // Remember, this block may be called multiple times if I have to retry the transaction.
+        results = [NSMutableArray arrayWithCapacity: docs.count];
+
+        //// PART I: In which all the docs' numeric IDs and current revisions are looked up:
+        NSMutableArray* docIDs = [NSMutableArray arrayWithCapacity: docs.count];
+        for (NSDictionary* properties in docs) {
+            NSString* docID = properties.cbl_id;
+            Assert(docID, @"Missing _id in document passed to -addDocuments:");
+            [docIDs addObject: docID];
+        }
+        NSMutableDictionary* numericIDs = [NSMutableDictionary dictionaryWithCapacity: docs.count];
+        NSMutableDictionary* leaves = [NSMutableDictionary dictionary];
+        CBLStatus status = [self lookUpDocIDs: docIDs numericIDs: numericIDs leaves: leaves];
+        if (CBLStatusIsError(status))
+            return status;
+
+        //// PART II: In which each revision is prepared and validated, then inserted in batches:
+        NSMutableArray* pending = [NSMutableArray arrayWithCapacity: kBulkInsertBatchSize];
+        NSMutableArray* changes = [NSMutableArray array];
+        NSMutableSet* updatedDocs = [NSMutableSet set];   // numeric IDs with stale `leaves`
+        NSMutableDictionary* failedNewDocs = [NSMutableDictionary dictionary]; // numeric ID->docID
+        for (NSMutableDictionary* properties in docs) {
+            CBLBulkInsertDoc* doc = [[CBLBulkInsertDoc alloc] init];
+            doc->properties = properties;
+            doc->docID = properties.cbl_id;
+            doc->prevRevID = properties.cbl_rev;
+            doc->deleting = properties.cbl_deleted;
+            NSNumber* numericID = numericIDs[doc->docID];
+            if (!numericID)
+                return kCBLStatusDBError;
+            doc->docNumericID = numericID.longLongValue;
+
+            if ([updatedDocs containsObject: numericID]) {
+                // This doc was already updated earlier in the batch, so its current revisions
+                // have changed; insert what's pending and look them up again:
+                status = [self insertBulkRevisions: pending changes: changes];
+                if (CBLStatusIsError(status))
+                    return status;
+                status = [self lookUpCurrentRevisionsOf: @[numericID] into: leaves];
+                if (CBLStatusIsError(status))
+                    return status;
+                [updatedDocs removeObject: numericID];
+            }
+
+            NSError* error = nil;
+            status = [self prepareBulkRevision: doc
+                                        leaves: leaves[numericID]
+                                 allowConflict: allowConflict
+                               validationBlock: validationBlock
+                                         error: &error];
+            if (CBLStatusIsError(status)) {
+                if (status >= 500)
+                    return status;  // abort the whole thing if something goes badly wrong
+                [results addObject: error ?: CBLStatusToNSError(status)];
+                if (!leaves[numericID])
+                    failedNewDocs[numericID] = doc->docID;  // its 'docs' row may be new
+                continue;
+            }
+            [results addObject: doc];   // placeholder; replaced by doc->newRev below
+            [pending addObject: doc];
+            [updatedDocs addObject: numericID];
+            if (pending.count >= kBulkInsertBatchSize) {
+                status = [self insertBulkRevisions: pending changes: changes];
+                if (CBLStatusIsError(status))
+                    return status;
+            }
+        }
+        status = [self insertBulkRevisions: pending changes: changes];
+        if (CBLStatusIsError(status))
+            return status;
+        status = [self deleteEmptyDocs: failedNewDocs];
+        if (CBLStatusIsError(status))
+            return status;
+
+        for (NSUInteger i = 0; i < results.count; i++) {
+            CBLBulkInsertDoc* doc = $castIf(CBLBulkInsertDoc, results[i]);
+            if (doc)
+                results[i] = doc->newRev;
+        }
+
+        //// EPILOGUE: The delegate is told about the changes while the transaction is still
+        //// open, so it will post them all in one notification when the transaction ends.
+        for (CBLDatabaseChange* change in changes)
+            [_delegate databaseStorageChanged: change];
+        return kCBLStatusOK;
+    }];
+
+    if (CBLStatusIsError(status)) {
+        CBLStatusToOutNSError(status, outError);
+        return nil;
+    }
+    return results;
+}
+
+
+// Gets the numeric IDs of the given docIDs, creating 'docs' rows for any that don't exist yet,
+// then looks up the current revisions of those docs. (Part of -addDocuments:...)
+- (CBLStatus) lookUpDocIDs: (NSArray<NSString*>*)docIDs
+                numericIDs: (NSMutableDictionary*)numericIDs
+                    leaves: (NSMutableDictionary*)leaves
+{
+    NSMutableOrderedSet* unknownIDs = [NSMutableOrderedSet orderedSet];
+    for (NSString* docID in docIDs) {
+        SInt64 cached = [_docIDs numericIDForDocID: docID];
+        if (cached > 0)
+            numericIDs[docID] = @(cached);
+        else
+            [unknownIDs addObject: docID];
+    }
+
+    NSArray* unknown = unknownIDs.array;
+    for (NSUInteger start = 0; start < unknown.count; start += kBulkLookupBatchSize) {
+        NSUInteger n = MIN(kBulkLookupBatchSize, unknown.count - start);
+        NSArray* batch = [unknown subarrayWithRange: NSMakeRange(start, n)];
+        // (Multi-row VALUES needs SQLite 3.7.11)
+        NSUInteger rowsPerInsert = (sSQLiteVersion >= 3007011) ? n : 1;
+        _fmdb.shouldCacheStatements = (n == kBulkLookupBatchSize);   // else the SQL is a one-off
+        BOOL ok = YES;
+        for (NSUInteger i = 0; ok && i < n; i += rowsPerInsert) {
+            NSString* sql = $sprintf(@"INSERT OR IGNORE INTO docs (docid) VALUES %@",
+                                     repeatedSQL(@"(?)", rowsPerInsert));
+            ok = [_fmdb executeUpdate: sql withArgumentsInArray:
+                        [batch subarrayWithRange: NSMakeRange(i, rowsPerInsert)]];
+        }
+        [_newDocIDs addObjectsFromArray: batch];  // (some may already have existed; that's OK)
+        CBL_FMResultSet* r = nil;
+        if (ok) {
+            NSString* sql = $sprintf(@"SELECT doc_id, docid FROM docs WHERE docid IN (%@)",
+                                     repeatedSQL(@"?", n));
+            r = [_fmdb executeQuery: sql withArgumentsInArray: batch];
+        }
+        _fmdb.shouldCacheStatements = YES;
+        if (!r)
+            return self.lastDbError;
+        while ([r next]) {
+            SInt64 numericID = [r longLongIntForColumnIndex: 0];
+            NSString* docID = [r stringForColumnIndex: 1];
+            numericIDs[docID] = @(numericID);
+            [_docIDs setNumericID: numericID forDocID: docID];
+        }
+        [r close];
+    }
+
+    return [self lookUpCurrentRevisionsOf: numericIDs.allValues into: leaves];
+}
+
+
+// Deletes the 'docs' rows of the given docs (numeric ID -> docID) that have no revisions, i.e.
+// the ones -lookUpDocIDs:... created for new docs that then failed to save. (Part of
+// -addDocuments:...)
+- (CBLStatus) deleteEmptyDocs: (NSDictionary*)docs {
+    NSArray* numericIDs = docs.allKeys;
+    for (NSUInteger start = 0; start < numericIDs.count; start += kBulkLookupBatchSize) {
+        NSUInteger n = MIN(kBulkLookupBatchSize, numericIDs.count - start);
+        NSString* sql = $sprintf(@"DELETE FROM docs WHERE doc_id IN (%@) AND NOT EXISTS "
+                                  "(SELECT 1 FROM revs WHERE revs.doc_id = docs.doc_id)",
+                                 repeatedSQL(@"?", n));
+        _fmdb.shouldCacheStatements = NO;
+        BOOL ok = [_fmdb executeUpdate: sql withArgumentsInArray:
+                        [numericIDs subarrayWithRange: NSMakeRange(start, n)]];
+        _fmdb.shouldCacheStatements = YES;
+        if (!ok)
+            return self.lastDbError;
+    }
+    for (NSString* docID in docs.allValues)
+        [_docIDs removeDocID: docID];
+    return kCBLStatusOK;
+}
+
+
+// Looks up the current revisions of the given docs, storing into `leaves` an array of
+// [revID, deleted, sequence] triples for each doc that has any, with the winner first.
+// (Part of -addDocuments:...)
+- (CBLStatus) lookUpCurrentRevisionsOf: (NSArray<NSNumber*>*)numericIDs
+                                  into: (NSMutableDictionary*)leaves
+{
+    [leaves removeObjectsForKeys: numericIDs];
+    for (NSUInteger start = 0; start < numericIDs.count; start += kBulkLookupBatchSize) {
+        NSUInteger n = MIN(kBulkLookupBatchSize, numericIDs.count - start);
+        NSString* sql = $sprintf(@"SELECT doc_id, revid, deleted, sequence FROM revs "
+                                  "WHERE current=1 AND doc_id IN (%@) "
+                                  "ORDER BY doc_id, deleted ASC, revid DESC",
+                                 repeatedSQL(@"?", n));
+        _fmdb.shouldCacheStatements = (n == kBulkLookupBatchSize || n == 1);
+        CBL_FMResultSet* r = [_fmdb executeQuery: sql withArgumentsInArray:
+                                [numericIDs subarrayWithRange: NSMakeRange(start, n)]];
+        _fmdb.shouldCacheStatements = YES;
+        if (!r)
+            return self.lastDbError;
+        while ([r next]) {
+            NSNumber* numericID = @([r longLongIntForColumnIndex: 0]);
+            NSMutableArray* docLeaves = leaves[numericID];
+            if (!docLeaves)
+                leaves[numericID] = docLeaves = [NSMutableArray arrayWithCapacity: 1];
+            [docLeaves addObject: @[[r revIDForColumnIndex: 1],
+                                    @([r boolForColumnIndex: 2]),
+                                    @([r longLongIntForColumnIndex: 3])]];
+        }
+        [r close];
+    }
+    return kCBLStatusOK;
+}
+
+
+// Does the checks, revID generation and validation that -addDocID:... does before inserting,
+// using the doc's current revisions as looked up by -lookUpCurrentRevisionsOf:into:.
+- (CBLStatus) prepareBulkRevision: (CBLBulkInsertDoc*)doc
+                           leaves: (NSArray*)leaves
+                    allowConflict: (BOOL)allowConflict
+                  validationBlock: (CBL_StorageValidationBlock)validationBlock
+                            error: (NSError**)outError
+{
+    NSArray* winner = leaves.firstObject;
+    CBL_RevID* oldWinningRevID = winner[0];
+    BOOL oldWinnerWasDeletion = [winner[1] boolValue];
+    BOOL wasConflicted = !oldWinnerWasDeletion && leaves.count > 1 && ![leaves[1][1] boolValue];
+    BOOL docExists = oldWinningRevID && !oldWinnerWasDeletion;
+
+    CBL_RevID* prevRevID = doc->prevRevID;
+    SequenceNumber parentSequence = 0;
+    if (prevRevID) {
+        // Replacing: make sure given prevRevID is current & find its sequence number:
+        for (NSArray* leaf in leaves) {
+            if ($equal(leaf[0], prevRevID)) {
+                parentSequence = [leaf[2] longLongValue];
+                break;
+            }
+        }
+        if (parentSequence == 0 && allowConflict && leaves.count > 0) {
+            // The parent may be a non-current revision:
+            parentSequence = [self getSequenceOfDocument: doc->docNumericID revision: prevRevID
+                                             onlyCurrent: NO];
+        }
+        if (parentSequence == 0)
+            return (!allowConflict && docExists) ? kCBLStatusConflict : kCBLStatusNotFound;
+    } else if (doc->deleting) {
+        // Didn't specify a revision to delete: NotFound or a Conflict, depending
+        return docExists ? kCBLStatusConflict : kCBLStatusNotFound;
+    } else if (oldWinnerWasDeletion) {
+        // Creating a doc whose current revision is a deletion: insert on top of that
+        prevRevID = oldWinningRevID;
+        parentSequence = [winner[2] longLongValue];
+    } else if (oldWinningRevID) {
+        // The current winning revision is not deleted, so this is a conflict
+        return kCBLStatusConflict;
+    }
+
+    NSMutableDictionary* properties = doc->properties;
+    if (oldWinnerWasDeletion)
+        fixAttachmentRevpos(properties, prevRevID);
+    NSData* json = [CBL_Revision asCanonicalJSON: properties error: NULL];
+    if (!json)
+        return kCBLStatusBadJSON;
+    CBL_RevID* newRevID = [CBL_TreeRevID revIDForJSON: json
+                                              deleted: doc->deleting
+                                            prevRevID: prevRevID];
+    if (!newRevID)
+        return kCBLStatusBadID;  // invalid previous revID (no numeric prefix)
+    CBL_MutableRevision* newRev = [[CBL_MutableRevision alloc] initWithDocID: doc->docID
+                                                                       revID: newRevID
+                                                                     deleted: doc->deleting];
+    [properties cbl_setID: doc->docID rev: newRevID];
+    newRev.properties = properties;
+
+    if (validationBlock) {
+        CBL_Revision* prevRev = nil;
+        if (prevRevID) {
+            prevRev = [[CBL_Revision alloc] initWithDocID: doc->docID
+                                                    revID: prevRevID
+                                                  deleted: NO];
+        }
+        CBLStatus status = validationBlock(newRev, prevRev, prevRevID, outError);
+        if (CBLStatusIsError(status))
+            return status;
+    }
+
+    doc->prevRevID = prevRevID;
+    doc->parentSequence = parentSequence;
+    doc->oldWinningRevID = oldWinningRevID;
+    doc->oldWinnerWasDeletion = oldWinnerWasDeletion;
+    doc->inConflict = wasConflicted || (!doc->deleting && !$equal(prevRevID, oldWinningRevID));
+    doc->json = json;
+    doc->newRev = newRev;
+    return kCBLStatusOK;
+}
+
+
+// Inserts the pending revisions (at most one per doc) with a single multi-row INSERT, then does
+// the rest of what -addDocID:... does after inserting, adding a CBLDatabaseChange to `changes`
+// for each new revision. Empties `pending`. (Part of -addDocuments:...)
+- (CBLStatus) insertBulkRevisions: (NSMutableArray<CBLBulkInsertDoc*>*)pending
+                          changes: (NSMutableArray*)changes
+{
+    NSUInteger count = pending.count;
+    if (count == 0)
+        return kCBLStatusOK;
+
+    BOOL inserted = NO;
+    if (count > 1 && sSQLiteVersion >= 3007011) {   // (Multi-row VALUES needs SQLite 3.7.11)
+        NSMutableArray* args = [NSMutableArray arrayWithCapacity: 8 * count];
+        for (CBLBulkInsertDoc* doc in pending) {
+            [args addObject: @(doc->docNumericID)];
+            [args addObject: doc->newRev.revID];
+            [args addObject: (doc->parentSequence ? @(doc->parentSequence) : [NSNull null])];
+            [args addObject: @YES];
+            [args addObject: @(doc->deleting)];
+            [args addObject: @(doc->properties.cbl_attachments == nil)];
+            [args addObject: [self storedBodyForJSON: doc->json]];
+            [args addObject: doc->properties[@"type"] ?: [NSNull null]];
+        }
+        NSString* sql = $sprintf(@"INSERT INTO revs (doc_id, revid, parent, current, deleted, "
+                                  "no_attachments, json, doc_type) VALUES %@",
+                                 repeatedSQL(@"(?,?,?,?,?,?,?,?)", count));
+        _fmdb.shouldCacheStatements = (count == kBulkInsertBatchSize);
+        inserted = [_fmdb executeUpdate: sql withArgumentsInArray: args];
+        _fmdb.shouldCacheStatements = YES;
+        if (inserted) {
+            // AUTOINCREMENT gives the rows of a single INSERT consecutive sequences:
+            SequenceNumber sequence = _fmdb.lastInsertRowId - count + 1;
+            for (CBLBulkInsertDoc* doc in pending) {
+                doc->newRev.sequence = sequence;
+                if (doc->properties.cbl_attachments
+                        && ![self addAttachmentRefsOf: doc->properties sequence: sequence])
+                    return self.lastDbError;
+                ++sequence;
+            }
+            LogVerbose(Database, @"    Inserted %lu revs as seqs %lld-%lld",
+                       (unsigned long)count, sequence - count, sequence - 1);
+        } else if (_fmdb.lastErrorCode != SQLITE_CONSTRAINT) {
+            return self.lastDbError;
+        }
+        // A constraint error means some revision already exists; the INSERT had no effect,
+        // so fall back to inserting them one at a time to find out which.
+    }
+
+    if (!inserted) {
+        for (CBLBulkInsertDoc* doc in pending) {
+            CBL_MutableRevision* newRev = doc->newRev;
+            SequenceNumber sequence = [self insertRevision: newRev
+                                              docNumericID: doc->docNumericID
+                                            parentSequence: doc->parentSequence
+                                                   current: YES
+                                            hasAttachments: (doc->properties.cbl_attachments != nil)
+                                                      JSON: doc->json
+                                                   docType: doc->properties[@"type"]];
+            if (!sequence) {
+                if (_fmdb.lastErrorCode != SQLITE_CONSTRAINT)
+                    return self.lastDbError;
+                LogTo(Database, @"Duplicate rev PUT: %@ / %@ (parent seq %lld)",
+                      doc->docID, newRev.revID, doc->parentSequence);
+                newRev.body = nil;
+                if (![self relinkDuplicateRevID: newRev.revID docNumericID: doc->docNumericID
+                                 parentSequence: doc->parentSequence])
+                    return self.lastDbError;
+            }
+        }
+    }
+
+    // Make replaced revs non-current:
+    NSMutableArray* parents = [NSMutableArray arrayWithCapacity: count];
+    for (CBLBulkInsertDoc* doc in pending) {
+        if (doc->parentSequence > 0)
+            [parents addObject: @(doc->parentSequence)];
+    }
+    if (parents.count > 0) {
+        NSString* sql = $sprintf(@"UPDATE revs SET current=0, doc_type=null WHERE sequence IN (%@)",
+                                 repeatedSQL(@"?", parents.count));
+        _fmdb.shouldCacheStatements = NO;
+        BOOL ok = [_fmdb executeUpdate: sql withArgumentsInArray: parents];
+        _fmdb.shouldCacheStatements = YES;
+        if (!ok)
+            return self.lastDbError;
+    }
+
+    for (CBLBulkInsertDoc* doc in pending) {
+        CBL_MutableRevision* newRev = doc->newRev;
+        if (newRev.sequenceIfKnown == 0)
+            continue;  // duplicate rev; see above
+
+        // Delete the deepest revs in the tree to enforce the maxRevTreeDepth:
+        int minGenToKeep = (int)newRev.generation - (int)_maxRevTreeDepth + 1;
+        if (minGenToKeep > 1) {
+            NSInteger pruned = [self pruneDocument: doc->docID
+                                         numericID: doc->docNumericID
+                                  generationsBelow: minGenToKeep];
+            if (pruned > 0)
+                LogVerbose(Database, @"Pruned %zd old revisions of doc '%@'", pruned, doc->docID);
+        }
+
+        CBL_RevID* winningRevID = [self winnerWithDocID: doc->docNumericID
+                                              oldWinner: doc->oldWinningRevID
+                                             oldDeleted: doc->oldWinnerWasDeletion
+                                                 newRev: newRev];
+        [changes addObject: [[CBLDatabaseChange alloc] initWithAddedRevision: newRev
+                                                           winningRevisionID: winningRevID
+                                                                  inConflict: doc->inConflict
+                                                                      source: nil]];
+    }
+    [pending removeAllObjects];
+    return kCBLStatusOK;
+}
+
+
 - (CBLStatus) forceInsert: (CBL_Revision*)inRev
           revisionHistory: (NSArray<CBL_RevID*>*)fullHistory
           validationBlock: (CBL_StorageValidationBlock)validationBlock
@@ -2069,16 +3274,95 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
           @(current),
           @(rev.deleted),
           @(!hasAttachments),
-          json,
+          [self storedBodyForJSON: json],
           docType])
         return 0;
     SequenceNumber sequence = _fmdb.lastInsertRowId;
     LogVerbose(Database, @"    Inserted rev %@ as seq %lld (parent %lld), cur=%d, JSON=%lu bytes",
                rev, sequence, parentSequence, current, (unsigned long)json.length);
+    if (hasAttachments && json && ![self addAttachmentRefsOf: rev.properties sequence: sequence])
+        return 0;
     return rev.sequence = sequence;
 }
 
 
+// Adds the keys of the attachments in a revision body to the attachment_refs index.
+- (BOOL) addAttachmentRefsOf: (NSDictionary*)properties sequence: (SequenceNumber)sequence {
+    __block BOOL ok = YES;
+    [properties.cbl_attachments enumerateKeysAndObjectsUsingBlock:^(id key, NSDictionary* att, BOOL *stop) {
+        CBLBlobKey blobKey;
+        if ([CBL_Attachment digest: att[@"digest"] toBlobKey: &blobKey]) {
+            NSData* keyData = [[NSData alloc] initWithBytes: &blobKey length: sizeof(blobKey)];
+            if (![_fmdb executeUpdate: @"INSERT INTO attachment_refs (sequence, key) VALUES (?, ?)",
+                                       @(sequence), keyData]) {
+                ok = NO;
+                *stop = YES;
+            }
+        }
+    }];
+    return ok;
+}
+
+
+// Adds the attachment_refs rows of the revisions after a sequence that have attachments but no rows
+// yet (all of them, when upgrading an older database.) The bodies are read in batches so they
+// aren't all in memory at once.
+- (BOOL) indexAttachmentRefsAfterSequence: (SequenceNumber)since {
+    if (since == 0)
+        Log(@"CBLDatabase: Indexing attachments of %@ ...", _directory);
+    for (;;) {
+        CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT sequence, json FROM revs "
+                                                   "WHERE sequence > ? AND no_attachments != 1 "
+                                                   "AND json NOT NULL AND NOT EXISTS (SELECT 1 FROM "
+                                                   "attachment_refs WHERE sequence=revs.sequence) "
+                                                   "ORDER BY sequence LIMIT ?",
+                                                  @(since), @(kAttachmentRefsBatchSize)];
+        if (!r)
+            return NO;
+        NSMutableArray* refs = [NSMutableArray array];
+        NSUInteger count = 0;
+        while ([r next]) {
+            ++count;
+            since = [r longLongIntForColumnIndex: 0];
+            @autoreleasepool {
+                NSData* json = [self JSONFromStoredBody: [r dataNoCopyForColumnIndex: 1]];
+                NSDictionary* rev = [CBLJSON JSONObjectWithData: json options: 0 error: NULL];
+                NSDictionary* atts = rev.cbl_attachments;
+                if (atts)
+                    [refs addObject: @[@(since), @{@"_attachments": atts}]];
+            }
+        }
+        [r close];
+        for (NSArray* ref in refs) {
+            if (![self addAttachmentRefsOf: ref[1] sequence: [ref[0] longLongValue]])
+                return NO;
+        }
+        if (count < kAttachmentRefsBatchSize)
+            return YES;
+    }
+}
+
+
+// Brings the attachment_refs index up to date before it's relied on. Revisions I insert index
+// their own attachments, but the schema version is still 1xx, so an older version can open the
+// database and add revisions without doing so. Those are found among the revisions after the
+// sequence recorded in kAttachmentRefsSequenceKey, as ones with attachments but no index rows.
+- (BOOL) updateAttachmentRefs: (NSError**)outError {
+    CBLStatus status = [self inTransaction: ^CBLStatus{
+        SequenceNumber indexed = [[self infoForKey: kAttachmentRefsSequenceKey] longLongValue];
+        SequenceNumber last = self.lastSequence;
+        if (last <= indexed)
+            return kCBLStatusOK;
+        LogTo(Database, @"%@: Indexing attachments of sequences %lld-%lld",
+              self, indexed + 1, last);
+        if (![self indexAttachmentRefsAfterSequence: indexed])
+            return self.lastDbError;
+        return [self setInfo: $sprintf(@"%lld", last) forKey: kAttachmentRefsSequenceKey];
+    }];
+    return !CBLStatusIsError(status) || CBLStatusToOutNSError(status, outError);
+}
+
+
 /** Returns the JSON to be stored into the 'json' column for a given CBL_Revision.
     This has all the special keys like "_id" stripped out. */
 - (NSData*) encodeDocumentJSON: (CBL_Revision*)rev {
@@ -2145,6 +3429,357 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 }
 
 
+#pragma mark - BODY COMPRESSION:
+
+
+// A compressed revision body in the 'json' column looks like this (canonical JSON always starts
+// with '{', so the marker byte tells the two apart):
+//   byte 0       kCompressedBodyMarker
+//   byte 1       number of the dictionary it was compressed with, or 0 for none
+//   bytes 2-5    length of the JSON, little-endian
+//   bytes 6-     raw deflate stream
+#define kCompressedBodyMarker       0x01
+#define kCompressedBodyHeaderSize   6
+
+#define kMinCompressedBodyLength    128     // Shorter bodies are always stored as-is
+#define kBodyCompressionLevel       6       // zlib compression level (its default)
+#define kBodyDictionarySamples      200     // Max number of documents a dictionary is trained from
+#define kMinBodyDictionarySamples   20      // Min number of documents a dictionary is trained from
+#define kMaxBodyDictionaryLength    (32*1024) // zlib only uses the last 32KB of a dictionary
+#define kMaxBodyDictionaryString    64      // Longer keys/strings aren't put in a dictionary
+
+
+- (void) setCompressesDocuments: (BOOL)compressesDocuments {
+    _compressesDocuments = compressesDocuments;
+    if (compressesDocuments && !_bodyDictionaryNumber)
+        [self loadBodyDictionary: YES];
+}
+
+
+// Returns the data to store in the 'json' column for a revision's canonical JSON: compressed, if
+// that's enabled and makes it enough smaller, else the JSON itself.
+- (NSData*) storedBodyForJSON: (NSData*)json {
+    NSUInteger jsonLength = json.length;
+    if (!_compressesDocuments || jsonLength < kMinCompressedBodyLength || jsonLength > UINT32_MAX)
+        return json;
+    NSData* deflated = [CBLGZip dataByDeflatingData: json
+                                         dictionary: _bodyDictionary
+                                              level: kBodyCompressionLevel];
+    if (!deflated || kCompressedBodyHeaderSize + deflated.length > jsonLength * 7 / 8)
+        return json;    // not worth the time it'll take to decompress
+    uint32_t length = (uint32_t)jsonLength;
+    uint8_t header[kCompressedBodyHeaderSize] = {
+        kCompressedBodyMarker, (uint8_t)_bodyDictionaryNumber,
+        length & 0xFF, (length >> 8) & 0xFF, (length >> 16) & 0xFF, length >> 24};
+    if (!_schemaHasCompressedBodies) {
+        // Older versions would read a compressed body as invalid JSON, so bump the schema version
+        // to one they refuse to open. (This is in the same transaction as the body's insertion.)
+        if (![_fmdb executeUpdate: $sprintf(@"PRAGMA user_version = %d",
+                                            kCompressedBodiesSchemaVersion)]) {
+            Warn(@"%@: Couldn't update schema version: %@", self, _fmdb.lastErrorMessage);
+            return json;
+        }
+        LogTo(Database, @"%@: Schema version is now %d", self, kCompressedBodiesSchemaVersion);
+        _schemaHasCompressedBodies = YES;
+    }
+    NSMutableData* body = [NSMutableData dataWithCapacity: sizeof(header) + deflated.length];
+    [body appendBytes: header length: sizeof(header)];
+    [body appendData: deflated];
+    return body;
+}
+
+
++ (NSData*) JSONFromStoredBody: (NSData*)body
+                  dictionaries: (NSData* (^)(unsigned number))dictionaryNumbered
+{
+    const uint8_t* bytes = body.bytes;
+    if (body.length < kCompressedBodyHeaderSize || bytes[0] != kCompressedBodyMarker)
+        return body;
+    NSData* dictionary = nil;
+    if (bytes[1] > 0) {
+        dictionary = dictionaryNumbered(bytes[1]);
+        if (!dictionary) {
+            Warn(@"CBL_SQLiteStorage: Missing compression dictionary #%u", bytes[1]);
+            return nil;
+        }
+    }
+    uint32_t length = bytes[2] | (bytes[3] << 8) | (bytes[4] << 16) | ((uint32_t)bytes[5] << 24);
+    NSData* json = [CBLGZip dataByInflatingBytes: bytes + kCompressedBodyHeaderSize
+                                          length: body.length - kCompressedBodyHeaderSize
+                                      dictionary: dictionary
+                                  inflatedLength: length];
+    if (!json)
+        Warn(@"CBL_SQLiteStorage: Couldn't decompress a %lu-byte revision body (dictionary #%u)",
+             (unsigned long)body.length, bytes[1]);
+    return json;
+}
+
+
+// Returns the JSON of a revision body read from the 'json' column, decompressing it if necessary.
+// (Compressed bodies are always readable, whether or not compression is currently enabled.)
+// If a compressed body can't be decompressed, returns nil and sets *outStatus (if non-NULL) to
+// kCBLStatusCorruptError.
+- (NSData*) JSONFromStoredBody: (NSData*)body status: (CBLStatus*)outStatus {
+    if (body.length == 0 || ((const uint8_t*)body.bytes)[0] != kCompressedBodyMarker)
+        return body;
+    NSData* json = [[self class] JSONFromStoredBody: body dictionaries: ^NSData*(unsigned number) {
+        return [self bodyDictionaryNumbered: number];
+    }];
+    if (!json && outStatus)
+        *outStatus = kCBLStatusCorruptError;
+    return json;
+}
+
+- (NSData*) JSONFromStoredBody: (NSData*)body {
+    return [self JSONFromStoredBody: body status: NULL];
+}
+
+
+// Is a body from the 'json' column stored the way -storedBodyForJSON: would store it now?
+// (Long uncompressed bodies never are, though compressing them may not turn out to be worth it.)
+- (BOOL) isStoredBodyCurrent: (NSData*)body {
+    const uint8_t* bytes = body.bytes;
+    if (body.length >= kCompressedBodyHeaderSize && bytes[0] == kCompressedBodyMarker)
+        return _compressesDocuments && bytes[1] == _bodyDictionaryNumber;
+    return !_compressesDocuments || body.length < kMinCompressedBodyLength;
+}
+
+
+// The compression dictionary with the given number, loaded from the info table the first time.
+- (NSData*) bodyDictionaryNumbered: (unsigned)number {
+    NSData* dictionary = _bodyDictionaries[@(number)];
+    if (!dictionary) {
+        dictionary = [_fmdb dataForQuery: @"SELECT value FROM info WHERE key=?",
+                                          $sprintf(@"body_dict_%u", number)];
+        if (!dictionary)
+            return nil;
+        if (!_bodyDictionaries)
+            _bodyDictionaries = [[NSMutableDictionary alloc] init];
+        _bodyDictionaries[@(number)] = dictionary;
+    }
+    return dictionary;
+}
+
+
+// Sets up the dictionary to compress new bodies with: the most recently trained one, or else (if
+// `train` is YES) a new one trained from the current documents, if there are enough of them.
+- (void) loadBodyDictionary: (BOOL)train {
+    unsigned number = (unsigned)[[self infoForKey: @"body_dict"] intValue];
+    NSData* dictionary = number ? [self bodyDictionaryNumbered: number] : nil;
+    if (dictionary) {
+        _bodyDictionary = dictionary;
+        _bodyDictionaryNumber = number;
+        return;
+    }
+    // Never train in a transaction: if it were rolled back, the bodies compressed meanwhile
+    // would refer to a dictionary that doesn't exist.
+    if (!train || _readOnly || self.inTransaction || number >= UINT8_MAX)
+        return;
+
+    NSMutableArray* samples = [NSMutableArray array];
+    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT json FROM revs"
+                          " WHERE current=1 AND deleted=0 AND json NOT NULL"
+                          " ORDER BY random() LIMIT ?", @(kBodyDictionarySamples)];
+    while ([r next]) {
+        NSData* json = [self JSONFromStoredBody: [r dataForColumnIndex: 0]];
+        if (json.length >= kMinCompressedBodyLength)
+            [samples addObject: json];
+    }
+    [r close];
+    if (samples.count < kMinBodyDictionarySamples)
+        return;
+    dictionary = trainBodyDictionary(samples);
+    if (!dictionary)
+        return;
+    // Another connection may have saved a dictionary while this one was training, so the number
+    // is re-read inside the write transaction, and a saved dictionary is never overwritten (bodies
+    // compressed with it would become unreadable.) If this one loses the race, use the winner's.
+    unsigned trainedNumber = number;
+    __block BOOL superseded = NO;
+    CBLStatus status = [self inTransaction: ^CBLStatus {
+        unsigned current = (unsigned)[[self infoForKey: @"body_dict"] intValue];
+        if (current != trainedNumber || current >= UINT8_MAX) {
+            superseded = YES;
+            return kCBLStatusOK;
+        }
+        if (![_fmdb executeUpdate: @"INSERT INTO info (key, value) VALUES (?, ?)",
+                                   $sprintf(@"body_dict_%u", current + 1), dictionary]) {
+            if (_fmdb.lastErrorCode == SQLITE_CONSTRAINT)
+                superseded = YES;
+            return self.lastDbError;
+        }
+        return [self setInfo: $sprintf(@"%u", current + 1) forKey: @"body_dict"];
+    }];
+    if (superseded) {
+        LogTo(Database, @"%@: Another connection saved a compression dictionary first", self);
+        [self loadBodyDictionary: NO];
+        return;
+    } else if (CBLStatusIsError(status)) {
+        Warn(@"%@: Couldn't save compression dictionary (status %d)", self, status);
+        return;
+    }
+    number = trainedNumber + 1;
+    LogTo(Database, @"%@: Trained %lu-byte compression dictionary #%u from %lu documents",
+          self, (unsigned long)dictionary.length, number, (unsigned long)samples.count);
+    if (!_bodyDictionaries)
+        _bodyDictionaries = [[NSMutableDictionary alloc] init];
+    _bodyDictionaries[@(number)] = dictionary;
+    _bodyDictionary = dictionary;
+    _bodyDictionaryNumber = number;
+}
+
+
+// Is this a string that JSON encodes as-is, between quotes?
+static BOOL isPlainJSONString(NSString* str) {
+    NSUInteger length = str.length;
+    if (length > kMaxBodyDictionaryString)
+        return NO;
+    for (NSUInteger i = 0; i < length; ++i) {
+        unichar c = [str characterAtIndex: i];
+        if (c < ' ' || c == '"' || c == '\\')
+            return NO;
+    }
+    return YES;
+}
+
+
+// Adds the JSON fragments of a value that could go in a dictionary -- object keys with their
+// colons, and short strings -- to a set.
+static void collectJSONFragments(id value, NSMutableSet* fragments) {
+    if ([value isKindOfClass: [NSDictionary class]]) {
+        for (NSString* key in value) {
+            if (isPlainJSONString(key))
+                [fragments addObject: $sprintf(@"\"%@\":", key)];
+            collectJSONFragments(value[key], fragments);
+        }
+    } else if ([value isKindOfClass: [NSArray class]]) {
+        for (id item in value)
+            collectJSONFragments(item, fragments);
+    } else if ([value isKindOfClass: [NSString class]]) {
+        if (isPlainJSONString(value))
+            [fragments addObject: $sprintf(@"\"%@\"", value)];
+    }
+}
+
+
+// Builds a compression dictionary from sample JSON bodies: a typical body, to prime the
+// compressor with the usual structure, followed by the fragments that recur across the samples.
+// Fragments that would save the most come last, since zlib finds those the most cheaply.
+static NSData* trainBodyDictionary(NSArray* samples) {
+    NSCountedSet* counts = [[NSCountedSet alloc] init];
+    for (NSData* json in samples) {
+        @autoreleasepool {
+            NSMutableSet* fragments = [NSMutableSet set];
+            collectJSONFragments([CBLJSON JSONObjectWithData: json options: 0 error: NULL],
+                                 fragments);
+            for (NSString* fragment in fragments)
+                [counts addObject: fragment];
+        }
+    }
+
+    // Score each fragment that appears in enough documents by how many bytes it could save:
+    NSUInteger minCount = MAX(2u, samples.count / 10);
+    NSMutableArray* scored = [NSMutableArray array];
+    for (NSString* fragment in counts) {
+        NSUInteger count = [counts countForObject: fragment];
+        if (count >= minCount) {
+            NSData* data = [fragment dataUsingEncoding: NSUTF8StringEncoding];
+            [scored addObject: @[@(count * data.length), data]];
+        }
+    }
+    [scored sortUsingComparator: ^NSComparisonResult(NSArray* a, NSArray* b) {
+        return [b[0] compare: a[0]];
+    }];
+
+    NSArray* bySize = [samples sortedArrayUsingComparator: ^NSComparisonResult(NSData* a, NSData* b) {
+        return [@(a.length) compare: @(b.length)];
+    }];
+    NSData* typical = bySize[bySize.count / 2];
+    if (typical.length > kMaxBodyDictionaryLength / 4)
+        typical = nil;
+
+    // Take the best fragments that fit, then lay them out in increasing order of score:
+    NSUInteger available = kMaxBodyDictionaryLength - typical.length;
+    NSMutableArray* chosen = [NSMutableArray array];
+    for (NSArray* item in scored) {
+        NSData* data = item[1];
+        if (data.length <= available) {
+            [chosen addObject: data];
+            available -= data.length;
+        }
+    }
+    if (chosen.count == 0)
+        return nil;
+    NSMutableData* dictionary = [NSMutableData dataWithCapacity: kMaxBodyDictionaryLength];
+    if (typical)
+        [dictionary appendData: typical];
+    for (NSData* data in chosen.reverseObjectEnumerator)
+        [dictionary appendData: data];
+    return dictionary;
+}
+
+
+// Rewrites the bodies of current revisions that aren't stored the current way (uncompressed, or
+// compressed with an older dictionary or none), a batch per transaction, continuing after
+// _recompressSequence. Returns at `deadline`, if nonzero; sets *outFinished when it's done.
+- (CBLStatus) recompressBodiesUntil: (CFAbsoluteTime)deadline finished: (BOOL*)outFinished {
+    *outFinished = NO;
+    if (!_compressesDocuments) {
+        *outFinished = YES;     // (compressed bodies stay readable, so there's nothing to do)
+        return kCBLStatusOK;
+    }
+    if (!_bodyDictionaryNumber)
+        [self loadBodyDictionary: YES];    // there may be enough documents by now
+
+    for (;;) {
+        __block NSUInteger count = 0, recompressed = 0;
+        __block SequenceNumber maxSequence = _recompressSequence;
+        CBLStatus status = [self inTransaction: ^CBLStatus {
+            CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT sequence, json FROM revs"
+                                  " WHERE sequence > ? AND current=1 AND json NOT NULL"
+                                  " ORDER BY sequence LIMIT ?",
+                                  @(_recompressSequence), @(kCompactBatchSize)];
+            if (!r)
+                return self.lastDbError;
+            NSMutableArray* updates = [NSMutableArray array];
+            while ([r next]) {
+                @autoreleasepool {
+                    ++count;
+                    maxSequence = [r longLongIntForColumnIndex: 0];
+                    NSData* body = [r dataNoCopyForColumnIndex: 1];
+                    if ([self isStoredBodyCurrent: body])
+                        continue;
+                    NSData* json = [self JSONFromStoredBody: body];
+                    NSData* newBody = json ? [self storedBodyForJSON: json] : nil;
+                    if (newBody && newBody != body)
+                        [updates addObject: @[@(maxSequence), newBody]];
+                }
+            }
+            [r close];
+            for (NSArray* update in updates) {
+                if (![_fmdb executeUpdate: @"UPDATE revs SET json=? WHERE sequence=?",
+                                           update[1], update[0]])
+                    return self.lastDbError;
+            }
+            recompressed = updates.count;
+            return kCBLStatusOK;
+        }];
+        if (CBLStatusIsError(status))
+            return status;
+        _recompressSequence = maxSequence;
+        _compactRecompressedCount += recompressed;
+        if (count < kCompactBatchSize) {
+            LogTo(Database, @"    ... recompressed %lu revision bodies",
+                  (unsigned long)_compactRecompressedCount);
+            *outFinished = YES;
+            return kCBLStatusOK;
+        } else if (deadline > 0 && CFAbsoluteTimeGetCurrent() >= deadline) {
+            return kCBLStatusOK;
+        }
+    }
+}
+
+
 #pragma mark - HOUSEKEEPING:
 
 
@@ -2180,19 +3815,46 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
         [self setInfo: @"true" forKey: @"pruned"];
     }
 
+    if (self.isIncrementallyVacuumed) {
+        // Start over, in case a background compaction is partway through:
+        _compacting = NO;
+        BOOL finished;
+        if (![self compactFor: 0 finished: &finished error: outError])
+            return NO;
+        if (!finished)      // shouldn't happen; an untimed call either finishes or fails
+            return CBLStatusToOutNSError(kCBLStatusDBBusy, outError);
+        return YES;
+    }
+
+    // This is an older database that can only be compacted by a full VACUUM, which rewrites the
+    // whole file and temporarily needs that much free disk space. Switch it to incremental mode
+    // while vacuuming, so that this doesn't happen again.
+
     // Remove the JSON of non-current revisions, which is most of the space.
     Log(@"CBLDatabase: Deleting JSON of old revisions...");
-    if (![_fmdb executeUpdate: @"UPDATE revs SET json=null, doc_type=null, no_attachments=1"
-                                " WHERE current=0"])
+    if (![_fmdb executeUpdate: @"DELETE FROM attachment_refs WHERE sequence IN "
+                                "(SELECT sequence FROM revs WHERE current=0)"]
+            || ![_fmdb executeUpdate: @"UPDATE revs SET json=null, doc_type=null, no_attachments=1"
+                                       " WHERE current=0"])
         return CBLStatusToOutNSError(self.lastDbError, outError);
     Log(@"    ... deleted %d revisions", _fmdb.changes);
 
+    if (_compressesDocuments) {
+        Log(@"CBLDatabase: Recompressing revision bodies...");
+        _recompressSequence = 0;
+        _compactRecompressedCount = 0;
+        BOOL finished;
+        CBLStatus status = [self recompressBodiesUntil: 0 finished: &finished];
+        if (CBLStatusIsError(status))
+            return CBLStatusToOutNSError(status, outError);
+    }
+
     Log(@"Flushing SQLite WAL...");
     if (![_fmdb executeUpdate: @"PRAGMA wal_checkpoint(RESTART)"])
         return CBLStatusToOutNSError(self.lastDbError, outError);
 
-    Log(@"Vacuuming SQLite database...");
-    if (![_fmdb executeUpdate: @"VACUUM"])
+    Log(@"Vacuuming SQLite database, switching it to incremental auto-vacuum...");
+    if (![_fmdb executeUpdate: @"PRAGMA auto_vacuum=INCREMENTAL"] || ![_fmdb executeUpdate: @"VACUUM"])
         return CBLStatusToOutNSError(self.lastDbError, outError);
 
 //    Log(@"Closing and re-opening database...");
@@ -2205,6 +3867,160 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 }
 
 
+#define kVacuumBatchPages   256     // Number of free pages released per incremental_vacuum
+
+
+// Is the database in auto_vacuum=INCREMENTAL mode?
+- (BOOL) isIncrementallyVacuumed {
+    return [_fmdb intForQuery: @"PRAGMA auto_vacuum"] == 2;
+}
+
+
+// Compacts in phases: first removes the JSON of non-current revisions, a batch per transaction;
+// then, if document compression is on, recompresses current revisions that need it; then, if the
+// database is in incremental auto-vacuum mode, frees the pages that released, a batch at a time.
+// Returns after `duration` seconds (if nonzero), and a later call continues where it left off.
+// (Non-current revisions created meanwhile are left for next time.) Pages can't be freed inside
+// a transaction, so a timed call just leaves that for later, while an untimed one fails.
+- (BOOL) compactFor: (NSTimeInterval)duration
+           finished: (BOOL*)outFinished
+              error: (NSError**)outError
+{
+    *outFinished = NO;
+    if (!_compacting) {
+        LogTo(Database, @"%@: Starting incremental compaction...", self);
+        _compacting = YES;
+        _compactStripped = NO;
+        _compactSequence = 0;
+        _compactStrippedCount = 0;
+        _compactRecompressed = NO;
+        _recompressSequence = 0;
+        _compactRecompressedCount = 0;
+    }
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + duration;
+
+    while (!_compactStripped) {
+        __block SequenceNumber maxSequence = _compactSequence;
+        __block NSUInteger count = 0;
+        CBLStatus status = [self inTransaction: ^CBLStatus {
+            CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT sequence FROM revs"
+                                  " WHERE sequence > ? AND current=0 AND json NOT NULL"
+                                  " ORDER BY sequence LIMIT ?",
+                                  @(_compactSequence), @(kCompactBatchSize)];
+            if (!r)
+                return self.lastDbError;
+            while ([r next]) {
+                maxSequence = [r longLongIntForColumnIndex: 0];
+                ++count;
+            }
+            [r close];
+            if (count == 0)
+                return kCBLStatusOK;
+            if (![_fmdb executeUpdate: @"DELETE FROM attachment_refs WHERE sequence IN"
+                                        " (SELECT sequence FROM revs WHERE sequence > ?"
+                                        " AND sequence <= ? AND current=0 AND json NOT NULL)",
+                                        @(_compactSequence), @(maxSequence)]
+                    || ![_fmdb executeUpdate: @"UPDATE revs SET json=null, doc_type=null,"
+                                               " no_attachments=1 WHERE sequence > ?"
+                                               " AND sequence <= ? AND current=0 AND json NOT NULL",
+                                               @(_compactSequence), @(maxSequence)])
+                return self.lastDbError;
+            return kCBLStatusOK;
+        }];
+        if (CBLStatusIsError(status)) {
+            _compacting = NO;
+            return CBLStatusToOutNSError(status, outError);
+        }
+        _compactSequence = maxSequence;
+        _compactStrippedCount += count;
+        if (count < kCompactBatchSize) {
+            LogTo(Database, @"    ... deleted JSON of %lu old revisions",
+                  (unsigned long)_compactStrippedCount);
+            _compactStripped = YES;
+        } else if (duration > 0 && CFAbsoluteTimeGetCurrent() >= deadline) {
+            return YES;
+        }
+    }
+
+    if (!_compactRecompressed) {
+        BOOL finished;
+        CBLStatus status = [self recompressBodiesUntil: (duration > 0 ? deadline : 0)
+                                              finished: &finished];
+        if (CBLStatusIsError(status)) {
+            _compacting = NO;
+            return CBLStatusToOutNSError(status, outError);
+        }
+        if (!finished)
+            return YES;
+        _compactRecompressed = YES;
+    }
+
+    if (self.isIncrementallyVacuumed) {
+        if (self.inTransaction) {
+            // incremental_vacuum would be rolled back with the transaction:
+            if (duration > 0)
+                return YES;
+            _compacting = NO;
+            if (outError)
+                *outError = CBLStatusToNSErrorWithInfo(kCBLStatusDBBusy,
+                                             @"Can't compact inside a transaction", nil, nil);
+            return NO;
+        }
+        int freePages = [_fmdb intForQuery: @"PRAGMA freelist_count"];
+        while (freePages > 0) {
+            // This pragma returns a row for each page it frees, and has to be stepped through:
+            CBL_FMResultSet* r = [_fmdb executeQuery: $sprintf(@"PRAGMA incremental_vacuum(%d)",
+                                                               kVacuumBatchPages)];
+            if (!r) {
+                _compacting = NO;
+                return CBLStatusToOutNSError(self.lastDbError, outError);
+            }
+            while ([r next])
+                ;
+            [r close];
+            int nowFree = [_fmdb intForQuery: @"PRAGMA freelist_count"];
+            if (nowFree >= freePages)
+                break;              // no progress; maybe a reader is in the way
+            freePages = nowFree;
+            if (freePages > 0 && duration > 0 && CFAbsoluteTimeGetCurrent() >= deadline)
+                return YES;
+        }
+        // Let the WAL write the freed pages back, so the file gets truncated:
+        [_fmdb executeUpdate: @"PRAGMA wal_checkpoint(RESTART)"];
+    }
+
+    LogTo(Database, @"%@: ...Finished incremental compaction", self);
+    _compacting = NO;
+    *outFinished = YES;
+    return YES;
+}
+
+
+- (NSDictionary*) compactionInfo {
+    SequenceNumber lastSequence = self.lastSequence;
+    double progress = 0.0;
+    if (_compacting && lastSequence > 0) {
+        progress = _compactStripped ? 1.0 : MIN(_compactSequence / (double)lastSequence, 1.0);
+        if (_compressesDocuments) {
+            // Recompression is the second half:
+            double recompressed = _compactRecompressed ? 1.0
+                                    : MIN(_recompressSequence / (double)lastSequence, 1.0);
+            progress = (progress + recompressed) / 2;
+        }
+    }
+    return $dict({@"compacting", @(_compacting)},
+                 {@"progress", @(progress)},
+                 {@"revisions_stripped", @(_compactStrippedCount)},
+                 {@"revisions_recompressed", @(_compactRecompressedCount)},
+                 {@"compression_dictionary", (_compressesDocuments ? @(_bodyDictionaryNumber)
+                                                                   : nil)},
+                 {@"incremental_vacuum", @(self.isIncrementallyVacuumed)},
+                 {@"page_size", @([_fmdb intForQuery: @"PRAGMA page_size"])},
+                 {@"page_count", @([_fmdb intForQuery: @"PRAGMA page_count"])},
+                 {@"free_pages", @([_fmdb intForQuery: @"PRAGMA freelist_count"])});
+}
+
+
 - (CBLStatus) pruneRevsToMaxDepth: (NSUInteger)maxDepth numberPruned: (NSUInteger*)outPruned {
     if (maxDepth == 0)
         maxDepth = self.maxRevTreeDepth;
@@ -2311,28 +4127,45 @@ NSString* CBLJoinSQLQuotedStrings(NSArray* strings) {
 
 
 - (NSSet*) findAllAttachmentKeys: (NSError**)outError {
-    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT json FROM revs WHERE no_attachments != 1"];
+    if (!_readOnly && ![self updateAttachmentRefs: outError])
+        return nil;
+    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT DISTINCT key FROM attachment_refs"];
     if (!r) {
         CBLStatusToOutNSError(self.lastDbStatus, outError);
         return nil;
     }
     NSMutableSet* allKeys = [NSMutableSet set];
-    while ([r next]) {
-        NSDictionary* rev = [CBLJSON JSONObjectWithData: [r dataNoCopyForColumnIndex: 0]
-                                                options: 0 error: NULL];
-        [rev.cbl_attachments enumerateKeysAndObjectsUsingBlock:^(id key, NSDictionary* att, BOOL *stop) {
-            CBLBlobKey blobKey;
-            if ([CBL_Attachment digest: att[@"digest"] toBlobKey: &blobKey]) {
-                NSData* keyData = [[NSData alloc] initWithBytes: &blobKey length: sizeof(blobKey)];
-                [allKeys addObject: keyData];
-            }
-        }];
-    }
+    while ([r next])
+        [allKeys addObject: [r dataForColumnIndex: 0]];
     [r close];
     return allKeys;
 }
 
 
+- (NSSet*) referencedAttachmentKeys: (NSArray*)keys error: (NSError**)outError {
+    NSMutableSet* found = [NSMutableSet set];
+    if (keys.count == 0)
+        return found;
+    if (!_readOnly && ![self updateAttachmentRefs: outError])
+        return nil;
+    NSMutableString* sql = [@"SELECT DISTINCT key FROM attachment_refs WHERE key IN (?" mutableCopy];
+    for (NSUInteger i = 1; i < keys.count; i++)
+        [sql appendString: @",?"];
+    [sql appendString: @")"];
+    _fmdb.shouldCacheStatements = NO;   // (the SQL differs with the number of keys)
+    CBL_FMResultSet* r = [_fmdb executeQuery: sql withArgumentsInArray: keys];
+    _fmdb.shouldCacheStatements = YES;
+    if (!r) {
+        CBLStatusToOutNSError(self.lastDbStatus, outError);
+        return nil;
+    }
+    while ([r next])
+        [found addObject: [r dataForColumnIndex: 0]];
+    [r close];
+    return found;
+}
+
+
 /** Purges specific revisions, which deletes them completely from the local database _without_ adding a "tombstone" revision. It's as though they were never there.
     @param docsToRevs  A dictionary mapping document IDs to arrays of revision ID strings or "*".
     @param outResult  On success will point to an NSDictionary with the same form as docsToRev, containing the doc/revision IDs that were actually removed. */
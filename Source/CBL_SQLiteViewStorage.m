@@ -357,7 +357,7 @@
         // This is the emit() block, which gets called from within the user-defined map() block
         // that's called down below.
         __block CBL_SQLiteViewStorage* curView;
-        __block NSMutableDictionary* curDoc;
+        __block NSDictionary* curDoc;
         __block SequenceNumber sequence = minLastSequence;
         __block CBLStatus emitStatus = kCBLStatusOK;
         __block unsigned insertedCount = 0;
@@ -469,19 +469,16 @@
                 if (deleted)
                     continue;
 
-                // Get the document properties, to pass to the map function:
-                curDoc = [dbStorage documentPropertiesFromJSON: json
-                                                    docID: docID revID:revID
-                                                  deleted: NO
-                                                 sequence: sequence];
+                // Get the document properties, to pass to the map function. Their values are
+                // parsed lazily, since map functions often look at only a few of them:
+                curDoc = [dbStorage lazyDocumentPropertiesFromJSON: json
+                                                             docID: docID revID: revID
+                                                   extraProperties: $dict({@"_local_seq", @(sequence)},
+                                                                          {@"_conflicts", conflicts})];
                 if (!curDoc) {
                     Warn(@"Failed to parse JSON of doc %@ rev %@", docID, revID);
                     continue;
                 }
-                curDoc[@"_local_seq"] = @(sequence);
-
-                if (conflicts)
-                    curDoc[@"_conflicts"] = conflicts;
 
                 // Call the user-defined map() to emit new key/value pairs from this revision:
                 int i = -1;
@@ -616,12 +613,11 @@ static NSString* viewNames(NSArray* views) {
     else if ([self groupOrReduceWithOptions: options])
         rows = [self reducedQueryWithOptions: options status: outStatus];
     else
-        rows = [self regularQueryWithOptions: options status: outStatus];
+        return [self regularQueryWithOptions: options sequenceNumber: lastSeq status: outStatus];
 
     if (!rows)
         return nil;
     return [[CBLQueryEnumerator alloc] initWithSequenceNumber: lastSeq rows: rows];
-    //OPT: Return objects from enum as they're found, without collecting them in an array first
 }
 
 
@@ -640,9 +636,79 @@ typedef CBLStatus (^QueryRowBlock)(NSData* keyData, NSData* valueData, NSString*
                                    CBL_FMResultSet* r);
 
 
-/** Generates and runs the SQL SELECT statement for a view query, calling the onRow callback. */
-- (CBLStatus) _runQueryWithOptions: (const CBLQueryOptions*)options
-                             onRow: (QueryRowBlock)onRow
+// Appends a condition that selects only the rows sorting after `position`, which holds the
+// values of the query's sort columns (see -sortColumnsForOptions:) in the last row read. This is
+// how a query resumes when it's read a page at a time.
+static void appendResumeCondition(NSMutableString* sql, NSMutableArray* args,
+                                  NSArray* sortColumns, NSArray* position)
+{
+    // "c1 >= ? AND (c1 > ? OR (c1 = ? AND (c2 > ? OR (c2 = ? AND c3 > ?))))", with the
+    // comparisons reversed for descending columns. (The first term lets SQLite use an index.)
+    NSUInteger n = sortColumns.count;
+    NSArray* first = sortColumns[0];
+    [sql appendFormat: @" AND %@ %@ ?%@ AND ",
+                       first[0], ([first[2] boolValue] ? @"<=" : @">="), first[1]];
+    [args addObject: position[0]];
+    for (NSUInteger i = 0; i < n; ++i) {
+        NSString* column = sortColumns[i][0], *collation = sortColumns[i][1];
+        BOOL descending = [sortColumns[i][2] boolValue];
+        [sql appendFormat: @"(%@ %@ ?%@", column, (descending ? @"<" : @">"), collation];
+        [args addObject: position[i]];
+        if (i + 1 < n) {
+            [sql appendFormat: @" OR (%@ = ?%@ AND ", column, collation];
+            [args addObject: position[i]];
+        }
+    }
+    for (NSUInteger i = 0; i + 1 < n; ++i)
+        [sql appendString: @"))"];
+    [sql appendString: @")"];
+}
+
+
+// The columns a view query's rows are sorted by, as [name, collation, descending] triples. The map
+// table's rowid comes last, to give every row a distinct position to resume after.
+- (NSArray*) sortColumnsForOptions: (const CBLQueryOptions*)options
+                         collation: (NSString*)collationStr
+{
+    NSNumber* descending = @(options->descending);
+    NSMutableArray* columns = [NSMutableArray array];
+    if (options->bbox) {
+        [columns addObject: @[@"bboxes.y0", @"", @NO]];
+        [columns addObject: @[@"bboxes.x0", collationStr, descending]];
+    } else {
+        [columns addObject: @[@"key", collationStr, descending]];
+    }
+    [columns addObject: @[@"docid", @"", descending]];
+    [columns addObject: @[$sprintf(@"'maps_%@'.rowid", self.mapTableName), @"", descending]];
+    return columns;
+}
+
+
+// The values of the sort columns (see -sortColumnsForOptions:) in the current row of `r`.
+static NSArray* sortPosition(CBL_FMResultSet* r, const CBLQueryOptions* options) {
+    NSString* docID = [r stringForColumnIndex: 2];
+    NSNumber* mapRowID = @([r longLongIntForColumn: @"map_rowid"]);
+    if (options->bbox)
+        return @[@([r doubleForColumn: @"y0"]), @([r doubleForColumn: @"x0"]), docID, mapRowID];
+    else
+        return @[[r dataForColumnIndex: 0], docID, mapRowID];
+}
+
+
+/** Generates and runs the SQL SELECT statement for a view query, returning its result set. */
+- (CBL_FMResultSet*) _executeQueryWithOptions: (const CBLQueryOptions*)options
+                                       status: (CBLStatus*)outStatus
+{
+    return [self _executeQueryWithOptions: options resumeAfter: nil rowsRead: 0 status: outStatus];
+}
+
+
+/** Generates and runs the SQL SELECT statement for a view query, returning its result set. If
+    `position` is non-nil, the rows start after it, and the limit is reduced by `rowsRead`. */
+- (CBL_FMResultSet*) _executeQueryWithOptions: (const CBLQueryOptions*)options
+                                  resumeAfter: (NSArray*)position
+                                     rowsRead: (unsigned)rowsRead
+                                       status: (CBLStatus*)outStatus
 {
     // OPT: It would be faster to use separate tables for raw-or ascii-collated views so that
     // they could be indexed with the right collation, instead of having to specify it here.
@@ -656,12 +722,15 @@ typedef CBLStatus (^QueryRowBlock)(NSData* keyData, NSData* valueData, NSString*
     if (options->includeDocs)
         [sql appendString: @", revid, json"];
     if (options->bbox) {
-        if (![self createRTreeSchema])
-            return kCBLStatusNotImplemented;
+        if (![self createRTreeSchema]) {
+            *outStatus = kCBLStatusNotImplemented;
+            return nil;
+        }
         [sql appendFormat: @", bboxes.x0, bboxes.y0, bboxes.x1, bboxes.y1, maps_%@.geokey",
                                  self.mapTableName];
     }
-    [sql appendFormat: @" FROM 'maps_%@', revs, docs", self.mapTableName];
+    [sql appendFormat: @", 'maps_%@'.rowid AS map_rowid FROM 'maps_%@', revs, docs",
+                       self.mapTableName, self.mapTableName];
     if (options->bbox)
         [sql appendString: @", bboxes"];
     [sql appendString: @" WHERE 1"];
@@ -723,21 +792,23 @@ typedef CBLStatus (^QueryRowBlock)(NSData* keyData, NSData* valueData, NSString*
         [args addObject: @(options->bbox->max.y)];
     }
     
+    NSArray* sortColumns = [self sortColumnsForOptions: options collation: collationStr];
+    if (position)
+        appendResumeCondition(sql, args, sortColumns, position);
+
     [sql appendFormat: @" AND revs.sequence = 'maps_%@'.sequence AND docs.doc_id = revs.doc_id "
                         "ORDER BY", self.mapTableName];
-    if (options->bbox)
-        [sql appendString: @" bboxes.y0, bboxes.x0"];
-    else
-        [sql appendString: @" key"];
-    [sql appendString: collationStr];
-    if (options->descending)
-        [sql appendString: @" DESC"];
-    [sql appendString: (options->descending ? @", docid DESC" : @", docid")];
+    NSString* delimiter = @" ";
+    for (NSArray* column in sortColumns) {
+        [sql appendFormat: @"%@%@%@%@", delimiter, column[0], column[1],
+                           ([column[2] boolValue] ? @" DESC" : @"")];
+        delimiter = @", ";
+    }
 
     [sql appendString: @" LIMIT ? OFFSET ?"];
-    int limit = (options->limit != kCBLQueryOptionsDefaultLimit) ? options->limit : -1;
+    int limit = (options->limit != kCBLQueryOptionsDefaultLimit) ? options->limit - rowsRead : -1;
     [args addObject: @(limit)];
-    [args addObject: @(options->skip)];
+    [args addObject: @(position ? 0 : options->skip)];
 
     LogTo(Query, @"Query %@: %@\n\tArguments: %@", _name, sql, args);
     
@@ -746,11 +817,21 @@ typedef CBLStatus (^QueryRowBlock)(NSData* keyData, NSData* valueData, NSString*
     fmdb.bindNSDataAsString = YES;
     CBL_FMResultSet* r = [fmdb executeQuery: sql withArgumentsInArray: args];
     fmdb.bindNSDataAsString = NO;
+    *outStatus = r ? kCBLStatusOK : dbStorage.lastDbError;
+    return r;
+}
+
+
+/** Generates and runs the SQL SELECT statement for a view query, calling the onRow callback. */
+- (CBLStatus) _runQueryWithOptions: (const CBLQueryOptions*)options
+                             onRow: (QueryRowBlock)onRow
+{
+    CBLStatus status;
+    CBL_FMResultSet* r = [self _executeQueryWithOptions: options status: &status];
     if (!r)
-        return dbStorage.lastDbError;
+        return status;
 
     // Now run the query and iterate over its rows:
-    CBLStatus status = kCBLStatusOK;
     while ([r next]) {
         @autoreleasepool {
             NSData* keyData = [r dataForColumnIndex: 0];
@@ -773,8 +854,9 @@ typedef CBLStatus (^QueryRowBlock)(NSData* keyData, NSData* valueData, NSString*
 }
 
 
-- (NSArray*) regularQueryWithOptions: (CBLQueryOptions*)options
-                              status: (CBLStatus*)outStatus
+- (CBLQueryEnumerator*) regularQueryWithOptions: (CBLQueryOptions*)options
+                                 sequenceNumber: (SequenceNumber)lastSeq
+                                         status: (CBLStatus*)outStatus
 {
     CBL_SQLiteStorage* db = _dbStorage;
 
@@ -790,95 +872,162 @@ typedef CBLStatus (^QueryRowBlock)(NSData* keyData, NSData* valueData, NSString*
         options->skip = 0;
     }
 
-    NSMutableArray* rows = $marray();
-    *outStatus = [self _runQueryWithOptions: options
-                                      onRow: ^CBLStatus(NSData* keyData, NSData* valueData,
-                                                        NSString* docID,
-                                                        CBL_FMResultSet *r)
-    {
-        SequenceNumber sequence = [r longLongIntForColumnIndex:3];
-        CBL_Revision* docRevision = nil;
-        if (options->includeDocs) {
-            NSDictionary* value = nil;
-            if (valueData && !CBLQueryRowValueIsEntireDoc(valueData))
-                value = $castIf(NSDictionary, fromJSON(valueData));
-            NSString* linkedID = value.cbl_id;
-            if (linkedID) {
-                // Linked document: http://wiki.apache.org/couchdb/Introduction_to_CouchDB_views#Linked_documents
-                CBL_RevID* linkedRev = value.cbl_rev; // usually nil
-                CBLStatus linkedStatus;
-                docRevision = [db getDocumentWithID: linkedID
-                                         revisionID: linkedRev
-                                           withBody: YES
-                                             status: &linkedStatus];
-                sequence = docRevision.sequence;
-            } else {
-                docRevision = [_dbStorage revisionWithDocID: docID
-                                                      revID: [r revIDForColumnIndex: 4]
-                                                    deleted: NO
+    // Reads the next row from the result set `r` that passes the filter, reading no more than
+    // pageRowsLeft rows; returns nil at the end of the page, setting `finished` if it's also the
+    // end of the query.
+    __block CBL_FMResultSet* r = nil;
+    __block unsigned pageRowsLeft = 0;
+    __block unsigned rowsRead = 0;          // result rows read so far, after the skipped ones
+    __block NSArray* position = nil;        // sort position of the last row read
+    __block BOOL finished = NO;
+    CBLQueryRowGenerator readRow = ^CBLQueryRow* {
+        while (pageRowsLeft > 0) {
+            if (limit == 0 || ![r next]) {
+                finished = YES;
+                break;
+            }
+            --pageRowsLeft;
+            ++rowsRead;
+            position = sortPosition(r, options);
+            NSData* keyData = [r dataForColumnIndex: 0];
+            NSData* valueData = [r dataForColumnIndex: 1];
+            NSString* docID = [r stringForColumnIndex: 2];
+            Assert(keyData);
+            SequenceNumber sequence = [r longLongIntForColumnIndex:3];
+            CBL_Revision* docRevision = nil;
+            if (options->includeDocs) {
+                NSDictionary* value = nil;
+                if (valueData && !CBLQueryRowValueIsEntireDoc(valueData))
+                    value = $castIf(NSDictionary, fromJSON(valueData));
+                NSString* linkedID = value.cbl_id;
+                if (linkedID) {
+                    // Linked document: http://wiki.apache.org/couchdb/Introduction_to_CouchDB_views#Linked_documents
+                    CBL_RevID* linkedRev = value.cbl_rev; // usually nil
+                    CBLStatus linkedStatus;
+                    docRevision = [db getDocumentWithID: linkedID
+                                             revisionID: linkedRev
+                                               withBody: YES
+                                                 status: &linkedStatus];
+                    sequence = docRevision.sequence;
+                } else {
+                    docRevision = [_dbStorage revisionWithDocID: docID
+                                                          revID: [r revIDForColumnIndex: 4]
+                                                        deleted: NO
+                                                       sequence: sequence
+                                                           json: [r dataForColumnIndex: 5]];
+                }
+            }
+            LogVerbose(Query, @"Query %@: Found row with key=%@, value=%@, id=%@",
+                  _name, [keyData my_UTF8ToString], [valueData my_UTF8ToString],
+                  toJSONString(docID));
+            CBLQueryRow* row;
+            if (options->bbox) {
+                CBLGeoRect bbox = {{[r doubleForColumn: @"x0"],
+                                    [r doubleForColumn: @"y0"]},
+                                   {[r doubleForColumn: @"x1"],
+                                    [r doubleForColumn: @"y1"]}};
+                row = [[CBLGeoQueryRow alloc] initWithDocID: docID
                                                    sequence: sequence
-                                                       json: [r dataForColumnIndex: 5]];
+                                                boundingBox: bbox
+                                                geoJSONData: [r dataForColumn: @"geokey"]
+                                                      value: valueData
+                                                docRevision: docRevision];
+            } else {
+                row = [[CBLQueryRow alloc] initWithDocID: docID
+                                                sequence: sequence
+                                                     key: keyData
+                                                   value: valueData
+                                             docRevision: docRevision];
             }
-        }
-        LogVerbose(Query, @"Query %@: Found row with key=%@, value=%@, id=%@",
-              _name, [keyData my_UTF8ToString], [valueData my_UTF8ToString],
-              toJSONString(docID));
-        CBLQueryRow* row;
-        if (options->bbox) {
-            CBLGeoRect bbox = {{[r doubleForColumn: @"x0"],
-                                [r doubleForColumn: @"y0"]},
-                               {[r doubleForColumn: @"x1"],
-                                [r doubleForColumn: @"y1"]}};
-            row = [[CBLGeoQueryRow alloc] initWithDocID: docID
-                                               sequence: sequence
-                                            boundingBox: bbox
-                                            geoJSONData: [r dataForColumn: @"geokey"]
-                                                  value: valueData
-                                            docRevision: docRevision];
-        } else {
-            row = [[CBLQueryRow alloc] initWithDocID: docID
-                                            sequence: sequence
-                                                 key: keyData
-                                               value: valueData
-                                         docRevision: docRevision];
-        }
 
-        if (filter) {
-            if (![self row: row passesFilter: filter])
-                return kCBLStatusOK;
-            if (skip > 0) {
-                --skip;
-                return kCBLStatusOK;
+            if (filter) {
+                if (![self row: row passesFilter: filter])
+                    continue;
+                if (skip > 0) {
+                    --skip;
+                    continue;
+                }
             }
+            --limit;
+            return row;
         }
-        
-        [rows addObject: row];
-
-        if (--limit == 0)
-            return 0;  // stops the iteration
-        return kCBLStatusOK;
-    }];
+        return nil;
+    };
+
+    if (!options.keys) {
+        // Return rows from the enumerator a page at a time, so they never all have to be in
+        // memory at once. Each page's statement is finished before its rows are returned, so no
+        // read snapshot is held open while the caller consumes them:
+        __block NSMutableArray* page = nil;
+        __block NSUInteger pageIndex = 0;
+        CBLStatus (^readPage)() = ^CBLStatus {
+            CBLStatus status;
+            r = [self _executeQueryWithOptions: options resumeAfter: position rowsRead: rowsRead
+                                        status: &status];
+            if (!r)
+                return status;
+            page = [[NSMutableArray alloc] initWithCapacity: kCBLQueryPageSize];
+            pageIndex = 0;
+            pageRowsLeft = kCBLQueryPageSize;
+            for (;;) {
+                @autoreleasepool {
+                    CBLQueryRow* row = readRow();
+                    if (!row)
+                        break;
+                    [page addObject: row];
+                }
+            }
+            [r close];
+            r = nil;
+            return kCBLStatusOK;
+        };
+        *outStatus = [db withReadLock: readPage];
+        if (CBLStatusIsError(*outStatus))
+            return nil;
+        return [[CBLQueryEnumerator alloc] initWithSequenceNumber: lastSeq
+                                                     rowGenerator: ^CBLQueryRow*
+        {
+            while (pageIndex >= page.count) {
+                if (finished)
+                    return nil;
+                CBLStatus status = [db withReadLock: readPage];
+                if (CBLStatusIsError(status)) {
+                    Warn(@"Query %@: Couldn't read rows (status %d)", _name, status);
+                    return nil;
+                }
+            }
+            return page[pageIndex++];
+        }];
+    }
 
-    // If given keys, sort the output into that order, and add entries for missing keys:
-    if (options.keys) {
-        // Group rows by key:
-        NSMutableDictionary* rowsByKey = $mdict();
-        for (CBLQueryRow* row in rows) {
+    // If given keys, sort the output into that order. (The keys are grouped, so this has to read
+    // all the rows first; but there are only as many as the rows emitted with those keys.)
+    // Group rows by key:
+    r = [self _executeQueryWithOptions: options status: outStatus];
+    if (!r)
+        return nil;
+    pageRowsLeft = UINT_MAX;
+    NSMutableDictionary* rowsByKey = $mdict();
+    for (;;) {
+        @autoreleasepool {
+            CBLQueryRow* row = readRow();
+            if (!row)
+                break;
             NSMutableArray* rows = rowsByKey[row.key];
             if (!rows)
                 rows = rowsByKey[row.key] = [[NSMutableArray alloc] init];
             [rows addObject: row];
         }
-        // Now concatenate them in the order the keys are given in options:
-        NSMutableArray* sortedRows = $marray();
-        for (NSString* key in options.keys) {
-            NSArray* rows = rowsByKey[key];
-            if (rows)
-                [sortedRows addObjectsFromArray: rows];
-        }
-        rows = sortedRows;
     }
-    return rows;
+    [r close];
+    // Now concatenate them in the order the keys are given in options:
+    NSMutableArray* sortedRows = $marray();
+    for (NSString* key in options.keys) {
+        NSArray* rows = rowsByKey[key];
+        if (rows)
+            [sortedRows addObjectsFromArray: rows];
+    }
+    return [[CBLQueryEnumerator alloc] initWithSequenceNumber: lastSeq rows: sortedRows];
 }
 
 
@@ -8,7 +8,7 @@
 //
 
 #import <Foundation/Foundation.h>
-@class CBL_Server, MYReadWriteLock;
+@class CBL_Server, MYReadWriteLock, CBL_DocIDCache;
 
 
 /** Container for shared state between CBLDatabase instances that represent the same database file. API is thread-safe. */
@@ -30,7 +30,7 @@
                inDatabaseNamed: (NSString*)dbName;
 
 - (MYReadWriteLock*) lockForDatabaseNamed: (NSString*)dbName;   // only SQLite storage uses this
-- (NSCache*) docIDCacheForDatabaseNamed: (NSString*)dbName;     // only SQLite storage uses this
+- (CBL_DocIDCache*) docIDCacheForDatabaseNamed: (NSString*)dbName; // only SQLite storage uses this
 
 - (void) openedDatabase: (NSString*)dbName;
 - (void) closedDatabase: (NSString*)dbName;
@@ -43,3 +43,32 @@
 @property CBL_Server* backgroundServer;
 
 @end
+
+
+/** A compact hash table mapping document IDs to the numeric row IDs the SQLite storage uses for
+    them. It grows as needed up to a memory budget; beyond that, entries are forgotten in batches,
+    oldest first. One instance is shared by every connection to a database. API is thread-safe. */
+@interface CBL_DocIDCache : NSObject
+
+- (instancetype) initWithMemoryBudget: (size_t)memoryBudget;
+
+/** The approximate maximum number of bytes the cache may use. Changing it clears the cache. */
+@property (nonatomic) size_t memoryBudget;
+
+/** Returns the numeric ID cached for the docID, or 0 if it's not cached. */
+- (SInt64) numericIDForDocID: (NSString*)docID;
+
+- (void) setNumericID: (SInt64)numericID forDocID: (NSString*)docID;
+
+/** Like -setNumericID:forDocID:, but returns NO instead of evicting any older entries when the
+    cache is full. Used to warm up the cache. */
+- (BOOL) preloadNumericID: (SInt64)numericID forDocID: (NSString*)docID;
+
+- (void) removeDocID: (NSString*)docID;
+- (void) removeAllDocIDs;
+
+@property (readonly) NSUInteger count;
+@property (readonly) size_t memoryUsed;
+@property (readonly) UInt64 hits, misses;
+
+@end
@@ -18,6 +18,12 @@
 #import "MYReadWriteLock.h"
 
 
+UsingLogDomain(Database);
+
+
+#define kDefaultDocIDCacheBudget (4*1024*1024)
+
+
 @implementation CBL_Shared
 {
     NSMutableDictionary* _databases;
@@ -114,11 +120,12 @@
     }
 }
 
-- (NSCache*) docIDCacheForDatabaseNamed: (NSString*)dbName {
+- (CBL_DocIDCache*) docIDCacheForDatabaseNamed: (NSString*)dbName {
     @synchronized(self) {
-        NSCache* cache = [self valueForType: @"docIDCache" name: @"" inDatabaseNamed: dbName];
+        CBL_DocIDCache* cache = [self valueForType: @"docIDCache" name: @""
+                                   inDatabaseNamed: dbName];
         if (!cache) {
-            cache = [[NSCache alloc] init];
+            cache = [[CBL_DocIDCache alloc] initWithMemoryBudget: kDefaultDocIDCacheBudget];
             [self setValue: cache forType: @"docIDCache" name: @"" inDatabaseNamed: dbName];
         }
         return cache;
@@ -141,3 +148,358 @@
 }
 
 @end
+
+
+
+#pragma mark - DOC ID CACHE:
+
+
+// Doc IDs longer than this (in UTF-8) aren't cached.
+#define kMaxCachedDocIDLength 256
+
+// Initial sizes of a generation's slot table and key storage:
+#define kInitialSlotCount 256
+#define kInitialKeysSize (8*1024)
+
+typedef struct {
+    uint32_t hash;          // 0 if the slot is empty
+    uint32_t keyLength;
+    uint32_t keyOffset;     // offset of the docID's UTF-8 bytes in the generation's `keys`
+    SInt64 numericID;       // 0 if the docID was removed
+} DocIDSlot;
+
+// An open-addressing (linear probing) hash table, plus storage for its keys. The cache has two
+// of these; when the current one is full, the previous one's contents are dropped and it becomes
+// the current one.
+typedef struct {
+    DocIDSlot* slots;
+    uint32_t slotCount;     // always 0 or a power of 2
+    uint32_t count;         // number of slots in use
+    char* keys;
+    uint32_t keysUsed, keysSize;
+} DocIDGeneration;
+
+
+static uint32_t hashDocID(const char* key, uint32_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint32_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+    return hash ?: 1;
+}
+
+
+// Returns the slot holding the key, or else the empty slot where it belongs; or NULL if the
+// generation has no slots.
+static DocIDSlot* findSlot(const DocIDGeneration* gen,
+                           uint32_t hash, const char* key, uint32_t length)
+{
+    if (gen->slotCount == 0)
+        return NULL;
+    uint32_t mask = gen->slotCount - 1;
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        DocIDSlot* slot = &gen->slots[i];
+        if (slot->hash == 0)
+            return slot;
+        if (slot->hash == hash && slot->keyLength == length
+                               && memcmp(gen->keys + slot->keyOffset, key, length) == 0)
+            return slot;
+    }
+}
+
+
+static size_t generationSize(const DocIDGeneration* gen) {
+    return gen->slotCount * sizeof(DocIDSlot) + gen->keysSize;
+}
+
+
+static void clearGeneration(DocIDGeneration* gen) {
+    if (gen->slots)
+        memset(gen->slots, 0, gen->slotCount * sizeof(DocIDSlot));
+    gen->count = 0;
+    gen->keysUsed = 0;
+}
+
+
+static void freeGeneration(DocIDGeneration* gen) {
+    free(gen->slots);
+    free(gen->keys);
+    memset(gen, 0, sizeof(*gen));
+}
+
+
+// Makes room in the generation for another key of the given length, by enlarging its slot table
+// and/or key storage. Returns NO if that would make it bigger than maxSize.
+static BOOL growGeneration(DocIDGeneration* gen, uint32_t keyLength, size_t maxSize) {
+    uint32_t slotCount = gen->slotCount, keysSize = gen->keysSize;
+    if (gen->count + 1 > slotCount / 4 * 3)
+        slotCount = MAX(2*slotCount, kInitialSlotCount);
+    while (gen->keysUsed + keyLength > keysSize)
+        keysSize = MAX(2*keysSize, kInitialKeysSize);
+    if (slotCount * sizeof(DocIDSlot) + (size_t)keysSize > maxSize)
+        return NO;
+
+    if (keysSize != gen->keysSize) {
+        char* keys = realloc(gen->keys, keysSize);
+        if (!keys)
+            return NO;
+        gen->keys = keys;
+        gen->keysSize = keysSize;
+    }
+    if (slotCount != gen->slotCount) {
+        DocIDSlot* oldSlots = gen->slots;
+        uint32_t oldSlotCount = gen->slotCount;
+        DocIDSlot* slots = calloc(slotCount, sizeof(DocIDSlot));
+        if (!slots)
+            return NO;
+        gen->slots = slots;
+        gen->slotCount = slotCount;
+        gen->count = 0;
+        for (uint32_t i = 0; i < oldSlotCount; i++) {
+            DocIDSlot* old = &oldSlots[i];
+            if (old->hash && old->numericID) {      // (removed entries are dropped)
+                *findSlot(gen, old->hash, gen->keys + old->keyOffset, old->keyLength) = *old;
+                gen->count++;
+            }
+        }
+        free(oldSlots);
+    }
+    return YES;
+}
+
+
+// Adds a key to the generation, growing it if necessary. Returns NO if it's full.
+static BOOL addToGeneration(DocIDGeneration* gen, uint32_t hash, const char* key, uint32_t length,
+                            SInt64 numericID, size_t maxSize)
+{
+    DocIDSlot* slot = findSlot(gen, hash, key, length);
+    if (slot && slot->hash) {
+        slot->numericID = numericID;
+        return YES;
+    }
+    if (gen->count + 1 > gen->slotCount / 4 * 3 || gen->keysUsed + length > gen->keysSize) {
+        if (!growGeneration(gen, length, maxSize))
+            return NO;
+        slot = findSlot(gen, hash, key, length);
+    }
+    memcpy(gen->keys + gen->keysUsed, key, length);
+    *slot = (DocIDSlot){hash, length, gen->keysUsed, numericID};
+    gen->keysUsed += length;
+    gen->count++;
+    return YES;
+}
+
+
+// Gets the UTF-8 bytes of a docID, copying them into `buf` if they aren't directly available.
+// Returns NULL if the docID is too long to cache.
+static const char* docIDBytes(NSString* docID, char buf[kMaxCachedDocIDLength],
+                              uint32_t* outLength)
+{
+    CFStringRef str = (__bridge CFStringRef)docID;
+    const char* bytes = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+    if (bytes) {
+        size_t length = strlen(bytes);
+        if (length > kMaxCachedDocIDLength)
+            return NULL;
+        *outLength = (uint32_t)length;
+        return bytes;
+    }
+    CFIndex length = CFStringGetLength(str), used;
+    if (CFStringGetBytes(str, CFRangeMake(0, length), kCFStringEncodingUTF8, 0, false,
+                        (UInt8*)buf, kMaxCachedDocIDLength, &used) < length)
+        return NULL;
+    *outLength = (uint32_t)used;
+    return buf;
+}
+
+
+@implementation CBL_DocIDCache
+{
+    NSLock* _lock;
+    DocIDGeneration _current, _previous;
+    size_t _memoryBudget;
+    UInt64 _hits, _misses;
+}
+
+
+- (instancetype) initWithMemoryBudget: (size_t)memoryBudget {
+    self = [super init];
+    if (self) {
+        _lock = [[NSLock alloc] init];
+        _memoryBudget = memoryBudget;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    freeGeneration(&_current);
+    freeGeneration(&_previous);
+}
+
+
+- (size_t) memoryBudget {
+    [_lock lock];
+    size_t budget = _memoryBudget;
+    [_lock unlock];
+    return budget;
+}
+
+
+- (void) setMemoryBudget: (size_t)memoryBudget {
+    [_lock lock];
+    if (memoryBudget != _memoryBudget) {
+        _memoryBudget = memoryBudget;
+        freeGeneration(&_current);
+        freeGeneration(&_previous);
+    }
+    [_lock unlock];
+}
+
+
+- (SInt64) numericIDForDocID: (NSString*)docID {
+    char buf[kMaxCachedDocIDLength];
+    uint32_t length;
+    const char* key = docIDBytes(docID, buf, &length);
+    if (!key)
+        return 0;
+    uint32_t hash = hashDocID(key, length);
+
+    [_lock lock];
+    SInt64 numericID = 0;
+    DocIDSlot* slot = findSlot(&_current, hash, key, length);
+    if (slot && slot->hash) {
+        numericID = slot->numericID;
+    } else {
+        slot = findSlot(&_previous, hash, key, length);
+        if (slot && slot->hash) {
+            // Still in use, so move it to the current generation before it's dropped:
+            numericID = slot->numericID;
+            slot->numericID = 0;
+            if (numericID)
+                [self _add: numericID hash: hash key: key length: length evict: YES];
+        }
+    }
+    if (numericID)
+        ++_hits;
+    else
+        ++_misses;
+    [_lock unlock];
+    return numericID;
+}
+
+
+- (void) setNumericID: (SInt64)numericID forDocID: (NSString*)docID {
+    [self _setNumericID: numericID forDocID: docID evict: YES];
+}
+
+
+- (BOOL) preloadNumericID: (SInt64)numericID forDocID: (NSString*)docID {
+    return [self _setNumericID: numericID forDocID: docID evict: NO];
+}
+
+
+- (BOOL) _setNumericID: (SInt64)numericID forDocID: (NSString*)docID evict: (BOOL)evict {
+    Assert(numericID > 0);
+    char buf[kMaxCachedDocIDLength];
+    uint32_t length;
+    const char* key = docIDBytes(docID, buf, &length);
+    if (!key)
+        return YES;     // too long to cache; just ignore it
+    uint32_t hash = hashDocID(key, length);
+
+    [_lock lock];
+    DocIDSlot* old = findSlot(&_previous, hash, key, length);
+    if (old && old->hash)
+        old->numericID = 0;
+    BOOL added = [self _add: numericID hash: hash key: key length: length evict: evict];
+    [_lock unlock];
+    return added;
+}
+
+
+// Adds an entry to the current generation; if it's full, and `evict` is true, the previous
+// generation's entries are dropped and the current one takes its place. Must hold the lock.
+- (BOOL) _add: (SInt64)numericID hash: (uint32_t)hash key: (const char*)key
+       length: (uint32_t)length evict: (BOOL)evict
+{
+    size_t maxSize = _memoryBudget / 2;
+    if (addToGeneration(&_current, hash, key, length, numericID, maxSize))
+        return YES;
+    if (!evict) {
+        // Warming up: fill the previous generation too, so the whole budget gets used. (Entries
+        // are preloaded newest first, so the older ones are the first to be dropped later.)
+        return addToGeneration(&_previous, hash, key, length, numericID, maxSize);
+    }
+    LogTo(Database, @"DocIDCache: Dropping %u old docIDs (%u in current generation)",
+          _previous.count, _current.count);
+    // Swap the generations, and reuse the previous one's memory for the new current one:
+    DocIDGeneration previous = _previous;
+    _previous = _current;
+    _current = previous;
+    clearGeneration(&_current);
+    return addToGeneration(&_current, hash, key, length, numericID, maxSize);
+}
+
+
+- (void) removeDocID: (NSString*)docID {
+    char buf[kMaxCachedDocIDLength];
+    uint32_t length;
+    const char* key = docIDBytes(docID, buf, &length);
+    if (!key)
+        return;
+    uint32_t hash = hashDocID(key, length);
+
+    [_lock lock];
+    // Leave the key in place (so probing past it still works) but mark it removed:
+    DocIDSlot* slot = findSlot(&_current, hash, key, length);
+    if (slot && slot->hash)
+        slot->numericID = 0;
+    slot = findSlot(&_previous, hash, key, length);
+    if (slot && slot->hash)
+        slot->numericID = 0;
+    [_lock unlock];
+}
+
+
+- (void) removeAllDocIDs {
+    [_lock lock];
+    freeGeneration(&_current);
+    freeGeneration(&_previous);
+    [_lock unlock];
+}
+
+
+- (NSUInteger) count {
+    [_lock lock];
+    NSUInteger count = _current.count + _previous.count;
+    [_lock unlock];
+    return count;
+}
+
+
+- (size_t) memoryUsed {
+    [_lock lock];
+    size_t size = generationSize(&_current) + generationSize(&_previous);
+    [_lock unlock];
+    return size;
+}
+
+
+- (UInt64) hits {
+    [_lock lock];
+    UInt64 hits = _hits;
+    [_lock unlock];
+    return hits;
+}
+
+
+- (UInt64) misses {
+    [_lock lock];
+    UInt64 misses = _misses;
+    [_lock unlock];
+    return misses;
+}
+
+
+@end
@@ -93,6 +93,17 @@
                                   withBody: (BOOL)withBody
                                     status: (CBLStatus*)outStatus;
 
+/** Retrieves the current revisions of many documents at once. This is equivalent to calling
+    -getDocumentWithID:revisionID:withBody:status: with a nil revID for each, but faster.
+    @param docIDs  The document IDs
+    @param withBody  If NO, revisions' bodies won't be loaded
+    @param outStatus  If returning nil, store a CBLStatus error value here.
+    @return  An array with one item for each docID, in the same order: the current revision, or
+            NSNull if the document doesn't exist or is deleted. Returns nil on error. */
+- (NSArray*) getDocumentsWithIDs: (NSArray<NSString*>*)docIDs
+                        withBody: (BOOL)withBody
+                          status: (CBLStatus*)outStatus;
+
 /** Loads the body of a revision.
     On entry, rev.docID and rev.revID will be valid.
     On success, rev.body and rev.sequence will be valid. */
@@ -276,10 +287,73 @@
 /** Registers the encryption key of the database file. Must be called before opening the db. */
 - (void) setEncryptionKey: (CBLSymmetricKey*)key;
 
+/** Tunes the storage's memory use and durability: `profile` is one of the kCBLSQLiteProfile...
+    presets, and `settings` overrides individual values of it (see CBLDatabaseOptions.)
+    Must be called before opening the db. */
+- (void) setSQLiteProfile: (NSString*)profile settings: (NSDictionary*)settings;
+
 /** Called when the delegate changes its encryptionKey property. The storage should rewrite its
     files using the new key (which may be nil, meaning no encryption.) */
 - (MYAction*) actionToChangeEncryptionKey: (CBLSymmetricKey*)newKey;
 
+/** Of the given attachment keys (NSData objects containing CBLBlobKeys), returns the ones referred
+    to by any revision that still has a body. A storage that keeps an index of attachment
+    references implements this, so attachment garbage collection can check a batch of blobs at a
+    time instead of calling -findAllAttachmentKeys:, which has to scan every revision. */
+- (NSSet*) referencedAttachmentKeys: (NSArray*)keys error: (NSError**)outError;
+
+/** Adds new revisions of many documents, in a single transaction. The outcome is the same as
+    calling -addDocID:... on each one in order, but a storage that implements this can look up
+    the documents and insert the revisions in bulk, and the delegate's -databaseStorageChanged:
+    calls all happen inside the transaction, so they're posted as a single notification.
+    @param docs  The new revisions' properties. Each one's "_id" property must be set to the
+                document ID; "_rev" is the parent revision ID (missing if creating a document),
+                and "_deleted" marks a deletion.
+    @param allowConflict  Same as for -addDocID:...
+    @param validationBlock  Same as for -addDocID:...
+    @param outError  On return, an error indicating why the whole operation failed.
+    @return  An array with one item for each document, in order: either the new CBL_Revision
+                (as returned by -addDocID:...) or an NSError if that document couldn't be added.
+                Returns nil if the operation as a whole failed. */
+- (NSArray*) addDocuments: (NSArray<NSMutableDictionary*>*)docs
+            allowConflict: (BOOL)allowConflict
+          validationBlock: (CBL_StorageValidationBlock)validationBlock
+                    error: (NSError**)outError;
+
+/** Does the same work as -compact:, but in bounded batches, returning after about `duration`
+    seconds (if nonzero) so that other work can interleave. The next call continues where this one
+    left off; *outFinished is set to YES when it's done. With a zero `duration` it either finishes
+    or fails, e.g. if called inside a transaction. */
+- (BOOL) compactFor: (NSTimeInterval)duration
+           finished: (BOOL*)outFinished
+              error: (NSError**)outError;
+
+/** Storage-specific statistics about file space and compaction progress, for diagnostics. */
+@property (readonly) NSDictionary* compactionInfo;
+
+/** Fills the cache of document IDs from the database, as far as its memory budget allows, so
+    that operations on existing documents don't have to look their IDs up one at a time. */
+- (void) preloadDocIDs;
+
+/** The approximate maximum number of bytes the document ID cache may use. Changing it empties
+    the cache. */
+@property size_t docIDCacheBudget;
+
+/** Statistics about the document ID cache (size and hit counts), for diagnostics. */
+@property (readonly) NSDictionary* docIDCacheInfo;
+
+/** If YES, the storage records how often each of its queries runs and how long it takes. */
+@property BOOL collectsStatementStats;
+
+/** Statistics about the storage's prepared statements: the cache's hit counts, and (if
+    collectsStatementStats is set) the most-run and slowest queries with their query plans. */
+@property (readonly) NSDictionary* statementStats;
+
+/** If YES, revision bodies are stored compressed when that makes them significantly smaller,
+    and compaction recompresses existing ones. Bodies read back are always plain canonical JSON,
+    whether or not this is set. Should be set after opening. */
+@property (nonatomic) BOOL compressesDocuments;
+
 @end
 
 
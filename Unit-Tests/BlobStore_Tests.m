@@ -10,6 +10,8 @@
 #import "CBL_BlobStore+Internal.h"
 #import "CBL_BlobStoreWriter.h"
 #import "CBLSymmetricKey.h"
+#import "CBLMisc.h"
+#import "CBLProgressGroup.h"
 
 
 @interface BlobStore_Tests : XCTestCase
@@ -85,6 +87,16 @@
 
     NSString* path = [store blobPathForKey: key];
     AssertEq((path == nil), encrypt);  // path is returned IFF not encrypted
+
+    NSData* mapped = [store mappedBlobForKey: key];     // decrypted on demand if encrypted
+    AssertEqual(mapped, item);
+    AssertEq([store lengthOfBlobForKey: key], item.length);
+
+    // With packing disabled, even an empty blob gets a file of its own:
+    CBLBlobKey emptyKey;
+    Assert([store storeBlob: [NSData data] creatingKey: &emptyKey]);
+    Assert([[NSFileManager defaultManager] fileExistsAtPath: [store rawPathForKey: emptyKey]]);
+    AssertEq([store blobForKey: emptyKey].length, 0u);
 }
 
 
@@ -185,4 +197,489 @@
 }
 
 
+- (void) test06_Sharded {
+    NSError* error;
+    store = [[CBL_BlobStore alloc] initWithPath: [storePath stringByAppendingString: @"-sharded"]
+                                  encryptionKey: store.encryptionKey
+                                         layout: kCBLBlobStoreSharded
+                                          error: &error];
+    Assert(store, @"Couldn't create sharded store: %@", error.my_compactDescription);
+    AssertEq(store.layout, kCBLBlobStoreSharded);
+
+    NSData* item = [@"this is an item" dataUsingEncoding: NSUTF8StringEncoding];
+    CBLBlobKey key;
+    Assert([store storeBlob: item creatingKey: &key]);
+    CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: store];
+    [writer appendData: [@"another item" dataUsingEncoding: NSUTF8StringEncoding]];
+    [writer finish];
+    Assert([writer install]);
+
+    NSString* path = [store rawPathForKey: key];
+    NSString* shardDir = $sprintf(@"%02X/%02X", key.bytes[0], key.bytes[1]);
+    AssertEqual([path stringByDeletingLastPathComponent],
+                [store.path stringByAppendingPathComponent: shardDir]);
+    AssertEqual([store blobForKey: key], item);
+    [self verifyRawBlob: key withCleartext: item];
+    AssertEq(store.count, 2u);
+    AssertEq(store.allKeys.count, 2u);
+
+    AssertEq([store deleteBlobsExceptMatching: ^BOOL(CBLBlobKey k) {
+        return memcmp(&k, &key, sizeof(k)) == 0;
+    } error: &error], 1);
+    AssertEq(store.count, 1u);
+
+    NSString* dir = store.path;
+    store = nil;
+    [[NSFileManager defaultManager] removeItemAtPath: dir error: NULL];
+}
+
+
+- (void) test07_MigrateLayout {
+    NSData* item = [@"this is an item" dataUsingEncoding: NSUTF8StringEncoding];
+    CBLBlobKey key;
+    Assert([store storeBlob: item creatingKey: &key]);
+    CBLSymmetricKey* encryptionKey = store.encryptionKey;
+    store = nil;
+
+    // Reopening as sharded moves the files in the background:
+    NSError* error;
+    store = [[CBL_BlobStore alloc] initWithPath: storePath
+                                  encryptionKey: encryptionKey
+                                         layout: kCBLBlobStoreSharded
+                                          error: &error];
+    Assert(store, @"Couldn't reopen store: %@", error.my_compactDescription);
+    AssertEq(store.layout, kCBLBlobStoreSharded);
+    AssertEqual([store blobForKey: key], item);     // readable during migration
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 5.0];
+    while (store.isMigrating && timeout.timeIntervalSinceNow > 0)
+        [NSThread sleepForTimeInterval: 0.01];
+    Assert(!store.isMigrating);
+    AssertEqual([[[store rawPathForKey: key] stringByDeletingLastPathComponent]
+                            substringToIndex: storePath.length], storePath);
+    Assert(!$equal([[store rawPathForKey: key] stringByDeletingLastPathComponent], storePath));
+    AssertEqual([store blobForKey: key], item);
+
+    // Reopening as flat doesn't change the layout:
+    CBL_BlobStore* store2 = [[CBL_BlobStore alloc] initWithPath: storePath
+                                                  encryptionKey: encryptionKey
+                                                          error: &error];
+    AssertEq(store2.layout, kCBLBlobStoreSharded);
+    store2 = nil;
+
+    // ...but -changeLayout: does:
+    Assert([store changeLayout: kCBLBlobStoreFlat error: &error]);
+    AssertEq(store.layout, kCBLBlobStoreFlat);
+    AssertEqual([[store rawPathForKey: key] stringByDeletingLastPathComponent], storePath);
+    AssertEqual([store blobForKey: key], item);
+    AssertEq(store.count, 1u);
+}
+
+
+- (void) test08_PersistentSummary {
+    CBLBlobKey key;
+    Assert([store storeBlob: [@"this is an item" dataUsingEncoding: NSUTF8StringEncoding]
+                creatingKey: &key]);
+    Assert([store storeBlob: [@"this is another item" dataUsingEncoding: NSUTF8StringEncoding]
+                creatingKey: &key]);
+    AssertEq(store.count, 2u);
+    UInt64 size = store.totalDataSize;
+    Assert(size >= 35);
+
+    // Closing the store saves the summary:
+    CBLSymmetricKey* encryptionKey = store.encryptionKey;
+    store = nil;
+    NSString* summaryPath = [storePath stringByAppendingPathComponent: kSummaryFilename];
+    Assert([[NSFileManager defaultManager] fileExistsAtPath: summaryPath]);
+
+    // ...and reopening it consumes the summary, so a crash can't leave a stale one behind:
+    NSError* error;
+    store = [[CBL_BlobStore alloc] initWithPath: storePath encryptionKey: encryptionKey
+                                          error: &error];
+    Assert(store, @"Couldn't reopen store: %@", error.my_compactDescription);
+    Assert(![[NSFileManager defaultManager] fileExistsAtPath: summaryPath]);
+    AssertEq(store.count, 2u);
+    AssertEq(store.totalDataSize, size);
+    Assert([store deleteBlobForKey: key]);
+    AssertEq(store.count, 1u);
+    Assert(store.totalDataSize < size);
+}
+
+
+- (void) test09_PackedBlobs {
+    store.maxPackedBlobLength = kDefaultMaxPackedBlobLength;
+    NSData* item = [@"this is an item" dataUsingEncoding: NSUTF8StringEncoding];
+    NSMutableData* bigItem = [NSMutableData dataWithLength: kDefaultMaxPackedBlobLength + 1];
+    CBLBlobKey key, key2, bigKey;
+    Assert([store storeBlob: item creatingKey: &key]);
+    Assert([store storeBlob: item creatingKey: &key2]);
+    Assert([store storeBlob: bigItem creatingKey: &bigKey]);
+
+    // The small blob doesn't get a file, the big one does:
+    Assert(![[NSFileManager defaultManager] fileExistsAtPath: [store rawPathForKey: key]]);
+    Assert([[NSFileManager defaultManager] fileExistsAtPath: [store rawPathForKey: bigKey]]);
+    AssertNil([store blobPathForKey: key]);
+    Assert([store hasBlobForKey: key]);
+    AssertEqual([store blobForKey: key], item);
+    AssertEqual([store blobForKey: bigKey], bigItem);
+
+    CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: store];
+    [writer appendData: [@"written item" dataUsingEncoding: NSUTF8StringEncoding]];
+    [writer finish];
+    Assert([writer install]);
+    CBLBlobKey writtenKey = writer.blobKey;
+    Assert(![[NSFileManager defaultManager] fileExistsAtPath: [store rawPathForKey: writtenKey]]);
+    AssertEq(store.count, 3u);
+    AssertEq(store.allKeys.count, 3u);
+
+    // Reopen; the pack index is rebuilt from the pack file:
+    CBLSymmetricKey* encryptionKey = store.encryptionKey;
+    store = nil;
+    [[NSFileManager defaultManager] removeItemAtPath: [storePath stringByAppendingPathComponent:
+                                                                        kSummaryFilename]
+                                               error: NULL];
+    NSError* error;
+    store = [[CBL_BlobStore alloc] initWithPath: storePath encryptionKey: encryptionKey
+                                          error: &error];
+    Assert(store, @"Couldn't reopen store: %@", error.my_compactDescription);
+    store.maxPackedBlobLength = kDefaultMaxPackedBlobLength;
+    AssertEq(store.count, 3u);
+    AssertEqual([store blobForKey: key], item);
+
+    // Delete a packed blob, then compact the pack during garbage collection:
+    Assert([store deleteBlobForKey: writtenKey]);
+    Assert(![store hasBlobForKey: writtenKey]);
+    AssertEq([store deleteBlobsExceptMatching: ^BOOL(CBLBlobKey k) {
+        return memcmp(&k, &bigKey, sizeof(k)) == 0;
+    } error: &error], 1);
+    AssertEq(store.count, 1u);
+    Assert(![store hasBlobForKey: key]);
+    Assert([store storeBlob: item creatingKey: &key]);
+    AssertEqual([store blobForKey: key], item);
+    NSArray* packs = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:
+                            [storePath stringByAppendingPathComponent: kPackDirName] error: NULL];
+    AssertEq(packs.count, 1u);      // the old pack was deleted
+
+    // Packed blobs survive a change of key:
+    Assert([store changeEncryptionKey: [CBLSymmetricKey new] error: &error],
+           @"Rekey failed: %@", error.my_compactDescription);
+    AssertEqual([store blobForKey: key], item);
+    AssertEqual([store blobForKey: bigKey], bigItem);
+    AssertEq(store.count, 2u);
+}
+
+
+- (void) test10_ResumableRekey {
+    NSMutableArray* items = [NSMutableArray array];
+    CBLBlobKey keys[20];
+    for (int i = 0; i < 20; i++) {
+        NSData* item = [$sprintf(@"item #%d", i) dataUsingEncoding: NSUTF8StringEncoding];
+        [items addObject: item];
+        Assert([store storeBlob: item creatingKey: &keys[i]]);
+    }
+
+    // Make copying one blob fail, so the rekey fails partway through:
+    NSFileManager* fmgr = [NSFileManager defaultManager];
+    NSString* badName = [store rawPathForKey: keys[10]].lastPathComponent;
+    CBLBlobStoreRekeyFileFilter = ^BOOL(NSString* path) {
+        return ![path.lastPathComponent isEqualToString: badName];
+    };
+    CBLSymmetricKey* oldKey = store.encryptionKey;
+    CBLSymmetricKey* newKey = [CBLSymmetricKey new];
+    NSError* error;
+    Assert(![store changeEncryptionKey: newKey error: &error]);
+    CBLBlobStoreRekeyFileFilter = nil;
+    AssertEq(store.encryptionKey, oldKey);
+    AssertEqual([store blobForKey: keys[0]], items[0]);
+
+    // The blobs copied so far are left in the rekey directory:
+    NSString* rekeyPath = [storePath stringByAppendingPathExtension: @"rekey"];
+    Assert([fmgr fileExistsAtPath: rekeyPath]);
+    NSMutableDictionary* copied = [NSMutableDictionary dictionary];
+    for (NSString* name in [fmgr contentsOfDirectoryAtPath: rekeyPath error: NULL]) {
+        if ([name hasSuffix: @".blob"]) {
+            NSString* path = [rekeyPath stringByAppendingPathComponent: name];
+            copied[name] = [fmgr attributesOfItemAtPath: path error: NULL].fileModificationDate;
+        }
+    }
+
+    // Meanwhile a blob that was already copied is deleted:
+    int deleted = -1;
+    for (int i = 0; i < 20 && deleted < 0; i++) {
+        if (copied[[store rawPathForKey: keys[i]].lastPathComponent])
+            deleted = i;
+    }
+    Assert(deleted >= 0);
+    [copied removeObjectForKey: [store rawPathForKey: keys[deleted]].lastPathComponent];
+    Assert([store deleteBlobForKey: keys[deleted]]);
+
+    // Retrying with the same key resumes, without copying those blobs again:
+    [NSThread sleepForTimeInterval: 1.0];   // so a rewritten file would have a newer date
+    NSProgress* nsProgress = [NSProgress progressWithTotalUnitCount: -1];
+    CBLProgressGroup* progress = [CBLProgressGroup new];
+    [progress addProgress: nsProgress];
+    void (^handler)(void) = ^{ };
+    progress.cancellationHandler = handler;
+    Assert([[store actionToChangeEncryptionKey: newKey progress: progress] run: &error],
+           @"Rekey failed: %@", error.my_compactDescription);
+    AssertEq(progress.cancellationHandler, handler);
+    AssertEqual(store.encryptionKey, newKey);
+    Assert(![fmgr fileExistsAtPath: rekeyPath]);
+    Assert(nsProgress.totalUnitCount > 0);
+    AssertEq(nsProgress.completedUnitCount, nsProgress.totalUnitCount);
+    for (NSString* name in copied) {
+        NSString* path = [storePath stringByAppendingPathComponent: name];
+        AssertEqual([fmgr attributesOfItemAtPath: path error: NULL].fileModificationDate,
+                    copied[name]);
+    }
+    // ...and the deleted blob stays deleted:
+    Assert(![store hasBlobForKey: keys[deleted]]);
+    AssertEq(store.count, 19u);
+    for (int i = 0; i < 20; i++) {
+        if (i != deleted)
+            AssertEqual([store blobForKey: keys[i]], items[i]);
+    }
+}
+
+
+- (void) test11_WriterDigests {
+    // Append enough data, in uneven pieces, to span several hashing batches:
+    NSMutableData* data = [NSMutableData dataWithLength: 1000000];
+    SecRandomCopyBytes(kSecRandomDefault, data.length, data.mutableBytes);
+    CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: store];
+    for (NSUInteger pos = 0; pos < data.length; ) {
+        NSUInteger len = MIN(1 + random() % 100000, data.length - pos);
+        [writer appendData: [data subdataWithRange: NSMakeRange(pos, len)]];
+        pos += len;
+    }
+    [writer finish];
+
+    NSData* sha1 = CBLSHA1Digest(data);
+    AssertEq(memcmp(writer.blobKey.bytes, sha1.bytes, sizeof(CBLBlobKey)), 0);
+    uint8_t md5[CC_MD5_DIGEST_LENGTH];
+    CC_MD5(data.bytes, (CC_LONG)data.length, md5);
+    NSString* md5Str = [@"md5-" stringByAppendingString:
+                        [[NSData dataWithBytes: md5 length: sizeof(md5)] base64EncodedStringWithOptions: 0]];
+    AssertEqual(writer.MD5DigestString, md5Str);
+    Assert([writer verifyDigest: md5Str]);
+    Assert([writer verifyDigest: writer.SHA1DigestString]);
+    [writer cancel];
+
+    // Without MD5:
+    writer = [[CBL_BlobStoreWriter alloc] initWithStore: store];
+    writer.computesMD5 = NO;
+    [writer appendData: data];
+    [writer finish];
+    AssertEq(memcmp(writer.blobKey.bytes, sha1.bytes, sizeof(CBLBlobKey)), 0);
+    AssertNil(writer.MD5DigestString);
+    Assert(![writer verifyDigest: md5Str]);
+    [writer cancel];
+}
+
+
+- (void) test12_ReadOnly {
+    NSData* item = [@"this is an item" dataUsingEncoding: NSUTF8StringEncoding];
+    CBLBlobKey key;
+    Assert([store storeBlob: item creatingKey: &key]);
+    CBLSymmetricKey* encryptionKey = store.encryptionKey;
+    store = nil;
+    NSString* encMarkerPath = [storePath stringByAppendingPathComponent: kEncryptionMarkerFilename];
+    if (encryptionKey) {
+        // Make it look like a store written by an older version:
+        Assert([@"AES" writeToFile: encMarkerPath atomically: YES
+                          encoding: NSUTF8StringEncoding error: NULL]);
+    }
+
+    // Opening read-only doesn't upgrade the marker, encrypt the store, or change its layout:
+    NSError* error;
+    store = [[CBL_BlobStore alloc] initWithPath: storePath
+                                  encryptionKey: (encryptionKey ?: [CBLSymmetricKey new])
+                                         layout: kCBLBlobStoreSharded
+                                       readOnly: YES
+                                          error: &error];
+    Assert(store, @"Couldn't open store read-only: %@", error.my_compactDescription);
+    AssertEq(store.layout, kCBLBlobStoreFlat);
+    Assert(!store.isMigrating);
+    AssertEqual([store blobForKey: key], item);
+    [self verifyRawBlob: key withCleartext: item];
+    NSString* marker = [NSString stringWithContentsOfFile: encMarkerPath
+                                                 encoding: NSUTF8StringEncoding error: NULL];
+    AssertEqual(marker, (encryptionKey ? @"AES" : nil));
+}
+
+
+- (void) test13_ChunkedBlobs {
+    store.minChunkedBlobLength = kDefaultMinChunkedBlobLength;
+    NSMutableData* itemA = [NSMutableData dataWithLength: 3*1024*1024];
+    SecRandomCopyBytes(kSecRandomDefault, itemA.length, itemA.mutableBytes);
+    NSMutableData* itemB = [itemA mutableCopy];
+    memcpy((uint8_t*)itemB.mutableBytes + 1500000, "EDITED", 6);
+    CBLBlobKey keyA, keyB;
+    Assert([store storeBlob: itemA creatingKey: &keyA]);
+    Assert([store storeBlob: itemB creatingKey: &keyB]);
+
+    // The blobs are chunked, and share all but the edited chunk:
+    Assert(![[NSFileManager defaultManager] fileExistsAtPath: [store rawPathForKey: keyA]]);
+    AssertNil([store blobPathForKey: keyA]);
+    NSArray* chunksA = [store chunkKeysForKey: keyA];
+    NSArray* chunksB = [store chunkKeysForKey: keyB];
+    Assert(chunksA.count > 3);
+    AssertEq(chunksA.count, chunksB.count);
+    NSMutableSet* differing = [NSMutableSet setWithArray: chunksB];
+    [differing minusSet: [NSSet setWithArray: chunksA]];
+    AssertEq(differing.count, 1u);
+    AssertEq(store.count, 2u);
+
+    AssertEqual([store blobForKey: keyA], itemA);
+    AssertEqual([store blobForKey: keyB], itemB);
+    AssertEq([store lengthOfBlobForKey: keyB], itemB.length);
+    UInt64 length;
+    NSInputStream* stream = [store blobInputStreamForKey: keyB length: &length];
+    AssertEq(length, itemB.length);
+    NSMutableData* streamed = [NSMutableData data];
+    uint8_t buf[32768];
+    NSInteger n;
+    while ((n = [stream read: buf maxLength: sizeof(buf)]) > 0)
+        [streamed appendBytes: buf length: n];
+    [stream close];
+    AssertEqual(streamed, itemB);
+
+    // Large blobs installed by a writer are chunked too:
+    CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: store];
+    [itemB appendBytes: "more" length: 4];
+    [writer appendData: itemB];
+    [writer finish];
+    Assert([writer install]);
+    CBLBlobKey keyC = writer.blobKey;
+    AssertEq([store chunkKeysForKey: keyC].count, chunksB.count);
+    AssertEqual([store blobForKey: keyC], itemB);
+
+    // Transfer blob A, then B, to another store, sending only the chunks it's missing:
+    NSString* store2Path = [storePath stringByAppendingString: @"2"];
+    [[NSFileManager defaultManager] removeItemAtPath: store2Path error: NULL];
+    NSError* error;
+    CBL_BlobStore* store2 = [[CBL_BlobStore alloc] initWithPath: store2Path
+                                                  encryptionKey: store.encryptionKey
+                                                          error: &error];
+    Assert(store2, @"Couldn't create store2: %@", error.my_compactDescription);
+    for (int i = 0; i < 2; i++) {
+        CBLBlobKey key = i ? keyB : keyA;
+        NSArray* chunks = i ? chunksB : chunksA;
+        NSArray* missing = [store2 missingChunkKeys: chunks];
+        AssertEq(missing.count, (i ? 1u : chunksA.count));
+        for (NSData* chunkKey in missing) {
+            CBLBlobKey k, storedKey;
+            [chunkKey getBytes: &k length: sizeof(k)];
+            Assert([store2 storeChunk: [store chunkForKey: k] creatingKey: &storedKey]);
+        }
+        // Compaction doesn't delete chunks that are waiting to be assembled:
+        Assert([store2 compactStorage: &error]);
+        AssertEq([store2 missingChunkKeys: chunks].count, 0u);
+        Assert([store2 storeBlobForKey: key fromChunks: chunks error: &error]);
+        AssertEqual([store2 blobForKey: key], (i ? [store blobForKey: keyB] : itemA));
+    }
+    Assert(![store2 storeBlobForKey: keyC fromChunks: chunksA error: &error]);
+    [store2 close];
+    store2 = nil;
+    [[NSFileManager defaultManager] removeItemAtPath: store2Path error: NULL];
+
+    // Garbage collection deletes the chunks only blob A used:
+    AssertEq([store deleteBlobsExceptMatching: ^BOOL(CBLBlobKey k) {
+        return memcmp(&k, &keyA, sizeof(k)) != 0;
+    } error: &error], 1);
+    Assert(![store hasBlobForKey: keyA]);
+    AssertEq([store missingChunkKeys: chunksA].count, 1u);
+    AssertEqual([store blobForKey: keyC], itemB);
+
+    // Chunked blobs survive a change of key:
+    Assert([store changeEncryptionKey: [CBLSymmetricKey new] error: &error],
+           @"Rekey failed: %@", error.my_compactDescription);
+    AssertEqual([store blobForKey: keyC], itemB);
+    AssertEq([store chunkKeysForKey: keyB].count, chunksB.count);
+    AssertEq(store.count, 2u);
+
+    // A chunk that becomes unreadable after the stream is opened makes the stream fail, rather
+    // than end early:
+    stream = [store blobInputStreamForKey: keyC length: &length];
+    Assert(stream);
+    CBL_BlobStore* chunkStore = [[CBL_BlobStore alloc]
+                                initWithPath: [store.path stringByAppendingPathComponent: kChunkDirName]
+                               encryptionKey: store.encryptionKey error: &error];
+    CBLBlobKey lastChunk;
+    [[store chunkKeysForKey: keyC].lastObject getBytes: &lastChunk length: sizeof(lastChunk)];
+    Assert([[NSFileManager defaultManager] removeItemAtPath: [chunkStore rawPathForKey: lastChunk]
+                                                      error: &error]);
+    NSInteger bytesRead, total = 0;
+    while ((bytesRead = [stream read: buf maxLength: sizeof(buf)]) > 0)
+        total += bytesRead;
+    AssertEq(bytesRead, -1);
+    Assert(total < (NSInteger)length);
+    AssertEq(stream.streamStatus, NSStreamStatusError);
+    Assert(stream.streamError != nil);
+    [stream close];
+}
+
+
+- (void) test14_BlobCache {
+    store.maxCachedBlobLength = 100;
+    store.blobCacheCapacity = 250;
+    CBLBlobKey keys[4];
+    NSMutableArray* items = [NSMutableArray array];
+    for (int i = 0; i < 4; i++) {
+        NSData* item = [$sprintf(@"%d%@", i, [@"" stringByPaddingToLength: 99
+                                                                withString: @"x"
+                                                           startingAtIndex: 0])
+                        dataUsingEncoding: NSUTF8StringEncoding];
+        [items addObject: item];
+        Assert([store storeBlob: item creatingKey: &keys[i]]);
+    }
+    NSData* big = [NSMutableData dataWithLength: 101];
+    CBLBlobKey bigKey;
+    Assert([store storeBlob: big creatingKey: &bigKey]);
+
+    // First reads miss, later ones hit:
+    UInt64 hits = store.cacheHits, misses = store.cacheMisses;
+    AssertEqual([store blobForKey: keys[0]], items[0]);
+    AssertEqual([store blobForKey: keys[1]], items[1]);
+    AssertEq(store.cacheMisses, misses + 2);
+    AssertEqual([store blobForKey: keys[0]], items[0]);
+    AssertEqual([store mappedBlobForKey: keys[1]], items[1]);
+    AssertEq(store.cacheHits, hits + 2);
+    AssertEq([store lengthOfBlobForKey: keys[0]], 100u);
+
+    // Blobs over the maximum length aren't cached, and don't count as hits or misses:
+    AssertEqual([store blobForKey: bigKey], big);
+    AssertEqual([store blobForKey: bigKey], big);
+    AssertEq(store.cacheHits, hits + 2);
+    AssertEq(store.cacheMisses, misses + 2);
+
+    // Only two fit, so reading a third evicts the least recently used (keys[0]):
+    AssertEqual([store blobForKey: keys[2]], items[2]);
+    hits = store.cacheHits, misses = store.cacheMisses;
+    AssertEqual([store blobForKey: keys[1]], items[1]);
+    AssertEqual([store blobForKey: keys[2]], items[2]);
+    AssertEq(store.cacheHits, hits + 2);
+    AssertEqual([store blobForKey: keys[0]], items[0]);
+    AssertEq(store.cacheMisses, misses + 1);
+
+    // Deleting a blob removes it from the cache, and a missing blob isn't cached:
+    Assert([store deleteBlobForKey: keys[0]]);
+    hits = store.cacheHits, misses = store.cacheMisses;
+    AssertNil([store blobForKey: keys[0]]);
+    AssertNil([store blobForKey: keys[0]]);
+    AssertEq(store.cacheHits, hits);
+    AssertEq(store.cacheMisses, misses);
+    AssertEq([store deleteBlobsExceptMatching: ^BOOL(CBLBlobKey k) {
+        return memcmp(&k, &keys[2], sizeof(k)) != 0;
+    } error: NULL], 1);
+    AssertNil([store blobForKey: keys[2]]);
+
+    // A low-memory warning empties the cache:
+    AssertEqual([store blobForKey: keys[3]], items[3]);
+    [store lowMemoryWarning];
+    misses = store.cacheMisses;
+    AssertEqual([store blobForKey: keys[3]], items[3]);
+    AssertEq(store.cacheMisses, misses + 1);
+}
+
+
 @end
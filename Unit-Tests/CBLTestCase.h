@@ -84,6 +84,10 @@ void RemoveTemporaryCredential(NSURL* url, NSString* realm,
 /** YES if the underlying data store is SQLite (not ForestDB). */
 @property (readonly) BOOL isSQLiteDB;
 
+/** The SQLite profiles (kCBLSQLiteProfile...) to run each test with; by default just the default
+    profile. Subclasses can override this to run their tests under others too. */
++ (NSArray*) sqliteProfiles;
+
 /** Creates a document in the test database with the given properties. */
 - (CBLDocument*) createDocumentWithProperties: (NSDictionary*)properties;
 
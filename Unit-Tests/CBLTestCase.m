@@ -155,16 +155,26 @@ extern int c4_getObjectCount(void);             // from c4Base.h (CBForest)
 @implementation CBLTestCaseWithDB
 {
     BOOL _useForestDB;
+    NSString* _sqliteProfile;
     int _cbForestObjectCount;
 }
 
 @synthesize db=db;
 
 
++ (NSArray*) sqliteProfiles {
+    return @[kCBLSQLiteProfileDefault];
+}
+
+
 - (void)invokeTest {
-    // Run each test method twice, once with SQLite storage and once with ForestDB.
+    // Run each test method with SQLite storage (once per SQLite profile), then with ForestDB.
     _useForestDB = NO;
-    [super invokeTest];
+    for (NSString* profile in [[self class] sqliteProfiles]) {
+        _sqliteProfile = profile;
+        [super invokeTest];
+    }
+    _sqliteProfile = kCBLSQLiteProfileDefault;
     _useForestDB = YES;
     [super invokeTest];
 }
@@ -177,8 +187,12 @@ extern int c4_getObjectCount(void);             // from c4Base.h (CBForest)
 
     dbmgr = [CBLManager createEmptyAtTemporaryPath: @"CBL_iOS_Unit_Tests"];
     dbmgr.storageType = _useForestDB ? kCBLForestDBStorage : kCBLSQLiteStorage;
+    dbmgr.sqliteProfile = _sqliteProfile ?: kCBLSQLiteProfileDefault;
     Assert(dbmgr);
-    Log(@"---- Using %@ ----", dbmgr.storageType);
+    if (_useForestDB)
+        Log(@"---- Using %@ ----", dbmgr.storageType);
+    else
+        Log(@"---- Using %@ (%@ profile) ----", dbmgr.storageType, dbmgr.sqliteProfile);
     NSError* error;
     db = [dbmgr createEmptyDatabaseNamed: @"db" error: &error];
     Assert(db, @"Couldn't create db: %@", error.my_compactDescription);
@@ -25,6 +25,7 @@
 #import "CBLInternal.h"
 #import "CouchbaseLitePrivate.h"
 #import "CBLGZip.h"
+#import "CBL_SQLiteStorage.h"
 
 
 @interface DatabaseAttachment_Tests : CBLTestCaseWithDB
@@ -446,6 +447,58 @@
 }
 
 
+- (void) test13a_BackgroundGarbageCollection {
+    NSMutableArray* revs = $marray();
+    for (int i=0; i<250; i++) {
+        [revs addObject: [self putDoc: $sprintf(@"doc-%d", i)
+                       withAttachment: $sprintf(@"Attachment #%d", i)
+                           compressed: NO]];
+    }
+    // Two docs share an attachment; purging one of them mustn't delete it:
+    [self putDoc: @"twin" withAttachment: @"Attachment #0" compressed: NO];
+    AssertEq(db.attachmentStore.count, 250u);
+
+    NSMutableDictionary* toPurge = $mdict();
+    for (int i=0; i<150; i++)
+        toPurge[[revs[i] docID]] = @[@"*"];
+    AssertEq([db.storage purgeRevisions: toPurge result: NULL], kCBLStatusOK);
+    [db garbageCollectAttachmentsInBackground];
+    Assert([self wait: 10.0 for: ^BOOL{
+        return db.attachmentStore.count == 101u;
+    }]);
+    Assert([db.attachmentStore hasBlobForKey: [CBL_BlobStore keyForBlob:
+                                    [@"Attachment #0" dataUsingEncoding: NSUTF8StringEncoding]]]);
+    [db _close];
+}
+
+
+- (void) test13b_GarbageCollectUnindexedAttachments {
+    if (!self.isSQLiteDB)
+        return;
+    for (int i=0; i<10; i++) {
+        [self putDoc: $sprintf(@"doc-%d", i)
+      withAttachment: $sprintf(@"Attachment #%d", i)
+          compressed: NO];
+    }
+    // An older version of CBL adds revisions without indexing their attachments:
+    CBL_SQLiteStorage* storage = (CBL_SQLiteStorage*)db.storage;
+    Assert([storage.fmdb executeUpdate: @"DELETE FROM attachment_refs WHERE sequence > 5"]);
+
+    // ...but garbage collection indexes them before deciding what's unused:
+    NSError* error;
+    Assert([db compact: &error], @"Compact failed: %@", error);
+    AssertEq(db.attachmentStore.count, 10u);
+    AssertEq([storage.fmdb intForQuery: @"SELECT count(*) FROM attachment_refs"], 10);
+
+    // So does reopening the database:
+    [self putDoc: @"doc-10" withAttachment: @"Attachment #10" compressed: NO];
+    Assert([storage.fmdb executeUpdate: @"DELETE FROM attachment_refs WHERE sequence > 10"]);
+    [self reopenTestDB];
+    storage = (CBL_SQLiteStorage*)db.storage;
+    AssertEq([storage.fmdb intForQuery: @"SELECT count(*) FROM attachment_refs"], 11);
+}
+
+
 - (void) test14_FollowingAttachments {
     RequireTestCase(CBL_Database_PutAttachment);
     NSMutableString* attachStr = [@"boing " mutableCopy];
@@ -605,6 +658,46 @@
 }
 
 
+- (void) test18_CompressAttachments {
+    db.attachmentCompressionPolicy = [CBLDatabase defaultAttachmentCompressionPolicy];
+    NSMutableString* text = [NSMutableString string];
+    for (int i = 0; i < 500; i++)
+        [text appendFormat: @"{\"line\": %d, \"text\": \"all work and no play\"}\n", i];
+    NSData* textBody = [text dataUsingEncoding: NSUTF8StringEncoding];
+    NSMutableData* photoBody = [NSMutableData dataWithLength: 20000];
+    arc4random_buf(photoBody.mutableBytes, photoBody.length);
+    NSData* tinyBody = [@"too small to bother" dataUsingEncoding: NSUTF8StringEncoding];
+
+    CBLUnsavedRevision* rev = [[db createDocument] newRevision];
+    [rev setAttachmentNamed: @"log.json" withContentType: @"application/json" content: textBody];
+    [rev setAttachmentNamed: @"photo.jpg" withContentType: @"image/jpeg" content: photoBody];
+    [rev setAttachmentNamed: @"tiny.txt" withContentType: @"text/plain" content: tinyBody];
+    NSError* error;
+    CBLSavedRevision* saved = [rev save: &error];
+    Assert(saved, @"Couldn't save: %@", error.my_compactDescription);
+
+    // The JSON is stored gzipped, but reads back decoded:
+    NSDictionary* meta = saved[@"_attachments"][@"log.json"];
+    AssertEqual(meta[@"encoding"], @"gzip");
+    AssertEq([meta[@"length"] unsignedLongLongValue], textBody.length);
+    CBLAttachment* att = [saved attachmentNamed: @"log.json"];
+    Assert(att.encodedLength < att.length / 4);
+    AssertEqual(att.content, textBody);
+    AssertNil(att.contentURL);
+    CBLBlobKey key;
+    Assert([CBL_Attachment digest: meta[@"digest"] toBlobKey: &key]);
+    AssertEq([db.attachmentStore lengthOfBlobForKey: key], att.encodedLength);
+
+    // Incompressible types and tiny attachments are stored as-is:
+    for (NSString* name in @[@"photo.jpg", @"tiny.txt"]) {
+        AssertNil(saved[@"_attachments"][name][@"encoding"]);
+        att = [saved attachmentNamed: name];
+        AssertEq(att.encodedLength, att.length);
+    }
+    AssertEqual([saved attachmentNamed: @"photo.jpg"].content, photoBody);
+}
+
+
 static NSDictionary* attachmentsDict(NSData* data, NSString* name, NSString* type, BOOL gzipped) {
     if (gzipped)
         data = [CBLGZip dataByCompressingData: data];
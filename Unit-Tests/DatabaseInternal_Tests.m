@@ -13,6 +13,7 @@
 #import "CBLDatabase+Replication.h"
 #import "CBLDatabase+REST.h"
 #import "CBL_Storage.h"
+#import "CBL_SQLiteStorage.h"
 #import "CBLDatabaseUpgrade.h"
 #import "CBL_Attachment.h"
 #import "CBL_Body.h"
@@ -24,6 +25,7 @@
 #import "CBLInternal.h"
 #import "CouchbaseLitePrivate.h"
 #import "CBLGZip.h"
+#import "CBJSONEncoder.h"
 
 
 static NSDictionary* userProperties(NSDictionary* dict) {
@@ -1170,4 +1172,408 @@ static CBLDatabaseChange* announcement(CBLDatabase* db, CBL_Revision* rev, CBL_R
 }
 
 
+
+- (void) test31_IncrementalCompaction {
+    if (!self.isSQLiteDB)
+        return;
+    id<CBL_Storage> storage = db.storage;
+    AssertEqual(db.compactionInfo[@"incremental_vacuum"], @YES);
+
+    // Create enough obsolete revisions that stripping them takes several batches:
+    NSString* padding = [@"" stringByPaddingToLength: 2000 withString: @"x" startingAtIndex: 0];
+    CBLStatus status;
+    NSError* error;
+    CBL_Revision *firstRev = nil, *rev = nil;
+    for (int i = 0; i < 1200; i++) {
+        NSString* docID = $sprintf(@"doc%04d", i);
+        CBL_Revision* rev1 = [db putDocID: docID properties: $mdict({@"padding", padding})
+                           prevRevisionID: nil allowConflict: NO source: nil
+                                   status: &status error: &error];
+        Assert(rev1, @"Couldn't save doc %d: %@", i, error.my_compactDescription);
+        rev = [db putDocID: docID properties: $mdict({@"i", @(i)})
+            prevRevisionID: rev1.revID allowConflict: NO source: nil
+                    status: &status error: &error];
+        Assert(rev, @"Couldn't update doc %d: %@", i, error.my_compactDescription);
+        if (!firstRev)
+            firstRev = rev1;
+    }
+    NSUInteger pagesBefore = [db.compactionInfo[@"page_count"] unsignedIntegerValue];
+
+    // Compact in tiny time slices, like the (longer) ones -compactInBackground runs:
+    BOOL finished = NO;
+    unsigned slices = 0;
+    while (!finished) {
+        Assert([storage compactFor: 0.001 finished: &finished error: &error],
+               @"Compaction failed: %@", error.my_compactDescription);
+        ++slices;
+        if (!finished)
+            AssertEqual(db.compactionInfo[@"compacting"], @YES);
+    }
+    Log(@"Compacted in %u slices; info = %@", slices, db.compactionInfo);
+
+    NSDictionary* info = db.compactionInfo;
+    AssertEqual(info[@"compacting"], @NO);
+    Assert([info[@"revisions_stripped"] unsignedIntegerValue] >= 1199u);
+    AssertEq([info[@"free_pages"] intValue], 0);
+    Assert([info[@"page_count"] unsignedIntegerValue] < pagesBefore);
+
+    CBL_Revision* oldRev = [db getDocumentWithID: firstRev.docID revisionID: firstRev.revID];
+    Assert(oldRev.missing);
+    CBL_Revision* curRev = [db getDocumentWithID: rev.docID revisionID: nil];
+    AssertEqual(curRev.revID, rev.revID);
+    AssertEqual(curRev[@"i"], @1199);
+
+    // Pages can't be freed inside a transaction, so compacting there fails instead of
+    // claiming success:
+    __block BOOL compacted = YES;
+    __block NSError* compactError = nil;
+    [db inTransaction: ^BOOL {
+        compacted = [db compact: &compactError];
+        return YES;
+    }];
+    Assert(!compacted);
+    AssertEqual(compactError.domain, CBLHTTPErrorDomain);
+    AssertEq(compactError.code, 500);
+}
+
+
+- (void) test31b_CompactInBackground {
+    CBL_Revision *rev1 = [self putDoc: @{@"n": @1}];
+    CBL_Revision *rev2 = [self putDoc: @{@"_id": rev1.docID, @"_rev": rev1.revID, @"n": @2}];
+
+    Assert([db compactInBackground]);
+    Assert(db.compactionScheduled);
+    Assert([db compactInBackground]);      // already scheduled; does nothing
+    Assert([self wait: 10.0 for: ^BOOL{ return !db.compactionScheduled; }]);
+
+    CBL_Revision* oldRev = [db getDocumentWithID: rev1.docID revisionID: rev1.revID];
+    Assert(oldRev.missing);
+    CBL_Revision* curRev = [db getDocumentWithID: rev1.docID revisionID: nil];
+    AssertEqual(curRev.revID, rev2.revID);
+    AssertEqual(curRev[@"n"], @2);
+}
+
+
+- (void) test31c_MigrateToIncrementalVacuum {
+    if (!self.isSQLiteDB)
+        return;
+    // Databases created by older versions don't use incremental auto-vacuum:
+    CBL_SQLiteStorage* storage = (CBL_SQLiteStorage*)db.storage;
+    Assert([storage.fmdb executeUpdate: @"PRAGMA auto_vacuum=NONE"]);
+    Assert([storage.fmdb executeUpdate: @"VACUUM"]);
+    AssertEqual(db.compactionInfo[@"incremental_vacuum"], @NO);
+
+    CBL_Revision *rev1 = [self putDoc: @{@"n": @1}];
+    CBL_Revision *rev2 = [self putDoc: @{@"_id": rev1.docID, @"_rev": rev1.revID, @"n": @2}];
+
+    // A full compaction switches it over:
+    NSError* error;
+    Assert([db compact: &error], @"Compaction failed: %@", error.my_compactDescription);
+    AssertEqual(db.compactionInfo[@"incremental_vacuum"], @YES);
+
+    // ...and it stays switched over once reopened:
+    [self reopenTestDB];
+    AssertEqual(db.compactionInfo[@"incremental_vacuum"], @YES);
+    CBL_Revision* oldRev = [db getDocumentWithID: rev1.docID revisionID: rev1.revID];
+    Assert(oldRev.missing);
+    CBL_Revision* curRev = [db getDocumentWithID: rev1.docID revisionID: nil];
+    AssertEqual(curRev.revID, rev2.revID);
+    AssertEqual(curRev[@"n"], @2);
+
+    // From here on it compacts incrementally:
+    BOOL finished;
+    Assert([(id<CBL_Storage>)db.storage compactFor: 0.0 finished: &finished error: &error]);
+    Assert(finished);
+}
+
+
+static NSDictionary* employeeProperties(int i) {
+    return @{@"type": @"employee", @"index": @(i), @"name": $sprintf(@"Employee %d", i),
+             @"department": @[@"Sales", @"Engineering", @"Support"][i % 3],
+             @"address": @{@"street": $sprintf(@"%d Main Street", 100 + i), @"city": @"Springfield",
+                           @"state": @"Oregon", @"country": @"United States"},
+             @"skills": @[@"negotiation", @"presentations", @"spreadsheets", @"scheduling"],
+             @"notes": @"Prefers email over phone calls; available Monday through Thursday."};
+}
+
+- (void) test32_CompressedBodies {
+    if (!self.isSQLiteDB)
+        return;
+    CBL_SQLiteStorage* storage = (CBL_SQLiteStorage*)db.storage;
+    CBL_Revision* plainRev = [self putDoc: employeeProperties(0)];
+
+    // Too few documents to train a dictionary yet, so bodies are compressed without one:
+    storage.compressesDocuments = YES;
+    AssertEqual(db.compactionInfo[@"compression_dictionary"], @0);
+
+    // The first compressed body makes the schema unreadable by older versions, unless it's
+    // rolled back:
+    AssertEq([storage.fmdb intForQuery: @"PRAGMA user_version"], 103);
+    [db inTransaction: ^BOOL {
+        [self putDoc: employeeProperties(99)];
+        return NO;
+    }];
+    AssertEq([storage.fmdb intForQuery: @"PRAGMA user_version"], 103);
+    NSMutableArray* revs = [NSMutableArray array];
+    for (int i = 1; i <= 40; i++)
+        [revs addObject: [self putDoc: employeeProperties(i)]];
+    NSData* json = [CBJSONEncoder canonicalEncoding: employeeProperties(1) error: NULL];
+    CBL_Revision* rev = revs[0];
+    NSData* stored = [storage.fmdb dataForQuery: @"SELECT json FROM revs WHERE sequence=?",
+                                                 @(rev.sequence)];
+    AssertEq(((const uint8_t*)stored.bytes)[0], 1);
+    AssertEq(((const uint8_t*)stored.bytes)[1], 0);
+    Assert(stored.length < json.length);
+    AssertEq([storage.fmdb intForQuery: @"PRAGMA user_version"], 200);
+
+    // Compression doesn't affect revision IDs:
+    CBL_Revision* sameRev = [self putDoc: employeeProperties(0)];
+    AssertEqual(sameRev.revID, plainRev.revID);
+
+    // Compaction trains a dictionary, and recompresses all the bodies with it:
+    NSError* error;
+    Assert([db compact: &error], @"Compaction failed: %@", error.my_compactDescription);
+    NSDictionary* info = db.compactionInfo;
+    Log(@"After compaction, info = %@", info);
+    AssertEqual(info[@"compression_dictionary"], @1);
+    AssertEq([info[@"revisions_recompressed"] intValue], 42);
+    NSData* restored = [storage.fmdb dataForQuery: @"SELECT json FROM revs WHERE sequence=?",
+                                                   @(rev.sequence)];
+    AssertEq(((const uint8_t*)restored.bytes)[1], 1);
+    Assert(restored.length < stored.length);
+    stored = [storage.fmdb dataForQuery: @"SELECT json FROM revs WHERE sequence=?",
+                                         @(plainRev.sequence)];
+    AssertEq(((const uint8_t*)stored.bytes)[0], 1);
+
+    // Bodies read back intact, even with compression turned off again:
+    storage.compressesDocuments = NO;
+    for (CBL_Revision* savedRev in revs) {
+        CBL_Revision* readRev = [db getDocumentWithID: savedRev.docID revisionID: nil];
+        AssertEqual(userProperties(readRev.properties), userProperties(savedRev.properties));
+    }
+
+    // Map functions see the decompressed properties:
+    CBLView* view = [db viewNamed: @"byName"];
+    [view setMapBlock: MAPBLOCK({
+        emit(doc[@"name"], doc[@"address"][@"city"]);
+    }) version: @"1"];
+    NSArray* rows = [[[view createQuery] run: &error] allObjects];
+    AssertEq(rows.count, 42u);
+    AssertEqual([rows[0] key], @"Employee 0");
+    AssertEqual([rows[0] value], @"Springfield");
+
+    // The new schema version still opens:
+    [self reopenTestDB];
+    storage = (CBL_SQLiteStorage*)db.storage;
+    CBL_Revision* readRev = [db getDocumentWithID: rev.docID revisionID: nil];
+    AssertEqual(userProperties(readRev.properties), userProperties(rev.properties));
+
+    // A body that won't decompress is reported as corrupt, not as missing:
+    Assert([storage.fmdb executeUpdate: @"UPDATE revs SET json=substr(json, 1, 40) WHERE sequence=?",
+                                        @(rev.sequence)]);
+    [self allowWarningsIn: ^{
+        CBLStatus status;
+        AssertNil([db getDocumentWithID: rev.docID revisionID: nil withBody: YES status: &status]);
+        AssertEq(status, kCBLStatusCorruptError);
+        CBL_MutableRevision* bodyless = [[CBL_MutableRevision alloc] initWithDocID: rev.docID
+                                                                             revID: rev.revID
+                                                                           deleted: NO];
+        AssertEq([db loadRevisionBody: bodyless], kCBLStatusCorruptError);
+    }];
+}
+
+
+- (void) test33_StatementCache {
+    if (!self.isSQLiteDB)
+        return;
+    CBL_SQLiteStorage* storage = (CBL_SQLiteStorage*)db.storage;
+
+    // Running more distinct queries than the cache holds evicts the least recently used:
+    for (int i = 0; i < 200; i++)
+        AssertEq([storage.fmdb intForQuery: $sprintf(@"SELECT %d", i)], i);
+    NSDictionary* stats = db.statementStats;
+    NSUInteger cacheSize = [stats[@"cache_size"] unsignedIntegerValue];
+    Assert(cacheSize > 0);
+    Assert([stats[@"cached_statements"] unsignedIntegerValue] <= cacheSize);
+    Assert([stats[@"cache_evictions"] unsignedIntegerValue] >= 200 - cacheSize);
+    AssertEq([storage.fmdb intForQuery: @"SELECT 199"], 199);
+    Assert([db.statementStats[@"cache_hits"] unsignedIntegerValue]
+                > [stats[@"cache_hits"] unsignedIntegerValue]);
+
+    // Per-statement statistics:
+    db.collectsStatementStats = YES;
+    for (int i = 0; i < 50; i++)
+        [self putDoc: @{@"i": @(i)}];
+    for (int i = 0; i < 100; i++)
+        AssertEq([storage.fmdb intForQuery: @"SELECT count(*) FROM docs WHERE docid > ?", @""], 50);
+    stats = db.statementStats;
+    Log(@"Statement stats = %@", stats);
+    AssertEqual(stats[@"collecting"], @YES);
+    NSDictionary* hottest = [stats[@"hottest"] firstObject];
+    AssertEqual(hottest[@"sql"], @"SELECT count(*) FROM docs WHERE docid > ?");
+    Assert([hottest[@"count"] unsignedIntegerValue] >= 100u);
+    Assert([hottest[@"query_plan"] count] > 0);
+    Assert([stats[@"slowest"] count] > 0);
+
+    db.collectsStatementStats = NO;
+    AssertEqual(db.statementStats[@"collecting"], @NO);
+    AssertNil(db.statementStats[@"hottest"]);
+}
+
+
+- (void) test34_SQLiteProfiles {
+    if (!self.isSQLiteDB)
+        return;
+    CBLDatabaseOptions* options = [CBLDatabaseOptions new];
+    options.create = YES;
+    options.sqliteProfile = kCBLSQLiteProfileServer;
+    options.sqliteSettings = @{@"cache_size": @(-8192), @"bogus": @1, @"synchronous": @"OFF; x",
+                               @"temp_store": @"file", @"wal_autocheckpoint": @"FULL"};
+    __block NSError* error;
+    __block CBLDatabase* server;
+    [self allowWarningsIn: ^{
+        NSError* openError;
+        server = [dbmgr openDatabaseNamed: @"server" withOptions: options error: &openError];
+        error = openError;
+    }];
+    Assert(server, @"Couldn't open db: %@", error);
+    CBL_FMDatabase* fmdb = ((CBL_SQLiteStorage*)server.storage).fmdb;
+    AssertEq([fmdb intForQuery: @"PRAGMA cache_size"], -8192);     // overridden
+    AssertEq([fmdb intForQuery: @"PRAGMA temp_store"], 1);         // FILE, overridden
+    AssertEq([fmdb intForQuery: @"PRAGMA synchronous"], 1);        // NORMAL; bad override ignored
+    AssertEq([fmdb intForQuery: @"PRAGMA wal_autocheckpoint"], 10000); // keyword isn't a number
+
+    // A low-memory warning shrinks the page cache:
+    [(CBL_SQLiteStorage*)server.storage lowMemoryWarning];
+    AssertEq([fmdb intForQuery: @"PRAGMA cache_size"], -512);
+
+    // The default profile comes from the manager:
+    dbmgr.sqliteProfile = kCBLSQLiteProfileLowMemory;
+    options = [CBLDatabaseOptions new];
+    options.create = YES;
+    CBLDatabase* small = [dbmgr openDatabaseNamed: @"small" withOptions: options error: &error];
+    Assert(small, @"Couldn't open db: %@", error);
+    fmdb = ((CBL_SQLiteStorage*)small.storage).fmdb;
+    AssertEq([fmdb intForQuery: @"PRAGMA cache_size"], -512);
+    AssertEq([fmdb intForQuery: @"PRAGMA temp_store"], 1);         // FILE
+    AssertEq([fmdb intForQuery: @"PRAGMA wal_autocheckpoint"], 250);
+}
+
+
+- (void) test35_LazyQueryEnumerators {
+    for (int i = 0; i < 100; i++)
+        [self putDoc: @{@"_id": $sprintf(@"doc-%03d", i), @"i": @(i)}];
+    CBLView* view = [db viewNamed: @"byI"];
+    [view setMapBlock: MAPBLOCK({
+        emit(doc[@"i"], nil);
+    }) version: @"1"];
+    AssertEq([view _updateIndex], kCBLStatusOK);
+
+    // Two enumerators of the same query can be stepped through alternately:
+    CBLQueryOptions* options = [CBLQueryOptions new];
+    options->skip = 10;
+    options->limit = 50;
+    CBLStatus status;
+    CBLQueryEnumerator* e1 = [db getAllDocs: options status: &status];
+    CBLQueryEnumerator* e2 = [db getAllDocs: options status: &status];
+    CBLQueryEnumerator* v1 = [view _queryWithOptions: options status: &status];
+    CBLQueryEnumerator* v2 = [view _queryWithOptions: options status: &status];
+    Assert(e1 && e2 && v1 && v2);
+    for (int i = 10; i < 60; i++) {
+        AssertEqual(e1.nextRow.documentID, $sprintf(@"doc-%03d", i));
+        AssertEqual(e2.nextRow.documentID, $sprintf(@"doc-%03d", i));
+        AssertEqual(v1.nextRow.key, @(i));
+        AssertEqual(v2.nextRow.key, @(i));
+    }
+    AssertNil(e1.nextRow);
+    AssertNil(e1.nextRow);
+    AssertNil(v2.nextRow);
+
+    // Filters, skip and limit still apply:
+    options = [CBLQueryOptions new];
+    options->skip = 5;
+    options->limit = 10;
+    options.filter = ^BOOL(CBLQueryRow* row) {
+        return [row.documentID hasSuffix: @"0"];
+    };
+    NSArray* rows = [[view _queryWithOptions: options status: &status] allObjects];
+    AssertEq(rows.count, 5u);
+    AssertEqual([rows[0] key], @50);
+    rows = [[db getAllDocs: options status: &status] allObjects];
+    Assert(rows.count > 0);
+    for (CBLQueryRow* row in rows)
+        Assert([row.documentID hasSuffix: @"0"]);
+
+    // Results longer than a page are read a page at a time, each resuming where the last one
+    // ended, even when rows have the same key and doc ID, or are in descending order:
+    CBLView* dups = [db viewNamed: @"dups"];
+    [dups setMapBlock: MAPBLOCK({
+        emit(@"k", doc[@"i"]);
+        emit(@"k", doc[@"i"]);
+    }) version: @"1"];
+    AssertEq([dups _updateIndex], kCBLStatusOK);
+    options = [CBLQueryOptions new];
+    options->skip = 3;
+    rows = [[dups _queryWithOptions: options status: &status] allObjects];
+    AssertEq(rows.count, 197u);
+    for (NSUInteger i = 0; i < rows.count; i++)
+        AssertEqual([rows[i] documentID], $sprintf(@"doc-%03d", (int)(i + 3) / 2));
+    options = [CBLQueryOptions new];
+    options->descending = YES;
+    rows = [[db getAllDocs: options status: &status] allObjects];
+    AssertEq(rows.count, 100u);
+    for (NSUInteger i = 0; i < rows.count; i++)
+        AssertEqual([rows[i] documentID], $sprintf(@"doc-%03d", 99 - (int)i));
+
+    // The database can be written to while an enumerator is partway through:
+    CBLQueryEnumerator* e = [dups _queryWithOptions: [CBLQueryOptions new] status: &status];
+    AssertEqual(e.nextRow.documentID, @"doc-000");
+    [self putDoc: @{@"_id": @"doc-zzz"}];
+    NSUInteger count = 1;
+    while (e.nextRow)
+        ++count;
+    AssertEq(count, 200u);
+
+    // ...and clearing the statement cache (as optimizing the indexes does) doesn't close the
+    // statement out from under it:
+    if (self.isSQLiteDB) {
+        e = [dups _queryWithOptions: [CBLQueryOptions new] status: &status];
+        AssertEqual(e.nextRow.documentID, @"doc-000");
+        [((CBL_SQLiteStorage*)db.storage).fmdb clearCachedStatements];
+        count = 1;
+        while (e.nextRow)
+            ++count;
+        AssertEq(count, 200u);
+    }
+}
+
+
+- (void) test36_DocIDCacheAfterAbort {
+    if (!self.isSQLiteDB)
+        return;
+    // Aborting a nested transaction only forgets the docIDs it added, not the outer one's:
+    [db inTransaction: ^BOOL {
+        [self putDoc: @{@"_id": @"outer"}];
+        [db inTransaction: ^BOOL {
+            [self putDoc: @{@"_id": @"inner"}];
+            return NO;
+        }];
+        return YES;
+    }];
+    NSUInteger misses = [db.docIDCacheInfo[@"misses"] unsignedIntegerValue];
+    CBLStatus status;
+    AssertNotNil([db getDocumentWithID: @"outer" revisionID: nil withBody: YES status: &status]);
+    AssertEq([db.docIDCacheInfo[@"misses"] unsignedIntegerValue], misses);
+
+    // The aborted doc's rowid gets reused, and isn't confused with the new doc:
+    AssertNil([db getDocumentWithID: @"inner" revisionID: nil withBody: YES status: &status]);
+    AssertEq(status, kCBLStatusNotFound);
+    [self putDoc: @{@"_id": @"another", @"n": @1}];
+    AssertNil([db getDocumentWithID: @"inner" revisionID: nil withBody: YES status: &status]);
+    CBL_Revision* rev = [db getDocumentWithID: @"another" revisionID: nil withBody: YES
+                                       status: &status];
+    AssertEqual(rev[@"n"], @1);
+}
+
+
 @end
@@ -7,6 +7,10 @@
 //
 
 #import "CBLTestCase.h"
+#import "CBLDatabase+Attachments.h"
+#import "CBLGZip.h"
+#import "CBL_BlobStoreWriter.h"
+#import "CBLSymmetricKey.h"
 
 
 @interface Database_Benchmarks : CBLTestCaseWithDB
@@ -33,6 +37,11 @@ static const int kNumTestNames = 1000;
     _ageRange = NSMakeRange(20, 50);
 }
 
+// Run each benchmark under each SQLite profile, to compare them:
++ (NSArray*) sqliteProfiles {
+    return @[kCBLSQLiteProfileDefault, kCBLSQLiteProfileServer, kCBLSQLiteProfileLowMemory];
+}
+
 - (int)ageValue:(NSUInteger)row {
     return row % (int)_ageRange.length + (int)_ageRange.location;
 }
@@ -83,4 +92,336 @@ static const int kNumTestNames = 1000;
     Log(@"testCreateNewDocs took %.3f sec; that's %.0f docs/sec", duration, kNumDocs/duration);
 }
 
+
+// Compares saving docs in batches with -putDocuments: to saving them one at a time.
+- (void)testPutDocumentsInBulk {
+    static const NSUInteger kNumDocs = 50000, kBatchSize = 1000;
+
+    NSTimeInterval start = CFAbsoluteTimeGetCurrent();
+    [db inTransaction:^BOOL{
+        for (NSUInteger i = 0; i < kNumDocs; i++)
+            [self insertObject: i];
+        return YES;
+    }];
+    NSTimeInterval singleTime = CFAbsoluteTimeGetCurrent() - start;
+
+    start = CFAbsoluteTimeGetCurrent();
+    for (NSUInteger i = 0; i < kNumDocs; i += kBatchSize) {
+        @autoreleasepool {
+            NSMutableArray* batch = [NSMutableArray arrayWithCapacity: kBatchSize];
+            for (NSUInteger j = i; j < i + kBatchSize; j++) {
+                [batch addObject: @{@"type":  @"employee",
+                                    @"name":  [self nameValue: j],
+                                    @"age":   @([self ageValue: j]),
+                                    @"hired": @([self hiredValue: j])}];
+            }
+            NSError* error;
+            Assert([db putDocuments: batch error: &error], @"putDocuments failed: %@", error);
+        }
+    }
+    NSTimeInterval bulkTime = CFAbsoluteTimeGetCurrent() - start;
+    AssertEq(db.documentCount, 2*kNumDocs);
+
+    Log(@"Saving %lu docs one at a time took %.3f sec (%.0f docs/sec); in batches of %lu took"
+        " %.3f sec (%.0f docs/sec)",
+        (unsigned long)kNumDocs, singleTime, kNumDocs/singleTime,
+        (unsigned long)kBatchSize, bulkTime, kNumDocs/bulkTime);
+}
+
+
+// Compares loading docs with -documentsWithIDs: to loading them one at a time.
+- (void)testDocumentsWithIDs {
+    static const NSUInteger kNumDocs = 20000;
+
+    NSMutableArray* docIDs = [NSMutableArray arrayWithCapacity: kNumDocs];
+    [db inTransaction:^BOOL{
+        for (NSUInteger i = 0; i < kNumDocs; i++) {
+            @autoreleasepool {
+                CBLDocument* doc = [db createDocument];
+                NSError* error;
+                Assert([doc putProperties: @{@"name": [self nameValue: i],
+                                             @"age": @([self ageValue: i])}
+                                    error: &error]);
+                [docIDs addObject: doc.documentID];
+            }
+        }
+        return YES;
+    }];
+    // Read them in a different order than they were created:
+    [docIDs sortUsingSelector: @selector(compare:)];
+
+    [db _clearDocumentCache];
+    NSTimeInterval start = CFAbsoluteTimeGetCurrent();
+    for (NSString* docID in docIDs) {
+        @autoreleasepool {
+            Assert([db existingDocumentWithID: docID].properties);
+        }
+    }
+    NSTimeInterval singleTime = CFAbsoluteTimeGetCurrent() - start;
+
+    [db _clearDocumentCache];
+    start = CFAbsoluteTimeGetCurrent();
+    NSError* error;
+    NSArray* docs = [db documentsWithIDs: docIDs error: &error];
+    Assert(docs, @"documentsWithIDs failed: %@", error);
+    for (CBLDocument* doc in docs)
+        Assert(doc.properties);
+    NSTimeInterval bulkTime = CFAbsoluteTimeGetCurrent() - start;
+
+    Log(@"Loading %lu docs one at a time took %.3f sec (%.0f docs/sec); all at once took"
+        " %.3f sec (%.0f docs/sec)",
+        (unsigned long)kNumDocs, singleTime, kNumDocs/singleTime, bulkTime, kNumDocs/bulkTime);
+}
+
+
+// Reports the storage saved, and the time it costs, by compressing JSON attachments.
+- (void)testCompressedAttachments {
+    static const NSUInteger kNumDocs = 200;
+
+    NSMutableArray* records = [NSMutableArray array];
+    for (NSUInteger i = 0; i < 500; i++) {
+        [records addObject: @{@"type":  @"employee",
+                              @"name":  [self nameValue: i],
+                              @"age":   @([self ageValue: i]),
+                              @"hired": @([self hiredValue: i])}];
+    }
+    NSData* json = [CBLJSON dataWithJSONObject: records options: 0 error: NULL];
+
+    for (int compress = 0; compress <= 1; compress++) {
+        db.attachmentCompressionPolicy = compress ? [CBLDatabase defaultAttachmentCompressionPolicy]
+                                                  : nil;
+        UInt64 startSize = db.attachmentStore.totalDataSize;
+        NSTimeInterval start = CFAbsoluteTimeGetCurrent();
+        [db inTransaction:^BOOL{
+            for (NSUInteger i = 0; i < kNumDocs; i++) {
+                @autoreleasepool {
+                    // Vary each body so it isn't deduplicated:
+                    NSMutableData* body = [json mutableCopy];
+                    [body appendData: [$sprintf(@"\n%d %lu", compress, (unsigned long)i)
+                                       dataUsingEncoding: NSUTF8StringEncoding]];
+                    CBLUnsavedRevision* rev = [[db createDocument] newRevision];
+                    [rev setAttachmentNamed: @"records.json" withContentType: @"application/json"
+                                    content: body];
+                    NSError* error;
+                    Assert([rev save: &error], @"Save failed: %@", error);
+                }
+            }
+            return YES;
+        }];
+        NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+        UInt64 stored = db.attachmentStore.totalDataSize - startSize;
+        Log(@"%@: %lu x %lu-byte JSON attachments stored in %llu bytes (%.0f%%), in %.3f sec",
+            (compress ? @"gzip" : @"plain"), (unsigned long)kNumDocs, (unsigned long)json.length,
+            stored, 100.0 * stored / (kNumDocs * json.length), duration);
+    }
+}
+
+
+- (void) testContentCodings {
+    static const NSUInteger kNumDocs = 5000;
+    [db inTransaction:^BOOL{
+        for (NSUInteger i = 0; i < kNumDocs; i++)
+            [self insertObject: i];
+        return YES;
+    }];
+
+    // Build a _changes feed response and a _bulk_docs request body from the docs:
+    NSMutableArray* results = $marray(), *docs = $marray();
+    for (CBLQueryRow* row in [[db createAllDocumentsQuery] run: NULL]) {
+        [results addObject: $dict({@"seq", @(results.count + 1)},
+                                  {@"id", row.documentID},
+                                  {@"changes", @[$dict({@"rev", row.documentRevisionID})]})];
+        [docs addObject: row.document.properties];
+    }
+    NSDictionary* payloads = @{@"_changes": $dict({@"results", results},
+                                                  {@"last_seq", @(results.count)}),
+                               @"_bulk_docs": $dict({@"docs", docs},
+                                                    {@"new_edits", $false})};
+
+    static const int kReps = 10;
+    for (NSString* name in payloads) {
+        NSData* json = [CBLJSON dataWithJSONObject: payloads[name] options: 0 error: NULL];
+        for (int level = 0; level <= 9; level += 3) {
+            // level 0 stands for the incremental codec at the default level, for comparison:
+            __block NSMutableData* compressed;
+            CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+            for (int i = 0; i < kReps; i++) {
+                if (level > 0) {
+                    compressed = [[CBLGZip dataByCompressingData: json level: level] mutableCopy];
+                } else {
+                    compressed = [NSMutableData data];
+                    CBLGZip* codec = [[CBLGZip alloc] initForCompressing: YES];
+                    void (^onOutput)(const void*,size_t) = ^(const void* bytes, size_t len) {
+                        [compressed appendBytes: bytes length: len];
+                    };
+                    [codec addBytes: json.bytes length: json.length onOutput: onOutput];
+                    [codec addBytes: NULL length: 0 onOutput: onOutput];
+                }
+            }
+            CFAbsoluteTime compressTime = (CFAbsoluteTimeGetCurrent() - start) / kReps;
+
+            NSData* decompressed;
+            start = CFAbsoluteTimeGetCurrent();
+            for (int i = 0; i < kReps; i++)
+                decompressed = [CBLGZip dataByDecompressingData: compressed];
+            CFAbsoluteTime decompressTime = (CFAbsoluteTimeGetCurrent() - start) / kReps;
+            AssertEqual(decompressed, json);
+
+            Log(@"%@ (%lu bytes), %@: %.0f%%, compress %.0f MB/sec, decompress %.0f MB/sec",
+                name, (unsigned long)json.length,
+                (level > 0 ? $sprintf(@"level %d", level) : @"incremental"),
+                100.0 * compressed.length / json.length,
+                json.length / compressTime / 1.0e6, json.length / decompressTime / 1.0e6);
+        }
+    }
+}
+
+// Reports the file size, and the save/load throughput, of documents stored compressed vs. plain.
+- (void)testCompressedDocuments {
+    static const NSUInteger kNumDocs = 5000;
+
+    for (int compress = 0; compress <= 1; compress++) {
+        CBLDatabaseOptions* options = [CBLDatabaseOptions new];
+        options.create = YES;
+        options.storageType = kCBLSQLiteStorage;
+        options.compressDocuments = compress;
+        NSError* error;
+        CBLDatabase* bench = [dbmgr openDatabaseNamed: (compress ? @"compressed" : @"plain")
+                                          withOptions: options error: &error];
+        Assert(bench, @"Couldn't open db: %@", error);
+
+        NSTimeInterval start = CFAbsoluteTimeGetCurrent();
+        [bench inTransaction:^BOOL{
+            for (NSUInteger i = 0; i < kNumDocs; i++) {
+                @autoreleasepool {
+                    NSMutableArray* history = [NSMutableArray array];
+                    for (NSUInteger j = 0; j < 40; j++)
+                        [history addObject: @{@"type": @"review", @"score": @((i + j) % 5),
+                                              @"reviewer": [self nameValue: i + j],
+                                              @"comment": @"Meets expectations in all areas."}];
+                    NSDictionary* properties = @{@"type":  @"employee",
+                                                 @"name":  [self nameValue: i],
+                                                 @"age":   @([self ageValue: i]),
+                                                 @"hired": @([self hiredValue: i]),
+                                                 @"reviews": history};
+                    Assert([[bench createDocument] putProperties: properties error: &error]);
+                }
+            }
+            return YES;
+        }];
+        NSTimeInterval saveTime = CFAbsoluteTimeGetCurrent() - start;
+
+        // Compacting trains the dictionary and recompresses the bodies with it:
+        start = CFAbsoluteTimeGetCurrent();
+        Assert([bench compact: &error]);
+        NSTimeInterval compactTime = CFAbsoluteTimeGetCurrent() - start;
+        NSDictionary* info = bench.compactionInfo;
+        UInt64 fileSize = [info[@"page_count"] unsignedLongLongValue]
+                        * [info[@"page_size"] unsignedLongLongValue];
+
+        start = CFAbsoluteTimeGetCurrent();
+        CBLQuery* query = [bench createAllDocumentsQuery];
+        query.prefetch = YES;
+        NSUInteger count = 0;
+        for (CBLQueryRow* row in [query run: &error]) {
+            if (row.documentProperties)
+                ++count;
+        }
+        AssertEq(count, kNumDocs);
+        NSTimeInterval loadTime = CFAbsoluteTimeGetCurrent() - start;
+
+        Log(@"%@: %lu docs in %llu bytes; saved in %.3f sec (%.0f docs/sec), compacted in %.3f sec,"
+            " loaded in %.3f sec (%.0f docs/sec)",
+            (compress ? @"compressed" : @"plain"), (unsigned long)kNumDocs, fileSize,
+            saveTime, kNumDocs/saveTime, compactTime, loadTime, kNumDocs/loadTime);
+        Assert([bench deleteDatabase: &error]);
+    }
+}
+
+
+// Reports the indexing time of map functions that look at only a few properties of large docs,
+// compared to one that looks at all of them. (Unread properties are never parsed.)
+- (void)testIndexingSelectiveMaps {
+    static const NSUInteger kNumDocs = 5000;
+
+    [db inTransaction:^BOOL{
+        for (NSUInteger i = 0; i < kNumDocs; i++) {
+            @autoreleasepool {
+                NSMutableDictionary* properties = [@{@"type":  @"employee",
+                                                     @"name":  [self nameValue: i],
+                                                     @"age":   @([self ageValue: i])} mutableCopy];
+                for (NSUInteger j = 0; j < 50; j++)
+                    properties[$sprintf(@"field%02lu", (unsigned long)j)] =
+                        @{@"score": @((i + j) % 5), @"reviewer": [self nameValue: i + j],
+                          @"tags": @[@"one", @"two", @"three"]};
+                NSError* error;
+                Assert([[db createDocument] putProperties: properties error: &error]);
+            }
+        }
+        return YES;
+    }];
+
+    NSDictionary* maps = @{
+        @"byName": MAPBLOCK({
+            if ($equal(doc[@"type"], @"employee"))
+                emit(doc[@"name"], nil);
+        }),
+        @"byAge": MAPBLOCK({
+            emit(@[doc[@"age"], doc[@"name"]], doc[@"field07"]);
+        }),
+        @"everything": MAPBLOCK({
+            NSUInteger n = 0;
+            for (NSString* key in doc)
+                n += (doc[key] != nil);
+            emit(doc[@"name"], @(n));
+        }),
+    };
+    for (NSString* name in @[@"byName", @"byAge", @"everything"]) {
+        CBLView* view = [db viewNamed: name];
+        [view setMapBlock: maps[name] version: @"1"];
+        NSTimeInterval start = CFAbsoluteTimeGetCurrent();
+        [view updateIndex];
+        NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+        AssertEq(view.totalRows, kNumDocs);
+        Log(@"Indexing %lu docs with map '%@' took %.3f sec (%.0f docs/sec)",
+            (unsigned long)kNumDocs, name, duration, kNumDocs/duration);
+    }
+}
+
+
+// Streams blobs of increasing size through a writer, 1MB at a time, with and without encryption.
+- (void) testBlobWriterThroughput {
+    NSMutableData* chunk = [NSMutableData dataWithLength: 1024*1024];
+    SecRandomCopyBytes(kSecRandomDefault, chunk.length, chunk.mutableBytes);
+    for (int encrypt = 0; encrypt <= 1; encrypt++) {
+        NSString* storePath = [NSTemporaryDirectory()
+                                    stringByAppendingPathComponent: @"CBL_BlobStoreBenchmark"];
+        [[NSFileManager defaultManager] removeItemAtPath: storePath error: NULL];
+        NSError* error;
+        CBL_BlobStore* store = [[CBL_BlobStore alloc] initWithPath: storePath
+                                    encryptionKey: (encrypt ? [CBLSymmetricKey new] : nil)
+                                            error: &error];
+        Assert(store, @"Couldn't create CBL_BlobStore: %@", error.my_compactDescription);
+        for (NSUInteger megs = 1; megs <= 1024; megs *= 4) {
+            for (int md5 = 1; md5 >= 0; md5--) {
+                CBL_BlobStoreWriter* writer = [[CBL_BlobStoreWriter alloc] initWithStore: store];
+                writer.computesMD5 = md5;
+                CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+                for (NSUInteger i = 0; i < megs; i++)
+                    [writer appendData: chunk];
+                [writer finish];
+                CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+                Log(@"%4luMB %s%s: %.3f sec, %6.1f MB/sec",
+                    (unsigned long)megs, (encrypt ? "encrypted " : ""),
+                    (md5 ? "SHA-1+MD5" : "SHA-1"), elapsed, megs / elapsed);
+                AssertEq(writer.bytesWritten, megs * chunk.length);
+                [writer cancel];
+            }
+        }
+        store = nil;
+        [[NSFileManager defaultManager] removeItemAtPath: storePath error: NULL];
+    }
+}
+
+
 @end
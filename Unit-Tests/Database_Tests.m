@@ -8,6 +8,7 @@
 
 #import "CBLTestCase.h"
 #import "CBLInternal.h"
+#import "CBL_SQLiteStorage.h"
 
 
 @interface Database_Tests : CBLTestCaseWithDB
@@ -477,6 +478,97 @@
 }
 
 
+- (void) test076_PutDocuments {
+    __block NSUInteger notifications = 0;
+    id observer = [[NSNotificationCenter defaultCenter]
+                                            addObserverForName: kCBLDatabaseChangeNotification
+                                                        object: db
+                                                         queue: nil
+                                                    usingBlock: ^(NSNotification *note) {
+                                                        ++notifications;
+                                                    }];
+    NSError* error;
+    NSArray* revs = [db putDocuments: @[@{@"_id": @"a", @"n": @1},
+                                        @{@"_id": @"b", @"n": @2},
+                                        @{@"n": @3}]
+                               error: &error];
+    Assert(revs, @"putDocuments failed: %@", error);
+    AssertEq(revs.count, 3u);
+    AssertEqual([revs[0] document].documentID, @"a");
+    AssertEqual([revs[1] document].documentID, @"b");
+    NSString* newDocID = [revs[2] document].documentID;
+    Assert(newDocID.length > 0);
+    AssertEqual([db documentWithID: newDocID][@"n"], @3);
+    AssertEq(db.documentCount, 3u);
+    AssertEq(notifications, 1u);    // all the changes are posted at once
+
+    // Update one doc and delete another; the same doc can appear twice:
+    revs = [db putDocuments: @[@{@"_id": @"a", @"_rev": [revs[0] revisionID], @"n": @10},
+                               @{@"_id": @"b", @"_rev": [revs[1] revisionID], @"_deleted": @YES},
+                               @{@"_id": @"c", @"n": @4},
+                               @{@"_id": @"c", @"n": @5}]
+                      error: &error];
+    AssertNil(revs);    // the 2nd "c" has no "_rev" so it conflicts with the 1st
+    AssertEq(CBLStatusFromNSError(error, 0), kCBLStatusConflict);
+    // ...and the whole batch was backed out:
+    AssertEqual([db documentWithID: @"a"][@"n"], @1);
+    Assert(![db documentWithID: @"b"].isDeleted);
+    AssertNil([db existingDocumentWithID: @"c"]);
+
+    CBLDocument* docA = [db documentWithID: @"a"];
+    revs = [db putDocuments: @[@{@"_id": @"a", @"_rev": docA.currentRevisionID, @"n": @10},
+                               @{@"_id": @"b", @"_rev": [db documentWithID: @"b"].currentRevisionID,
+                                 @"_deleted": @YES}]
+                      error: &error];
+    Assert(revs, @"putDocuments failed: %@", error);
+    AssertEqual(docA[@"n"], @10);
+    AssertEqual(docA.currentRevision, revs[0]);
+    Assert([db documentWithID: @"b"].isDeleted);
+    AssertEq(db.documentCount, 2u);
+
+    [[NSNotificationCenter defaultCenter] removeObserver: observer];
+}
+
+
+- (void) test077_DocumentsWithIDs {
+    NSError* error;
+    NSMutableArray* docs = [NSMutableArray array];
+    for (int i = 0; i < 10; i++)
+        [docs addObject: @{@"_id": $sprintf(@"doc-%d", i), @"n": @(i)}];
+    Assert([db putDocuments: docs error: &error], @"putDocuments failed: %@", error);
+    Assert([[db documentWithID: @"doc-3"] deleteDocument: &error]);
+    [db _clearDocumentCache];
+
+    NSArray* ids = @[@"doc-7", @"nope", @"doc-3", @"doc-1", @"doc-7"];
+    NSArray* result = [db documentsWithIDs: ids error: &error];
+    Assert(result, @"documentsWithIDs failed: %@", error);
+    AssertEq(result.count, ids.count);
+    for (NSUInteger i = 0; i < ids.count; i++)
+        AssertEqual([result[i] documentID], ids[i]);
+    AssertEqual(result[0][@"n"], @7);
+    AssertNil([result[1] currentRevision]);
+    AssertNil([result[2] currentRevision]);     // deleted
+    AssertEqual(result[3][@"n"], @1);
+    Assert(result[4] == result[0]);
+    Assert(result[0] == [db existingDocumentWithID: @"doc-7"]);
+
+    // Storage-level lookup, without bodies:
+    CBLStatus status;
+    NSArray* revs = [db.storage getDocumentsWithIDs: ids withBody: NO status: &status];
+    AssertEq(revs.count, ids.count);
+    AssertEqual([revs[0] revIDString], [result[0] currentRevisionID]);
+    AssertNil([revs[0] body]);
+    AssertEqual(revs[1], [NSNull null]);
+    AssertEqual(revs[2], [NSNull null]);
+
+    if (self.isSQLiteDB) {
+        // The IDs don't stay behind in the lookup table:
+        CBL_SQLiteStorage* storage = (CBL_SQLiteStorage*)db.storage;
+        AssertEq([storage.fmdb intForQuery: @"SELECT count(*) FROM temp.lookup_docids"], 0);
+    }
+}
+
+
 - (void) test08_SaveDocumentWithNaNProperty {
     NSDictionary* properties = @{@"aNumber": [NSDecimalNumber notANumber]};
     CBLDocument* doc = [db createDocument];
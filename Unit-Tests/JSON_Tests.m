@@ -10,6 +10,8 @@
 #import "CBLJSON.h"
 #import "CBJSONEncoder.h"
 #import "CBLJSONReader.h"
+#import "CBLMisc.h"
+#include "yajl/yajl_gen.h"
 
 
 @interface CBL_GenericObjectMatcher : CBLJSONMatcher
@@ -183,6 +185,274 @@ static NSString* canonicalString(id obj) {
 }
 
 
+#pragma mark - REFERENCE ENCODER
+
+
+// The original yajl_gen-based encoder, which CBJSONEncoder's output has to match byte for byte,
+// since canonical JSON is what revision IDs are digested from. (Unlike the original, it checks
+// the status of opening an array or object, since yajl_gen can't nest any deeper after an error.)
+static yajl_gen_status yajlEncode(yajl_gen gen, id object, BOOL canonical,
+                                  CBJSONEncoderKeyFilter keyFilter, NSError** outError)
+{
+    if ([object isKindOfClass: [NSString class]]) {
+        __block yajl_gen_status status = yajl_gen_invalid_string;
+        CBLWithStringBytes(object, ^(const char *chars, size_t len) {
+            status = yajl_gen_string(gen, (const unsigned char*)chars, len);
+        });
+        return status;
+    } else if ([object isKindOfClass: [NSNumber class]]) {
+        NSNumber* number = object;
+        char ctype = number.objCType[0];
+        switch (ctype) {
+            case 'c': {
+                if (number == (id)kCFBooleanTrue)
+                    return yajl_gen_bool(gen, true);
+                else if (number == (id)kCFBooleanFalse)
+                    return yajl_gen_bool(gen, false);
+                else
+                    return yajl_gen_integer(gen, number.longLongValue);
+            }
+            case 'f':
+            case 'd': {
+                double n = number.doubleValue;
+                char str[32];
+                if (isnan(n) || isinf(n))
+                    return yajl_gen_invalid_number;
+                unsigned len = sprintf(str, (ctype=='f' ? "%.6g" : "%.16g"), n);
+                if (strspn(str, "0123456789-") == strlen(str)) {
+                    strcat(str, ".0");
+                    len += 2;
+                }
+                return yajl_gen_number(gen, str, len);
+            }
+            case 'Q': {
+                char str[32];
+                unsigned len = sprintf(str, "%llu", number.unsignedLongLongValue);
+                return yajl_gen_number(gen, str, len);
+            }
+            default:
+                return yajl_gen_integer(gen, number.longLongValue);
+        }
+    } else if ([object isKindOfClass: [NSNull class]]) {
+        return yajl_gen_null(gen);
+    } else if ([object isKindOfClass: [NSArray class]]) {
+        yajl_gen_status status = yajl_gen_array_open(gen);
+        if (status)
+            return status;
+        for (id item in object) {
+            status = yajlEncode(gen, item, canonical, nil, NULL);
+            if (status)
+                return status;
+        }
+        return yajl_gen_array_close(gen);
+    } else {
+        NSDictionary* dict = object;
+        yajl_gen_status status = yajl_gen_map_open(gen);
+        if (status)
+            return status;
+        id keys = dict;
+        if (canonical && dict.count > 1) {
+            keys = [dict.allKeys sortedArrayUsingComparator: ^NSComparisonResult(id s1, id s2) {
+                return [s1 compare: s2 options: NSLiteralSearch];
+            }];
+        }
+        for (NSString* key in keys) {
+            if (keyFilter) {
+                NSError* error = nil;
+                if (!keyFilter(key, &error)) {
+                    if (error) {
+                        if (outError)
+                            *outError = error;
+                        return -1;
+                    }
+                    continue;
+                }
+            }
+            status = yajlEncode(gen, key, canonical, nil, NULL);
+            if (status)
+                return status;
+            status = yajlEncode(gen, dict[key], canonical, nil, NULL);
+            if (status)
+                return status;
+        }
+        return yajl_gen_map_close(gen);
+    }
+}
+
+static NSData* yajlEncoding(id object, BOOL canonical, CBJSONEncoderKeyFilter keyFilter) {
+    yajl_gen gen = yajl_gen_alloc(NULL);
+    if (!gen)
+        return nil;
+    NSData* result = nil;
+    if (yajlEncode(gen, object, canonical, keyFilter, NULL) == yajl_gen_status_ok) {
+        const uint8_t* buf;
+        size_t len;
+        yajl_gen_get_buf(gen, &buf, &len);
+        result = [NSData dataWithBytes: buf length: len];
+    }
+    yajl_gen_free(gen);
+    return result;
+}
+
+
+static NSString* randomString(void) {
+    static const unichar kChars[] = {'a', 'Z', '0', ' ', '/', '"', '\\', '\n', '\r', '\t', '\b',
+                                     '\f', 0x01, 0x1F, 0x00, 0x7F, 0xE9, 0x6F22, 0xD83D, 0xDE00};
+    NSUInteger len = random() % 24;
+    unichar chars[24];
+    for (NSUInteger i = 0; i < len; i++) {
+        unichar c = kChars[random() % (sizeof(kChars)/sizeof(kChars[0]))];
+        if (c == 0xD83D || c == 0xDE00) {
+            // Only emit complete surrogate pairs:
+            if (i + 1 == len)
+                c = 'x';
+            else {
+                chars[i++] = 0xD83D;
+                c = 0xDE00;
+            }
+        }
+        chars[i] = c;
+    }
+    NSString* str = [[NSString alloc] initWithCharacters: chars length: len];
+    if (random() % 4 == 0)
+        return [str mutableCopy];
+    else if (random() % 2)
+        return [NSString stringWithUTF8String: str.UTF8String] ?: str;   // may have a C string ptr
+    return str;
+}
+
+static id randomJSONObject(unsigned depth) {
+    // Keys come from a small pool so that dictionaries often share key sets:
+    static NSString* const kKeys[] = {@"_id", @"_rev", @"type", @"name", @"abv", @"", @"Zed",
+                                      @"z", @"é", @"a\"b", @"_attachments", @"updated"};
+    switch (random() % (depth < 4 ? 12 : 9)) {
+        case 0:  return @((int)random() - RAND_MAX/2);
+        case 1:  return @(((long long)random() << 32 | random()) * (random() % 2 ? 1 : -1));
+        case 2:  return @(UINT64_MAX - random());
+        case 3:  return @(random() / (double)(random() + 1) * (random() % 2 ? 1e-10 : 1e10));
+        case 4:  return @((float)random() / 1000.0f);
+        case 5:  return random() % 2 ? @YES : @NO;
+        case 6:  return [NSNumber numberWithChar: (char)random()];
+        case 7:  return random() % 2 ? [NSNull null] : [NSDecimalNumber decimalNumberWithString: @"12.5"];
+        case 8:  return randomString();
+        case 9:
+        case 10: {
+            NSMutableDictionary* dict = [NSMutableDictionary dictionary];
+            NSUInteger n = random() % 8;
+            for (NSUInteger i = 0; i < n; i++) {
+                NSString* key = (random() % 5) ? kKeys[random() % 12] : randomString();
+                dict[key] = randomJSONObject(depth + 1);
+            }
+            return random() % 2 ? [dict copy] : dict;
+        }
+        default: {
+            NSMutableArray* array = [NSMutableArray array];
+            NSUInteger n = random() % 6;
+            for (NSUInteger i = 0; i < n; i++)
+                [array addObject: randomJSONObject(depth + 1)];
+            return array;
+        }
+    }
+}
+
+- (void) test_CBJSONEncoder_MatchesYajl {
+    // The encoder's output has to be byte-for-byte identical to the old yajl-based encoder's,
+    // since canonical JSON is what revision IDs are digested from.
+    srandom(42);
+    for (int i = 0; i < 20000; i++) {
+        @autoreleasepool {
+            id obj = randomJSONObject(0);
+            for (int canonical = 0; canonical <= 1; canonical++) {
+                NSError* error;
+                NSData* json = canonical ? [CBJSONEncoder canonicalEncoding: obj error: &error]
+                                         : [CBJSONEncoder encode: obj error: &error];
+                Assert(json, @"Couldn't encode %@: %@", obj, error);
+                NSData* expected = yajlEncoding(obj, canonical, nil);
+                AssertEqual(json, expected, @"Encodings of %@ differ: `%@` vs `%@`", obj,
+                            [json my_UTF8ToString], [expected my_UTF8ToString]);
+            }
+        }
+    }
+}
+
+static id nestedJSONObject(unsigned depth) {
+    id obj = @"bottom";
+    for (unsigned i = 0; i < depth; i++)
+        obj = (i % 2) ? @{@"k": obj} : @[@1, obj];
+    return obj;
+}
+
+- (void) test_CBJSONEncoder_MatchesYajl_Depth {
+    // Both stop at the same nesting depth:
+    for (unsigned depth = 127; depth <= 129; depth++) {
+        id obj = nestedJSONObject(depth);
+        for (int canonical = 0; canonical <= 1; canonical++) {
+            NSError* error;
+            NSData* json = canonical ? [CBJSONEncoder canonicalEncoding: obj error: &error]
+                                     : [CBJSONEncoder encode: obj error: &error];
+            AssertEqual(json, yajlEncoding(obj, canonical, nil), @"Depth %u", depth);
+            if (depth < 128) {
+                Assert(json, @"Couldn't encode depth %u: %@", depth, error);
+            } else {
+                AssertNil(json);
+                AssertEqual(error.domain, CBJSONEncoderErrorDomain);
+                AssertEq(error.code, yajl_max_depth_exceeded);
+            }
+        }
+    }
+}
+
+- (void) test_CBJSONEncoder_MatchesYajl_KeyFilter {
+    // A key filter only applies to the top-level dictionary's keys:
+    CBJSONEncoderKeyFilter filter = ^BOOL(NSString* key, NSError** outError) {
+        return ![key hasPrefix: @"_"];
+    };
+    srandom(42);
+    for (int i = 0; i < 2000; i++) {
+        @autoreleasepool {
+            NSDictionary* obj = @{@"_id": randomJSONObject(1), @"_rev": randomJSONObject(1),
+                                  @"type": randomJSONObject(1), @"name": randomJSONObject(1),
+                                  @"nested": @{@"_id": randomJSONObject(1),
+                                               @"x": randomJSONObject(1)}};
+            for (int canonical = 0; canonical <= 1; canonical++) {
+                CBJSONEncoder* encoder = [[CBJSONEncoder alloc] init];
+                encoder.canonical = canonical;
+                encoder.keyFilter = filter;
+                Assert([encoder encode: obj], @"Couldn't encode %@: %@", obj, encoder.error);
+                NSData* expected = yajlEncoding(obj, canonical, filter);
+                AssertEqual(encoder.encodedData, expected, @"Encodings of %@ differ", obj);
+            }
+        }
+    }
+
+    // A filter error stops both:
+    NSDictionary* obj = @{@"a": @1, @"b": @[@2], @"c": @{@"d": @3}};
+    CBJSONEncoderKeyFilter failing = ^BOOL(NSString* key, NSError** outError) {
+        if ([key isEqualToString: @"b"]) {
+            *outError = [NSError errorWithDomain: @"Bar" code: 847 userInfo: nil];
+            return NO;
+        }
+        return YES;
+    };
+    CBJSONEncoder* encoder = [[CBJSONEncoder alloc] init];
+    encoder.canonical = YES;
+    encoder.keyFilter = failing;
+    Assert(![encoder encode: obj]);
+    AssertEq(encoder.error.code, 847);
+    AssertNil(yajlEncoding(obj, YES, failing));
+
+    // ...as does nesting too deep below a filtered dictionary:
+    encoder = [[CBJSONEncoder alloc] init];
+    encoder.keyFilter = filter;
+    Assert(![encoder encode: @{@"deep": nestedJSONObject(127)}]);
+    AssertNil(yajlEncoding(@{@"deep": nestedJSONObject(127)}, NO, filter));
+    encoder = [[CBJSONEncoder alloc] init];
+    encoder.keyFilter = filter;
+    Assert([encoder encode: @{@"deep": nestedJSONObject(126)}]);
+    AssertEqual(encoder.encodedData, yajlEncoding(@{@"deep": nestedJSONObject(126)}, NO, filter));
+}
+
+
 - (void) test_CBJSONEncoderBenchmark {
     id obj = [CBLJSON JSONObjectWithData: [self contentsOfTestFile: @"beer.json"] options: 0 error: NULL];
     [self measureBlock:^{
@@ -195,6 +465,30 @@ static NSString* canonicalString(id obj) {
     }];
 }
 
+- (void) test_CBJSONEncoderCanonicalBenchmark {
+    id obj = [CBLJSON JSONObjectWithData: [self contentsOfTestFile: @"beer.json"] options: 0 error: NULL];
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            @autoreleasepool {
+                NSError* error;
+                Assert([CBJSONEncoder canonicalEncoding: obj error: &error]);
+            }
+        }
+    }];
+}
+
+- (void) test_YajlEncoderCanonicalBenchmark {
+    // Baseline for the above: the original yajl-based encoder.
+    id obj = [CBLJSON JSONObjectWithData: [self contentsOfTestFile: @"beer.json"] options: 0 error: NULL];
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            @autoreleasepool {
+                Assert(yajlEncoding(obj, YES, nil));
+            }
+        }
+    }];
+}
+
 - (void) test_NSJSONEncoderBenchmark {
     id obj = [CBLJSON JSONObjectWithData: [self contentsOfTestFile: @"beer.json"] options: 0 error: NULL];
     [self measureBlock:^{
@@ -223,6 +517,145 @@ static NSString* canonicalString(id obj) {
 }
 
 
+- (void) test_CBLJSONReader_Objects {
+    NSArray* inputs = @[@"{}", @"[]", @" [1, -2, 3.25, -4e-3, 0, true, false, null] ",
+                        @"{\"a\": {\"b\": [[], {}, [{}]]}, \"\": \"\"}",
+                        @"[\"\\\\\", \"\\\\\\\"\", \"\\\\\\\\\", \"x\\ty\\u00e9\\ud83c\\udf7a\\/\"]",
+                        @"[9223372036854775807, -9223372036854775808, 1e300]",
+                        [[self contentsOfTestFile: @"beer.json"] my_UTF8ToString]];
+    for (NSString* input in inputs) {
+        NSData* json = [input dataUsingEncoding: NSUTF8StringEncoding];
+        id expected = [NSJSONSerialization JSONObjectWithData: json options: 0 error: NULL];
+        id result = [CBLJSONReader objectWithBytes: json.bytes length: json.length options: 0];
+        AssertEqual(result, expected, @"for %@", input);
+    }
+
+    // Quotes and backslashes on either side of the 64-byte block boundaries:
+    for (NSUInteger pad = 0; pad < 70; pad++) {
+        NSString* input = $sprintf(@"[\"%@\\\\\", \"\\\"\", \"%@\\\\\\\"{\"]",
+                                   [@"" stringByPaddingToLength: pad withString: @"x" startingAtIndex: 0],
+                                   [@"" stringByPaddingToLength: 2*pad withString: @"\\" startingAtIndex: 0]);
+        NSData* json = [input dataUsingEncoding: NSUTF8StringEncoding];
+        AssertEqual([CBLJSONReader objectWithBytes: json.bytes length: json.length options: 0],
+                    [NSJSONSerialization JSONObjectWithData: json options: 0 error: NULL],
+                    @"for %@", input);
+    }
+
+    for (NSString* bad in @[@"", @" ", @"[1,]", @"{,}", @"[1 2]", @"{\"a\" 1}", @"[}", @"{\"a\":1]",
+                            @"\"abc", @"[\"a\\\"]", @"{}{}", @"[01]", @"[1.]", @"[-]", @"[tru]",
+                            @"[\"\\x\"]", @"[\"\\ud800\"]", @"[\"a\tb\"]", @"[1e999]"]) {
+        NSData* json = [bad dataUsingEncoding: NSUTF8StringEncoding];
+        AssertNil([CBLJSONReader objectWithBytes: json.bytes length: json.length options: 0],
+                  @"for %@", bad);
+    }
+
+    NSData* json = [@"{\"a\": [1]}" dataUsingEncoding: NSUTF8StringEncoding];
+    NSMutableDictionary* dict = [CBLJSONReader objectWithBytes: json.bytes length: json.length
+                                                       options: CBLJSONReadingMutableContainers];
+    [dict[@"a"] addObject: @2];
+    dict[@"b"] = @3;
+    AssertEqual(dict, (@{@"a": @[@1, @2], @"b": @3}));
+
+    json = [@" \"frag\"" dataUsingEncoding: NSUTF8StringEncoding];
+    AssertNil([CBLJSONReader objectWithBytes: json.bytes length: json.length options: 0]);
+    AssertEqual([CBLJSONReader objectWithBytes: json.bytes length: json.length
+                                       options: CBLJSONReadingAllowFragments], @"frag");
+}
+
+
+- (void) test_CBLJSONReader_Streaming {
+    NSData* json = [self contentsOfTestFile: @"beer.json"];
+    id expected = [NSJSONSerialization JSONObjectWithData: json options: 0 error: NULL];
+    for (size_t chunkSize = 1; chunkSize <= json.length; chunkSize = chunkSize * 3 + 1) {
+        CBL_GenericObjectMatcher* matcher = [[CBL_GenericObjectMatcher alloc] init];
+        CBLJSONReader* parser = [[CBLJSONReader alloc] initWithMatcher: matcher];
+        for (size_t pos = 0; pos < json.length; pos += chunkSize) {
+            Assert([parser parseBytes: (const uint8_t*)json.bytes + pos
+                               length: MIN(chunkSize, json.length - pos)]);
+        }
+        Assert([parser finish], @"Error: %@", parser.errorString);
+        AssertEqual([matcher end], expected);
+    }
+
+    CBLJSONReader* parser = [[CBLJSONReader alloc] initWithMatcher: [CBL_GenericObjectMatcher new]];
+    Assert([parser parseData: [@"{\"foo\": [1, " dataUsingEncoding: NSUTF8StringEncoding]]);
+    Assert(![parser parseData: [@"}" dataUsingEncoding: NSUTF8StringEncoding]]);
+    AssertEqual(parser.errorString, @"parse error: unexpected character at offset 12");
+}
+
+
+- (void) test_CBLJSONReaderBenchmark {
+    NSData* json = [self contentsOfTestFile: @"beer.json"];
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            @autoreleasepool {
+                Assert([CBLJSONReader objectWithBytes: json.bytes length: json.length options: 0]);
+            }
+        }
+    }];
+}
+
+- (void) test_NSJSONReaderBenchmark {
+    NSData* json = [self contentsOfTestFile: @"beer.json"];
+    [self measureBlock:^{
+        for (int i = 0; i < 10000; i++) {
+            @autoreleasepool {
+                Assert([NSJSONSerialization JSONObjectWithData: json options: 0 error: NULL]);
+            }
+        }
+    }];
+}
+
+
+#pragma mark - LAZY DICTIONARY
+
+
+- (void) test_CBLLazyDictionaryOfJSON {
+    NSString* const kJSON = @" {\"num\": -1.5e3, \"str\": \"a \\\"}\\\" b\", \"arr\": [1, [2], {\"x\": \"]\"}],"
+                             " \"dict\": {\"y\": null}, \"t\\u00e9\": true, \"_id\": \"old\", \"num\": 7}\n";
+    NSData* json = [kJSON dataUsingEncoding: NSUTF8StringEncoding];
+    NSDictionary* dict = [[CBLLazyDictionaryOfJSON alloc] initWithJSON: json
+                                                       extraProperties: @{@"_id": @"doc"}];
+    Assert(dict);
+    AssertEq(dict.count, 6u);
+    // Duplicate keys resolve to the last one, and extra properties override the JSON:
+    AssertEqual(dict[@"num"], @7);
+    AssertEqual(dict[@"_id"], @"doc");
+    AssertEqual(dict[@"str"], @"a \"}\" b");
+    AssertEqual(dict[@"t\u00e9"], @YES);
+    AssertNil(dict[@"missing"]);
+    AssertEqual(dict, (@{@"num": @7, @"str": @"a \"}\" b", @"arr": @[@1, @[@2], @{@"x": @"]"}],
+                         @"dict": @{@"y": [NSNull null]}, @"t\u00e9": @YES, @"_id": @"doc"}));
+    Assert(dict[@"arr"] == dict[@"arr"]);   // values are parsed only once
+
+    // It must round-trip through JSON:
+    AssertEqual([CBLJSON JSONObjectWithData: [CBLJSON dataWithJSONObject: dict options: 0 error: NULL]
+                                    options: 0 error: NULL],
+                dict);
+
+    AssertEq([[CBLLazyDictionaryOfJSON alloc] initWithJSON: [@"{}" dataUsingEncoding: NSUTF8StringEncoding]
+                                          extraProperties: nil].count, 0u);
+    for (NSString* bad in @[@"", @"[1]", @"\"x\"", @"{", @"{\"a\"}", @"{\"a\":}", @"{\"a\":1,}",
+                            @"{\"a\":[1}", @"{\"a\":1} x", @"{\"a\":\"1}",
+                            // Malformed values are caught up front, not when they're accessed:
+                            @"{\"a\":tru}", @"{\"a\":01}", @"{\"a\":1.}", @"{\"a\":[1 2]}",
+                            @"{\"a\":{\"b\" 1}}", @"{\"a\":\"\\x\"}", @"{\"a\":\"\\ud800\"}"]) {
+        AssertNil([[CBLLazyDictionaryOfJSON alloc] initWithJSON: [bad dataUsingEncoding: NSUTF8StringEncoding]
+                                                extraProperties: nil], @"for %@", bad);
+    }
+
+    // Invalid UTF-8 in a value:
+    NSMutableData* badUTF8 = [[@"{\"a\":\"x" dataUsingEncoding: NSUTF8StringEncoding] mutableCopy];
+    [badUTF8 appendBytes: "\xC3\"}" length: 3];
+    AssertNil([[CBLLazyDictionaryOfJSON alloc] initWithJSON: badUTF8 extraProperties: nil]);
+
+    // Once every value has been read, they're still the same objects:
+    for (NSString* key in dict)
+        Assert(dict[key] != nil);
+    Assert(dict[@"dict"] == dict[@"dict"]);
+}
+
+
 @end
 
 
@@ -9,9 +9,11 @@
 #import "CBLTestCase.h"
 #import "CBLMisc.h"
 #import "CBLSequenceMap.h"
+#import "CBL_Shared.h"
 #import "CBLFacebookAuthorizer.h"
 #import "CBLPersonaAuthorizer.h"
 #import "CBLSymmetricKey.h"
+#import "CBLGZip.h"
 #import "MYAnonymousIdentity.h"
 #import "MYURLUtils.h"
 
@@ -188,6 +190,47 @@ static int collateRevs(const char* rev1, const char* rev2) {
 }
 
 
+- (void) test_CBLDocIDCache {
+    CBL_DocIDCache* cache = [[CBL_DocIDCache alloc] initWithMemoryBudget: 256*1024];
+    AssertEq([cache numericIDForDocID: @"foo"], 0);
+    [cache setNumericID: 17 forDocID: @"foo"];
+    [cache setNumericID: 23 forDocID: @"bär"];
+    AssertEq([cache numericIDForDocID: @"foo"], 17);
+    AssertEq([cache numericIDForDocID: @"bär"], 23);
+    [cache setNumericID: 18 forDocID: @"foo"];
+    AssertEq([cache numericIDForDocID: @"foo"], 18);
+    [cache removeDocID: @"foo"];
+    AssertEq([cache numericIDForDocID: @"foo"], 0);
+    AssertEq([cache numericIDForDocID: @"bär"], 23);
+    AssertEq(cache.hits, 4ull);
+    AssertEq(cache.misses, 2ull);
+
+    // Fill it past its budget; the oldest entries get dropped, but not the newest:
+    static const SInt64 kNumDocs = 100000;
+    for (SInt64 i = 1; i <= kNumDocs; i++)
+        [cache setNumericID: i forDocID: $sprintf(@"doc-%lld", i)];
+    Assert(cache.memoryUsed <= cache.memoryBudget);
+    Assert(cache.count < kNumDocs);
+    AssertEq([cache numericIDForDocID: @"doc-1"], 0);
+    for (SInt64 i = kNumDocs - 500; i <= kNumDocs; i++)
+        AssertEq([cache numericIDForDocID: $sprintf(@"doc-%lld", i)], i);
+
+    // Preloading fills both generations, and stops when the cache is full rather than evicting:
+    [cache removeAllDocIDs];
+    AssertEq(cache.count, 0u);
+    SInt64 n = 0;
+    while ([cache preloadNumericID: n + 1 forDocID: $sprintf(@"doc-%lld", n + 1)])
+        ++n;
+    Assert(n > 1000);
+    AssertEq(cache.count, (NSUInteger)n);
+    Assert(cache.memoryUsed > cache.memoryBudget / 2);
+    Assert(cache.memoryUsed <= cache.memoryBudget);
+    for (SInt64 i = 1; i <= 1000; i++)
+        AssertEq([cache numericIDForDocID: $sprintf(@"doc-%lld", i)], i);
+    AssertEq([cache numericIDForDocID: $sprintf(@"doc-%lld", n)], n);
+}
+
+
 - (void) test_FacebookAuthorizer {
     NSString* token = @"pyrzqxgl";
     NSURL* site = [NSURL URLWithString: @"https://example.com/database"];
@@ -303,6 +346,69 @@ static int collateRevs(const char* rev1, const char* rev2) {
 }
 
 
+- (void) test_SymmetricKeyChunked {
+    CBLSymmetricKey* key = [[CBLSymmetricKey alloc] init];
+    NSMutableData* cleartext = [NSMutableData dataWithLength: 300000];
+    (void)SecRandomCopyBytes(kSecRandomDefault, cleartext.length, cleartext.mutableBytes);
+
+    // Incremental encryption, in pieces that don't line up with chunks:
+    CBLCryptorBlock encryptor = [key createChunkedEncryptor];
+    NSMutableData* ciphertext = [NSMutableData data];
+    for (NSUInteger pos = 0; pos < cleartext.length; pos += 7777) {
+        NSRange r = NSMakeRange(pos, MIN(7777u, cleartext.length - pos));
+        [ciphertext appendData: encryptor([cleartext subdataWithRange: r])];
+    }
+    [ciphertext appendData: encryptor(nil)];
+    Assert([CBLSymmetricKey isChunkedFormat: ciphertext]);
+    AssertEqual([key decryptData: ciphertext], cleartext);
+    AssertEqual([key decryptData: [key encryptDataInChunks: [NSData data]]], [NSData data]);
+
+    // Stream decryption:
+    NSInputStream* cryptoIn = [NSInputStream inputStreamWithData: ciphertext];
+    [cryptoIn open];
+    NSInputStream* in = [key decryptStream: cryptoIn];
+    NSMutableData* output = [NSMutableData data];
+    NSInteger bytesRead;
+    do {
+        uint8_t buf[4096];
+        bytesRead = [in read: buf maxLength: sizeof(buf)];
+        Assert(bytesRead >= 0);
+        [output appendBytes: buf length: bytesRead];
+    } while (bytesRead > 0);
+    AssertEqual(output, cleartext);
+
+    // Random access to a file:
+    NSString* path = [NSTemporaryDirectory() stringByAppendingPathComponent: @"chunked.test"];
+    Assert([ciphertext writeToFile: path atomically: YES]);
+    NSData<CBLDecryptedData>* contents = [key decryptedContentsOfFile: path];
+    AssertEq(contents.length, cleartext.length);
+    NSRange range = NSMakeRange(65000, 70000);      // spans 3 chunks
+    AssertEqual([contents subdataWithRange: range], [cleartext subdataWithRange: range]);
+    AssertEqual([contents decryptedDataInRange: range error: NULL],
+                [cleartext subdataWithRange: range]);
+    AssertEqual(contents, cleartext);
+
+    // Tampering is detected, and so is truncation:
+    NSMutableData* tampered = [ciphertext mutableCopy];
+    ((uint8_t*)tampered.mutableBytes)[100000] ^= 0x01;
+    AssertNil([key decryptData: tampered]);
+    Assert([tampered writeToFile: path atomically: YES]);
+    contents = [key decryptedContentsOfFile: path];
+    NSError* error;
+    AssertNil([contents decryptedDataInRange: range error: &error]);
+    AssertEq(error.code, NSFileReadCorruptFileError);
+    NSRange goodRange = NSMakeRange(0, 65536);      // only the tampered chunk is unreadable
+    AssertEqual([contents decryptedDataInRange: goodRange error: NULL],
+                [cleartext subdataWithRange: goodRange]);
+    AssertEqual([contents subdataWithRange: goodRange], [cleartext subdataWithRange: goodRange]);
+    XCTAssertThrowsSpecificNamed([contents subdataWithRange: range], NSException,
+                                 NSFileHandleOperationException);
+    NSData* truncated = [ciphertext subdataWithRange: NSMakeRange(0, 32 + 2*(65536 + 16))];
+    AssertNil([key decryptData: truncated]);
+    [[NSFileManager defaultManager] removeItemAtPath: path error: NULL];
+}
+
+
 - (void) test_AnonymousIdentity {
     NSError* error;
     MYDeleteAnonymousIdentity(@"CBLUnitTests");
@@ -371,4 +477,58 @@ static int collateRevs(const char* rev1, const char* rev2) {
 }
 
 
+
+- (void) test_ContentCoding {
+    NSMutableData* input = [NSMutableData data];
+    for (int i = 0; i < 2000; i++)
+        [input appendData: [$sprintf(@"{\"seq\":%d,\"id\":\"doc%d\"}\n", i, i % 97)
+                            dataUsingEncoding: NSUTF8StringEncoding]];
+    for (int level = -1; level <= 9; level++) {
+        NSData* compressed = [CBLGZip dataByCompressingData: input level: level];
+        Assert(compressed.length < input.length);
+        AssertEqual([CBLGZip dataByDecompressingData: compressed], input);
+    }
+    // Concatenated gzip members have a trailer that doesn't give the total length; all of them
+    // are decompressed:
+    NSData* compressed = [CBLGZip dataByCompressingData: input];
+    NSMutableData* twice = [compressed mutableCopy];
+    [twice appendData: compressed];
+    NSMutableData* expected = [input mutableCopy];
+    [expected appendData: input];
+    AssertEqual([CBLGZip dataByDecompressingData: twice], expected);
+    AssertEqual([CBLGZip dataByDecompressingData: [CBLGZip dataByCompressingData: [NSData data]]],
+                [NSData data]);
+
+    // Output bigger than the initial allocation limit, or than the trailer claims:
+    NSData* zeroes = [NSMutableData dataWithLength: 20*1024*1024];
+    AssertEqual([CBLGZip dataByDecompressingData: [CBLGZip dataByCompressingData: zeroes]], zeroes);
+    NSMutableData* lying = [compressed mutableCopy];
+    [lying appendData: [CBLGZip dataByCompressingData: [NSData dataWithBytes: "x" length: 1]]];
+    NSMutableData* lyingOutput = [input mutableCopy];
+    [lyingOutput appendBytes: "x" length: 1];
+    AssertEqual([CBLGZip dataByDecompressingData: lying], lyingOutput);
+
+    // Truncated data, and trailing data that isn't a gzip member, are errors:
+    [self allowWarningsIn: ^{
+        AssertNil([CBLGZip dataByDecompressingData:
+                                [compressed subdataWithRange: NSMakeRange(0, 100)]]);
+        NSMutableData* trailing = [compressed mutableCopy];
+        [trailing appendBytes: "garbage" length: 7];
+        AssertNil([CBLGZip dataByDecompressingData: trailing]);
+    }];
+
+    // Negotiation:
+    CBLContentCoding* gzip = [CBLContentCoding codingNamed: @"GZip"];
+    AssertEqual(gzip.name, @"gzip");
+    AssertEqual([gzip decompressData: [gzip compressData: input]], input);
+    Assert([[CBLContentCoding acceptEncoding] rangeOfString: @"gzip"].length > 0);
+    AssertEq([CBLContentCoding codingForAcceptEncoding: @"gzip, deflate"], gzip);
+    AssertEq([CBLContentCoding codingForAcceptEncoding: @"br;q=1.0, GZIP;q=0.5"], gzip);
+    AssertEq([CBLContentCoding codingForAcceptEncoding: @"*"], gzip);
+    AssertNil([CBLContentCoding codingForAcceptEncoding: @"gzip;q=0, br"]);
+    AssertNil([CBLContentCoding codingForAcceptEncoding: @"identity"]);
+    AssertNil([CBLContentCoding codingForAcceptEncoding: nil]);
+}
+
+
 @end
@@ -15,6 +15,7 @@
 #import "CBL_BlobStore.h"
 #import "CBL_BlobStoreWriter.h"
 #import "CBLGZip.h"
+#import "CBLByteBuffer.h"
 
 
 // Another hardcoded DB that needs to exist on the remote test server.
@@ -179,6 +180,20 @@
 @implementation MultiStreamWriter_Tests
 
 
+- (void) tearDown {
+    // Delete the files written by -createMixedWriterWithBufferSize:...
+    for (int i = 0; i < 3; ++i)
+        [[NSFileManager defaultManager] removeItemAtPath: [self tempFilePath: i] error: NULL];
+    [super tearDown];
+}
+
+
+- (NSString*) tempFilePath: (int)i {
+    return [NSTemporaryDirectory() stringByAppendingPathComponent:
+                                                        $sprintf(@"CBLMultiStreamWriter_%d", i)];
+}
+
+
 - (CBLMultiStreamWriter*) createWriterWithBufferSize: (unsigned)bufSize {
     CBLMultiStreamWriter* stream = [[CBLMultiStreamWriter alloc] initWithBufferSize: bufSize];
     [stream addData: [@"<part the first, let us make it a bit longer for greater interest>" dataUsingEncoding: NSUTF8StringEncoding]];
@@ -255,6 +270,68 @@
     AssertEqual(_output.my_UTF8ToString, @"<part the first, let us make it a bit longer for greater interest><2nd part, again unnecessarily prolonged for testing purposes beyond any reasonable length...>");
 }
 
+
+// Creates a writer with a mix of data, file and stream inputs; returns the expected output.
+- (CBLMultiStreamWriter*) createMixedWriterWithBufferSize: (unsigned)bufSize
+                                                fileSize: (NSUInteger)fileSize
+                                                  output: (NSData**)outExpected
+{
+    NSMutableData* expected = [NSMutableData data];
+    CBLMultiStreamWriter* writer = [[CBLMultiStreamWriter alloc] initWithBufferSize: bufSize];
+    for (int i = 0; i < 3; ++i) {
+        NSData* data = [$sprintf(@"<data part %d>", i) dataUsingEncoding: NSUTF8StringEncoding];
+        [writer addData: data];
+        [expected appendData: data];
+
+        NSMutableData* contents = [NSMutableData dataWithLength: fileSize + i];
+        arc4random_buf(contents.mutableBytes, contents.length);
+        NSString* path = [self tempFilePath: i];
+        Assert([contents writeToFile: path atomically: NO]);
+        Assert([writer addFile: path]);
+        [expected appendData: contents];
+
+        [writer addStream: [NSInputStream inputStreamWithData: contents] length: contents.length];
+        [expected appendData: contents];
+    }
+    AssertEq(writer.length, (SInt64)expected.length);
+    *outExpected = expected;
+    return writer;
+}
+
+
+- (void) test_CBLMultiStreamWriter_Files {
+    for (NSNumber* fileSize in @[@0, @100, @100000]) {
+        for (unsigned bufSize = 1; bufSize < 70000; bufSize *= 7) {
+            for (int direct = 0; direct <= 1; ++direct) {
+                Log(@"File size = %@, buffer size = %u, direct = %d", fileSize, bufSize, direct);
+                NSData* expected;
+                CBLMultiStreamWriter* writer = [self createMixedWriterWithBufferSize: bufSize
+                                                          fileSize: fileSize.unsignedIntegerValue
+                                                                              output: &expected];
+                writer.writesDataDirectly = direct;
+                AssertEqual([writer allOutput], expected);
+                AssertEqual([writer allOutput], expected);     // re-opening works
+            }
+        }
+    }
+}
+
+
+- (void) test_CBLMultiStreamWriter_Benchmark {
+    NSData* expected;
+    CBLMultiStreamWriter* writer = [self createMixedWriterWithBufferSize: 32768
+                                                                fileSize: 8*1024*1024
+                                                                  output: &expected];
+    for (int direct = 0; direct <= 1; ++direct) {
+        writer.writesDataDirectly = direct;
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        NSData* output = [writer allOutput];
+        CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+        AssertEq(output.length, expected.length);
+        Log(@"writesDataDirectly=%d: %.0f MB/sec", direct, expected.length / elapsed / 1.0e6);
+    }
+}
+
 @end
 
 
@@ -370,4 +447,103 @@
 }
 
 
+- (void) test_Throughput {
+    // A message with a few big parts, as in a pull of documents with large attachments:
+    NSMutableArray* bodies = [NSMutableArray array];
+    NSMutableData* mime = [NSMutableData data];
+    for (int i = 0; i < 4; i++) {
+        NSMutableData* body = [NSMutableData dataWithLength: 4*1024*1024];
+        arc4random_buf(body.mutableBytes, body.length);
+        [bodies addObject: body];
+        [mime appendData: [$sprintf(@"\r\n--BOUNDARY\r\nContent-Length: %lu\r\n\r\n",
+                                    (unsigned long)body.length)
+                           dataUsingEncoding: NSUTF8StringEncoding]];
+        [mime appendData: body];
+    }
+    [mime appendData: [@"\r\n--BOUNDARY--" dataUsingEncoding: NSUTF8StringEncoding]];
+
+    for (NSUInteger chunkSize = 1000; chunkSize <= 1024*1024; chunkSize *= 4) {
+        [self reset];
+        CBLMultipartReader* reader = [[CBLMultipartReader alloc] initWithContentType: @"multipart/related; boundary=\"BOUNDARY\"" delegate: self];
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        for (NSUInteger pos = 0; pos < mime.length; pos += chunkSize) {
+            @autoreleasepool {
+                NSData* chunk = [[NSData alloc] initWithBytesNoCopy: (void*)((const uint8_t*)mime.bytes + pos)
+                                                             length: MIN(chunkSize, mime.length - pos)
+                                                       freeWhenDone: NO];
+                [reader appendData: chunk];
+            }
+        }
+        CFAbsoluteTime elapsed = CFAbsoluteTimeGetCurrent() - start;
+        Assert(reader.finished, @"Reader didn't finish: %@", reader.error);
+        AssertEqual(_partList, bodies);
+        Log(@"Chunks of %7lu bytes: %.0f MB/sec", (unsigned long)chunkSize,
+            mime.length / elapsed / 1.0e6);
+    }
+}
+
+
+@end
+
+
+#pragma mark - BYTE BUFFER TESTS
+
+
+@interface ByteBuffer_Tests : CBLTestCase
+@end
+
+
+@implementation ByteBuffer_Tests
+
+
+- (void) test_Segments {
+    NSMutableData* big = [NSMutableData dataWithLength: 100000];
+    for (NSUInteger i = 0; i < big.length; ++i)
+        ((uint8_t*)big.mutableBytes)[i] = (uint8_t)(i % 251);
+    NSData* bigCopy = [big copy];
+
+    CBLByteBuffer* buf = [[CBLByteBuffer alloc] init];
+    [buf appendBytes: "header\r\n" length: 8];
+    [buf appendDataNoCopy: bigCopy];            // retained as its own segment
+    [buf appendBytes: "--boundary" length: 10];
+    AssertEq(buf.bytesAvailable, 8 + bigCopy.length + 10);
+
+    struct iovec regions[4];
+    AssertEq([buf getRegions: regions maxCount: 4], (NSUInteger)3);
+    Assert(regions[1].iov_base == bigCopy.bytes);  // not copied
+
+    // A slice within one segment shares storage, and outlives changes to the buffer:
+    NSData* slice = [buf subdataWithRange: NSMakeRange(8, 1000)];
+    Assert(slice.bytes == bigCopy.bytes);
+    // A slice across segments is a copy:
+    NSData* straddle = [buf subdataWithRange: NSMakeRange(6, 4)];
+    AssertEqual(straddle, [NSData dataWithBytes: "\r\n\x00\x01" length: 4]);
+    NSRange r = [buf searchFor: [@"--boundary" dataUsingEncoding: NSUTF8StringEncoding] from: 0];
+    AssertEq(r.location, 8 + bigCopy.length);
+
+    [buf advance: 8 + 1000];
+    [buf reset];
+    [buf appendBytes: "xyzzy" length: 5];
+    AssertEqual(slice, [big subdataWithRange: NSMakeRange(0, 1000)]);
+
+    // Reserve/commit writes directly into the buffer:
+    char* dst = [buf reserveBytes: 100];
+    memcpy(dst, "plugh", 5);
+    [buf commitBytes: 5];
+    AssertEqual(buf.data, [@"xyzzyplugh" dataUsingEncoding: NSUTF8StringEncoding]);
+    [buf advance: 10];
+    Assert(!buf.hasBytesAvailable);
+    AssertNil(buf.data);
+
+    // -appendData: copies, even data that doesn't own its bytes:
+    NSData* alias = [NSData dataWithBytesNoCopy: big.mutableBytes length: big.length
+                                   freeWhenDone: NO];
+    [buf appendData: alias];
+    AssertEq([buf getRegions: regions maxCount: 4], (NSUInteger)1);
+    Assert(regions[0].iov_base != big.mutableBytes);
+    ((uint8_t*)big.mutableBytes)[0] = 0xFF;
+    AssertEqual(buf.data, bigCopy);
+}
+
+
 @end
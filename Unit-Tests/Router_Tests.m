@@ -16,6 +16,9 @@
 #import "CBLInternal.h"
 #import "CBLMisc.h"
 #import "CBL_URLProtocol.h"
+#import "CBL_Attachment.h"
+#import "CBL_BlobStore+Internal.h"
+#import "CBL_SQLiteStorage.h"
 
 
 @interface CBL_Router ()
@@ -67,6 +70,30 @@ static CBLResponse* SendRequest(Router_Tests* self, NSString* method, NSString*
     return response;
 }
 
+// Sends a request through a router that streams large responses, as the listener's does. The
+// body is appended to `body`; *outAborted is set if the router aborted the response partway.
+static CBLResponse* SendStreamedRequest(Router_Tests* self, NSString* path, NSDictionary* headers,
+                                        NSMutableData* body, BOOL* outAborted) {
+    NSURL* url = [NSURL URLWithString: [@"cbl://" stringByAppendingString: path]];
+    NSMutableURLRequest* request = [NSMutableURLRequest requestWithURL: url];
+    for (NSString* header in headers)
+        [request setValue: headers[header] forHTTPHeaderField: header];
+    CBL_Router* router = [[CBL_Router alloc] initWithDatabaseManager: self->dbmgr request: request];
+    router.streamQueryRows = YES;
+    __block CBLResponse* response = nil;
+    __block BOOL finished = NO, aborted = NO;
+    router.onResponseReady = ^(CBLResponse* theResponse) {Assert(!response); response = theResponse;};
+    router.onDataAvailable = ^(NSData* data, BOOL done) {[body appendData: data];};
+    router.onFinished = ^{Assert(!finished && !aborted); finished = YES;};
+    router.onAborted = ^{Assert(!finished && !aborted); aborted = YES;};
+    [router start];
+    Assert(response);
+    Assert(finished || aborted);
+    *outAborted = aborted;
+    Log(@"GET %@ --> %d%@", path, response.status, (aborted ? @" (aborted)" : @""));
+    return response;
+}
+
 static id ParseJSONResponse(Router_Tests* self, CBLResponse* response) {
     NSData* json = response.body.asJSON;
     NSString* jsonStr = nil;
@@ -369,6 +396,56 @@ static void CheckCacheable(Router_Tests* self, NSString* path) {
 }
 
 
+- (void) test_AllDocs_Streamed {
+    // Create enough docs that the streamed response is written in several chunks:
+    [self createDocuments: 1000];
+    NSDictionary* expected = Send(self, @"GET", @"/db/_all_docs?include_docs=true",
+                                  kCBLStatusOK, nil);
+    AssertEqual(expected[@"total_rows"], @1000);
+
+    __block CBLResponse* response = nil;
+    NSMutableData* body = [NSMutableData data];
+    __block BOOL finished = NO;
+    __block unsigned chunks = 0, pauses = 0;
+
+    NSURL* url = [NSURL URLWithString: @"cbl:///db/_all_docs?include_docs=true"];
+    NSURLRequest* request = [NSURLRequest requestWithURL: url];
+    CBL_Router* router = [[CBL_Router alloc] initWithDatabaseManager: dbmgr request: request];
+    router.streamQueryRows = YES;
+    router.onResponseReady = ^(CBLResponse* routerResponse) {
+        Assert(!response);
+        response = routerResponse;
+    };
+    router.onDataAvailable = ^(NSData* content, BOOL finished) {
+        [body appendData: content];
+        ++chunks;
+    };
+    router.shouldPauseOutput = ^BOOL {
+        // Pause after every chunk:
+        ++pauses;
+        return YES;
+    };
+    router.onFinished = ^{
+        Assert(!finished);
+        finished = YES;
+    };
+
+    [router start];
+    AssertEq(response.status, 200);
+    AssertNil(response.body);
+    while (!finished) {
+        unsigned pausesBefore = pauses;
+        [router resumeOutput];
+        Assert(finished || pauses > pausesBefore);
+    }
+    Assert(chunks > 2);
+
+    NSDictionary* result = [CBLJSON JSONObjectWithData: body options: 0 error: NULL];
+    Assert(result, @"Couldn't parse response body:\n%@", body.my_UTF8ToString);
+    AssertEqual(result, expected);
+}
+
+
 - (void) test_Views {
     // PUT:
     SendBody(self, @"PUT", @"/db/doc1", $dict({@"message", @"hello"}), kCBLStatusCreated, nil);
@@ -1315,6 +1392,121 @@ static void CheckCacheable(Router_Tests* self, NSString* path) {
 }
 
 
+// Saves "doc1" with a 300KB attachment "att" that isn't compressible, returning its contents.
+- (NSData*) putLargeAttachmentInDatabase: (CBLDatabase*)database {
+    NSMutableData* content = [NSMutableData dataWithLength: 300000];
+    uint8_t* bytes = content.mutableBytes;
+    for (NSUInteger i = 0; i < content.length; i++)
+        bytes[i] = (uint8_t)random();
+    CBLUnsavedRevision* rev = [[database documentWithID: @"doc1"] newRevision];
+    [rev setAttachmentNamed: @"att" withContentType: @"application/octet-stream" content: content];
+    NSError* error;
+    Assert([rev save: &error], @"Couldn't save attachment: %@", error);
+    return content;
+}
+
+
+- (void) test_GetMappedAttachment {
+    NSData* content = [self putLargeAttachmentInDatabase: db];
+    CBLBlobKey key;
+    NSString* digest = [[db documentWithID: @"doc1"].currentRevision attachmentNamed: @"att"]
+                                                                            .metadata[@"digest"];
+    Assert([CBL_Attachment digest: digest toBlobKey: &key]);
+    AssertEqual([db.attachmentStore mappedBlobForKey: key], content);
+
+    // The whole attachment, streamed or not, comes from the mapped blob file:
+    CBLResponse* response = SendRequest(self, @"GET", @"/db/doc1/att", nil, nil);
+    AssertEq(response.status, kCBLStatusOK);
+    AssertEqual(response.headers[@"Accept-Ranges"], @"bytes");
+    AssertEqual(response.body.asJSON, content);
+    NSMutableData* body = [NSMutableData data];
+    BOOL aborted;
+    response = SendStreamedRequest(self, @"/db/doc1/att", nil, body, &aborted);
+    AssertEq(response.status, kCBLStatusOK);
+    Assert(!aborted);
+    AssertEqual(body, content);
+
+    // So does a range, which can span pages of the file:
+    response = SendRequest(self, @"GET", @"/db/doc1/att", @{@"Range": @"bytes=4000-9999"}, nil);
+    AssertEq(response.status, 206);
+    AssertEqual(response.headers[@"Content-Range"], @"bytes 4000-9999/300000");
+    AssertEqual(response.body.asJSON, [content subdataWithRange: NSMakeRange(4000, 6000)]);
+    response = SendRequest(self, @"GET", @"/db/doc1/att", @{@"Range": @"bytes=-10"}, nil);
+    AssertEq(response.status, 206);
+    AssertEqual(response.body.asJSON, [content subdataWithRange: NSMakeRange(299990, 10)]);
+}
+
+
+- (void) test_GetEncryptedAttachment {
+    if (!self.isSQLiteDB)
+        return;     // (mock encryption is SQLite-only)
+    CBLEnableMockEncryption = YES;
+    CBLDatabaseOptions* options = [CBLDatabaseOptions new];
+    options.create = YES;
+    options.encryptionKey = @"letmein";
+    NSError* error;
+    CBLDatabase* seekrit = [dbmgr openDatabaseNamed: @"seekrit" withOptions: options error: &error];
+    Assert(seekrit, @"Couldn't open encrypted db: %@", error);
+    NSData* content = [self putLargeAttachmentInDatabase: seekrit];
+
+    // Without streaming, the attachment is decrypted before the response is sent:
+    CBLResponse* response = SendRequest(self, @"GET", @"/seekrit/doc1/att", nil, nil);
+    AssertEq(response.status, kCBLStatusOK);
+    AssertEqual(response.body.asJSON, content);
+
+    // A range only decrypts the chunks it covers:
+    response = SendRequest(self, @"GET", @"/seekrit/doc1/att",
+                           @{@"Range": @"bytes=65000-70999"}, nil);
+    AssertEq(response.status, 206);
+    AssertEqual(response.headers[@"Content-Range"], @"bytes 65000-70999/300000");
+    AssertEqual(response.body.asJSON, [content subdataWithRange: NSMakeRange(65000, 6000)]);
+
+    // With streaming, it's decrypted a chunk at a time as it's sent:
+    NSMutableData* body = [NSMutableData data];
+    BOOL aborted;
+    response = SendStreamedRequest(self, @"/seekrit/doc1/att", nil, body, &aborted);
+    AssertEq(response.status, kCBLStatusOK);
+    AssertNil(response.body);
+    Assert(!aborted);
+    AssertEqual(body, content);
+
+    // Now damage the second encrypted chunk of the blob file:
+    CBLBlobKey key;
+    NSString* digest = [[seekrit documentWithID: @"doc1"].currentRevision attachmentNamed: @"att"]
+                                                                            .metadata[@"digest"];
+    Assert([CBL_Attachment digest: digest toBlobKey: &key]);
+    NSString* path = [seekrit.attachmentStore rawPathForKey: key];
+    NSMutableData* raw = [NSMutableData dataWithContentsOfFile: path];
+    Assert(raw.length > 100000);
+    ((uint8_t*)raw.mutableBytes)[100000] ^= 0x01;
+    Assert([raw writeToFile: path atomically: YES]);
+
+    [self allowWarningsIn: ^{
+        // A streamed response has already sent its status and the first chunk when it hits the
+        // damaged one, so it aborts the connection instead of finishing:
+        [body setLength: 0];
+        BOOL wasAborted;
+        CBLResponse* streamed = SendStreamedRequest(self, @"/seekrit/doc1/att", nil, body,
+                                                    &wasAborted);
+        AssertEq(streamed.status, kCBLStatusOK);
+        Assert(wasAborted);
+        AssertEqual(body, [content subdataWithRange: NSMakeRange(0, 65536)]);
+
+        // Otherwise the failure is found before the status is sent:
+        CBLResponse* r = SendRequest(self, @"GET", @"/seekrit/doc1/att", nil, nil);
+        AssertEq(r.internalStatus, kCBLStatusCorruptError);
+        r = SendRequest(self, @"GET", @"/seekrit/doc1/att", @{@"Range": @"bytes=70000-70099"}, nil);
+        AssertEq(r.internalStatus, kCBLStatusCorruptError);
+        r = SendRequest(self, @"GET", @"/seekrit/doc1/att", @{@"Range": @"bytes=0-99"}, nil);
+        AssertEq(r.status, 206);
+        AssertEqual(r.body.asJSON, [content subdataWithRange: NSMakeRange(0, 100)]);
+    }];
+
+    Assert([seekrit close: NULL]);
+    CBLEnableMockEncryption = NO;
+}
+
+
 - (void) test_PutMultipart {
     RequireTestCase(Docs);
     RequireTestCase(CBLMultipartDownloader);
@@ -1417,6 +1609,7 @@ static void CheckCacheable(Router_Tests* self, NSString* path) {
     // Compact the database -- this will null out the JSON of doc1r1 & doc1r2,
     // and they won't be returned as possible ancestors anymore.
     Send(self, @"POST", @"/db/_compact", kCBLStatusAccepted, nil);
+    Assert([self wait: 10.0 for: ^BOOL{ return !db.compactionScheduled; }]);
     
     SendBody(self, @"POST", @"/db/_revs_diff",
              $dict({@"11111", @[doc1r2ID, @"4-f000"]},
@@ -1662,6 +1855,13 @@ static void CheckCacheable(Router_Tests* self, NSString* path) {
     AssertEqual(bulkResult[2][@"status"], @(403));
     AssertEqual(bulkResult[2][@"error"], @"forbidden");
     AssertEqual(bulkResult[2][@"reason"], @"This is not a user doc.");
+    if (self.isSQLiteDB) {
+        // The rejected new docs didn't leave empty rows behind:
+        CBL_SQLiteStorage* storage = (CBL_SQLiteStorage*)db.storage;
+        AssertEq([storage.fmdb intForQuery: @"SELECT count(*) FROM docs WHERE NOT EXISTS "
+                                             "(SELECT 1 FROM revs WHERE revs.doc_id = docs.doc_id)"],
+                 0);
+    }
 
     // do_POST_bulk_docs, all_or_nothing=true
     result = SendBody(self, @"POST", @"/db/_bulk_docs",
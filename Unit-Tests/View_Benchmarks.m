@@ -18,6 +18,11 @@
 
 @implementation View_Benchmarks
 
+// Run each benchmark under each SQLite profile, to compare them:
++ (NSArray*) sqliteProfiles {
+    return @[kCBLSQLiteProfileDefault, kCBLSQLiteProfileServer, kCBLSQLiteProfileLowMemory];
+}
+
 - (void) benchmarkIndexingWithDocTypeOptimization: (BOOL)optimize conflicts: (BOOL)conflicts
 {
     [db inTransaction:^BOOL{